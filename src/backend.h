@@ -1,20 +1,87 @@
 #pragma once
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace gigagrad
 {
+
+struct GraphNodeHandle;
+
 namespace codegen
 {
 
 struct Program;
 
+// The state of one run of a compiled program: a scratch arena of its own and a pointer to
+// every buffer. The compiled code is shared and never written to, so several contexts of
+// one backend can run at the same time on different threads, without locks or compiling
+// again. Tensors start out bound to the data they point to when the context is created.
+struct ExecutionContext
+{
+    using RunFn = std::function<void(void **buffers, int64_t batch_size)>;
+
+    ExecutionContext(const Program &program, size_t alignment, RunFn run);
+    ~ExecutionContext();
+    ExecutionContext(const ExecutionContext &) = delete;
+    ExecutionContext &operator=(const ExecutionContext &) = delete;
+
+    // Points `tensor` at `data` for this context only. Throws if the program doesn't read it.
+    void Bind(GraphNodeHandle tensor, void *data);
+    void *GetBuffer(size_t idx) const { return buffers.at(idx); }
+    void *Output() const;
+
+    // Runs the whole program on the calling thread. See Backend::batch_size for `batch_size`.
+    void Execute(size_t batch_size = 0);
+
+    const Program &program;
+    RunFn run;
+    size_t alignment;
+    std::byte *arena;
+    std::vector<void *> buffers;
+};
+
+// Totals for one function of the program since profiling started or was last reset
+struct FunctionProfile
+{
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t bytes; // Bytes of the inputs and output (see EstimateCost), summed over all calls
+    const char *node_kind; // Kind of the graph node the function computes
+};
+
 struct Backend
 {
     virtual ~Backend() = default;
     virtual void LowerProgram(Program &&program) = 0;
     virtual void *InitBuffers() = 0; // Returns output buffer
+    // Intermediate buffers share memory once they're dead, so only tensors and buffers that
+    // no function reads are guaranteed to hold their values after Execute().
     virtual void *GetBuffer(size_t idx) = 0;
     virtual void Execute() = 0;
+
+    // Runs only function `ifn` of the program, provided that the functions before it have
+    // run, so that functions can be timed one at a time. Returns false if the backend
+    // can only run the whole program.
+    virtual bool ExecuteFunction(size_t ifn) { return false; }
+    // The lowered program, or nullptr if the backend doesn't keep it
+    virtual const Program *GetProgram() const { return nullptr; }
+    // A new context to run the program in, or nullptr if the backend can only run it
+    // through Execute(). Contexts must not outlive the backend.
+    virtual std::unique_ptr<ExecutionContext> CreateContext() const { return nullptr; }
+
+    // One entry per function if `profile` was set before LowerProgram, empty otherwise
+    virtual std::vector<FunctionProfile> GetProfile() const { return {}; }
+    virtual void ResetProfile() {}
+
+    bool profile = false; // Time every function of the program, at a small cost per call
+
+    // Rows of the batch dimension to run if the program has batched inputs (see
+    // Graph::AddBatchedInput), or 0 to run all of them. Only those rows of the output are
+    // written. The Metal and CUDA backends always run every row.
+    size_t batch_size = 0;
 };
 
 }
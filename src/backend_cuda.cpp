@@ -0,0 +1,682 @@
+#include "backend_cuda.h"
+
+#include <nvrtc.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+using namespace gigagrad;
+using namespace gigagrad::codegen;
+
+using Kernel = BackendCuda::Kernel;
+
+// A multiple of the warp size, which gg_reduce relies on
+constexpr unsigned int BlockSize = 256;
+constexpr unsigned int MatmulTile = 16;
+
+static const char *CudaPrelude = R"(
+// Combines every thread's x across the block
+__device__ float gg_reduce(float x, bool is_max)
+{
+    __shared__ float scratch[32];
+    unsigned int lane = threadIdx.x % 32;
+    unsigned int warp = threadIdx.x / 32;
+    for(int offset = 16; offset > 0; offset /= 2)
+    {
+        float other = __shfl_down_sync(0xFFFFFFFFu, x, offset);
+        x = is_max ? (x > other ? x : other) : x + other;
+    }
+    // The previous reduction may still be reading scratch
+    __syncthreads();
+    if(lane == 0)
+        scratch[warp] = x;
+    __syncthreads();
+    if(warp == 0)
+    {
+        x = lane < blockDim.x / 32 ? scratch[lane] : is_max ? __int_as_float(0xFF800000) : 0.0f;
+        for(int offset = 16; offset > 0; offset /= 2)
+        {
+            float other = __shfl_down_sync(0xFFFFFFFFu, x, offset);
+            x = is_max ? (x > other ? x : other) : x + other;
+        }
+        if(lane == 0)
+            scratch[0] = x;
+    }
+    __syncthreads();
+    return scratch[0];
+}
+
+__device__ inline unsigned short gg_to_f16(float x)
+{
+    unsigned int bits = __float_as_uint(x);
+    unsigned int sign = (bits >> 16) & 0x8000;
+    unsigned int abs = bits & 0x7FFFFFFF;
+    if(abs >= 0x7F800000)
+        return (unsigned short)(sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0));
+    if(abs >= 0x477FF000)
+        return (unsigned short)(sign | 0x7C00);
+    if(abs < 0x33000000)
+        return (unsigned short)sign;
+    unsigned int result, remainder, halfway;
+    if(abs < 0x38800000)
+    {
+        unsigned int shift = 126 - (abs >> 23);
+        unsigned int mantissa = (abs & 0x7FFFFF) | 0x800000;
+        result = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        unsigned int rebiased = abs - (112u << 23);
+        result = rebiased >> 13;
+        remainder = rebiased & 0x1FFF;
+        halfway = 0x1000;
+    }
+    if(remainder > halfway || (remainder == halfway && (result & 1)))
+        result++;
+    return (unsigned short)(sign | result);
+}
+
+__device__ inline float gg_from_f16(unsigned short x)
+{
+    unsigned int sign = (unsigned int)(x & 0x8000) << 16;
+    unsigned int exponent = (x >> 10) & 0x1F;
+    unsigned int mantissa = x & 0x3FF;
+    if(exponent == 0x1F)
+        return __uint_as_float(sign | 0x7F800000 | (mantissa << 13));
+    if(exponent != 0)
+        return __uint_as_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+    if(mantissa == 0)
+        return __uint_as_float(sign);
+    exponent = 113;
+    while(!(mantissa & 0x400))
+    {
+        mantissa <<= 1;
+        exponent--;
+    }
+    return __uint_as_float(sign | (exponent << 23) | ((mantissa & 0x3FF) << 13));
+}
+
+__device__ inline unsigned short gg_to_bf16(float x)
+{
+    unsigned int bits = __float_as_uint(x);
+    if((bits & 0x7FFFFFFF) > 0x7F800000)
+        return (unsigned short)((bits >> 16) | 0x40);
+    return (unsigned short)((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+__device__ inline float gg_from_bf16(unsigned short x)
+{
+    return __uint_as_float((unsigned int)x << 16);
+}
+
+__device__ inline signed char gg_to_i8(float x, float scale)
+{
+    return (signed char)fminf(fmaxf(rintf(x / scale), -127.0f), 127.0f);
+}
+
+__device__ inline unsigned char gg_to_u8(float x, float scale)
+{
+    return (unsigned char)fminf(fmaxf(rintf(x / scale), 0.0f), 255.0f);
+}
+
+)";
+
+static void Check(CUresult result)
+{
+    if(result != CUDA_SUCCESS)
+    {
+        const char *message = nullptr;
+        cuGetErrorString(result, &message);
+        throw std::runtime_error(std::string("CUDA error: ") + (message ? message : "unknown error"));
+    }
+}
+
+static void Check(nvrtcResult result)
+{
+    if(result != NVRTC_SUCCESS)
+        throw std::runtime_error(std::string("NVRTC error: ") + nvrtcGetErrorString(result));
+}
+
+struct CudaCtx
+{
+    FILE *file;
+    int indentation;
+    const Program *program;
+    const FunctionBuilder *function;
+    GridPlan plan;
+    size_t open_distributed_loops;
+};
+
+static const char *CudaType(DType dtype)
+{
+    switch(dtype)
+    {
+    case DType::F32:
+        return "float";
+    case DType::F16:
+    case DType::BF16:
+        return "unsigned short";
+    case DType::I8:
+        return "signed char";
+    case DType::U8:
+        return "unsigned char";
+    default:
+        throw std::domain_error("Invalid dtype");
+    }
+}
+
+// Exact, unlike printing with %f
+static std::string FloatLiteral(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    char literal[32];
+    std::snprintf(literal, sizeof(literal), "__uint_as_float(0x%08" PRIX32 "u)", bits);
+    return literal;
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const LoadIntImmediateInsn &i, size_t iinsn)
+{
+    std::fprintf(ctx.file, "%*slong long v%zu = %" PRIi64 "ll;\n", ctx.indentation, " ", iinsn, i.value);
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const IntArithmeticInsn &i, size_t iinsn)
+{
+    std::fprintf(ctx.file, "%*slong long v%zu = v%zu %c v%zu;\n", ctx.indentation, " ", iinsn, i.x, (char)i.op, i.y);
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const BeginLoopInsn &i, size_t iinsn)
+{
+    if(iinsn == ctx.plan.grid_loop && ctx.plan.mode == GridPlan::Mode::Flat)
+    {
+        std::fprintf(ctx.file, "%*s{\n%*s    long long v%zu = (long long)blockIdx.x * blockDim.x + threadIdx.x;\n",
+                     ctx.indentation, " ", ctx.indentation, " ", iinsn);
+        std::fprintf(ctx.file, "%*s    if(v%zu >= %zdll)\n%*s        return;\n",
+                     ctx.indentation, " ", iinsn, i.range, ctx.indentation, " ");
+    }
+    else if(iinsn == ctx.plan.grid_loop)
+    {
+        std::fprintf(ctx.file, "%*s{\n%*s    long long v%zu = blockIdx.x;\n", ctx.indentation, " ", ctx.indentation, " ", iinsn);
+    }
+    else if(ctx.plan.is_distributed[iinsn])
+    {
+        std::fprintf(ctx.file, "%*sfor(long long v%zu = threadIdx.x; v%zu < %zdll; v%zu += blockDim.x)\n%*s{\n",
+                     ctx.indentation, " ", iinsn, iinsn, i.range, iinsn, ctx.indentation, " ");
+        ctx.open_distributed_loops++;
+    }
+    else
+    {
+        std::fprintf(ctx.file, "%*sfor(long long v%zu = 0; v%zu < %zdll; v%zu++)\n%*s{\n",
+                     ctx.indentation, " ", iinsn, iinsn, i.range, iinsn, ctx.indentation, " ");
+    }
+    ctx.indentation += 4;
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const EndLoopInsn &, size_t iinsn)
+{
+    ctx.indentation -= 4;
+    std::fprintf(ctx.file, "%*s}\n", ctx.indentation, " ");
+    if(!ctx.plan.is_distributed[iinsn])
+        return;
+
+    // Every thread only saw its share of the iterations
+    ctx.open_distributed_loops--;
+    for(auto [accumulator, type] : ctx.plan.reductions[iinsn])
+    {
+        std::fprintf(ctx.file, "%*sv%zu = gg_reduce(v%zu, %s);\n",
+                     ctx.indentation, " ", accumulator, accumulator, type == ReduceOpType::MAX ? "true" : "false");
+    }
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const LoadInsn &i, size_t iinsn)
+{
+    const BufferDescriptor &desc = ctx.program->buffers[ctx.function->inputs[i.input]];
+    std::fprintf(ctx.file, "%*sfloat v%zu = ", ctx.indentation, " ", iinsn);
+    switch(desc.dtype)
+    {
+    case DType::F32:
+        std::fprintf(ctx.file, "i%zu[v%zu];\n", i.input, i.idx);
+        break;
+    case DType::F16:
+        std::fprintf(ctx.file, "gg_from_f16(i%zu[v%zu]);\n", i.input, i.idx);
+        break;
+    case DType::BF16:
+        std::fprintf(ctx.file, "gg_from_bf16(i%zu[v%zu]);\n", i.input, i.idx);
+        break;
+    case DType::I8:
+    case DType::U8:
+        std::fprintf(ctx.file, "(float)i%zu[v%zu] * %s;\n", i.input, i.idx, FloatLiteral(desc.scale).c_str());
+        break;
+    }
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const StoreInsn &i, size_t)
+{
+    const BufferDescriptor &desc = ctx.program->buffers[ctx.function->OutputBuffer(i.output)];
+    // Outside of the distributed loops, all threads of the block compute the same value
+    bool guard = ctx.plan.mode != GridPlan::Mode::Flat && ctx.open_distributed_loops == 0;
+    if(guard)
+        std::fprintf(ctx.file, "%*sif(threadIdx.x == 0)\n", ctx.indentation, " ");
+    std::fprintf(ctx.file, "%*soutput%s[v%zu] = ", ctx.indentation + (guard ? 4 : 0), " ",
+                 i.output == 0 ? "" : std::to_string(i.output).c_str(), i.offset);
+    switch(desc.dtype)
+    {
+    case DType::F32:
+        std::fprintf(ctx.file, "v%zu;\n", i.value);
+        break;
+    case DType::F16:
+        std::fprintf(ctx.file, "gg_to_f16(v%zu);\n", i.value);
+        break;
+    case DType::BF16:
+        std::fprintf(ctx.file, "gg_to_bf16(v%zu);\n", i.value);
+        break;
+    case DType::I8:
+        std::fprintf(ctx.file, "gg_to_i8(v%zu, %s);\n", i.value, FloatLiteral(desc.scale).c_str());
+        break;
+    case DType::U8:
+        std::fprintf(ctx.file, "gg_to_u8(v%zu, %s);\n", i.value, FloatLiteral(desc.scale).c_str());
+        break;
+    }
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const LoadImmediateInsn &i, size_t iinsn)
+{
+    std::fprintf(ctx.file, "%*sfloat v%zu = %s;\n", ctx.indentation, " ", iinsn, FloatLiteral(i.value).c_str());
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const UnaryInsn &i, size_t iinsn)
+{
+    auto op_str = i.type == UnaryOpType::EXP ? "expf"
+        : i.type == UnaryOpType::LOG ? "logf"
+        : i.type == UnaryOpType::SIN ? "sinf"
+        : i.type == UnaryOpType::SQRT ? "sqrtf"
+        : "INVALID";
+    std::fprintf(ctx.file, "%*sfloat v%zu = %s(v%zu);\n", ctx.indentation, " ", iinsn, op_str, i.x);
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const BinaryInsn &i, size_t iinsn)
+{
+    if(i.type == BinaryOpType::MAX)
+    {
+        std::fprintf(ctx.file, "%*sfloat v%zu = v%zu > v%zu ? v%zu : v%zu;\n",
+                     ctx.indentation, " ", iinsn, i.x, i.y, i.x, i.y);
+    }
+    else if(i.type == BinaryOpType::POW)
+    {
+        std::fprintf(ctx.file, "%*sfloat v%zu = powf(v%zu, v%zu);\n", ctx.indentation, " ", iinsn, i.x, i.y);
+    }
+    else
+    {
+        auto op_str = i.type == BinaryOpType::ADD ? "+"
+            : i.type == BinaryOpType::SUB ? "-"
+            : i.type == BinaryOpType::MUL ? "*"
+            : i.type == BinaryOpType::DIV ? "/"
+            : "==";
+        std::fprintf(ctx.file, "%*sfloat v%zu = (float)(v%zu %s v%zu);\n",
+                     ctx.indentation, " ", iinsn, i.x, op_str, i.y);
+    }
+}
+
+static void Lower_Cuda(CudaCtx &ctx, const AccumulateInsn &i, size_t)
+{
+    if(i.type == ReduceOpType::MAX)
+        std::fprintf(ctx.file, "%*sv%zu = v%zu > v%zu ? v%zu : v%zu;\n",
+                     ctx.indentation, " ", i.accumulator, i.accumulator, i.x, i.accumulator, i.x);
+    else
+        std::fprintf(ctx.file, "%*sv%zu += v%zu;\n", ctx.indentation, " ", i.accumulator, i.x);
+}
+
+static void Lower_Cuda(CudaCtx &, const MatmulInsn &, size_t)
+{
+    throw std::logic_error("Matmuls get a kernel of their own");
+}
+
+static void PrintKernelSignature(CudaCtx &ctx, const FunctionBuilder &fn, size_t ifn)
+{
+    std::fprintf(ctx.file, "extern \"C\" __global__ void gg_cuda_%zu(", ifn);
+    for(size_t i = 0; i < fn.inputs.size(); i++)
+        std::fprintf(ctx.file, "const %s *i%zu, ", CudaType(ctx.program->buffers[fn.inputs[i]].dtype), i);
+    // The outputs may be some of the inputs, for in-place weight updates
+    std::fprintf(ctx.file, "%s *output", CudaType(ctx.program->buffers[fn.output_buffer].dtype));
+    for(size_t i = 1; i < fn.NumOutputs(); i++)
+        std::fprintf(ctx.file, ", %s *output%zu", CudaType(ctx.program->buffers[fn.OutputBuffer(i)].dtype), i);
+    std::fprintf(ctx.file, ")\n{\n");
+}
+
+// Tiled through shared memory, one thread per element of the output
+static Kernel Lower_CudaMatmul(CudaCtx &ctx, const FunctionBuilder &fn, const MatmulInsn &i, size_t ifn)
+{
+    PrintKernelSignature(ctx, fn, ifn);
+    std::fprintf(ctx.file, "    __shared__ float x_tile[%u][%u];\n", MatmulTile, MatmulTile);
+    std::fprintf(ctx.file, "    __shared__ float y_tile[%u][%u];\n", MatmulTile, MatmulTile);
+    std::fprintf(ctx.file, "    long long row = (long long)blockIdx.y * %u + threadIdx.y;\n", MatmulTile);
+    std::fprintf(ctx.file, "    long long col = (long long)blockIdx.x * %u + threadIdx.x;\n", MatmulTile);
+    std::fprintf(ctx.file, "    long long remaining = blockIdx.z;\n    long long x_offset = 0;\n    long long y_offset = 0;\n");
+    for(ssize_t dim = std::ssize(i.batch_shape) - 1; dim >= 0; dim--)
+    {
+        std::fprintf(ctx.file, "    x_offset += (remaining %% %zdll) * %zdll;\n", i.batch_shape[dim], i.x_batch_strides[dim]);
+        std::fprintf(ctx.file, "    y_offset += (remaining %% %zdll) * %zdll;\n", i.batch_shape[dim], i.y_batch_strides[dim]);
+        std::fprintf(ctx.file, "    remaining /= %zdll;\n", i.batch_shape[dim]);
+    }
+    std::fprintf(ctx.file, "    float acc = 0.0f;\n");
+    std::fprintf(ctx.file, "    for(long long k0 = 0; k0 < %zdll; k0 += %u)\n    {\n", i.K, MatmulTile);
+    std::fprintf(ctx.file, "        long long xk = k0 + threadIdx.x;\n        long long yk = k0 + threadIdx.y;\n");
+    std::fprintf(ctx.file, "        x_tile[threadIdx.y][threadIdx.x] = row < %zdll && xk < %zdll ? i%zu[x_offset + row * %zdll + xk] : 0.0f;\n",
+                 i.M, i.K, i.x, i.K);
+    std::fprintf(ctx.file, "        y_tile[threadIdx.y][threadIdx.x] = yk < %zdll && col < %zdll ? i%zu[y_offset + yk * %zdll + col] : 0.0f;\n",
+                 i.K, i.N, i.y, i.N);
+    std::fprintf(ctx.file, "        __syncthreads();\n");
+    std::fprintf(ctx.file, "        for(int k = 0; k < %u; k++)\n", MatmulTile);
+    std::fprintf(ctx.file, "            acc += x_tile[threadIdx.y][k] * y_tile[k][threadIdx.x];\n");
+    std::fprintf(ctx.file, "        __syncthreads();\n    }\n");
+    std::fprintf(ctx.file, "    if(row < %zdll && col < %zdll)\n", i.M, i.N);
+    std::fprintf(ctx.file, "        output[(long long)blockIdx.z * %zdll + row * %zdll + col] = acc;\n}\n\n", i.M * i.N, i.N);
+
+    dim_t batches = std::accumulate(i.batch_shape.begin(), i.batch_shape.end(), dim_t{1}, std::multiplies{});
+    Kernel kernel = { GridPlan::Mode::Matmul, {}, { MatmulTile, MatmulTile, 1 }, nullptr, {} };
+    kernel.blocks[0] = static_cast<unsigned int>((i.N + MatmulTile - 1) / MatmulTile);
+    kernel.blocks[1] = static_cast<unsigned int>((i.M + MatmulTile - 1) / MatmulTile);
+    kernel.blocks[2] = static_cast<unsigned int>(batches);
+    return kernel;
+}
+
+static Kernel Lower_Cuda(CudaCtx &ctx, const FunctionBuilder &fn, size_t ifn)
+{
+    ctx.function = &fn;
+    ctx.plan = PlanGrid(fn);
+    if(ctx.plan.mode == GridPlan::Mode::Matmul)
+    {
+        for(const Instruction &insn : fn.insns)
+            if(auto *matmul = std::get_if<MatmulInsn>(&insn))
+                return Lower_CudaMatmul(ctx, fn, *matmul, ifn);
+    }
+
+    PrintKernelSignature(ctx, fn, ifn);
+    ctx.indentation = 4;
+    ctx.open_distributed_loops = 0;
+    for(size_t i = 0; i < fn.insns.size(); i++)
+        std::visit([&](auto &&insn) { Lower_Cuda(ctx, insn, i); }, fn.insns[i]);
+    std::fprintf(ctx.file, "}\n\n");
+
+    Kernel kernel = { ctx.plan.mode, { 1, 1, 1 }, { BlockSize, 1, 1 }, nullptr, {} };
+    if(ctx.plan.mode == GridPlan::Mode::Flat)
+        kernel.blocks[0] = static_cast<unsigned int>((ctx.plan.grid + BlockSize - 1) / BlockSize);
+    else
+        kernel.blocks[0] = static_cast<unsigned int>(ctx.plan.grid);
+    return kernel;
+}
+
+static size_t TensorBytes(const BufferDescriptor &desc)
+{
+    GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+    const Shape &shape = tensor.shape();
+    return SizeOf(desc.dtype) * std::accumulate(shape.begin(), shape.end(), size_t{1}, std::multiplies{});
+}
+
+BackendCuda::BackendCuda()
+{
+    Check(cuInit(0));
+    Check(cuDeviceGet(&this->device, 0));
+    Check(cuDevicePrimaryCtxRetain(&this->context, this->device));
+    Check(cuCtxSetCurrent(this->context));
+    Check(cuStreamCreate(&this->stream, CU_STREAM_NON_BLOCKING));
+}
+
+BackendCuda::~BackendCuda()
+{
+    cuCtxSetCurrent(this->context);
+    for(CUevent event : this->events)
+        cuEventDestroy(event);
+    for(void *host : this->host_buffers)
+        if(host)
+            cuMemFreeHost(host);
+    for(const DeviceTensor &tensor : this->tensors)
+        if(tensor.buffer)
+            cuMemFree(tensor.buffer);
+    if(this->arena)
+        cuMemFree(this->arena);
+    if(this->module)
+        cuModuleUnload(this->module);
+    cuStreamDestroy(this->stream);
+    cuDevicePrimaryCtxRelease(this->device);
+}
+
+void BackendCuda::LowerProgram(Program &&program)
+{
+    this->program = std::move(program);
+    char *source = nullptr;
+    size_t source_size = 0;
+    FILE *file = open_memstream(&source, &source_size);
+    if(!file)
+        throw std::system_error(errno, std::generic_category());
+
+    CudaCtx ctx = { file, 0, &this->program, nullptr, {}, 0 };
+    std::fputs(CudaPrelude, file);
+    for(size_t ifn = 0; ifn < this->program.functions.size(); ifn++)
+        this->kernels.push_back(::Lower_Cuda(ctx, this->program.functions[ifn], ifn));
+    std::fclose(file);
+    std::string source_str(source, source_size);
+    std::free(source);
+
+    int major, minor;
+    Check(cuDeviceGetAttribute(&major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, this->device));
+    Check(cuDeviceGetAttribute(&minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, this->device));
+    std::string arch = "--gpu-architecture=compute_" + std::to_string(major) + std::to_string(minor);
+    const char *options[] = { arch.c_str() };
+
+    nvrtcProgram nvrtc;
+    Check(nvrtcCreateProgram(&nvrtc, source_str.c_str(), "gigagrad.cu", 0, nullptr, nullptr));
+    nvrtcResult compiled = nvrtcCompileProgram(nvrtc, 1, options);
+    if(compiled != NVRTC_SUCCESS)
+    {
+        size_t log_size;
+        nvrtcGetProgramLogSize(nvrtc, &log_size);
+        std::string log(log_size, '\0');
+        nvrtcGetProgramLog(nvrtc, log.data());
+        nvrtcDestroyProgram(&nvrtc);
+        throw std::runtime_error("Failed to compile CUDA kernels: " + log);
+    }
+    size_t ptx_size;
+    Check(nvrtcGetPTXSize(nvrtc, &ptx_size));
+    std::string ptx(ptx_size, '\0');
+    Check(nvrtcGetPTX(nvrtc, ptx.data()));
+    nvrtcDestroyProgram(&nvrtc);
+
+    Check(cuCtxSetCurrent(this->context));
+    Check(cuModuleLoadData(&this->module, ptx.c_str()));
+    for(size_t ifn = 0; ifn < this->kernels.size(); ifn++)
+    {
+        std::string name = "gg_cuda_" + std::to_string(ifn);
+        Check(cuModuleGetFunction(&this->kernels[ifn].function, this->module, name.c_str()));
+    }
+
+    if(this->profile)
+    {
+        this->events.resize(2 * this->kernels.size());
+        for(CUevent &event : this->events)
+            Check(cuEventCreate(&event, CU_EVENT_DEFAULT));
+        this->profile_counters.assign(2 * this->kernels.size(), 0);
+    }
+}
+
+void *BackendCuda::InitBuffers()
+{
+    Check(cuCtxSetCurrent(this->context));
+    ArenaPlan plan = PlanArena(this->program, 256);
+    this->offsets = std::move(plan.offsets);
+    Check(cuMemAlloc(&this->arena, std::max<size_t>(plan.size_bytes, 1)));
+    this->tensors.resize(this->program.buffers.size());
+    this->host_buffers.assign(this->program.buffers.size(), nullptr);
+    for(size_t ibuff = 0; ibuff < this->program.buffers.size(); ibuff++)
+    {
+        const BufferDescriptor &desc = this->program.buffers[ibuff];
+        if(std::holds_alternative<GraphNodeHandle>(desc.id))
+            Check(cuMemAlloc(&this->tensors[ibuff].buffer, std::max(SizeOf(desc.dtype) * desc.size_elts, TensorBytes(desc))));
+    }
+    for(size_t ifn = 0; ifn < this->program.functions.size(); ifn++)
+    {
+        const FunctionBuilder &fn = this->program.functions[ifn];
+        for(size_t input : fn.inputs)
+            this->kernels[ifn].args.push_back(this->DevicePointer(input));
+        for(size_t ioutput = 0; ioutput < fn.NumOutputs(); ioutput++)
+        {
+            size_t output = fn.OutputBuffer(ioutput);
+            if(this->tensors[output].buffer)
+                this->tensors[output].is_written = true;
+            this->kernels[ifn].args.push_back(this->DevicePointer(output));
+        }
+    }
+    return this->GetBuffer(this->program.functions.back().output_buffer);
+}
+
+CUdeviceptr BackendCuda::DevicePointer(size_t idx) const
+{
+    if(this->tensors[idx].buffer)
+        return this->tensors[idx].buffer;
+    return this->arena + this->offsets[idx];
+}
+
+void *BackendCuda::GetBuffer(size_t idx)
+{
+    const BufferDescriptor &desc = this->program.buffers.at(idx);
+    if(std::holds_alternative<GraphNodeHandle>(desc.id))
+    {
+        GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+        return tensor.data();
+    }
+
+    // From now on, the buffer is copied back after every run
+    if(!this->host_buffers[idx])
+    {
+        size_t size_bytes = SizeOf(desc.dtype) * desc.size_elts;
+        Check(cuCtxSetCurrent(this->context));
+        Check(cuMemAllocHost(&this->host_buffers[idx], size_bytes));
+        std::memset(this->host_buffers[idx], 0, size_bytes);
+    }
+    return this->host_buffers[idx];
+}
+
+void BackendCuda::Run(size_t first_function, size_t end_function)
+{
+    Check(cuCtxSetCurrent(this->context));
+    // A tensor is uploaded once per run, however many functions read it
+    std::vector<bool> uploaded(this->tensors.size(), false);
+    for(size_t ifn = first_function; ifn < end_function; ifn++)
+    {
+        const FunctionBuilder &fn = this->program.functions[ifn];
+        for(size_t ibuff : fn.inputs)
+        {
+            DeviceTensor &tensor = this->tensors[ibuff];
+            if(!tensor.buffer || uploaded[ibuff])
+                continue;
+            uploaded[ibuff] = true;
+            // Inputs may change between runs without the pointer changing, weights only
+            // change through the program
+            const BufferDescriptor &desc = this->program.buffers[ibuff];
+            GraphNodeHandle node = std::get<GraphNodeHandle>(desc.id);
+            const void *data = node.data();
+            if(tensor.is_written && tensor.uploaded_from == data)
+                continue;
+            Check(cuMemcpyHtoDAsync(tensor.buffer, data, TensorBytes(desc), this->stream));
+            tensor.uploaded_from = data;
+        }
+    }
+
+    for(size_t ifn = first_function; ifn < end_function; ifn++)
+    {
+        Kernel &kernel = this->kernels[ifn];
+        std::vector<void *> params;
+        for(CUdeviceptr &arg : kernel.args)
+            params.push_back(&arg);
+        if(this->profile)
+            Check(cuEventRecord(this->events[2 * ifn], this->stream));
+        Check(cuLaunchKernel(
+            kernel.function,
+            kernel.blocks[0], kernel.blocks[1], kernel.blocks[2],
+            kernel.threads[0], kernel.threads[1], kernel.threads[2],
+            0,
+            this->stream,
+            params.data(),
+            nullptr));
+        if(this->profile)
+            Check(cuEventRecord(this->events[2 * ifn + 1], this->stream));
+    }
+
+    for(size_t ibuff = 0; ibuff < this->host_buffers.size(); ibuff++)
+    {
+        if(!this->host_buffers[ibuff])
+            continue;
+        size_t size_bytes = SizeOf(this->program.buffers[ibuff].dtype) * this->program.buffers[ibuff].size_elts;
+        Check(cuMemcpyDtoHAsync(this->host_buffers[ibuff], this->arena + this->offsets[ibuff], size_bytes, this->stream));
+    }
+    Check(cuStreamSynchronize(this->stream));
+
+    if(this->profile)
+    {
+        for(size_t ifn = first_function; ifn < end_function; ifn++)
+        {
+            float milliseconds;
+            Check(cuEventElapsedTime(&milliseconds, this->events[2 * ifn], this->events[2 * ifn + 1]));
+            this->profile_counters[2 * ifn] += 1;
+            this->profile_counters[2 * ifn + 1] += static_cast<uint64_t>(milliseconds * 1e6);
+        }
+    }
+}
+
+void BackendCuda::Execute()
+{
+    this->Run(0, this->program.functions.size());
+}
+
+bool BackendCuda::ExecuteFunction(size_t ifn)
+{
+    this->Run(ifn, ifn + 1);
+    return true;
+}
+
+void BackendCuda::CopyTensorsToHost()
+{
+    Check(cuCtxSetCurrent(this->context));
+    for(size_t ibuff = 0; ibuff < this->tensors.size(); ibuff++)
+    {
+        const DeviceTensor &tensor = this->tensors[ibuff];
+        if(!tensor.is_written || !tensor.uploaded_from)
+            continue;
+        const BufferDescriptor &desc = this->program.buffers[ibuff];
+        GraphNodeHandle node = std::get<GraphNodeHandle>(desc.id);
+        Check(cuMemcpyDtoH(node.data(), tensor.buffer, TensorBytes(desc)));
+    }
+}
+
+void BackendCuda::CopyTensorsToDevice()
+{
+    for(DeviceTensor &tensor : this->tensors)
+        tensor.uploaded_from = nullptr;
+}
+
+const Program *BackendCuda::GetProgram() const
+{
+    return &this->program;
+}
+
+std::vector<FunctionProfile> BackendCuda::GetProfile() const
+{
+    if(!this->profile)
+        return {};
+    return BuildProfile(this->program, this->profile_counters.data());
+}
+
+void BackendCuda::ResetProfile()
+{
+    std::fill(this->profile_counters.begin(), this->profile_counters.end(), 0);
+}
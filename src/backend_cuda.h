@@ -0,0 +1,78 @@
+#pragma once
+#include "backend.h"
+#include "codegen.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <cuda.h>
+
+namespace gigagrad
+{
+namespace codegen
+{
+
+// Lowers every function to a CUDA kernel compiled with NVRTC (only built if meson finds the
+// CUDA toolkit) and runs the program on one stream. Functions map onto the grid as
+// described by GridPlan, with a thread block per group, and threads combine their partial
+// reductions with warp shuffles and then shared memory.
+//
+// Intermediate buffers live in a single device allocation made by InitBuffers. Tensors
+// that the program writes, i.e. the weights of a training graph, are uploaded on the first
+// run and then stay resident on the device: call CopyTensorsToHost to read them back, and
+// CopyTensorsToDevice after changing them on the host. Other tensors are uploaded before
+// every run, and the only buffers downloaded after a run are the intermediates returned by
+// InitBuffers or GetBuffer, such as the output or the loss.
+struct BackendCuda : public Backend
+{
+    BackendCuda();
+    virtual ~BackendCuda();
+    virtual void LowerProgram(Program &&program);
+    virtual void *InitBuffers();
+    virtual void *GetBuffer(size_t idx);
+    virtual void Execute();
+    virtual bool ExecuteFunction(size_t ifn);
+    virtual const Program *GetProgram() const;
+    virtual std::vector<FunctionProfile> GetProfile() const;
+    virtual void ResetProfile();
+
+    void CopyTensorsToHost();
+    void CopyTensorsToDevice();
+
+    struct Kernel
+    {
+        GridPlan::Mode mode;
+        unsigned int blocks[3];
+        unsigned int threads[3];
+        CUfunction function;
+        std::vector<CUdeviceptr> args; // Inputs and then the output, set by InitBuffers
+    };
+
+    struct DeviceTensor
+    {
+        CUdeviceptr buffer = 0;
+        bool is_written = false; // By some function, so it stays resident
+        const void *uploaded_from = nullptr; // Host data the device copy is current with
+    };
+
+    Program program;
+    CUdevice device;
+    CUcontext context = nullptr;
+    CUstream stream = nullptr;
+    CUmodule module = nullptr;
+    std::vector<Kernel> kernels; // One per function of the program
+    CUdeviceptr arena = 0; // Backs all of the intermediate buffers, see PlanArena
+    std::vector<size_t> offsets; // Of the intermediate buffers in the arena
+    std::vector<DeviceTensor> tensors; // Indexed by buffer, empty for intermediates
+    std::vector<void *> host_buffers; // Indexed by buffer, pinned copies of intermediates
+    std::vector<CUevent> events; // Two per function if profiling
+    std::vector<uint64_t> profile_counters; // See BuildProfile
+
+private:
+    void Run(size_t first_function, size_t end_function);
+    CUdeviceptr DevicePointer(size_t idx) const;
+};
+
+}
+}
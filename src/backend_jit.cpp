@@ -0,0 +1,603 @@
+#include "backend_jit.h"
+#include "backend_scalar_c.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/mman.h>
+
+using namespace gigagrad;
+using namespace gigagrad::codegen;
+
+static void Matmul(const float *x, const float *y, float *output, dim_t M, dim_t K, dim_t N)
+{
+    // Block along K so that the rows of y we stream over stay in cache
+    constexpr dim_t KC = 256;
+    std::fill(output, output + M * N, 0.0f);
+    for(dim_t kc = 0; kc < K; kc += KC)
+    {
+        dim_t kend = std::min(K, kc + KC);
+        for(dim_t i = 0; i < M; i++)
+        {
+            float *output_row = output + i * N;
+            for(dim_t k = kc; k < kend; k++)
+            {
+                float a = x[i * K + k];
+                const float *y_row = y + k * N;
+                for(dim_t j = 0; j < N; j++)
+                    output_row[j] += a * y_row[j];
+            }
+        }
+    }
+}
+
+static void RunMatmul(const JitMatmul *matmul, void **buffers, int64_t batch_size)
+{
+    const MatmulInsn &insn = matmul->insn;
+    const float *x = static_cast<const float *>(buffers[matmul->x_buffer]);
+    const float *y = static_cast<const float *>(buffers[matmul->y_buffer]);
+    float *output = static_cast<float *>(buffers[matmul->output_buffer]);
+
+    // The batch replaces whichever dimension comes first
+    Shape batch_shape = insn.batch_shape;
+    dim_t M = insn.M;
+    if(insn.is_batched)
+        (batch_shape.empty() ? M : batch_shape[0]) = batch_size;
+
+    dim_t num_batches = std::accumulate(batch_shape.begin(), batch_shape.end(), dim_t{1}, std::multiplies{});
+    for(dim_t ibatch = 0; ibatch < num_batches; ibatch++)
+    {
+        dim_t x_offset = 0;
+        dim_t y_offset = 0;
+        dim_t remaining = ibatch;
+        for(ssize_t dim = std::ssize(insn.batch_shape) - 1; dim >= 0; dim--)
+        {
+            dim_t coord = remaining % insn.batch_shape[dim];
+            remaining /= insn.batch_shape[dim];
+            x_offset += coord * insn.x_batch_strides[dim];
+            y_offset += coord * insn.y_batch_strides[dim];
+        }
+        Matmul(x + x_offset, y + y_offset, output + ibatch * insn.M * insn.N, M, insn.K, insn.N);
+    }
+}
+
+namespace
+{
+
+enum Reg : uint8_t
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+};
+
+enum XmmReg : uint8_t
+{
+    XMM0 = 0,
+    XMM1 = 1,
+};
+
+// Just enough of an x86-64 assembler for the instructions below. Every value lives in a
+// stack slot addressed relative to rbp, rbx holds the buffer table for the whole function,
+// and rax/rcx/rdx/xmm0/xmm1 are scratch.
+struct Emitter
+{
+    void Byte(uint8_t b) { code.push_back(b); }
+
+    void Bytes(std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+
+    void Imm32(int32_t imm)
+    {
+        uint8_t bytes[4];
+        std::memcpy(bytes, &imm, 4);
+        code.insert(code.end(), bytes, bytes + 4);
+    }
+
+    void Imm64(uint64_t imm)
+    {
+        uint8_t bytes[8];
+        std::memcpy(bytes, &imm, 8);
+        code.insert(code.end(), bytes, bytes + 8);
+    }
+
+    // ModRM for [base + disp32], base must not be rsp/r12
+    void Mem(uint8_t reg, Reg base, int32_t disp)
+    {
+        Byte(0x80 | (reg << 3) | base);
+        Imm32(disp);
+    }
+
+    void Slot(uint8_t reg, size_t iinsn) { Mem(reg, RBP, SlotOffset(iinsn)); }
+
+    static int32_t SlotOffset(size_t iinsn) { return -16 - 8 * static_cast<int32_t>(iinsn); }
+
+    void MovRegSlot(Reg reg, size_t iinsn) { Bytes({ 0x48, 0x8B }); Slot(reg, iinsn); }
+    void MovSlotReg(size_t iinsn, Reg reg) { Bytes({ 0x48, 0x89 }); Slot(reg, iinsn); }
+    void MovImm64(Reg reg, uint64_t imm) { Bytes({ 0x48, static_cast<uint8_t>(0xB8 | reg) }); Imm64(imm); }
+    void MovssXmmSlot(XmmReg reg, size_t iinsn) { Bytes({ 0xF3, 0x0F, 0x10 }); Slot(reg, iinsn); }
+    void MovssSlotXmm(size_t iinsn, XmmReg reg) { Bytes({ 0xF3, 0x0F, 0x11 }); Slot(reg, iinsn); }
+    void SseXmm0Slot(uint8_t opcode, size_t iinsn) { Bytes({ 0xF3, 0x0F, opcode }); Slot(XMM0, iinsn); }
+
+    // Clobbers eax
+    void MovFloatImm(XmmReg reg, float value)
+    {
+        int32_t bits;
+        std::memcpy(&bits, &value, 4);
+        Byte(0xB8); // mov eax, imm32
+        Imm32(bits);
+        Bytes({ 0x66, 0x0F, 0x6E, static_cast<uint8_t>(0xC0 | (reg << 3)) }); // movd reg, eax
+    }
+
+    // rax = buffers[ibuffer]
+    void LoadBufferPointer(size_t ibuffer)
+    {
+        Bytes({ 0x48, 0x8B });
+        Mem(RAX, RBX, static_cast<int32_t>(8 * ibuffer));
+    }
+
+    void Call(const void *fn)
+    {
+        MovImm64(RAX, reinterpret_cast<uint64_t>(fn));
+        Bytes({ 0xFF, 0xD0 }); // call rax
+    }
+
+    size_t Jump(std::initializer_list<uint8_t> opcode)
+    {
+        Bytes(opcode);
+        Imm32(0);
+        return code.size();
+    }
+
+    // Points the rel32 that ends at `jump` at `target`
+    void Patch(size_t jump, size_t target)
+    {
+        int32_t rel = static_cast<int32_t>(target) - static_cast<int32_t>(jump);
+        std::memcpy(&code[jump - 4], &rel, 4);
+    }
+
+    std::vector<uint8_t> code;
+};
+
+struct OpenLoop
+{
+    size_t slot;
+    size_t top;
+    size_t exit_jump;
+};
+
+struct JitCtx
+{
+    Emitter &e;
+    const Program &program;
+    const FunctionBuilder &fn;
+    std::vector<std::unique_ptr<JitMatmul>> &matmuls;
+    size_t batch_slot; // Holds the batch size the function was called with
+    std::vector<OpenLoop> loops;
+};
+
+}
+
+static void Lower_Jit(JitCtx &ctx, const LoadIntImmediateInsn &i, size_t iinsn)
+{
+    ctx.e.MovImm64(RAX, static_cast<uint64_t>(i.value));
+    ctx.e.MovSlotReg(iinsn, RAX);
+}
+
+static void Lower_Jit(JitCtx &ctx, const IntArithmeticInsn &i, size_t iinsn)
+{
+    Emitter &e = ctx.e;
+    e.MovRegSlot(RAX, i.x);
+    switch(i.op)
+    {
+    case IntArithmeticInsn::Op::ADD:
+        e.Bytes({ 0x48, 0x03 });
+        e.Slot(RAX, i.y);
+        break;
+    case IntArithmeticInsn::Op::SUB:
+        e.Bytes({ 0x48, 0x2B });
+        e.Slot(RAX, i.y);
+        break;
+    case IntArithmeticInsn::Op::MUL:
+        e.Bytes({ 0x48, 0x0F, 0xAF });
+        e.Slot(RAX, i.y);
+        break;
+    case IntArithmeticInsn::Op::DIV:
+    case IntArithmeticInsn::Op::MOD:
+        e.Bytes({ 0x48, 0x99 }); // cqo
+        e.Bytes({ 0x48, 0xF7 }); // idiv
+        e.Slot(7, i.y);
+        if(i.op == IntArithmeticInsn::Op::MOD)
+        {
+            e.MovSlotReg(iinsn, RDX);
+            return;
+        }
+        break;
+    }
+    e.MovSlotReg(iinsn, RAX);
+}
+
+static void Lower_Jit(JitCtx &ctx, const BeginLoopInsn &i, size_t iinsn)
+{
+    Emitter &e = ctx.e;
+    e.Bytes({ 0x48, 0xC7 }); // mov qword [slot], 0
+    e.Slot(0, iinsn);
+    e.Imm32(0);
+    size_t top = e.code.size();
+    e.MovRegSlot(RAX, iinsn);
+    if(i.is_batch)
+        e.MovRegSlot(RCX, ctx.batch_slot);
+    else
+        e.MovImm64(RCX, static_cast<uint64_t>(i.range));
+    e.Bytes({ 0x48, 0x39, 0xC8 }); // cmp rax, rcx
+    size_t exit_jump = e.Jump({ 0x0F, 0x8D }); // jge
+    ctx.loops.push_back({ iinsn, top, exit_jump });
+}
+
+static void Lower_Jit(JitCtx &ctx, const EndLoopInsn &, size_t)
+{
+    Emitter &e = ctx.e;
+    OpenLoop loop = ctx.loops.back();
+    ctx.loops.pop_back();
+    e.Bytes({ 0x48, 0xFF }); // inc qword [slot]
+    e.Slot(0, loop.slot);
+    size_t back_jump = e.Jump({ 0xE9 });
+    e.Patch(back_jump, loop.top);
+    e.Patch(loop.exit_jump, e.code.size());
+}
+
+// Narrower dtypes are converted by calling the functions in dtype.cpp
+static void Lower_Jit(JitCtx &ctx, const LoadInsn &i, size_t iinsn)
+{
+    Emitter &e = ctx.e;
+    const BufferDescriptor &desc = ctx.program.buffers[ctx.fn.inputs[i.input]];
+    e.LoadBufferPointer(ctx.fn.inputs[i.input]);
+    e.MovRegSlot(RCX, i.idx);
+    switch(desc.dtype)
+    {
+    case DType::F32:
+        e.Bytes({ 0xF3, 0x0F, 0x10, 0x04, 0x88 }); // movss xmm0, [rax + rcx * 4]
+        break;
+    case DType::F16:
+    case DType::BF16:
+        e.Bytes({ 0x0F, 0xB7, 0x3C, 0x48 }); // movzx edi, word [rax + rcx * 2]
+        e.Call(reinterpret_cast<const void *>(desc.dtype == DType::F16 ? &FromF16 : &FromBF16));
+        break;
+    case DType::I8:
+        e.Bytes({ 0x0F, 0xBE, 0x3C, 0x08 }); // movsx edi, byte [rax + rcx]
+        e.MovFloatImm(XMM0, desc.scale);
+        e.Call(reinterpret_cast<const void *>(&FromI8));
+        break;
+    case DType::U8:
+        e.Bytes({ 0x0F, 0xB6, 0x3C, 0x08 }); // movzx edi, byte [rax + rcx]
+        e.MovFloatImm(XMM0, desc.scale);
+        e.Call(reinterpret_cast<const void *>(&FromU8));
+        break;
+    }
+    e.MovssSlotXmm(iinsn, XMM0);
+}
+
+static void Lower_Jit(JitCtx &ctx, const StoreInsn &i, size_t)
+{
+    Emitter &e = ctx.e;
+    size_t output_buffer = ctx.fn.OutputBuffer(i.output);
+    const BufferDescriptor &desc = ctx.program.buffers[output_buffer];
+    e.MovssXmmSlot(XMM0, i.value);
+    if(desc.dtype == DType::F32)
+    {
+        e.LoadBufferPointer(output_buffer);
+        e.MovRegSlot(RCX, i.offset);
+        e.Bytes({ 0xF3, 0x0F, 0x11, 0x04, 0x88 }); // movss [rax + rcx * 4], xmm0
+        return;
+    }
+
+    if(IsQuantized(desc.dtype))
+    {
+        e.MovFloatImm(XMM1, desc.scale);
+        e.Call(desc.dtype == DType::I8
+               ? reinterpret_cast<const void *>(&ToI8)
+               : reinterpret_cast<const void *>(&ToU8));
+    }
+    else
+    {
+        e.Call(reinterpret_cast<const void *>(desc.dtype == DType::F16 ? &ToF16 : &ToBF16));
+    }
+    e.Bytes({ 0x89, 0xC2 }); // mov edx, eax
+    e.LoadBufferPointer(output_buffer);
+    e.MovRegSlot(RCX, i.offset);
+    if(IsQuantized(desc.dtype))
+        e.Bytes({ 0x88, 0x14, 0x08 }); // mov byte [rax + rcx], dl
+    else
+        e.Bytes({ 0x66, 0x89, 0x14, 0x48 }); // mov word [rax + rcx * 2], dx
+}
+
+static void Lower_Jit(JitCtx &ctx, const LoadImmediateInsn &i, size_t iinsn)
+{
+    Emitter &e = ctx.e;
+    int32_t bits;
+    std::memcpy(&bits, &i.value, 4);
+    e.Byte(0xB8); // mov eax, imm32
+    e.Imm32(bits);
+    e.Byte(0x89); // mov dword [slot], eax
+    e.Slot(RAX, iinsn);
+}
+
+static void Lower_Jit(JitCtx &ctx, const UnaryInsn &i, size_t iinsn)
+{
+    Emitter &e = ctx.e;
+    switch(i.type)
+    {
+    case UnaryOpType::NOP:
+    case UnaryOpType::CAST:
+        e.MovssXmmSlot(XMM0, i.x);
+        break;
+    case UnaryOpType::SQRT:
+        e.SseXmm0Slot(0x51, i.x);
+        break;
+    case UnaryOpType::EXP:
+        e.MovssXmmSlot(XMM0, i.x);
+        e.Call(reinterpret_cast<const void *>(static_cast<float (*)(float)>(::expf)));
+        break;
+    case UnaryOpType::LOG:
+        e.MovssXmmSlot(XMM0, i.x);
+        e.Call(reinterpret_cast<const void *>(static_cast<float (*)(float)>(::logf)));
+        break;
+    case UnaryOpType::SIN:
+        e.MovssXmmSlot(XMM0, i.x);
+        e.Call(reinterpret_cast<const void *>(static_cast<float (*)(float)>(::sinf)));
+        break;
+    }
+    e.MovssSlotXmm(iinsn, XMM0);
+}
+
+static void Lower_Jit(JitCtx &ctx, const BinaryInsn &i, size_t iinsn)
+{
+    Emitter &e = ctx.e;
+    e.MovssXmmSlot(XMM0, i.x);
+    switch(i.type)
+    {
+    case BinaryOpType::ADD:
+        e.SseXmm0Slot(0x58, i.y);
+        break;
+    case BinaryOpType::SUB:
+        e.SseXmm0Slot(0x5C, i.y);
+        break;
+    case BinaryOpType::MUL:
+        e.SseXmm0Slot(0x59, i.y);
+        break;
+    case BinaryOpType::DIV:
+        e.SseXmm0Slot(0x5E, i.y);
+        break;
+    case BinaryOpType::MAX:
+        e.SseXmm0Slot(0x5F, i.y); // maxss is exactly x > y ? x : y
+        break;
+    case BinaryOpType::CMP:
+        e.SseXmm0Slot(0xC2, i.y); // cmpeqss, all ones if equal
+        e.Byte(0x00);
+        e.Byte(0xB8); // mov eax, 1.0f
+        e.Imm32(0x3F800000);
+        e.Bytes({ 0x66, 0x0F, 0x6E, 0xC8 }); // movd xmm1, eax
+        e.Bytes({ 0x0F, 0x54, 0xC1 }); // andps xmm0, xmm1
+        break;
+    case BinaryOpType::POW:
+        e.MovssXmmSlot(XMM1, i.y);
+        e.Call(reinterpret_cast<const void *>(static_cast<float (*)(float, float)>(::powf)));
+        break;
+    }
+    e.MovssSlotXmm(iinsn, XMM0);
+}
+
+static void Lower_Jit(JitCtx &ctx, const AccumulateInsn &i, size_t)
+{
+    Emitter &e = ctx.e;
+    e.MovssXmmSlot(XMM0, i.accumulator);
+    e.SseXmm0Slot(i.type == ReduceOpType::MAX ? 0x5F : 0x58, i.x);
+    e.MovssSlotXmm(i.accumulator, XMM0);
+}
+
+static void Lower_Jit(JitCtx &ctx, const MatmulInsn &i, size_t)
+{
+    Emitter &e = ctx.e;
+    auto &matmul = ctx.matmuls.emplace_back(std::make_unique<JitMatmul>(JitMatmul
+    {
+        .insn = i,
+        .x_buffer = ctx.fn.inputs[i.x],
+        .y_buffer = ctx.fn.inputs[i.y],
+        .output_buffer = ctx.fn.output_buffer,
+    }));
+    e.MovImm64(RDI, reinterpret_cast<uint64_t>(matmul.get()));
+    e.Bytes({ 0x48, 0x89, 0xDE }); // mov rsi, rbx
+    e.MovRegSlot(RDX, ctx.batch_slot);
+    e.Call(reinterpret_cast<const void *>(&RunMatmul));
+}
+
+// Emits `void fn(void **buffers, int64_t batch_size)`
+static void Lower_Jit(
+    Emitter &e,
+    const Program &program,
+    const FunctionBuilder &fn,
+    std::vector<std::unique_ptr<JitMatmul>> &matmuls)
+{
+    // After pushing rbp and rbx the stack is 8 bytes off of 16 byte alignment, so round
+    // the frame to an odd number of slots to keep it aligned for calls. The slot after the
+    // instructions' holds the batch size.
+    size_t batch_slot = fn.insns.size();
+    size_t num_slots = (batch_slot + 1) | 1;
+    int32_t frame_size = static_cast<int32_t>(8 * num_slots);
+
+    e.Byte(0x55); // push rbp
+    e.Bytes({ 0x48, 0x89, 0xE5 }); // mov rbp, rsp
+    e.Byte(0x53); // push rbx
+    e.Bytes({ 0x48, 0x89, 0xFB }); // mov rbx, rdi
+
+    // Touch every page of a large frame in order so we never skip over a guard page
+    constexpr int32_t PageSize = 4096;
+    for(int32_t probed = PageSize; probed < frame_size; probed += PageSize)
+    {
+        e.Bytes({ 0x48, 0x81, 0xEC }); // sub rsp, PageSize
+        e.Imm32(PageSize);
+        e.Bytes({ 0x48, 0x83, 0x0C, 0x24, 0x00 }); // or qword [rsp], 0
+    }
+    e.Bytes({ 0x48, 0x81, 0xEC }); // sub rsp, remainder
+    e.Imm32(frame_size - (frame_size - 1) / PageSize * PageSize);
+
+    e.MovSlotReg(batch_slot, RSI);
+
+    JitCtx ctx = { e, program, fn, matmuls, batch_slot, {} };
+    for(size_t iinsn = 0; iinsn < fn.insns.size(); iinsn++)
+        std::visit([&](auto &&insn) { Lower_Jit(ctx, insn, iinsn); }, fn.insns[iinsn]);
+
+    e.Bytes({ 0x48, 0x8B, 0x5D, 0xF8 }); // mov rbx, [rbp - 8]
+    e.Byte(0xC9); // leave
+    e.Byte(0xC3); // ret
+}
+
+BackendJit::~BackendJit()
+{
+    if(this->code)
+        munmap(this->code, this->code_size);
+    ::operator delete[](this->arena, std::align_val_t{BufferAlignment});
+}
+
+void BackendJit::LowerProgram(Program &&program)
+{
+#if !defined(__x86_64__)
+    throw std::runtime_error("BackendJit only supports x86-64");
+#endif
+    this->program = std::move(program);
+
+    Emitter e;
+    std::vector<size_t> entry_points;
+    for(const FunctionBuilder &fn : this->program.functions)
+    {
+        // Align function entries for the instruction fetcher
+        while(e.code.size() % 16 != 0)
+            e.Byte(0xCC);
+        entry_points.push_back(e.code.size());
+        Lower_Jit(e, this->program, fn, this->matmuls);
+    }
+
+    this->code_size = std::max<size_t>(e.code.size(), 1);
+    this->code = mmap(nullptr, this->code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(this->code == MAP_FAILED)
+    {
+        this->code = nullptr;
+        throw std::system_error(errno, std::generic_category());
+    }
+    std::memcpy(this->code, e.code.data(), e.code.size());
+    if(mprotect(this->code, this->code_size, PROT_READ | PROT_EXEC) != 0)
+        throw std::system_error(errno, std::generic_category());
+
+    for(size_t entry : entry_points)
+        this->eval_fns.push_back(reinterpret_cast<GraphEvalFn>(static_cast<uint8_t *>(this->code) + entry));
+    if(this->profile)
+        this->profile_counters.assign(2 * this->eval_fns.size(), 0);
+}
+
+void *BackendJit::InitBuffers()
+{
+    ArenaPlan plan = PlanArena(this->program, BufferAlignment);
+    this->arena = new (std::align_val_t{BufferAlignment}) std::byte[plan.size_bytes];
+    this->buffers.reserve(this->program.buffers.size());
+    for(ssize_t ibuff = 0; ibuff < std::ssize(this->program.buffers); ibuff++)
+    {
+        auto &desc = this->program.buffers[ibuff];
+        if(std::holds_alternative<GraphNodeHandle>(desc.id))
+        {
+            GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+            this->buffers.push_back(reinterpret_cast<void *>(tensor.data()));
+        }
+        else
+        {
+            this->buffers.push_back(reinterpret_cast<void *>(this->arena + plan.offsets[ibuff]));
+        }
+    }
+    return this->buffers[this->program.functions.back().output_buffer];
+}
+
+void *BackendJit::GetBuffer(size_t idx)
+{
+    return this->buffers.at(idx);
+}
+
+// Tensors may be pointed at different data between runs
+static void BindTensors(const Program &program, std::vector<void *> &buffers)
+{
+    for(ssize_t ibuff = 0; ibuff < std::ssize(program.buffers); ibuff++)
+    {
+        auto &desc = program.buffers[ibuff];
+        if(std::holds_alternative<GraphNodeHandle>(desc.id))
+        {
+            GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+            buffers[ibuff] = (reinterpret_cast<void *>(tensor.data()));
+        }
+    }
+}
+
+void BackendJit::Execute()
+{
+    BindTensors(this->program, this->buffers);
+    int64_t batch = RunBatchSize(this->program, this->batch_size);
+    for(size_t ifn = 0; ifn < this->eval_fns.size(); ifn++)
+        this->RunFunction(ifn, this->buffers.data(), batch);
+}
+
+// The generated code has no way to read the clock, so the profile is taken from here.
+// Execution contexts may run concurrently, hence the atomics.
+void BackendJit::RunFunction(size_t ifn, void **buffers, int64_t batch_size) const
+{
+    if(!this->profile)
+    {
+        this->eval_fns[ifn](buffers, batch_size);
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    this->eval_fns[ifn](buffers, batch_size);
+    auto end = std::chrono::steady_clock::now();
+    std::atomic_ref<uint64_t>(this->profile_counters[2 * ifn]).fetch_add(1, std::memory_order_relaxed);
+    std::atomic_ref<uint64_t>(this->profile_counters[2 * ifn + 1]).fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), std::memory_order_relaxed);
+}
+
+bool BackendJit::ExecuteFunction(size_t ifn)
+{
+    BindTensors(this->program, this->buffers);
+    this->RunFunction(ifn, this->buffers.data(), RunBatchSize(this->program, this->batch_size));
+    return true;
+}
+
+const Program *BackendJit::GetProgram() const
+{
+    return &this->program;
+}
+
+std::unique_ptr<ExecutionContext> BackendJit::CreateContext() const
+{
+    return std::make_unique<ExecutionContext>(this->program, BufferAlignment, [this](void **buffers, int64_t batch_size)
+    {
+        for(size_t ifn = 0; ifn < this->eval_fns.size(); ifn++)
+            this->RunFunction(ifn, buffers, batch_size);
+    });
+}
+
+std::vector<FunctionProfile> BackendJit::GetProfile() const
+{
+    if(!this->profile)
+        return {};
+    return BuildProfile(this->program, this->profile_counters.data());
+}
+
+void BackendJit::ResetProfile()
+{
+    std::fill(this->profile_counters.begin(), this->profile_counters.end(), 0);
+}
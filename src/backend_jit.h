@@ -0,0 +1,57 @@
+#pragma once
+#include "backend.h"
+#include "codegen.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace gigagrad
+{
+namespace codegen
+{
+
+// Matmuls are run by a kernel in the host binary, called from the generated code
+struct JitMatmul
+{
+    MatmulInsn insn;
+    size_t x_buffer;
+    size_t y_buffer;
+    size_t output_buffer;
+};
+
+// Lowers the instruction stream straight to x86-64 machine code in memory, so that
+// compiling a program doesn't involve an external compiler or touch the filesystem.
+// Every instruction gets a stack slot, so the code is not very fast, but it compiles
+// in microseconds per function. Throws on other architectures.
+struct BackendJit : public Backend
+{
+    using GraphEvalFn = void (*)(void **, int64_t);
+    BackendJit() = default;
+    virtual ~BackendJit();
+    virtual void LowerProgram(Program &&program);
+    virtual void *InitBuffers();
+    virtual void *GetBuffer(size_t idx);
+    virtual void Execute();
+    virtual bool ExecuteFunction(size_t ifn);
+    virtual const Program *GetProgram() const;
+    virtual std::unique_ptr<ExecutionContext> CreateContext() const;
+    virtual std::vector<FunctionProfile> GetProfile() const;
+    virtual void ResetProfile();
+
+    Program program;
+    void *code = nullptr;
+    size_t code_size = 0;
+    std::vector<GraphEvalFn> eval_fns; // One per function of the program
+    std::vector<std::unique_ptr<JitMatmul>> matmuls;
+    std::byte *arena = nullptr;
+    std::vector<void *> buffers;
+    mutable std::vector<uint64_t> profile_counters; // See BuildProfile
+
+private:
+    void RunFunction(size_t ifn, void **buffers, int64_t batch_size) const;
+};
+
+}
+}
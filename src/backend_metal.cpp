@@ -2,3 +2,547 @@
 #define CA_PRIVATE_IMPLEMENTATION
 #define MTL_PRIVATE_IMPLEMENTATION
 #include "metal-cpp/SingleHeader/Metal.hpp"
+
+#include "backend_metal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <unistd.h>
+
+using namespace gigagrad;
+using namespace gigagrad::codegen;
+
+using Kernel = BackendMetal::Kernel;
+
+// Threadgroups are at most this big, the scratch space for reductions is sized for it
+constexpr size_t MaxThreads = 256;
+constexpr size_t MatmulTile = 16;
+// Metal has 31 buffer argument slots
+constexpr size_t MaxKernelBuffers = 31;
+
+static const char *MetalPrelude = R"(#include <metal_stdlib>
+using namespace metal;
+
+// Combines every thread's x across the threadgroup, whose size is a power of two
+static float gg_reduce(float x, bool is_max, threadgroup float *scratch, uint lid, uint threads)
+{
+    scratch[lid] = x;
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    for(uint stride = threads / 2; stride > 0; stride /= 2)
+    {
+        if(lid < stride)
+        {
+            float other = scratch[lid + stride];
+            scratch[lid] = is_max ? (scratch[lid] > other ? scratch[lid] : other) : scratch[lid] + other;
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+    float result = scratch[0];
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    return result;
+}
+
+static inline ushort gg_to_bf16(float x)
+{
+    uint bits = as_type<uint>(x);
+    if((bits & 0x7FFFFFFF) > 0x7F800000)
+        return ushort((bits >> 16) | 0x40);
+    return ushort((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+)";
+
+struct MetalCtx
+{
+    FILE *file;
+    int indentation;
+    const Program *program;
+    const FunctionBuilder *function;
+    GridPlan plan;
+    size_t open_distributed_loops;
+};
+
+static const char *MetalType(DType dtype)
+{
+    switch(dtype)
+    {
+    case DType::F32:
+        return "float";
+    case DType::F16:
+        return "half";
+    case DType::BF16:
+        return "ushort";
+    case DType::I8:
+        return "char";
+    case DType::U8:
+        return "uchar";
+    default:
+        throw std::domain_error("Invalid dtype");
+    }
+}
+
+// Exact, and MSL (being C++14) has no hex float literals
+static std::string FloatLiteral(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    char literal[32];
+    std::snprintf(literal, sizeof(literal), "as_type<float>(0x%08" PRIx32 "u)", bits);
+    return literal;
+}
+
+static void Lower_Metal(MetalCtx &ctx, const LoadIntImmediateInsn &i, size_t iinsn)
+{
+    std::fprintf(ctx.file, "%*slong v%zu = %" PRIi64 ";\n", ctx.indentation, " ", iinsn, i.value);
+}
+
+static void Lower_Metal(MetalCtx &ctx, const IntArithmeticInsn &i, size_t iinsn)
+{
+    std::fprintf(ctx.file, "%*slong v%zu = v%zu %c v%zu;\n", ctx.indentation, " ", iinsn, i.x, (char)i.op, i.y);
+}
+
+static void Lower_Metal(MetalCtx &ctx, const BeginLoopInsn &i, size_t iinsn)
+{
+    if(iinsn == ctx.plan.grid_loop && ctx.plan.mode == GridPlan::Mode::Flat)
+    {
+        std::fprintf(ctx.file, "%*sif(gid >= %zd)\n%*s    return;\n", ctx.indentation, " ", i.range, ctx.indentation, " ");
+        std::fprintf(ctx.file, "%*s{\n%*s    long v%zu = gid;\n", ctx.indentation, " ", ctx.indentation, " ", iinsn);
+    }
+    else if(iinsn == ctx.plan.grid_loop)
+    {
+        std::fprintf(ctx.file, "%*s{\n%*s    long v%zu = group;\n", ctx.indentation, " ", ctx.indentation, " ", iinsn);
+    }
+    else if(ctx.plan.is_distributed[iinsn])
+    {
+        std::fprintf(ctx.file, "%*sfor(long v%zu = lid; v%zu < %zd; v%zu += threads)\n%*s{\n",
+                     ctx.indentation, " ", iinsn, iinsn, i.range, iinsn, ctx.indentation, " ");
+        ctx.open_distributed_loops++;
+    }
+    else
+    {
+        std::fprintf(ctx.file, "%*sfor(long v%zu = 0; v%zu < %zd; v%zu++)\n%*s{\n",
+                     ctx.indentation, " ", iinsn, iinsn, i.range, iinsn, ctx.indentation, " ");
+    }
+    ctx.indentation += 4;
+}
+
+static void Lower_Metal(MetalCtx &ctx, const EndLoopInsn &i, size_t iinsn)
+{
+    ctx.indentation -= 4;
+    std::fprintf(ctx.file, "%*s}\n", ctx.indentation, " ");
+    if(!ctx.plan.is_distributed[iinsn])
+        return;
+
+    // Every thread only saw its share of the iterations
+    ctx.open_distributed_loops--;
+    for(auto [accumulator, type] : ctx.plan.reductions[iinsn])
+    {
+        std::fprintf(ctx.file, "%*sv%zu = gg_reduce(v%zu, %s, scratch, lid, threads);\n",
+                     ctx.indentation, " ", accumulator, accumulator, type == ReduceOpType::MAX ? "true" : "false");
+    }
+}
+
+static void Lower_Metal(MetalCtx &ctx, const LoadInsn &i, size_t iinsn)
+{
+    const BufferDescriptor &desc = ctx.program->buffers[ctx.function->inputs[i.input]];
+    std::fprintf(ctx.file, "%*sfloat v%zu = ", ctx.indentation, " ", iinsn);
+    if(desc.dtype == DType::F32)
+        std::fprintf(ctx.file, "i%zu[v%zu];\n", i.input, i.idx);
+    else if(desc.dtype == DType::BF16)
+        std::fprintf(ctx.file, "as_type<float>(uint(i%zu[v%zu]) << 16);\n", i.input, i.idx);
+    else if(IsQuantized(desc.dtype))
+        std::fprintf(ctx.file, "float(i%zu[v%zu]) * %s;\n", i.input, i.idx, FloatLiteral(desc.scale).c_str());
+    else
+        std::fprintf(ctx.file, "float(i%zu[v%zu]);\n", i.input, i.idx);
+}
+
+static void Lower_Metal(MetalCtx &ctx, const StoreInsn &i, size_t iinsn)
+{
+    const BufferDescriptor &desc = ctx.program->buffers[ctx.function->OutputBuffer(i.output)];
+    // Outside of the distributed loops, all threads of the group compute the same value
+    bool guard = ctx.plan.mode != GridPlan::Mode::Flat && ctx.open_distributed_loops == 0;
+    if(guard)
+        std::fprintf(ctx.file, "%*sif(lid == 0)\n", ctx.indentation, " ");
+    std::fprintf(ctx.file, "%*soutput%s[v%zu] = ", ctx.indentation + (guard ? 4 : 0), " ",
+                 i.output == 0 ? "" : std::to_string(i.output).c_str(), i.offset);
+    switch(desc.dtype)
+    {
+    case DType::F32:
+        std::fprintf(ctx.file, "v%zu;\n", i.value);
+        break;
+    case DType::F16:
+        std::fprintf(ctx.file, "half(v%zu);\n", i.value);
+        break;
+    case DType::BF16:
+        std::fprintf(ctx.file, "gg_to_bf16(v%zu);\n", i.value);
+        break;
+    case DType::I8:
+        std::fprintf(ctx.file, "char(clamp(rint(v%zu / %s), -127.0f, 127.0f));\n", i.value, FloatLiteral(desc.scale).c_str());
+        break;
+    case DType::U8:
+        std::fprintf(ctx.file, "uchar(clamp(rint(v%zu / %s), 0.0f, 255.0f));\n", i.value, FloatLiteral(desc.scale).c_str());
+        break;
+    }
+}
+
+static void Lower_Metal(MetalCtx &ctx, const LoadImmediateInsn &i, size_t iinsn)
+{
+    std::fprintf(ctx.file, "%*sfloat v%zu = %s;\n", ctx.indentation, " ", iinsn, FloatLiteral(i.value).c_str());
+}
+
+static void Lower_Metal(MetalCtx &ctx, const UnaryInsn &i, size_t iinsn)
+{
+    auto op_str = i.type == UnaryOpType::EXP ? "exp"
+        : i.type == UnaryOpType::LOG ? "log"
+        : i.type == UnaryOpType::SIN ? "sin"
+        : i.type == UnaryOpType::SQRT ? "sqrt"
+        : "INVALID";
+    std::fprintf(ctx.file, "%*sfloat v%zu = %s(v%zu);\n", ctx.indentation, " ", iinsn, op_str, i.x);
+}
+
+static void Lower_Metal(MetalCtx &ctx, const BinaryInsn &i, size_t iinsn)
+{
+    if(i.type == BinaryOpType::MAX)
+    {
+        std::fprintf(ctx.file, "%*sfloat v%zu = v%zu > v%zu ? v%zu : v%zu;\n",
+                     ctx.indentation, " ", iinsn, i.x, i.y, i.x, i.y);
+    }
+    else if(i.type == BinaryOpType::POW)
+    {
+        std::fprintf(ctx.file, "%*sfloat v%zu = pow(v%zu, v%zu);\n", ctx.indentation, " ", iinsn, i.x, i.y);
+    }
+    else
+    {
+        auto op_str = i.type == BinaryOpType::ADD ? "+"
+            : i.type == BinaryOpType::SUB ? "-"
+            : i.type == BinaryOpType::MUL ? "*"
+            : i.type == BinaryOpType::DIV ? "/"
+            : "==";
+        std::fprintf(ctx.file, "%*sfloat v%zu = (float)(v%zu %s v%zu);\n",
+                     ctx.indentation, " ", iinsn, i.x, op_str, i.y);
+    }
+}
+
+static void Lower_Metal(MetalCtx &ctx, const AccumulateInsn &i, size_t iinsn)
+{
+    if(i.type == ReduceOpType::MAX)
+        std::fprintf(ctx.file, "%*sv%zu = v%zu > v%zu ? v%zu : v%zu;\n",
+                     ctx.indentation, " ", i.accumulator, i.accumulator, i.x, i.accumulator, i.x);
+    else
+        std::fprintf(ctx.file, "%*sv%zu += v%zu;\n", ctx.indentation, " ", i.accumulator, i.x);
+}
+
+static void Lower_Metal(MetalCtx &ctx, const MatmulInsn &i, size_t iinsn)
+{
+    throw std::logic_error("Matmuls get a kernel of their own");
+}
+
+static void PrintKernelSignature(MetalCtx &ctx, const FunctionBuilder &fn, size_t ifn)
+{
+    std::fprintf(ctx.file, "kernel void gg_metal_%zu(\n", ifn);
+    for(size_t i = 0; i < fn.inputs.size(); i++)
+        std::fprintf(ctx.file, "    device const %s *i%zu [[buffer(%zu)]],\n", MetalType(ctx.program->buffers[fn.inputs[i]].dtype), i, i);
+    std::fprintf(ctx.file, "    device %s *output [[buffer(%zu)]],\n", MetalType(ctx.program->buffers[fn.output_buffer].dtype), fn.inputs.size());
+    for(size_t i = 1; i < fn.NumOutputs(); i++)
+        std::fprintf(ctx.file, "    device %s *output%zu [[buffer(%zu)]],\n",
+                     MetalType(ctx.program->buffers[fn.OutputBuffer(i)].dtype), i, fn.inputs.size() + i);
+}
+
+// Tiled through threadgroup memory, one thread per element of the output
+static Kernel Lower_MetalMatmul(MetalCtx &ctx, const FunctionBuilder &fn, const MatmulInsn &i, size_t ifn)
+{
+    PrintKernelSignature(ctx, fn, ifn);
+    std::fprintf(ctx.file, "    uint3 group [[threadgroup_position_in_grid]],\n");
+    std::fprintf(ctx.file, "    uint3 local [[thread_position_in_threadgroup]])\n{\n");
+    std::fprintf(ctx.file, "    threadgroup float x_tile[%zu][%zu];\n", MatmulTile, MatmulTile);
+    std::fprintf(ctx.file, "    threadgroup float y_tile[%zu][%zu];\n", MatmulTile, MatmulTile);
+    std::fprintf(ctx.file, "    long row = group.y * %zu + local.y;\n", MatmulTile);
+    std::fprintf(ctx.file, "    long col = group.x * %zu + local.x;\n", MatmulTile);
+    std::fprintf(ctx.file, "    long remaining = group.z;\n    long x_offset = 0;\n    long y_offset = 0;\n");
+    for(ssize_t dim = std::ssize(i.batch_shape) - 1; dim >= 0; dim--)
+    {
+        std::fprintf(ctx.file, "    x_offset += (remaining %% %zd) * %zd;\n", i.batch_shape[dim], i.x_batch_strides[dim]);
+        std::fprintf(ctx.file, "    y_offset += (remaining %% %zd) * %zd;\n", i.batch_shape[dim], i.y_batch_strides[dim]);
+        std::fprintf(ctx.file, "    remaining /= %zd;\n", i.batch_shape[dim]);
+    }
+    std::fprintf(ctx.file, "    float acc = 0.0f;\n");
+    std::fprintf(ctx.file, "    for(long k0 = 0; k0 < %zd; k0 += %zu)\n    {\n", i.K, MatmulTile);
+    std::fprintf(ctx.file, "        long xk = k0 + local.x;\n        long yk = k0 + local.y;\n");
+    std::fprintf(ctx.file, "        x_tile[local.y][local.x] = row < %zd && xk < %zd ? i%zu[x_offset + row * %zd + xk] : 0.0f;\n",
+                 i.M, i.K, i.x, i.K);
+    std::fprintf(ctx.file, "        y_tile[local.y][local.x] = yk < %zd && col < %zd ? i%zu[y_offset + yk * %zd + col] : 0.0f;\n",
+                 i.K, i.N, i.y, i.N);
+    std::fprintf(ctx.file, "        threadgroup_barrier(mem_flags::mem_threadgroup);\n");
+    std::fprintf(ctx.file, "        for(uint k = 0; k < %zu; k++)\n", MatmulTile);
+    std::fprintf(ctx.file, "            acc += x_tile[local.y][k] * y_tile[k][local.x];\n");
+    std::fprintf(ctx.file, "        threadgroup_barrier(mem_flags::mem_threadgroup);\n    }\n");
+    std::fprintf(ctx.file, "    if(row < %zd && col < %zd)\n", i.M, i.N);
+    std::fprintf(ctx.file, "        output[(long)group.z * %zd + row * %zd + col] = acc;\n}\n\n", i.M * i.N, i.N);
+
+    size_t batches = std::accumulate(i.batch_shape.begin(), i.batch_shape.end(), size_t{1}, std::multiplies{});
+    size_t blocks_x = (i.N + MatmulTile - 1) / MatmulTile;
+    size_t blocks_y = (i.M + MatmulTile - 1) / MatmulTile;
+    return { GridPlan::Mode::Matmul, blocks_x * blocks_y, batches, nullptr };
+}
+
+static Kernel Lower_Metal(MetalCtx &ctx, const FunctionBuilder &fn, size_t ifn)
+{
+    ctx.function = &fn;
+    if(fn.inputs.size() + fn.NumOutputs() > MaxKernelBuffers)
+        throw std::runtime_error("Function reads more buffers than Metal can bind");
+    for(const Instruction &insn : fn.insns)
+        if(auto *matmul = std::get_if<MatmulInsn>(&insn))
+            return Lower_MetalMatmul(ctx, fn, *matmul, ifn);
+
+    ctx.plan = PlanGrid(fn);
+    PrintKernelSignature(ctx, fn, ifn);
+    std::fprintf(ctx.file, "    uint gid [[thread_position_in_grid]],\n");
+    std::fprintf(ctx.file, "    uint group [[threadgroup_position_in_grid]],\n");
+    std::fprintf(ctx.file, "    uint lid [[thread_position_in_threadgroup]],\n");
+    std::fprintf(ctx.file, "    uint threads [[threads_per_threadgroup]])\n{\n");
+    if(ctx.plan.mode != GridPlan::Mode::Flat)
+        std::fprintf(ctx.file, "    threadgroup float scratch[%zu];\n", MaxThreads);
+    ctx.indentation = 4;
+    ctx.open_distributed_loops = 0;
+    for(size_t i = 0; i < fn.insns.size(); i++)
+        std::visit([&](auto &&insn) { Lower_Metal(ctx, insn, i); }, fn.insns[i]);
+    std::fprintf(ctx.file, "}\n\n");
+
+    return { ctx.plan.mode, static_cast<size_t>(ctx.plan.grid), 1, nullptr };
+}
+
+static std::string ErrorString(NS::Error *error)
+{
+    return error ? error->localizedDescription()->utf8String() : "unknown error";
+}
+
+BackendMetal::BackendMetal()
+{
+    this->device = MTL::CreateSystemDefaultDevice();
+    if(!this->device)
+        throw std::runtime_error("No Metal device available");
+    this->queue = this->device->newCommandQueue();
+}
+
+BackendMetal::~BackendMetal()
+{
+    for(Kernel &kernel : this->kernels)
+        kernel.pipeline->release();
+    for(TensorBuffer &tensor : this->tensors)
+        if(tensor.buffer)
+            tensor.buffer->release();
+    if(this->arena)
+        this->arena->release();
+    if(this->library)
+        this->library->release();
+    this->queue->release();
+    this->device->release();
+}
+
+void BackendMetal::LowerProgram(Program &&program)
+{
+    this->program = std::move(program);
+    char *source = nullptr;
+    size_t source_size = 0;
+    FILE *file = open_memstream(&source, &source_size);
+    if(!file)
+        throw std::system_error(errno, std::generic_category());
+
+    MetalCtx ctx = { file, 0, &this->program, nullptr, {}, 0 };
+    std::fputs(MetalPrelude, file);
+    for(size_t ifn = 0; ifn < this->program.functions.size(); ifn++)
+        this->kernels.push_back(::Lower_Metal(ctx, this->program.functions[ifn], ifn));
+    std::fclose(file);
+    std::string source_str(source, source_size);
+    std::free(source);
+
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+    NS::Error *error = nullptr;
+    this->library = this->device->newLibrary(NS::String::string(source_str.c_str(), NS::UTF8StringEncoding), nullptr, &error);
+    if(!this->library)
+    {
+        std::string message = ErrorString(error);
+        pool->release();
+        throw std::runtime_error("Failed to compile Metal kernels: " + message);
+    }
+    for(size_t ifn = 0; ifn < this->kernels.size(); ifn++)
+    {
+        std::string name = "gg_metal_" + std::to_string(ifn);
+        MTL::Function *function = this->library->newFunction(NS::String::string(name.c_str(), NS::UTF8StringEncoding));
+        this->kernels[ifn].pipeline = this->device->newComputePipelineState(function, &error);
+        function->release();
+        if(!this->kernels[ifn].pipeline)
+        {
+            std::string message = ErrorString(error);
+            this->kernels.resize(ifn);
+            pool->release();
+            throw std::runtime_error("Failed to create pipeline for " + name + ": " + message);
+        }
+    }
+    pool->release();
+}
+
+void *BackendMetal::InitBuffers()
+{
+    // Generous alignment, so that any offset into the arena is valid to bind
+    ArenaPlan plan = PlanArena(this->program, 256);
+    this->offsets = std::move(plan.offsets);
+    this->arena = this->device->newBuffer(std::max<size_t>(plan.size_bytes, 1), MTL::ResourceStorageModeShared);
+    this->tensors.resize(this->program.buffers.size());
+    for(const FunctionBuilder &fn : this->program.functions)
+        for(size_t i = 0; i < fn.NumOutputs(); i++)
+            this->tensors[fn.OutputBuffer(i)].is_written = true;
+    return this->GetBuffer(this->program.functions.back().output_buffer);
+}
+
+void *BackendMetal::GetBuffer(size_t idx)
+{
+    const BufferDescriptor &desc = this->program.buffers.at(idx);
+    if(std::holds_alternative<GraphNodeHandle>(desc.id))
+    {
+        GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+        return tensor.data();
+    }
+    return static_cast<std::byte *>(this->arena->contents()) + this->offsets[idx];
+}
+
+static size_t TensorBytes(const BufferDescriptor &desc)
+{
+    GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+    const Shape &shape = tensor.shape();
+    return SizeOf(desc.dtype) * std::accumulate(shape.begin(), shape.end(), size_t{1}, std::multiplies{});
+}
+
+// Tensors may be pointed at different data between runs
+void BackendMetal::BindTensors()
+{
+    const size_t page_size = static_cast<size_t>(getpagesize());
+    for(size_t ibuff = 0; ibuff < this->program.buffers.size(); ibuff++)
+    {
+        const BufferDescriptor &desc = this->program.buffers[ibuff];
+        if(!std::holds_alternative<GraphNodeHandle>(desc.id))
+            continue;
+
+        TensorBuffer &tensor = this->tensors[ibuff];
+        GraphNodeHandle node = std::get<GraphNodeHandle>(desc.id);
+        void *data = node.data();
+        size_t size_bytes = std::max(SizeOf(desc.dtype) * desc.size_elts, TensorBytes(desc));
+        if(data == tensor.wrapped)
+            continue;
+        if(reinterpret_cast<uintptr_t>(data) % page_size == 0)
+        {
+            // Wrapping requires whole pages. The page the data ends in is mapped anyway.
+            if(tensor.buffer)
+                tensor.buffer->release();
+            size_t wrapped_bytes = (size_bytes + page_size - 1) / page_size * page_size;
+            tensor.buffer = this->device->newBuffer(data, wrapped_bytes, MTL::ResourceStorageModeShared, nullptr);
+            tensor.wrapped = data;
+            continue;
+        }
+
+        if(!tensor.buffer || tensor.wrapped)
+        {
+            if(tensor.buffer)
+                tensor.buffer->release();
+            tensor.buffer = this->device->newBuffer(size_bytes, MTL::ResourceStorageModeShared);
+            tensor.wrapped = nullptr;
+        }
+        std::memcpy(tensor.buffer->contents(), data, TensorBytes(desc));
+    }
+}
+
+void BackendMetal::Encode(MTL::ComputeCommandEncoder *encoder, size_t ifn)
+{
+    const FunctionBuilder &fn = this->program.functions[ifn];
+    const Kernel &kernel = this->kernels[ifn];
+    auto bind = [&](size_t ibuff, size_t index)
+    {
+        if(this->tensors[ibuff].buffer)
+            encoder->setBuffer(this->tensors[ibuff].buffer, 0, index);
+        else
+            encoder->setBuffer(this->arena, this->offsets[ibuff], index);
+    };
+    for(size_t i = 0; i < fn.inputs.size(); i++)
+        bind(fn.inputs[i], i);
+    for(size_t i = 0; i < fn.NumOutputs(); i++)
+        bind(fn.OutputBuffer(i), fn.inputs.size() + i);
+
+    encoder->setComputePipelineState(kernel.pipeline);
+    if(kernel.mode == GridPlan::Mode::Matmul)
+    {
+        const MatmulInsn &matmul = std::get<MatmulInsn>(*std::find_if(
+            fn.insns.begin(),
+            fn.insns.end(),
+            [](const Instruction &insn) { return std::holds_alternative<MatmulInsn>(insn); }));
+        size_t blocks_x = (matmul.N + MatmulTile - 1) / MatmulTile;
+        encoder->dispatchThreadgroups(
+            MTL::Size(blocks_x, kernel.grid / blocks_x, kernel.batches),
+            MTL::Size(MatmulTile, MatmulTile, 1));
+        return;
+    }
+
+    // Reductions assume a power of two
+    size_t threads = MaxThreads;
+    while(threads > kernel.pipeline->maxTotalThreadsPerThreadgroup())
+        threads /= 2;
+    size_t groups = kernel.mode == GridPlan::Mode::Flat ? (kernel.grid + threads - 1) / threads : kernel.grid;
+    encoder->dispatchThreadgroups(MTL::Size(groups, 1, 1), MTL::Size(threads, 1, 1));
+}
+
+// A serial compute encoder runs its dispatches one after the other, so we can encode the
+// whole program into one
+void BackendMetal::Run(size_t first_function, size_t end_function)
+{
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+    this->BindTensors();
+    MTL::CommandBuffer *commands = this->queue->commandBuffer();
+    MTL::ComputeCommandEncoder *encoder = commands->computeCommandEncoder();
+    for(size_t ifn = first_function; ifn < end_function; ifn++)
+        this->Encode(encoder, ifn);
+    encoder->endEncoding();
+    commands->commit();
+    commands->waitUntilCompleted();
+    if(commands->status() == MTL::CommandBufferStatusError)
+    {
+        std::string message = ErrorString(commands->error());
+        pool->release();
+        throw std::runtime_error("Metal command buffer failed: " + message);
+    }
+
+    for(size_t ibuff = 0; ibuff < this->program.buffers.size(); ibuff++)
+    {
+        const TensorBuffer &tensor = this->tensors[ibuff];
+        if(tensor.buffer && !tensor.wrapped && tensor.is_written)
+        {
+            const BufferDescriptor &desc = this->program.buffers[ibuff];
+            GraphNodeHandle node = std::get<GraphNodeHandle>(desc.id);
+            std::memcpy(node.data(), tensor.buffer->contents(), TensorBytes(desc));
+        }
+    }
+    pool->release();
+}
+
+void BackendMetal::Execute()
+{
+    this->Run(0, this->program.functions.size());
+}
+
+bool BackendMetal::ExecuteFunction(size_t ifn)
+{
+    this->Run(ifn, ifn + 1);
+    return true;
+}
+
+const Program *BackendMetal::GetProgram() const
+{
+    return &this->program;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "backend.h"
+#include "codegen.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace MTL
+{
+class Buffer;
+class CommandQueue;
+class ComputeCommandEncoder;
+class ComputePipelineState;
+class Device;
+class Library;
+}
+
+namespace gigagrad
+{
+namespace codegen
+{
+
+// Lowers every function to a Metal compute kernel (only built on macOS). Functions map
+// onto the grid as described by GridPlan, with a threadgroup per group, and threads combine
+// their partial reductions in threadgroup memory.
+//
+// Intermediate buffers live in a single shared-storage MTLBuffer, so they're directly
+// accessible from the host. Tensors whose data is page-aligned are wrapped without a
+// copy, others are copied in before and (if written) out after every run.
+struct BackendMetal : public Backend
+{
+    BackendMetal();
+    virtual ~BackendMetal();
+    virtual void LowerProgram(Program &&program);
+    virtual void *InitBuffers();
+    virtual void *GetBuffer(size_t idx);
+    virtual void Execute();
+    virtual bool ExecuteFunction(size_t ifn);
+    virtual const Program *GetProgram() const;
+
+    struct Kernel
+    {
+        GridPlan::Mode mode;
+        size_t grid; // Iterations of the grid loop, or blocks of the output for matmuls
+        size_t batches; // Of matmuls
+        MTL::ComputePipelineState *pipeline;
+    };
+
+    // Staging for a tensor whose data can't be wrapped in place
+    struct TensorBuffer
+    {
+        MTL::Buffer *buffer = nullptr;
+        void *wrapped = nullptr; // Host pointer `buffer` wraps without a copy, if any
+        bool is_written = false; // By some function, so it needs to be copied back
+    };
+
+    Program program;
+    MTL::Device *device = nullptr;
+    MTL::CommandQueue *queue = nullptr;
+    MTL::Library *library = nullptr;
+    std::vector<Kernel> kernels; // One per function of the program
+    MTL::Buffer *arena = nullptr; // Backs all of the intermediate buffers, see PlanArena
+    std::vector<size_t> offsets; // Of the intermediate buffers in the arena
+    std::vector<TensorBuffer> tensors; // Indexed by buffer, empty for intermediates
+
+private:
+    void Run(size_t first_function, size_t end_function);
+    void BindTensors();
+    void Encode(MTL::ComputeCommandEncoder *encoder, size_t ifn);
+};
+
+}
+}
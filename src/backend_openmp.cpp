@@ -0,0 +1,11 @@
+#include "backend_openmp.h"
+
+using namespace gigagrad;
+using namespace gigagrad::codegen;
+
+BackendOpenMP::BackendOpenMP()
+    : BackendScalarC(LowerOptions{ .prefix = "gg_openmp", .openmp = true })
+{
+    // Every function already runs on all cores
+    this->num_threads = 1;
+}
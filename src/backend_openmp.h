@@ -0,0 +1,18 @@
+#pragma once
+#include "backend_scalar_c.h"
+
+namespace gigagrad
+{
+namespace codegen
+{
+
+// Same lowering as BackendScalarC, but the outermost non-reduction loop of every
+// function is run with `omp parallel for` and innermost loops get `omp simd`. Functions
+// run one after the other by default, since each one already uses all cores.
+struct BackendOpenMP : public BackendScalarC
+{
+    BackendOpenMP();
+};
+
+}
+}
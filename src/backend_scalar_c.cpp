@@ -1,11 +1,21 @@
 #include "backend_scalar_c.h"
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <system_error>
 #include <cstdio>
 #include <cerrno>
 #include <cstdlib>
+#include <string>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 
 #include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace gigagrad;
 using namespace gigagrad::codegen;
@@ -15,6 +25,12 @@ struct LowerCtx
     const char *prefix;
     FILE *file;
     int indentation;
+    bool openmp;
+    bool profile;
+    bool standalone;
+    const Program *program;
+    const FunctionBuilder *function; // Function being lowered
+    std::unordered_map<size_t, std::string> loop_pragmas; // Keyed by BeginLoopInsn index
 };
 
 static void Lower_ScalarC(LowerCtx &ctx, const LoadIntImmediateInsn &i, size_t iinsn)
@@ -30,8 +46,11 @@ static void Lower_ScalarC(LowerCtx &ctx, const IntArithmeticInsn &i, size_t iins
 
 static void Lower_ScalarC(LowerCtx &ctx, const BeginLoopInsn &i, size_t iinsn)
 {
-    std::fprintf(ctx.file, "%*sfor(int64_t v%zu = 0; v%zu < %zd; v%zu++)\n%*s{\n",
-                 ctx.indentation, " ", iinsn, iinsn, i.range, iinsn, ctx.indentation, " ");
+    if(auto pragma = ctx.loop_pragmas.find(iinsn); pragma != ctx.loop_pragmas.end())
+        std::fprintf(ctx.file, "%*s%s\n", ctx.indentation, " ", pragma->second.c_str());
+    std::string range = i.is_batch ? "batch_size" : std::to_string(i.range);
+    std::fprintf(ctx.file, "%*sfor(int64_t v%zu = 0; v%zu < %s; v%zu++)\n%*s{\n",
+                 ctx.indentation, " ", iinsn, iinsn, range.c_str(), iinsn, ctx.indentation, " ");
     ctx.indentation += 4;
 }
 
@@ -41,20 +60,56 @@ static void Lower_ScalarC(LowerCtx &ctx, const EndLoopInsn &i, size_t iinsn)
     std::fprintf(ctx.file, "%*s}\n", ctx.indentation, " ");
 }
 
+static const char *CType(DType dtype)
+{
+    switch(dtype)
+    {
+    case DType::F32:
+        return "float";
+    case DType::F16:
+    case DType::BF16:
+        return "uint16_t";
+    case DType::I8:
+        return "int8_t";
+    case DType::U8:
+        return "uint8_t";
+    default:
+        throw std::domain_error("Invalid dtype");
+    }
+}
+
 static void Lower_ScalarC(LowerCtx &ctx, const LoadInsn &i, size_t iinsn)
 {
-    std::fprintf(ctx.file, "%*sfloat v%zu = i%zu[v%zu];\n",
-                 ctx.indentation, " ", iinsn, i.input, i.idx);
+    const BufferDescriptor &desc = ctx.program->buffers[ctx.function->inputs[i.input]];
+    std::fprintf(ctx.file, "%*sfloat v%zu = ", ctx.indentation, " ", iinsn);
+    if(desc.dtype == DType::F32)
+        std::fprintf(ctx.file, "i%zu[v%zu];\n", i.input, i.idx);
+    else if(IsQuantized(desc.dtype))
+        std::fprintf(ctx.file, "gg_from_%s(i%zu[v%zu], %a);\n", DTypeName(desc.dtype), i.input, i.idx, desc.scale);
+    else
+        std::fprintf(ctx.file, "gg_from_%s(i%zu[v%zu]);\n", DTypeName(desc.dtype), i.input, i.idx);
+}
+
+static std::string OutputName(size_t output)
+{
+    return output == 0 ? "output" : "output" + std::to_string(output);
 }
 
 static void Lower_ScalarC(LowerCtx &ctx, const StoreInsn &i, size_t iinsn)
 {
-    std::fprintf(ctx.file, "%*soutput[v%zu] = v%zu;\n", ctx.indentation, " ", i.offset, i.value);
+    const BufferDescriptor &desc = ctx.program->buffers[ctx.function->OutputBuffer(i.output)];
+    std::fprintf(ctx.file, "%*s%s[v%zu] = ", ctx.indentation, " ", OutputName(i.output).c_str(), i.offset);
+    if(desc.dtype == DType::F32)
+        std::fprintf(ctx.file, "v%zu;\n", i.value);
+    else if(IsQuantized(desc.dtype))
+        std::fprintf(ctx.file, "gg_to_%s(v%zu, %a);\n", DTypeName(desc.dtype), i.value, desc.scale);
+    else
+        std::fprintf(ctx.file, "gg_to_%s(v%zu);\n", DTypeName(desc.dtype), i.value);
 }
 
 static void Lower_ScalarC(LowerCtx &ctx, const LoadImmediateInsn &i, size_t iinsn)
 {
-    std::fprintf(ctx.file, "%*sfloat v%zu = %f;\n", ctx.indentation, " ", iinsn, i.value);
+    std::fprintf(ctx.file, "%*sfloat v%zu = %a;\n", ctx.indentation, " ", iinsn, i.value);
 }
 
 static void Lower_ScalarC(LowerCtx &ctx, const UnaryInsn &i, size_t iinsn)
@@ -107,13 +162,330 @@ static void Lower_ScalarC(LowerCtx &ctx, const AccumulateInsn &i, size_t iinsn)
         std::fprintf(ctx.file, "%*sv%zu += v%zu;\n", ctx.indentation, " ", i.accumulator, i.x);
 }
 
+static void Lower_ScalarC(LowerCtx &ctx, const MatmulInsn &i, size_t iinsn)
+{
+    std::string x_offset = "0";
+    std::string y_offset = "0";
+    std::string output_offset = "0";
+    dim_t output_stride = i.M * i.N;
+    for(ssize_t dim = std::ssize(i.batch_shape) - 1; dim >= 0; dim--)
+    {
+        std::string batch_var = "v" + std::to_string(iinsn) + "_" + std::to_string(dim);
+        x_offset += " + " + batch_var + " * " + std::to_string(i.x_batch_strides[dim]);
+        y_offset += " + " + batch_var + " * " + std::to_string(i.y_batch_strides[dim]);
+        output_offset += " + " + batch_var + " * " + std::to_string(output_stride);
+        output_stride *= i.batch_shape[dim];
+    }
+    // The batch replaces whichever dimension comes first
+    auto range = [&](size_t dim, dim_t value)
+    {
+        return i.is_batched && dim == 0 ? std::string("batch_size") : std::to_string(value);
+    };
+    for(size_t dim = 0; dim < i.batch_shape.size(); dim++)
+    {
+        std::fprintf(ctx.file, "%*sfor(int64_t v%zu_%zu = 0; v%zu_%zu < %s; v%zu_%zu++)\n%*s{\n",
+                     ctx.indentation, " ", iinsn, dim, iinsn, dim, range(dim, i.batch_shape[dim]).c_str(), iinsn, dim,
+                     ctx.indentation, " ");
+        ctx.indentation += 4;
+    }
+    std::string M = i.batch_shape.empty() ? range(0, i.M) : std::to_string(i.M);
+    std::fprintf(ctx.file, "%*sgg_matmul(i%zu + %s, i%zu + %s, output + %s, %s, %zd, %zd);\n",
+                 ctx.indentation, " ",
+                 i.x, x_offset.c_str(),
+                 i.y, y_offset.c_str(),
+                 output_offset.c_str(),
+                 M.c_str(), i.K, i.N);
+    for(size_t dim = 0; dim < i.batch_shape.size(); dim++)
+    {
+        ctx.indentation -= 4;
+        std::fprintf(ctx.file, "%*s}\n", ctx.indentation, " ");
+    }
+}
+
+// Cache-tiled, register-blocked matmul. B is packed into panels of GG_KC x GG_NC split into
+// strips GG_NR wide, A is packed per thread into GG_MC x GG_KC blocks of GG_MR high strips,
+// and the micro-kernel keeps a GG_MR x GG_NR block of the output in vector registers.
+static const char *MatmulKernel = R"(
+#if defined(__AVX512F__)
+#define GG_VL 16
+#define GG_MR 8
+#define GG_NR 32
+#elif defined(__AVX__)
+#define GG_VL 8
+#define GG_MR 6
+#define GG_NR 16
+#else
+#define GG_VL 4
+#define GG_MR 6
+#define GG_NR 16
+#endif
+#define GG_MC (GG_MR * 16)
+#define GG_KC 256
+#define GG_NC 512
+typedef float gg_vec __attribute__((vector_size(GG_VL * sizeof(float))));
+
+static inline void gg_matmul(const float *x, const float *y, float *out, int64_t M, int64_t K, int64_t N)
+{
+    float *bp = (float *)aligned_alloc(64, sizeof(float) * GG_KC * GG_NC);
+    for(int64_t jc = 0; jc < N; jc += GG_NC)
+    {
+        int64_t nc = N - jc < GG_NC ? N - jc : GG_NC;
+        for(int64_t pc = 0; pc < K; pc += GG_KC)
+        {
+            int64_t kc = K - pc < GG_KC ? K - pc : GG_KC;
+#ifdef _OPENMP
+            #pragma omp parallel for
+#endif
+            for(int64_t js = 0; js < nc; js += GG_NR)
+            {
+                float *strip = bp + js * kc;
+                for(int64_t k = 0; k < kc; k++)
+                    for(int64_t c = 0; c < GG_NR; c++)
+                        strip[k * GG_NR + c] = js + c < nc ? y[(pc + k) * N + jc + js + c] : 0.0f;
+            }
+#ifdef _OPENMP
+            #pragma omp parallel for
+#endif
+            for(int64_t ic = 0; ic < M; ic += GG_MC)
+            {
+                float ap[GG_MC * GG_KC] __attribute__((aligned(64)));
+                int64_t mc = M - ic < GG_MC ? M - ic : GG_MC;
+                for(int64_t is = 0; is < mc; is += GG_MR)
+                    for(int64_t k = 0; k < kc; k++)
+                        for(int64_t r = 0; r < GG_MR; r++)
+                            ap[is * kc + k * GG_MR + r] = is + r < mc ? x[(ic + is + r) * K + pc + k] : 0.0f;
+                for(int64_t js = 0; js < nc; js += GG_NR)
+                {
+                    const float *b = bp + js * kc;
+                    for(int64_t is = 0; is < mc; is += GG_MR)
+                    {
+                        const float *a = ap + is * kc;
+                        gg_vec acc[GG_MR][GG_NR / GG_VL] = {{0}};
+                        for(int64_t k = 0; k < kc; k++)
+                        {
+                            const gg_vec *bv = (const gg_vec *)(b + k * GG_NR);
+                            for(int64_t r = 0; r < GG_MR; r++)
+                            {
+                                gg_vec av = (gg_vec){} + a[k * GG_MR + r];
+                                for(int64_t c = 0; c < GG_NR / GG_VL; c++)
+                                    acc[r][c] += av * bv[c];
+                            }
+                        }
+                        int64_t mr = mc - is < GG_MR ? mc - is : GG_MR;
+                        int64_t nr = nc - js < GG_NR ? nc - js : GG_NR;
+                        for(int64_t r = 0; r < mr; r++)
+                        {
+                            float *o = out + (ic + is + r) * N + jc + js;
+                            for(int64_t c = 0; c < nr; c++)
+                            {
+                                float v = acc[r][c / GG_VL][c % GG_VL];
+                                o[c] = pc == 0 ? v : o[c] + v;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    free(bp);
+}
+
+)";
+
+// Loads and stores of tensors that aren't F32 go through these. Keep them in sync with
+// dtype.cpp.
+static const char *DTypeConversions = R"(
+static inline uint16_t gg_to_f16(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, 4);
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7FFFFFFF;
+    if(abs >= 0x7F800000)
+        return (uint16_t)(sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0));
+    if(abs >= 0x477FF000)
+        return (uint16_t)(sign | 0x7C00);
+    if(abs < 0x33000000)
+        return (uint16_t)sign;
+    uint32_t result, remainder, halfway;
+    if(abs < 0x38800000)
+    {
+        uint32_t shift = 126 - (abs >> 23);
+        uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+        result = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        uint32_t rebiased = abs - (112u << 23);
+        result = rebiased >> 13;
+        remainder = rebiased & 0x1FFF;
+        halfway = 0x1000;
+    }
+    if(remainder > halfway || (remainder == halfway && (result & 1)))
+        result++;
+    return (uint16_t)(sign | result);
+}
+
+static inline float gg_from_f16(uint16_t x)
+{
+    uint32_t sign = (uint32_t)(x & 0x8000) << 16;
+    uint32_t exponent = (x >> 10) & 0x1F;
+    uint32_t mantissa = x & 0x3FF;
+    uint32_t bits;
+    if(exponent == 0x1F)
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    else if(exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if(mantissa == 0)
+        bits = sign;
+    else
+    {
+        exponent = 113;
+        while(!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float result;
+    memcpy(&result, &bits, 4);
+    return result;
+}
+
+static inline uint16_t gg_to_bf16(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, 4);
+    if((bits & 0x7FFFFFFF) > 0x7F800000)
+        return (uint16_t)((bits >> 16) | 0x40);
+    return (uint16_t)((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+static inline float gg_from_bf16(uint16_t x)
+{
+    uint32_t bits = (uint32_t)x << 16;
+    float result;
+    memcpy(&result, &bits, 4);
+    return result;
+}
+
+static inline int8_t gg_to_i8(float x, float scale)
+{
+    float q = nearbyintf(x / scale);
+    q = q > 127.0f ? 127.0f : q < -127.0f ? -127.0f : q;
+    return (int8_t)q;
+}
+
+static inline float gg_from_i8(int8_t x, float scale)
+{
+    return (float)x * scale;
+}
+
+static inline uint8_t gg_to_u8(float x, float scale)
+{
+    float q = nearbyintf(x / scale);
+    q = q > 255.0f ? 255.0f : q < 0.0f ? 0.0f : q;
+    return (uint8_t)q;
+}
+
+static inline float gg_from_u8(uint8_t x, float scale)
+{
+    return (float)x * scale;
+}
+
+)";
+
+static bool IsIntermediateBuffer(const Program &program, size_t buffer_id)
+{
+    return !std::holds_alternative<GraphNodeHandle>(program.buffers[buffer_id].id);
+}
+
+// Parallelizes the outermost non-reduction loop of every loop nest and vectorizes
+// innermost loops. A loop is a reduction loop if it accumulates into an accumulator
+// that was declared outside of it. Loops that still contain integer division are
+// not forced to vectorize, since gathers with emulated 64-bit division are slower
+// than the scalar loop.
+static void AnnotateLoops_OpenMP(LowerCtx &ctx, const FunctionBuilder &fn)
+{
+    ctx.loop_pragmas.clear();
+
+    // Intermediate buffers are allocated by us, so we know they're aligned.
+    std::string aligned;
+    for(size_t i = 0; i < fn.inputs.size(); i++)
+        if(IsIntermediateBuffer(*ctx.program, fn.inputs[i]))
+            aligned += (aligned.empty() ? "" : ", ") + ("i" + std::to_string(i));
+    for(size_t i = 0; i < fn.NumOutputs(); i++)
+        if(IsIntermediateBuffer(*ctx.program, fn.OutputBuffer(i)))
+            aligned += (aligned.empty() ? "" : ", ") + OutputName(i);
+    if(!aligned.empty())
+        aligned = " aligned(" + aligned + " : " + std::to_string(BufferAlignment) + ")";
+
+    struct OpenLoop
+    {
+        size_t begin;
+        bool has_inner_loop;
+        bool has_divmod;
+        bool is_strided; // Vectorizing it would need gathers
+        std::string reduction;
+    };
+    std::vector<OpenLoop> open_loops;
+    for(size_t iinsn = 0; iinsn < fn.insns.size(); iinsn++)
+    {
+        const Instruction &insn = fn.insns[iinsn];
+        if(auto *begin = std::get_if<BeginLoopInsn>(&insn))
+        {
+            if(!open_loops.empty())
+                open_loops.back().has_inner_loop = true;
+            open_loops.push_back({ iinsn, false, false, begin->stride != 1, "" });
+        }
+        else if(auto *arith = std::get_if<IntArithmeticInsn>(&insn))
+        {
+            if(!open_loops.empty()
+               && (arith->op == IntArithmeticInsn::Op::DIV || arith->op == IntArithmeticInsn::Op::MOD))
+                open_loops.back().has_divmod = true;
+        }
+        else if(auto *accum = std::get_if<AccumulateInsn>(&insn))
+        {
+            for(OpenLoop &loop : open_loops)
+            {
+                if(accum->accumulator < loop.begin)
+                {
+                    auto op = accum->type == ReduceOpType::SUM ? "+" : "max";
+                    loop.reduction += std::string(" reduction(") + op + ":v" + std::to_string(accum->accumulator) + ")";
+                }
+            }
+        }
+        else if(std::holds_alternative<EndLoopInsn>(insn))
+        {
+            OpenLoop loop = std::move(open_loops.back());
+            open_loops.pop_back();
+            bool parallel = open_loops.empty() && loop.reduction.empty();
+            bool simd = !loop.has_inner_loop && !loop.has_divmod && !loop.is_strided;
+            if(parallel && simd)
+                ctx.loop_pragmas[loop.begin] = "#pragma omp parallel for simd" + aligned;
+            else if(parallel)
+                ctx.loop_pragmas[loop.begin] = "#pragma omp parallel for";
+            else if(simd)
+                ctx.loop_pragmas[loop.begin] = "#pragma omp simd" + loop.reduction + aligned;
+        }
+    }
+}
+
 static void Lower_ScalarC(LowerCtx &ctx, const FunctionBuilder &fn, size_t ifn)
 {
+    ctx.function = &fn;
     std::fprintf(ctx.file, "static void %s_%zu(\n", ctx.prefix, ifn);
     for(size_t i = 0; i < fn.inputs.size(); i++)
-        std::fprintf(ctx.file, "    const float *i%zu,\n", i);
-    std::fprintf(ctx.file, "    float *output)\n{\n");
+        std::fprintf(ctx.file, "    const %s *i%zu,\n", CType(ctx.program->buffers[fn.inputs[i]].dtype), i);
+    for(size_t i = 0; i < fn.NumOutputs(); i++)
+        std::fprintf(ctx.file, "    %s *%s,\n", CType(ctx.program->buffers[fn.OutputBuffer(i)].dtype), OutputName(i).c_str());
+    std::fprintf(ctx.file, "    int64_t batch_size)\n{\n");
     ctx.indentation = 4;
+    if(ctx.openmp)
+        AnnotateLoops_OpenMP(ctx, fn);
     for(size_t i = 0; i < fn.insns.size(); i++)
     {
         std::visit([&](auto &&insn) { Lower_ScalarC(ctx, insn, i); }, fn.insns[i]);
@@ -121,99 +493,310 @@ static void Lower_ScalarC(LowerCtx &ctx, const FunctionBuilder &fn, size_t ifn)
     std::fprintf(ctx.file, "}\n\n");
 }
 
+// Prints the call of function `ifn`, bracketed by updates of its profile counters if
+// profiling is on
+static void GenerateCall(const Program &program, LowerCtx &ctx, size_t ifn, const char *indent)
+{
+    const FunctionBuilder &fn = program.functions[ifn];
+    if(ctx.profile)
+        std::fprintf(ctx.file, "%suint64_t start_%zu = gigagrad_now();\n", indent, ifn);
+    std::fprintf(ctx.file, "%s%s_%zu(\n", indent, ctx.prefix, ifn);
+    for(size_t iinput = 0; iinput < fn.inputs.size(); iinput++)
+        std::fprintf(ctx.file, "%s    buffers[%zu],\n", indent, fn.inputs[iinput]);
+    for(size_t ioutput = 0; ioutput < fn.NumOutputs(); ioutput++)
+        std::fprintf(ctx.file, "%s    buffers[%zu],\n", indent, fn.OutputBuffer(ioutput));
+    std::fprintf(ctx.file, "%s    batch_size);\n", indent);
+    if(ctx.profile)
+    {
+        // Execution contexts may run concurrently
+        std::fprintf(ctx.file, "%s__atomic_fetch_add(&gigagrad_profile[%zu], 1, __ATOMIC_RELAXED);\n", indent, 2 * ifn);
+        std::fprintf(ctx.file, "%s__atomic_fetch_add(&gigagrad_profile[%zu], gigagrad_now() - start_%zu, __ATOMIC_RELAXED);\n",
+                     indent, 2 * ifn + 1, ifn);
+    }
+}
+
 static void GenerateMain(const Program &program, LowerCtx &ctx)
 {
-    std::fprintf(ctx.file, "void gigagrad_main(void **buffers)\n{\n");
+    if(ctx.profile)
+    {
+        std::fprintf(ctx.file, "static uint64_t gigagrad_now(void)\n{\n");
+        std::fprintf(ctx.file, "    struct timespec ts;\n");
+        std::fprintf(ctx.file, "    clock_gettime(CLOCK_MONOTONIC, &ts);\n");
+        std::fprintf(ctx.file, "    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;\n");
+        std::fprintf(ctx.file, "}\n\n");
+    }
+
+    // Standalone code runs inside someone else's process, so leave its FP environment alone.
+    // Otherwise the profile counters belong to the backend, as every backend that compiles
+    // the same program shares the same object.
+    if(ctx.standalone)
+        std::fprintf(ctx.file, "static void gigagrad_main(void **buffers, int64_t batch_size)\n{\n");
+    else
+        std::fprintf(ctx.file, "void gigagrad_main(void **buffers, int64_t batch_size, uint64_t *gigagrad_profile)\n{\n");
+    if(!ctx.standalone)
+    {
+        std::fprintf(ctx.file, "#if __linux__\n");
+        std::fprintf(ctx.file, "    feenableexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW);\n");
+        std::fprintf(ctx.file, "#endif\n");
+    }
+    for(size_t ifn = 0; ifn < program.functions.size(); ifn++)
+    {
+        GenerateCall(program, ctx, ifn, "    ");
+        std::fprintf(ctx.file, "\n");
+    }
+    std::fprintf(ctx.file, "}\n\n");
+    if(ctx.standalone)
+        return;
+
+    // Entry point for running the functions one at a time, in whatever order the
+    // executor picks
+    std::fprintf(ctx.file, "void gigagrad_fn(size_t ifn, void **buffers, int64_t batch_size, uint64_t *gigagrad_profile)\n{\n");
     std::fprintf(ctx.file, "#if __linux__\n");
     std::fprintf(ctx.file, "    feenableexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW);\n");
     std::fprintf(ctx.file, "#endif\n");
+    std::fprintf(ctx.file, "    switch(ifn)\n    {\n");
     for(size_t ifn = 0; ifn < program.functions.size(); ifn++)
     {
-        const FunctionBuilder &fn = program.functions[ifn];
-        std::fprintf(ctx.file, "    %s_%zu(\n", ctx.prefix, ifn);
-        for(size_t iinput = 0; iinput < fn.inputs.size(); iinput++)
-            std::fprintf(ctx.file, "        buffers[%zu],\n", fn.inputs[iinput]);
-        std::fprintf(ctx.file, "        buffers[%zu]);\n\n", fn.output_buffer);
+        std::fprintf(ctx.file, "    case %zu:\n    {\n", ifn);
+        GenerateCall(program, ctx, ifn, "        ");
+        std::fprintf(ctx.file, "        break;\n    }\n");
     }
-    std::fprintf(ctx.file, "}\n");
+    std::fprintf(ctx.file, "    }\n}\n");
 }
 
 using GraphEvalFn = BackendScalarC::GraphEvalFn;
 
-static std::pair<GraphEvalFn, void *> CompileAndLoad(const std::filesystem::path &source_path)
+static void *LoadSymbol(void *handle, const char *name)
 {
-    std::filesystem::path obj_path = source_path;
-    obj_path.replace_extension(".so");
-    std::string command =
-        "cc " +
-        source_path.string() + 
-        " -o " +
-        obj_path.string() +
-        "  -Ofast -fPIC -shared -lm -march=native -mtune=native";
-    std::system(command.c_str());
-    // std::printf("Compiling with: %s\n", command.c_str());
-
-    void *handle = dlopen(obj_path.c_str(), RTLD_NOW | RTLD_LOCAL);
-    if(!handle)
-        throw std::runtime_error(dlerror());
     dlerror(); // Clear error conditions
-    auto main_fn = reinterpret_cast<GraphEvalFn>(dlsym(handle, "gigagrad_main"));
-    if(!main_fn)
+    void *symbol = dlsym(handle, name);
+    if(!symbol)
     {
         char *err = dlerror();
         if(!err)
-            throw std::runtime_error("Symbol gigagrad_main is NULL, which is unexpected");
+            throw std::runtime_error(std::string("Symbol ") + name + " is NULL, which is unexpected");
         else
             throw std::runtime_error(err);
     }
+    return symbol;
+}
+
+static std::pair<GraphEvalFn, void *> Load(const std::filesystem::path &obj_path)
+{
+    void *handle = dlopen(obj_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(!handle)
+        throw std::runtime_error(dlerror());
+    auto main_fn = reinterpret_cast<GraphEvalFn>(LoadSymbol(handle, "gigagrad_main"));
     return { main_fn, handle };
 }
 
-static std::pair<GraphEvalFn, void *> Lower_ScalarC(const char *prefix, const Program &program)
+// 64-bit FNV-1a
+static uint64_t Hash(std::string_view data, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    for(char c : data)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+std::filesystem::path gigagrad::codegen::DefaultKernelCacheDirectory()
+{
+    if(const char *dir = std::getenv("GIGAGRAD_CACHE_DIR"); dir && *dir)
+        return dir;
+    if(const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return std::filesystem::path(xdg) / "gigagrad";
+    if(const char *home = std::getenv("HOME"); home && *home)
+        return std::filesystem::path(home) / ".cache" / "gigagrad";
+    return std::filesystem::temp_directory_path() / "gigagrad";
+}
+
+// What `cc -v` reports about itself and about what -march=native resolves to on this machine,
+// so that caches shared between machines or compilers don't hand out objects built for
+// someone else's CPU
+static const std::string &CompilerIdentity()
+{
+    static const std::string identity = []()
+    {
+        FILE *pipe = popen("cc -march=native -mtune=native -E -v -x c /dev/null -o /dev/null 2>&1", "r");
+        if(!pipe)
+            throw std::system_error(errno, std::generic_category());
+        std::string result;
+        char chunk[4096];
+        while(size_t read = std::fread(chunk, 1, sizeof(chunk), pipe))
+            result.append(chunk, read);
+        if(pclose(pipe) != 0)
+            throw std::runtime_error("Failed to run cc");
+        return result;
+    }();
+    return identity;
+}
+
+// Moves `from` to `to` unless `to` already exists, in which case someone else compiled the
+// same thing first and may already have it mapped, so it's left alone
+static void Publish(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+    std::error_code error;
+    std::filesystem::create_hard_link(from, to, error);
+    std::filesystem::remove(from);
+    if(error && error != std::errc::file_exists)
+        throw std::system_error(error);
+}
+
+void gigagrad::codegen::AppendWords(std::vector<std::string> &argv, const std::string &words)
+{
+    std::istringstream stream(words);
+    for(std::string word; stream >> word;)
+        argv.push_back(word);
+}
+
+void gigagrad::codegen::RunCommand(const std::vector<std::string> &argv)
+{
+    std::vector<char *> c_argv;
+    for(const std::string &arg : argv)
+        c_argv.push_back(const_cast<char *>(arg.c_str()));
+    c_argv.push_back(nullptr);
+
+    std::string command;
+    for(const std::string &arg : argv)
+        command += (command.empty() ? "" : " ") + arg;
+    pid_t pid;
+    if(int error = posix_spawnp(&pid, c_argv[0], nullptr, nullptr, c_argv.data(), environ); error != 0)
+        throw std::system_error(error, std::generic_category(), "Failed to run " + command);
+    int status;
+    while(waitpid(pid, &status, 0) < 0)
+    {
+        if(errno != EINTR)
+            throw std::system_error(errno, std::generic_category(), "Failed to wait for " + command);
+    }
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error("Failed to run " + command);
+}
+
+// Kernels are cached by the hash of their source, the compile command and the compiler and
+// target it resolves to, so a process that lowers a program someone has compiled before
+// just dlopens the existing object. Everything is compiled under a name unique to the
+// process, thread and call and then linked into place, which is atomic and never replaces
+// an existing file, so concurrent compiles never see each other's partial files.
+static std::pair<GraphEvalFn, void *> CompileAndLoad(
+    const std::filesystem::path &cache_dir,
+    const char *prefix,
+    const std::string &source,
+    bool openmp)
+{
+    static std::atomic<uint64_t> num_compiles = 0;
+
+    std::string flags = std::string("-Ofast -fPIC -shared -lm -march=native -mtune=native") + (openmp ? " -fopenmp" : "");
+    char hash[17];
+    std::snprintf(hash, sizeof(hash), "%016" PRIx64, Hash(CompilerIdentity(), Hash(flags, Hash(source))));
+    std::string name = std::string(prefix) + "_" + hash;
+
+    std::filesystem::path obj_path = cache_dir / (name + ".so");
+    if(std::filesystem::exists(obj_path))
+        return Load(obj_path);
+
+    std::filesystem::create_directories(cache_dir);
+    std::string unique_suffix =
+        "." + std::to_string(getpid()) +
+        "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) +
+        "." + std::to_string(num_compiles++) + ".tmp";
+    std::filesystem::path source_path = cache_dir / (name + ".c");
+    std::filesystem::path tmp_source_path = cache_dir / (name + unique_suffix + ".c");
+    std::filesystem::path tmp_obj_path = cache_dir / (name + unique_suffix + ".so");
+    std::printf("FILE: %s\n", source_path.c_str());
+
+    FILE *file = std::fopen(tmp_source_path.c_str(), "w");
+    if(!file)
+        throw std::system_error(errno, std::generic_category());
+    size_t written = std::fwrite(source.data(), 1, source.size(), file);
+    if(std::fclose(file) != 0 || written != source.size())
+        throw std::runtime_error("Failed to write " + tmp_source_path.string());
+
+    std::vector<std::string> command = { "cc", tmp_source_path.string(), "-o", tmp_obj_path.string() };
+    AppendWords(command, flags);
+    RunCommand(command);
+
+    Publish(tmp_source_path, source_path);
+    Publish(tmp_obj_path, obj_path);
+    return Load(obj_path);
+}
+
+std::string gigagrad::codegen::GenerateSource(const Program &program, const SourceOptions &options)
 {
-    auto file_name = std::filesystem::temp_directory_path() / prefix;
-    file_name += ".c";
-    std::printf("FILE: %s\n", file_name.c_str());
-    FILE *file = std::fopen(file_name.c_str(), "w+");
+    char *source = nullptr;
+    size_t source_size = 0;
+    FILE *file = open_memstream(&source, &source_size);
     if(!file)
         throw std::system_error(errno, std::generic_category());
 
-    LowerCtx ctx = { prefix, file, 0 };
+    LowerCtx ctx = { options.prefix, file, 0, options.openmp, options.profile, options.standalone, &program, nullptr, {} };
 
     std::fprintf(file, "#define _GNU_SOURCE\n#include <fenv.h>\n");
-    std::fprintf(file, "#include <stdint.h>\n#include <math.h>\n\n");
+    std::fprintf(file, "#include <stdint.h>\n#include <stdlib.h>\n#include <math.h>\n");
+    if(options.profile)
+        std::fprintf(file, "#include <time.h>\n");
+    std::fprintf(file, "\n");
+
+    bool has_matmul = std::any_of(
+        program.functions.begin(),
+        program.functions.end(),
+        [](const FunctionBuilder &fn)
+        {
+            return std::any_of(
+                fn.insns.begin(),
+                fn.insns.end(),
+                [](const Instruction &insn) { return std::holds_alternative<MatmulInsn>(insn); });
+        });
+    if(has_matmul)
+        std::fputs(MatmulKernel, file);
+
+    bool has_conversions = std::any_of(
+        program.buffers.begin(),
+        program.buffers.end(),
+        [](const BufferDescriptor &desc) { return desc.dtype != DType::F32; });
+    if(has_conversions)
+    {
+        std::fprintf(file, "#include <string.h>\n");
+        std::fputs(DTypeConversions, file);
+    }
 
     for(size_t ifn = 0; ifn < program.functions.size(); ifn++)
         ::Lower_ScalarC(ctx, program.functions[ifn], ifn);
 
     GenerateMain(program, ctx);
     std::fclose(file);
-    return CompileAndLoad(file_name);
+    std::string source_str(source, source_size);
+    std::free(source);
+    return source_str;
 }
 
 BackendScalarC::~BackendScalarC()
 {
     dlclose(this->handle);
-    for(ssize_t ibuff = 0; ibuff < std::ssize(this->program.buffers); ibuff++)
-    {
-        auto &desc = this->program.buffers[ibuff];
-        if(!std::holds_alternative<GraphNodeHandle>(desc.id))
-        {
-            delete [] reinterpret_cast<float *>(this->buffers[ibuff]);
-        }
-    }
+    ::operator delete[](this->arena, std::align_val_t{BufferAlignment});
 }
 
 void BackendScalarC::LowerProgram(Program &&program)
 {
     this->program = std::move(program);
-    auto [eval_fn, handle] = Lower_ScalarC("gg_scalar", this->program);
+    std::filesystem::path cache_dir = this->cache_directory.empty()
+        ? DefaultKernelCacheDirectory()
+        : this->cache_directory;
+    SourceOptions source_options = { this->options.prefix, this->options.openmp, this->profile };
+    std::string source = GenerateSource(this->program, source_options);
+    auto [eval_fn, handle] = CompileAndLoad(cache_dir, this->options.prefix, source, this->options.openmp);
     this->eval_fn = eval_fn;
+    this->function_fn = reinterpret_cast<GraphFunctionFn>(LoadSymbol(handle, "gigagrad_fn"));
+    if(this->profile)
+        this->profile_counters.assign(2 * this->program.functions.size(), 0);
     this->handle = handle;
 }
 
 void *BackendScalarC::InitBuffers()
 {
+    ArenaPlan plan = PlanArena(this->program, BufferAlignment);
+    this->arena = new (std::align_val_t{BufferAlignment}) std::byte[plan.size_bytes];
     this->buffers.reserve(this->program.buffers.size());
     for(ssize_t ibuff = 0; ibuff < std::ssize(this->program.buffers); ibuff++)
     {
@@ -225,10 +808,10 @@ void *BackendScalarC::InitBuffers()
         }
         else
         {
-            float *intermediate_buf = new float[desc.size_elts];
-            this->buffers.push_back(reinterpret_cast<void *>(intermediate_buf));
+            this->buffers.push_back(reinterpret_cast<void *>(this->arena + plan.offsets[ibuff]));
         }
     }
+    this->task_graph = BuildTaskGraph(this->program, plan);
     return this->buffers[this->program.functions.back().output_buffer];
 }
 
@@ -237,16 +820,69 @@ void *BackendScalarC::GetBuffer(size_t idx)
     return this->buffers.at(idx);
 }
 
-void BackendScalarC::Execute()
+// Tensors may be pointed at different data between runs
+static void BindTensors(const Program &program, std::vector<void *> &buffers)
 {
-    for(ssize_t ibuff = 0; ibuff < std::ssize(this->program.buffers); ibuff++)
+    for(ssize_t ibuff = 0; ibuff < std::ssize(program.buffers); ibuff++)
     {
-        auto &desc = this->program.buffers[ibuff];
+        auto &desc = program.buffers[ibuff];
         if(std::holds_alternative<GraphNodeHandle>(desc.id))
         {
             GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
-            this->buffers[ibuff] = (reinterpret_cast<void *>(tensor.data()));
+            buffers[ibuff] = (reinterpret_cast<void *>(tensor.data()));
         }
     }
-    eval_fn(this->buffers.data());
+}
+
+void BackendScalarC::Execute()
+{
+    BindTensors(this->program, this->buffers);
+    int64_t batch = RunBatchSize(this->program, this->batch_size);
+    if(this->num_threads <= 1 || this->program.functions.size() <= 1)
+    {
+        this->eval_fn(this->buffers.data(), batch, this->profile_counters.data());
+        return;
+    }
+    if(!this->executor || this->executor->NumThreads() != this->num_threads)
+        this->executor = std::make_unique<Executor>(this->num_threads);
+    this->executor->Run(this->task_graph, [this, batch](size_t ifn)
+    {
+        this->function_fn(ifn, this->buffers.data(), batch, this->profile_counters.data());
+    });
+}
+
+bool BackendScalarC::ExecuteFunction(size_t ifn)
+{
+    BindTensors(this->program, this->buffers);
+    this->function_fn(ifn, this->buffers.data(), RunBatchSize(this->program, this->batch_size), this->profile_counters.data());
+    return true;
+}
+
+const Program *BackendScalarC::GetProgram() const
+{
+    return &this->program;
+}
+
+// The whole program runs in one call of gigagrad_main, whose functions parallelize
+// internally if they're OpenMP
+std::unique_ptr<ExecutionContext> BackendScalarC::CreateContext() const
+{
+    GraphEvalFn eval_fn = this->eval_fn;
+    uint64_t *profile_counters = this->profile_counters.data();
+    return std::make_unique<ExecutionContext>(
+        this->program,
+        BufferAlignment,
+        [eval_fn, profile_counters](void **buffers, int64_t batch_size) { eval_fn(buffers, batch_size, profile_counters); });
+}
+
+std::vector<FunctionProfile> BackendScalarC::GetProfile() const
+{
+    if(this->profile_counters.empty())
+        return {};
+    return BuildProfile(this->program, this->profile_counters.data());
+}
+
+void BackendScalarC::ResetProfile()
+{
+    std::fill(this->profile_counters.begin(), this->profile_counters.end(), 0);
 }
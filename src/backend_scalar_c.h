@@ -2,24 +2,89 @@
 #include "backend.h"
 #include "codegen.h"
 
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
 namespace gigagrad
 {
 namespace codegen
 {
 
+// Alignment (in bytes) of all intermediate buffers allocated by the backend
+constexpr size_t BufferAlignment = 64;
+
+// Where compiled kernels are cached: $GIGAGRAD_CACHE_DIR if set, otherwise
+// $XDG_CACHE_HOME/gigagrad or ~/.cache/gigagrad
+std::filesystem::path DefaultKernelCacheDirectory();
+
+// Splits `words` on whitespace onto the end of `argv`, without any of the shell's quoting
+void AppendWords(std::vector<std::string> &argv, const std::string &words);
+
+// Runs argv[0] (looked up in PATH) directly, so paths reach it as they are rather than
+// through the shell. Throws if it can't be run or exits with an error.
+void RunCommand(const std::vector<std::string> &argv);
+
+struct SourceOptions
+{
+    const char *prefix = "gg_scalar"; // Of the names of the generated functions
+    bool openmp = false;
+    bool profile = false;
+    bool standalone = false; // For embedding in other code, see below
+};
+
+// The C source that BackendScalarC compiles for `program`. It defines
+// gigagrad_main(void **buffers, int64_t batch_size, uint64_t *profile), which runs the whole
+// program given a pointer to every buffer, the number of rows of the batched inputs to run
+// (ignored if there are none) and the counters that profiling adds to (ignored if it's off,
+// see BuildProfile), and gigagrad_fn(ifn, buffers, batch_size, profile), which runs a single
+// function. Standalone source only has a static gigagrad_main(buffers, batch_size) that
+// doesn't touch the floating point environment.
+std::string GenerateSource(const Program &program, const SourceOptions &options);
+
 struct BackendScalarC : public Backend
 {
-    using GraphEvalFn = void (*)(void **);
+    using GraphEvalFn = void (*)(void **, int64_t, uint64_t *);
+    using GraphFunctionFn = void (*)(size_t, void **, int64_t, uint64_t *);
+    BackendScalarC() = default;
     virtual ~BackendScalarC();
     virtual void LowerProgram(Program &&program);
     virtual void *InitBuffers();
     virtual void *GetBuffer(size_t idx);
     virtual void Execute();
+    virtual bool ExecuteFunction(size_t ifn);
+    virtual const Program *GetProgram() const;
+    virtual std::unique_ptr<ExecutionContext> CreateContext() const;
+    virtual std::vector<FunctionProfile> GetProfile() const;
+    virtual void ResetProfile();
 
+    std::filesystem::path cache_directory; // Overrides DefaultKernelCacheDirectory() if set
     void *handle;
     Program program;
+    std::byte *arena = nullptr; // Backs all of the intermediate buffers, see PlanArena
     std::vector<void *> buffers;
     GraphEvalFn eval_fn;
+    GraphFunctionFn function_fn; // Runs a single function
+    mutable std::vector<uint64_t> profile_counters; // See BuildProfile
+
+    // Functions that don't depend on each other run in parallel on this many threads. Set it
+    // to std::thread::hardware_concurrency() to use every core.
+    size_t num_threads = 1;
+    TaskGraph task_graph;
+    std::unique_ptr<Executor> executor;
+
+protected:
+    struct LowerOptions
+    {
+        const char *prefix = "gg_scalar";
+        bool openmp = false;
+    };
+
+    explicit BackendScalarC(LowerOptions options) : options(options) {}
+
+    LowerOptions options;
 };
 
 }
@@ -4,6 +4,11 @@
 
 #include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <unordered_set>
+#include <utility>
 
 namespace gigagrad
 {
@@ -63,20 +68,32 @@ size_t CodegenNode(
     const Shape &broadcasted_shape = node.shape();
     const Shape &broadcasted_strides = node.strides();
 
+    // Shapes are aligned on the right. For every dimension the operand has, extract the
+    // coordinate along it from the broadcasted load index and scale it by the operand's
+    // own (contiguous) stride. Dimensions the operand is broadcasted along are skipped.
     auto generate_stride_adjustments =
         [&f, &broadcasted_shape, &broadcasted_strides, load_idx](const Shape &shape)
         {
-            auto load = load_idx;
-            for(ssize_t i = 0; i < std::ssize(shape); i++)
+            if(shape == broadcasted_shape)
+                return load_idx;
+
+            ssize_t rank_difference = std::ssize(broadcasted_shape) - std::ssize(shape);
+            auto load = f.IntImmediate(0);
+            dim_t stride = 1;
+            for(ssize_t i = std::ssize(shape) - 1; i >= 0; i--)
             {
-                if(broadcasted_shape[i] != 1 && shape[i] == 1)
+                ssize_t ibroadcast = i + rank_difference;
+                if(shape[i] == broadcasted_shape[ibroadcast])
                 {
-                    auto divisor = f.IntImmediate(broadcasted_strides[i] * broadcasted_shape[i]);
-                    auto modulus = f.IntImmediate(broadcasted_strides[i]);
-                    auto div = f.Arithmetic(load, IntArithmeticInsn::Op::DIV, divisor);
-                    auto mod = f.Arithmetic(load, IntArithmeticInsn::Op::MOD, modulus);
-                    load = f.Arithmetic(div, IntArithmeticInsn::Op::ADD, mod);
+                    auto broadcasted_stride = f.IntImmediate(broadcasted_strides[ibroadcast]);
+                    auto dim = f.IntImmediate(broadcasted_shape[ibroadcast]);
+                    auto operand_stride = f.IntImmediate(stride);
+                    auto div = f.Arithmetic(load_idx, IntArithmeticInsn::Op::DIV, broadcasted_stride);
+                    auto mod = f.Arithmetic(div, IntArithmeticInsn::Op::MOD, dim);
+                    auto mul = f.Arithmetic(mod, IntArithmeticInsn::Op::MUL, operand_stride);
+                    load = f.Arithmetic(load, IntArithmeticInsn::Op::ADD, mul);
                 }
+                stride *= shape[i];
             }
             return load;
         };
@@ -88,74 +105,852 @@ size_t CodegenNode(
     return f.Binary(b.type, x, y);
 }
 
-size_t CodegenNode(
-    Program &prog,
-    FunctionBuilder &old_f,
+static size_t NumElements(const Shape &shape)
+{
+    return std::accumulate(shape.begin(), shape.end(), dim_t{1}, std::multiplies{});
+}
+
+// Returns the node whose memory layout `node` is a reshape of
+static GraphNodeHandle StripReshapes(GraphNodeHandle node)
+{
+    while(node->Kind() == GraphNode::Kind::ViewOp)
+    {
+        const ViewOp &v = node->u.v.view_op;
+        bool is_reshape = v.offset == 0
+            && v.strides == node.strides()
+            && NumElements(v.shape) == NumElements(v.x.shape());
+        if(!is_reshape)
+            break;
+        node = v.x;
+    }
+    return node;
+}
+
+// Returns an F32 buffer containing `node` in contiguous layout, generating a function
+// for it if it isn't already backed by one. Tensors of other dtypes get converted.
+static size_t MaterializeContiguous(Program &prog, GraphNodeHandle node)
+{
+    node = StripReshapes(node);
+    if(node->Kind() == GraphNode::Kind::Tensor && node->u.t.tensor.dtype == DType::F32)
+        return prog.AddBuffer(node, NumElements(node.shape()));
+    if(!prog.node_function_cache.contains(node.node_idx))
+        CodegenNode(prog, node);
+    return prog.GetOutputBufferForNodeIdx(node.node_idx);
+}
+
+// Whether the leading dimension of `node` is the batch dimension of the batched inputs
+// (see Graph::AddBatchedInput), in which case only the rows up to the batch size given at
+// run time get computed. Rows must stay independent of each other for that, so anything
+// that mixes them throws.
+static bool IsBatched(Program &prog, GraphNodeHandle node)
+{
+    if(auto it = prog.batched_nodes.find(node.node_idx); it != prog.batched_nodes.end())
+        return it->second;
+
+    bool result = false;
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::Tensor:
+    {
+        result = node->u.t.tensor.is_batched;
+        if(result && prog.max_batch != 0 && prog.max_batch != node.shape()[0])
+            throw std::domain_error("Batched inputs have different batch dimensions");
+        if(result)
+            prog.max_batch = node.shape()[0];
+        break;
+    }
+    case GraphNode::Kind::UnaryOp:
+        result = IsBatched(prog, node->u.u.unary_op.x);
+        break;
+    case GraphNode::Kind::BinaryOp:
+    {
+        const BinaryOp &b = node->u.b.binary_op;
+        for(GraphNodeHandle x : { b.x, b.y })
+        {
+            if(!IsBatched(prog, x))
+                continue;
+            if(x.shape().size() != node.shape().size())
+                throw std::domain_error("Batched operand is broadcast along the batch dimension");
+            result = true;
+        }
+        break;
+    }
+    case GraphNode::Kind::ReduceOp:
+    {
+        const ReduceOp &r = node->u.r.reduce_op;
+        result = IsBatched(prog, r.x);
+        if(result && !r.dims.empty() && r.dims.front() == 0)
+            throw std::domain_error("Cannot reduce along the batch dimension");
+        break;
+    }
+    case GraphNode::Kind::ViewOp:
+    {
+        const ViewOp &v = node->u.v.view_op;
+        result = IsBatched(prog, v.x);
+        if(!result)
+            break;
+        // Every row of the view must lie within the same row of the input
+        dim_t row = v.x.strides()[0];
+        dim_t extent = v.offset;
+        for(size_t i = 1; i < v.shape.size(); i++)
+            extent += (v.shape[i] - 1) * std::abs(v.strides[i]);
+        bool keeps_rows = !v.shape.empty()
+            && v.shape[0] == v.x.shape()[0]
+            && v.strides[0] == row
+            && v.offset >= 0
+            && extent < row;
+        if(!keeps_rows)
+            throw std::domain_error("View moves the batch dimension");
+        break;
+    }
+    default:
+        break;
+    }
+    prog.batched_nodes[node.node_idx] = result;
+    return result;
+}
+
+size_t RunBatchSize(const Program &prog, size_t batch_size)
+{
+    if(batch_size == 0)
+        return prog.max_batch;
+    if(prog.max_batch == 0)
+        throw std::domain_error("Program has no batched inputs");
+    if(batch_size > static_cast<size_t>(prog.max_batch))
+        throw std::domain_error("Batch size exceeds the batched inputs' batch dimension");
+    return batch_size;
+}
+
+struct MatmulOperands
+{
+    GraphNodeHandle x;
+    GraphNodeHandle y;
+    MatmulInsn insn;
+};
+
+// GraphNodeHandle::matmul emits sum(reshape(X, (..., M, K, 1)) * reshape(Y, (..., 1, K, N)), -2).
+// Recognize that pattern so that we can emit a proper matmul kernel instead of reducing
+// over the broadcasted cube.
+static std::optional<MatmulOperands> MatchMatmul(const ReduceOp &r)
+{
+    const Shape &shape = r.x.shape();
+    const dim_t rank = std::ssize(shape);
+    if(r.type != ReduceOpType::SUM || r.keepdim || rank < 3 || r.dims != Dims{ rank - 2 })
+        return std::nullopt;
+
+    GraphNodeHandle mul = r.x;
+    if(mul->Kind() != GraphNode::Kind::BinaryOp || mul->u.b.binary_op.type != BinaryOpType::MUL)
+        return std::nullopt;
+
+    auto pad_shape = [rank](const Shape &s)
+    {
+        Shape result(rank - std::ssize(s), 1);
+        result.insert(result.end(), s.begin(), s.end());
+        return result;
+    };
+
+    const BinaryOp &b = mul->u.b.binary_op;
+    for(auto [x, y] : { std::pair{ b.x, b.y }, std::pair{ b.y, b.x } })
+    {
+        Shape xshape = pad_shape(x.shape());
+        Shape yshape = pad_shape(y.shape());
+        if(xshape[rank - 1] != 1 || yshape[rank - 3] != 1 || xshape[rank - 2] != yshape[rank - 2])
+            continue;
+
+        MatmulInsn insn = {};
+        insn.M = xshape[rank - 3];
+        insn.K = xshape[rank - 2];
+        insn.N = yshape[rank - 1];
+        dim_t x_stride = insn.M * insn.K;
+        dim_t y_stride = insn.K * insn.N;
+        insn.batch_shape.resize(rank - 3);
+        insn.x_batch_strides.resize(rank - 3);
+        insn.y_batch_strides.resize(rank - 3);
+        for(dim_t i = rank - 4; i >= 0; i--)
+        {
+            insn.batch_shape[i] = shape[i];
+            insn.x_batch_strides[i] = xshape[i] == 1 ? 0 : x_stride;
+            insn.y_batch_strides[i] = yshape[i] == 1 ? 0 : y_stride;
+            x_stride *= xshape[i];
+            y_stride *= yshape[i];
+        }
+        return MatmulOperands{ x, y, std::move(insn) };
+    }
+    return std::nullopt;
+}
+
+// Reductions that are computed inline in a loop nest over `shape`, instead of getting
+// their own function. The nest is laid out as the loops over the dimensions that aren't
+// in `dims`, and inside of those first the reduction loops of each fused reduction
+// followed by the loops over `dims` that compute the actual output. A reduction can thus
+// be fused if it is a keepdim reduction over `dims` of a tensor of shape `shape`, and we
+// reach it purely through elementwise ops, which (modulo broadcasting) preserve the
+// indices along the outer loops. Softmax fuses into a single nest this way, and so does
+// batchnorm.
+struct FusionPlan
+{
+    Shape shape;
+    std::optional<Dims> dims; // Taken from the first fusable reduction if not given
+    size_t output; // Node that the nest computes
+    std::vector<GraphNodeHandle> reductions; // Dependencies come first
+    std::unordered_set<size_t> visited;
+};
+
+static void PlanFusion(const Program &prog, FusionPlan &plan, GraphNodeHandle node)
+{
+    // Materialized nodes get their own nest, except for the one we're planning
+    bool is_materialized = prog.materialized_nodes.contains(node.node_idx) && node.node_idx != plan.output;
+    if(prog.node_function_cache.contains(node.node_idx) || is_materialized || !plan.visited.insert(node.node_idx).second)
+        return;
+
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::UnaryOp:
+        PlanFusion(prog, plan, node->u.u.unary_op.x);
+        break;
+    case GraphNode::Kind::BinaryOp:
+        PlanFusion(prog, plan, node->u.b.binary_op.x);
+        PlanFusion(prog, plan, node->u.b.binary_op.y);
+        break;
+    case GraphNode::Kind::ReduceOp:
+    {
+        const ReduceOp &r = node->u.r.reduce_op;
+        if(!r.keepdim || r.x.shape() != plan.shape || (plan.dims && r.dims != *plan.dims))
+            break;
+        plan.dims = r.dims;
+        PlanFusion(prog, plan, r.x);
+        plan.reductions.push_back(node);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Costs of computing an element of a node inline, relative to a cheap arithmetic op
+constexpr double TranscendentalCost = 16.0;
+constexpr double SqrtCost = 8.0;
+constexpr double DivCost = 4.0;
+// Cost of storing or loading an element of a materialized node
+constexpr double MemoryCost = 2.0;
+
+static double OpCost(GraphNodeHandle node)
+{
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::UnaryOp:
+        switch(node->u.u.unary_op.type)
+        {
+        case UnaryOpType::NOP:
+            return 0.0;
+        case UnaryOpType::CAST:
+            return 1.0;
+        case UnaryOpType::SQRT:
+            return SqrtCost;
+        default:
+            return TranscendentalCost;
+        }
+    case GraphNode::Kind::BinaryOp:
+        switch(node->u.b.binary_op.type)
+        {
+        case BinaryOpType::DIV:
+            return DivCost;
+        case BinaryOpType::POW:
+            return TranscendentalCost;
+        default:
+            return 1.0;
+        }
+    case GraphNode::Kind::Tensor:
+        return 1.0; // The load
+    default:
+        return 0.0;
+    }
+}
+
+static std::vector<GraphNodeHandle> Operands(GraphNodeHandle node)
+{
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::UnaryOp:
+        return { node->u.u.unary_op.x };
+    case GraphNode::Kind::BinaryOp:
+        if(node->u.b.binary_op.x.node_idx == node->u.b.binary_op.y.node_idx)
+            return { node->u.b.binary_op.x };
+        return { node->u.b.binary_op.x, node->u.b.binary_op.y };
+    case GraphNode::Kind::ReduceOp:
+        return { node->u.r.reduce_op.x };
+    case GraphNode::Kind::ViewOp:
+        return { node->u.v.view_op.x };
+    default:
+        return {};
+    }
+}
+
+static void CollectConsumers(
+    const Program &prog,
     GraphNodeHandle node,
-    const ReduceOp &r,
-    size_t output_load_idx,
-    size_t max_seen_size_elts)
+    std::unordered_set<size_t> &visited,
+    std::vector<GraphNodeHandle> &post_order,
+    std::unordered_map<size_t, std::vector<GraphNodeHandle>> &consumers)
 {
-    FunctionBuilder f(node, max_seen_size_elts);
+    if(prog.node_function_cache.contains(node.node_idx) || !visited.insert(node.node_idx).second)
+        return;
+    for(GraphNodeHandle x : Operands(node))
+    {
+        consumers[x.node_idx].push_back(node);
+        CollectConsumers(prog, x, visited, post_order, consumers);
+    }
+    post_order.push_back(node);
+}
 
-    std::vector<size_t> accumulators;
-    auto reduce_dim = r.dims.begin(); // dims is sorted
-    auto ioutput_strides = node.strides().begin();
+// Every node is evaluated once per element by each function it's inlined into, so what
+// matters is how many functions end up computing it: the functions of the nodes that get
+// their own (roots, reductions that don't fuse into a consumer and matmul operands) whose
+// elementwise subgraphs reach it. Materializing a node costs a store and a load per such
+// function, and saves computing it inline in all but one of them.
+void PlanMaterialization(Program &prog, const std::vector<GraphNodeHandle> &roots)
+{
+    std::vector<GraphNodeHandle> post_order;
+    std::unordered_map<size_t, std::vector<GraphNodeHandle>> consumers;
+    std::unordered_set<size_t> visited;
+    std::unordered_set<size_t> own_function;
+    for(GraphNodeHandle root : roots)
+    {
+        own_function.insert(root.node_idx);
+        CollectConsumers(prog, root, visited, post_order, consumers);
+    }
 
-    auto store_idx = f.IntImmediate(0);
-    auto load_idx = store_idx;
+    // Fused reductions are computed by their consumer's function
+    for(GraphNodeHandle node : post_order)
+    {
+        if(node->Kind() != GraphNode::Kind::ReduceOp)
+            continue;
+        const ReduceOp &r = node->u.r.reduce_op;
+        if(auto matmul = MatchMatmul(r))
+        {
+            own_function.insert(node.node_idx);
+            own_function.insert(r.x.node_idx);
+            own_function.insert(StripReshapes(matmul->x).node_idx);
+            own_function.insert(StripReshapes(matmul->y).node_idx);
+            continue;
+        }
+        bool is_fused = r.keepdim && std::any_of(
+            consumers[node.node_idx].begin(),
+            consumers[node.node_idx].end(),
+            [&](GraphNodeHandle c)
+            {
+                bool is_elementwise = c->Kind() == GraphNode::Kind::UnaryOp || c->Kind() == GraphNode::Kind::BinaryOp;
+                return is_elementwise && c.shape() == r.x.shape();
+            });
+        if(!is_fused)
+            own_function.insert(node.node_idx);
+    }
 
-    const Shape &input_shape = r.x.shape();
-    const Shape &input_strides = r.x.strides();
+    // Cost of an element of each node if everything below it is computed inline
+    std::unordered_map<size_t, double> inline_cost;
+    for(GraphNodeHandle node : post_order)
+    {
+        double cost = OpCost(node);
+        for(GraphNodeHandle x : Operands(node))
+        {
+            bool is_load = prog.node_function_cache.contains(x.node_idx)
+                || own_function.contains(x.node_idx)
+                || x->Kind() == GraphNode::Kind::ReduceOp;
+            cost += is_load ? 1.0 : inline_cost[x.node_idx];
+        }
+        inline_cost[node.node_idx] = cost;
+    }
 
-    // Generate loops for all of the non-reducing dimensions
-    for(ssize_t i = 0; i < std::ssize(input_shape); i++)
+    // Consumers come before their operands in reverse post order
+    std::unordered_map<size_t, std::vector<size_t>> functions; // Functions computing each node
+    for(auto node = post_order.rbegin(); node != post_order.rend(); node++)
     {
-        if(reduce_dim == r.dims.end() || i != *reduce_dim)
+        std::vector<size_t> &computed_by = functions[node->node_idx];
+        for(GraphNodeHandle c : consumers[node->node_idx])
         {
-            auto loop = f.Loop(input_shape[i], input_strides[i]);
-            auto input_stride = f.IntImmediate(input_strides[i]);
-            auto output_stride = f.IntImmediate(*ioutput_strides);
-            auto mul_input_stride = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, input_stride);
-            auto mul_output_stride = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, output_stride);
-            load_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul_input_stride);
-            store_idx = f.Arithmetic(store_idx, IntArithmeticInsn::Op::ADD, mul_output_stride);
-
-            if(!r.keepdim)
-                ioutput_strides++;
+            if(own_function.contains(c.node_idx))
+                computed_by.push_back(c.node_idx);
+            else
+                computed_by.insert(computed_by.end(), functions[c.node_idx].begin(), functions[c.node_idx].end());
         }
-        else if(i == *reduce_dim)
+        std::sort(computed_by.begin(), computed_by.end());
+        computed_by.erase(std::unique(computed_by.begin(), computed_by.end()), computed_by.end());
+
+        bool is_elementwise = (*node)->Kind() == GraphNode::Kind::UnaryOp || (*node)->Kind() == GraphNode::Kind::BinaryOp;
+        if(!is_elementwise || own_function.contains(node->node_idx))
+            continue;
+        double num_functions = static_cast<double>(computed_by.size());
+        double recompute = (num_functions - 1.0) * inline_cost[node->node_idx];
+        double materialize = MemoryCost * (num_functions + 1.0);
+        if(recompute > materialize)
         {
-            reduce_dim++;
+            prog.materialized_nodes.insert(node->node_idx);
+            own_function.insert(node->node_idx);
         }
+    }
+}
+
+struct OuterLoops
+{
+    size_t load_idx; // Index into `shape` with all of the other dimensions at 0
+    size_t store_idx; // Index into the output with `output_strides`
+};
+
+// Generates loops over the dimensions in `loops`, outermost first. The innermost one is
+// tiled `tile` times, i.e. covers `tile` consecutive elements per iteration. If
+// `is_batched`, the loop over dimension 0 runs for the batch size.
+static OuterLoops EmitOuterLoops(
+    FunctionBuilder &f,
+    const Shape &shape,
+    const Shape &strides,
+    const Dims &loops,
+    const Shape &output_strides,
+    dim_t tile = 1,
+    bool is_batched = false)
+{
+    auto store_idx = f.IntImmediate(0);
+    auto load_idx = store_idx;
+    for(size_t i = 0; i < loops.size(); i++)
+    {
+        dim_t dim = loops[i];
+        dim_t step = i + 1 == loops.size() ? tile : 1;
+        auto loop = f.Loop(shape[dim] / step, strides[dim] * step, is_batched && dim == 0);
+        auto input_stride = f.IntImmediate(strides[dim] * step);
+        auto output_stride = f.IntImmediate(output_strides[dim] * step);
+        auto mul_input_stride = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, input_stride);
+        auto mul_output_stride = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, output_stride);
+        load_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul_input_stride);
+        store_idx = f.Arithmetic(store_idx, IntArithmeticInsn::Op::ADD, mul_output_stride);
+    }
+    return { load_idx, store_idx };
+}
+
+// Output strides of a reduction, indexed by the dimensions of its input. Reduced
+// dimensions get 0.
+static Shape ReducedOutputStrides(const ReduceOp &r, const Shape &output_strides)
+{
+    Shape result(r.x.shape().size(), 0);
+    auto reduce_dim = r.dims.begin(); // dims is sorted
+    auto ioutput_strides = output_strides.begin();
+    for(ssize_t i = 0; i < std::ssize(result); i++)
+    {
+        bool is_reduced = reduce_dim != r.dims.end() && i == *reduce_dim;
+        if(is_reduced)
+            reduce_dim++;
+        else
+            result[i] = *ioutput_strides;
 
         // If keepdim, always advance output_strides because number of input/output
         // dimensions matches
-        if(r.keepdim)
+        if(r.keepdim || !is_reduced)
             ioutput_strides++;
     }
-    // Generate loops along reduction dimension
-    for(auto dim : r.dims)
+    return result;
+}
+
+// Dimensions of `rank` that aren't in `dims` (which is sorted)
+static Dims OtherDims(size_t rank, const Dims &dims)
+{
+    Dims result;
+    for(dim_t i = 0; i < static_cast<dim_t>(rank); i++)
+        if(!std::binary_search(dims.begin(), dims.end(), i))
+            result.push_back(i);
+    return result;
+}
+
+// Loop orders are picked by the memory the loops walk. Moving one step along each loop of
+// a nest moves the contiguous index into some node by `loop_strides`; every buffer the node
+// reads then moves by some other amount per loop. An access that moves less than a cache
+// line per iteration costs what it moves, others cost a whole line, so the loop with the
+// lowest total cost goes innermost.
+constexpr dim_t CacheLineElements = 16;
+
+// Translates steps through the contiguous index of `node` into steps along its dimensions,
+// which move the index into one of its inputs by `dim_strides`. A step that doesn't line
+// up with a single dimension is kept as is, as a contiguous walk would see it.
+static Shape MapLoopStrides(GraphNodeHandle node, const Shape &loop_strides, const Shape &dim_strides)
+{
+    const Shape &shape = node.shape();
+    const Shape &strides = node.strides();
+    Shape result;
+    for(dim_t step : loop_strides)
+    {
+        dim_t mapped = step;
+        for(size_t i = 0; i < shape.size(); i++)
+            if(shape[i] > 1 && strides[i] == step)
+                mapped = dim_strides[i];
+        result.push_back(mapped);
+    }
+    return result;
+}
+
+// Collects the strides at which `node` reads each of the buffers underneath it, following
+// broadcasts and views down to tensors and generated functions
+static void CollectReadStrides(
+    const Program &prog,
+    GraphNodeHandle node,
+    const Shape &loop_strides,
+    std::vector<Shape> &reads)
+{
+    if(prog.node_function_cache.contains(node.node_idx))
+    {
+        reads.push_back(loop_strides);
+        return;
+    }
+
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::Tensor:
+        reads.push_back(loop_strides);
+        break;
+    case GraphNode::Kind::UnaryOp:
+        CollectReadStrides(prog, node->u.u.unary_op.x, loop_strides, reads);
+        break;
+    case GraphNode::Kind::BinaryOp:
+    {
+        const Shape &shape = node.shape();
+        for(GraphNodeHandle operand : { node->u.b.binary_op.x, node->u.b.binary_op.y })
+        {
+            // Shapes are aligned on the right, broadcasted dimensions don't move the operand
+            const Shape &operand_shape = operand.shape();
+            const Shape &operand_strides = operand.strides();
+            ssize_t rank_difference = std::ssize(shape) - std::ssize(operand_shape);
+            Shape dim_strides(shape.size(), 0);
+            for(ssize_t i = std::max<ssize_t>(rank_difference, 0); i < std::ssize(shape); i++)
+                if(operand_shape[i - rank_difference] == shape[i])
+                    dim_strides[i] = operand_strides[i - rank_difference];
+            CollectReadStrides(prog, operand, MapLoopStrides(node, loop_strides, dim_strides), reads);
+        }
+        break;
+    }
+    case GraphNode::Kind::ViewOp:
+    {
+        const ViewOp &v = node->u.v.view_op;
+        CollectReadStrides(prog, v.x, MapLoopStrides(node, loop_strides, v.strides), reads);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Cost of every loop of a nest as the innermost one, given the strides of each access
+static std::vector<dim_t> LoopCosts(size_t num_loops, const std::vector<Shape> &accesses)
+{
+    std::vector<dim_t> costs(num_loops, 0);
+    for(const Shape &access : accesses)
+        for(size_t i = 0; i < num_loops; i++)
+            costs[i] += std::min(std::abs(access[i]), CacheLineElements);
+    return costs;
+}
+
+// Orders `loops` from the most expensive to the cheapest, keeping ties in their order
+static Dims OrderLoops(Dims loops, const std::vector<dim_t> &costs)
+{
+    std::stable_sort(
+        loops.begin(),
+        loops.end(),
+        [&](dim_t a, dim_t b) { return costs[a] > costs[b]; });
+    return loops;
+}
+
+// Loop order of the nest computing `node` elementwise, i.e. storing contiguously and
+// looping over all of its dimensions
+static Dims ElementwiseLoopOrder(const Program &prog, GraphNodeHandle node, const Dims &loops)
+{
+    std::vector<Shape> accesses = { node.strides() };
+    CollectReadStrides(prog, node, node.strides(), accesses);
+    return OrderLoops(loops, LoopCosts(node.shape().size(), accesses));
+}
+
+static std::vector<dim_t> ReductionCosts(const Program &prog, const ReduceOp &r)
+{
+    std::vector<Shape> reads;
+    CollectReadStrides(prog, r.x, r.x.strides(), reads);
+    return LoopCosts(r.x.shape().size(), reads);
+}
+
+// Whether `node` expands to at most `budget` elementwise nodes, not counting anything that
+// already has its own function
+static bool IsSmallExpression(const Program &prog, GraphNodeHandle node, size_t &budget)
+{
+    if(prog.node_function_cache.contains(node.node_idx))
+        return true;
+    if(budget == 0)
+        return false;
+    budget--;
+    switch(node->Kind())
     {
-        accumulators.push_back(f.Immediate(0.0f));
-        auto loop = f.Loop(input_shape[dim], input_strides[dim]);
-        auto stride = f.IntImmediate(input_strides[dim]);
+    case GraphNode::Kind::UnaryOp:
+        return IsSmallExpression(prog, node->u.u.unary_op.x, budget);
+    case GraphNode::Kind::BinaryOp:
+        return IsSmallExpression(prog, node->u.b.binary_op.x, budget)
+            && IsSmallExpression(prog, node->u.b.binary_op.y, budget);
+    case GraphNode::Kind::ViewOp:
+        return IsSmallExpression(prog, node->u.v.view_op.x, budget);
+    default:
+        return true;
+    }
+}
+
+// The innermost reduction loop is split into this many contiguous blocks, reduced side by
+// side into independent accumulators, so that its iterations don't all wait on one chain
+// of adds. Each block is still walked contiguously, so vectorizing the loop keeps a vector
+// of partial results per accumulator. They're combined pairwise after the loop.
+constexpr dim_t ReductionLanes = 8;
+constexpr dim_t MinLaneRange = 8 * ReductionLanes;
+constexpr size_t MaxLaneNodes = 16; // Larger bodies aren't worth unrolling
+
+// Generates loops along the reduction dimensions, in the given order, and returns the
+// reduced value of each of `columns` consecutive outputs, whose inputs are `column_stride`
+// apart. The first loop only runs for `first_range` iterations, for split reductions.
+static std::vector<size_t> EmitReduction(
+    Program &prog,
+    FunctionBuilder &f,
+    const ReduceOp &r,
+    size_t load_idx,
+    const Dims &order,
+    dim_t first_range,
+    dim_t columns,
+    dim_t column_stride)
+{
+    const Shape &input_shape = r.x.shape();
+    const Shape &input_strides = r.x.strides();
+    auto range_of = [&](size_t i) { return i == 0 ? first_range : input_shape[order[i]]; };
+
+    std::vector<std::vector<size_t>> accumulators; // Per outer loop, per column
+    for(size_t i = 0; i + 1 < order.size(); i++)
+    {
+        accumulators.emplace_back();
+        for(dim_t column = 0; column < columns; column++)
+            accumulators.back().push_back(f.Immediate(0.0f));
+        auto loop = f.Loop(range_of(i), input_strides[order[i]]);
+        auto stride = f.IntImmediate(input_strides[order[i]]);
         auto mul = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, stride);
         load_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul);
     }
 
-    auto to_accumulate = CodegenNode(prog, f, r.x, load_idx, 0);
+    dim_t range = range_of(order.size() - 1);
+    dim_t stride = input_strides[order.back()];
+    size_t budget = MaxLaneNodes;
+    bool use_lanes = columns == 1
+        && range >= MinLaneRange
+        && range % ReductionLanes == 0
+        && IsSmallExpression(prog, r.x, budget);
+    dim_t lanes = use_lanes ? ReductionLanes : 1;
 
-    ssize_t iaccum = std::ssize(r.dims) - 1;
-    do
+    std::vector<std::vector<size_t>> lane_accumulators(columns);
+    for(auto &column : lane_accumulators)
+        for(dim_t lane = 0; lane < lanes; lane++)
+            column.push_back(f.Immediate(0.0f));
+    dim_t lane_range = range / lanes;
+    auto loop = f.Loop(lane_range, stride);
+    auto loop_stride = f.IntImmediate(stride);
+    auto mul = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, loop_stride);
+    auto base_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul);
+    for(dim_t column = 0; column < columns; column++)
     {
-        f.Accumulate(r.type, accumulators[iaccum], to_accumulate);
-        to_accumulate = accumulators[iaccum];
+        for(dim_t lane = 0; lane < lanes; lane++)
+        {
+            auto offset = f.IntImmediate(column * column_stride + lane * lane_range * stride);
+            auto idx = f.Arithmetic(base_idx, IntArithmeticInsn::Op::ADD, offset);
+            auto x = CodegenNode(prog, f, r.x, idx, 0);
+            f.Accumulate(r.type, lane_accumulators[column][lane], x);
+        }
+    }
+    f.EndLoop();
+
+    auto combine = r.type == ReduceOpType::SUM ? BinaryOpType::ADD : BinaryOpType::MAX;
+    std::vector<size_t> result;
+    for(std::vector<size_t> &column : lane_accumulators)
+    {
+        while(column.size() > 1)
+        {
+            std::vector<size_t> combined;
+            for(size_t i = 0; i < column.size(); i += 2)
+                combined.push_back(f.Binary(combine, column[i], column[i + 1]));
+            column = std::move(combined);
+        }
+        result.push_back(column[0]);
+    }
+
+    for(ssize_t iaccum = std::ssize(accumulators) - 1; iaccum >= 0; iaccum--)
+    {
+        for(dim_t column = 0; column < columns; column++)
+        {
+            f.Accumulate(r.type, accumulators[iaccum][column], result[column]);
+            result[column] = accumulators[iaccum][column];
+        }
         f.EndLoop();
-        iaccum--;
-    } while(iaccum >= 0);
-    f.Store(store_idx, accumulators[0]);
-    for(ssize_t i = 0; i < std::ssize(input_shape) - std::ssize(r.dims); i++)
+    }
+    return result;
+}
+
+static size_t EmitReduction(Program &prog, FunctionBuilder &f, const ReduceOp &r, size_t load_idx)
+{
+    Dims order = OrderLoops(r.dims, ReductionCosts(prog, r));
+    return EmitReduction(prog, f, r, load_idx, order, r.x.shape()[order[0]], 1, 0)[0];
+}
+
+// A reduction whose innermost loop walks memory further apart than the innermost output
+// loop does is tiled along the latter instead: every iteration of the reduction then reads
+// a contiguous block, reduced into this many independent columns of outputs
+constexpr dim_t TileColumns = 16;
+
+static dim_t PickColumns(
+    const Program &prog,
+    const ReduceOp &r,
+    const Dims &loops,
+    const Dims &order,
+    const std::vector<dim_t> &costs)
+{
+    if(loops.empty())
+        return 1;
+    dim_t inner = loops.back();
+    size_t budget = MaxLaneNodes;
+    bool is_worth_tiling = costs[inner] < costs[order.back()]
+        && r.x.shape()[inner] % TileColumns == 0
+        && IsSmallExpression(prog, r.x, budget);
+    return is_worth_tiling ? TileColumns : 1;
+}
+
+// A reduction with few outputs over many elements leaves all but a few threads idle, so
+// it's split into chunks along its outermost reduction loop: one function reduces every
+// chunk, in parallel, into [chunks, outputs] partial results, and a second one combines
+// them. Returns the number of chunks, which must divide the loop's range, or 1.
+constexpr size_t MinSplitElements = size_t{1} << 16;
+constexpr size_t MaxSplitOutputs = 64;
+constexpr size_t MinChunkElements = size_t{1} << 13;
+constexpr dim_t MaxChunks = 64;
+
+static dim_t SplitChunks(const ReduceOp &r, GraphNodeHandle node, const Dims &order)
+{
+    size_t num_reduced = 1;
+    for(auto dim : r.dims)
+        num_reduced *= r.x.shape()[dim];
+    if(num_reduced < MinSplitElements || NumElements(node.shape()) > MaxSplitOutputs)
+        return 1;
+
+    dim_t outer_range = r.x.shape()[order[0]];
+    dim_t max_chunks = std::min<dim_t>(MaxChunks, num_reduced / MinChunkElements);
+    for(dim_t chunks = max_chunks; chunks > 1; chunks--)
+        if(outer_range % chunks == 0)
+            return chunks;
+    return 1;
+}
+
+static void EmitSplitReduction(
+    Program &prog,
+    GraphNodeHandle node,
+    const ReduceOp &r,
+    const Dims &loops,
+    const Dims &order,
+    dim_t chunks,
+    size_t max_seen_size_elts)
+{
+    size_t num_outputs = NumElements(node.shape());
+    dim_t chunk_range = r.x.shape()[order[0]] / chunks;
+    {
+        FunctionBuilder partials(node, num_outputs * chunks);
+        auto chunk = partials.Loop(chunks, 1);
+        Shape output_strides = ReducedOutputStrides(r, node.strides());
+        auto [load_idx, store_idx] = EmitOuterLoops(partials, r.x.shape(), r.x.strides(), loops, output_strides);
+        auto chunk_stride = partials.IntImmediate(chunk_range * r.x.strides()[order[0]]);
+        auto chunk_offset = partials.Arithmetic(chunk, IntArithmeticInsn::Op::MUL, chunk_stride);
+        load_idx = partials.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, chunk_offset);
+        auto outputs = partials.IntImmediate(num_outputs);
+        auto chunk_base = partials.Arithmetic(chunk, IntArithmeticInsn::Op::MUL, outputs);
+        store_idx = partials.Arithmetic(store_idx, IntArithmeticInsn::Op::ADD, chunk_base);
+        auto partial = EmitReduction(prog, partials, r, load_idx, order, chunk_range, 1, 0)[0];
+        partials.Store(store_idx, partial);
+        for(size_t i = 0; i < loops.size(); i++)
+            partials.EndLoop();
+        partials.EndLoop();
+        prog.PushFunction(std::move(partials));
+    }
+
+    FunctionBuilder combine(node, max_seen_size_elts);
+    auto input = combine.Input(prog.functions.back().output_buffer);
+    auto output = combine.Loop(num_outputs, 1);
+    auto accumulator = combine.Immediate(0.0f);
+    auto chunk = combine.Loop(chunks, num_outputs);
+    auto outputs = combine.IntImmediate(num_outputs);
+    auto chunk_base = combine.Arithmetic(chunk, IntArithmeticInsn::Op::MUL, outputs);
+    auto load_idx = combine.Arithmetic(chunk_base, IntArithmeticInsn::Op::ADD, output);
+    auto partial = combine.Load(input, load_idx);
+    combine.Accumulate(r.type, accumulator, partial);
+    combine.EndLoop();
+    combine.Store(output, accumulator);
+    combine.EndLoop();
+    prog.PushFunction(std::move(combine));
+}
+
+static void EmitFusedReductions(Program &prog, FunctionBuilder &f, const FusionPlan &plan, size_t load_idx)
+{
+    for(GraphNodeHandle reduction : plan.reductions)
+    {
+        auto accumulator = EmitReduction(prog, f, reduction->u.r.reduce_op, load_idx);
+        f.fused_reductions[reduction.node_idx] = accumulator;
+    }
+}
+
+size_t CodegenNode(
+    Program &prog,
+    FunctionBuilder &old_f,
+    GraphNodeHandle node,
+    const ReduceOp &r,
+    size_t output_load_idx,
+    size_t max_seen_size_elts)
+{
+    if(auto matmul = MatchMatmul(r))
+    {
+        size_t x_buffer = MaterializeContiguous(prog, matmul->x);
+        size_t y_buffer = MaterializeContiguous(prog, matmul->y);
+        FunctionBuilder f(node, max_seen_size_elts);
+        matmul->insn.x = f.Input(x_buffer);
+        matmul->insn.y = f.Input(y_buffer);
+        matmul->insn.is_batched = IsBatched(prog, node);
+        f.Matmul(std::move(matmul->insn));
+        prog.PushFunction(std::move(f));
+        auto input = old_f.Input(prog.functions.back().output_buffer);
+        return old_f.Load(input, output_load_idx);
+    }
+
+    FusionPlan plan = { r.x.shape(), r.dims, node.node_idx };
+    PlanFusion(prog, plan, r.x);
+    Shape output_strides = ReducedOutputStrides(r, node.strides());
+    std::vector<Shape> accesses = { output_strides };
+    CollectReadStrides(prog, r.x, r.x.strides(), accesses);
+    std::vector<dim_t> costs = LoopCosts(r.x.shape().size(), accesses);
+    Dims loops = OrderLoops(OtherDims(r.x.shape().size(), r.dims), costs);
+    Dims order = OrderLoops(r.dims, costs);
+    bool is_batched = IsBatched(prog, node);
+    bool can_split = plan.reductions.empty() && !is_batched;
+    if(dim_t chunks = can_split ? SplitChunks(r, node, order) : 1; chunks > 1)
+    {
+        EmitSplitReduction(prog, node, r, loops, order, chunks, max_seen_size_elts);
+        auto input = old_f.Input(prog.functions.back().output_buffer);
+        return old_f.Load(input, output_load_idx);
+    }
+
+    // Fused reductions are computed for the first column only, and the batch loop can't
+    // be tiled because the batch size needn't be a multiple of the tile
+    bool can_tile = plan.reductions.empty() && !(is_batched && !loops.empty() && loops.back() == 0);
+    dim_t columns = can_tile ? PickColumns(prog, r, loops, order, costs) : 1;
+    dim_t column_stride = columns > 1 ? r.x.strides()[loops.back()] : 0;
+    dim_t output_column_stride = columns > 1 ? output_strides[loops.back()] : 0;
+
+    FunctionBuilder f(node, max_seen_size_elts);
+    auto [load_idx, store_idx] = EmitOuterLoops(
+        f, r.x.shape(), r.x.strides(), loops, output_strides, columns, is_batched);
+    EmitFusedReductions(prog, f, plan, load_idx);
+    auto accumulators = EmitReduction(prog, f, r, load_idx, order, r.x.shape()[order[0]], columns, column_stride);
+    for(dim_t column = 0; column < columns; column++)
+    {
+        auto offset = f.IntImmediate(column * output_column_stride);
+        f.Store(f.Arithmetic(store_idx, IntArithmeticInsn::Op::ADD, offset), accumulators[column]);
+    }
+    for(size_t i = 0; i < loops.size(); i++)
         f.EndLoop();
 
     prog.PushFunction(std::move(f));
@@ -171,14 +966,16 @@ size_t CodegenNode(
     size_t load_idx,
     size_t max_seen_size)
 {
-    // TODO: This generates a lot of unnecessary crap right now, ideally this arithmetic
-    //       expression would get accumulated and simplified before being emitted.
+    // This emits a div/mod per dimension. SimplifyIndexArithmetic folds it back into
+    // an affine expression of the loop variables wherever the strides line up. A reshape
+    // reads its input at the same index though.
     const Shape &shape = v.shape;
     const Shape &strides = v.strides;
     const Shape &output_strides = node.strides();
+    bool is_reshape = v.offset == 0 && strides == output_strides;
 
-    auto new_load_idx = f.IntImmediate(0);
-    for(ssize_t i = std::ssize(shape) - 1; i >= 0; i--)
+    auto new_load_idx = is_reshape ? load_idx : f.IntImmediate(0);
+    for(ssize_t i = std::ssize(shape) - 1; i >= 0 && !is_reshape; i--)
     {
         auto output_stride = f.IntImmediate(output_strides[i]);
         auto output_shape = f.IntImmediate(shape[i]);
@@ -188,8 +985,11 @@ size_t CodegenNode(
         auto mul = f.Arithmetic(mod, IntArithmeticInsn::Op::MUL, input_stride);
         new_load_idx = f.Arithmetic(new_load_idx, IntArithmeticInsn::Op::ADD, mul);
     }
-    auto offset = f.IntImmediate(v.offset);
-    new_load_idx = f.Arithmetic(new_load_idx, IntArithmeticInsn::Op::ADD, offset);
+    if(!is_reshape)
+    {
+        auto offset = f.IntImmediate(v.offset);
+        new_load_idx = f.Arithmetic(new_load_idx, IntArithmeticInsn::Op::ADD, offset);
+    }
     size_t view_size = std::accumulate(
         v.shape.begin(),
         v.shape.end(),
@@ -198,12 +998,24 @@ size_t CodegenNode(
     view_size -= v.offset;
 
     max_seen_size = std::max(max_seen_size, view_size);
+
+    // The view reorders the indices, so values computed for the current outer loop
+    // iteration of a fusion nest don't apply underneath it.
+    auto fused_reductions = std::exchange(f.fused_reductions, {});
     auto x = CodegenNode(prog, f, v.x, new_load_idx, max_seen_size);
+    f.fused_reductions = std::move(fused_reductions);
     return x;
 }
 
 size_t CodegenNode(Program &prog, FunctionBuilder &f, GraphNodeHandle node, size_t load_idx, size_t max_seen_size_elts)
 {
+    if(auto fused = f.fused_reductions.find(node.node_idx); fused != f.fused_reductions.end())
+        return fused->second;
+    if(prog.materialized_nodes.contains(node.node_idx) && node.node_idx != f.node.node_idx)
+    {
+        if(!prog.node_function_cache.contains(node.node_idx))
+            CodegenNode(prog, node);
+    }
     if(prog.node_function_cache.contains(node.node_idx))
     {
         size_t function_id = prog.node_function_cache[node.node_idx];
@@ -218,6 +1030,43 @@ size_t CodegenNode(Program &prog, FunctionBuilder &f, GraphNodeHandle node, size
     });
 }
 
+// Emits the loop nest that computes `nodes` (of the same shape) and stores the i-th of them
+// to output i of `f`
+static void EmitElementwiseNest(Program &prog, FunctionBuilder &f, const std::vector<GraphNodeHandle> &nodes)
+{
+    GraphNodeHandle node = nodes[0];
+    FusionPlan plan = { node.shape(), std::nullopt, node.node_idx };
+    for(GraphNodeHandle n : nodes)
+    {
+        plan.output = n.node_idx;
+        PlanFusion(prog, plan, n);
+    }
+    Dims dims = plan.dims.value_or(Dims{});
+
+    // Outer loops are the dimensions not reduced by any fused reduction. Without
+    // fusion this covers all of the dimensions.
+    const Shape &shape = node.shape();
+    const Shape &strides = node.strides();
+    Dims loops = ElementwiseLoopOrder(prog, node, OtherDims(shape.size(), dims));
+    bool is_batched = IsBatched(prog, node);
+    auto [load_idx, _] = EmitOuterLoops(f, shape, strides, loops, strides, 1, is_batched);
+    EmitFusedReductions(prog, f, plan, load_idx);
+    for(auto dim : dims)
+    {
+        auto loop = f.Loop(shape[dim], strides[dim], is_batched && dim == 0);
+        auto stride = f.IntImmediate(strides[dim]);
+        auto mul = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, stride);
+        load_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul);
+    }
+    std::vector<size_t> to_store;
+    for(GraphNodeHandle n : nodes)
+        to_store.push_back(CodegenNode(prog, f, n, load_idx, 0));
+    for(size_t i = 0; i < to_store.size(); i++)
+        f.Store(load_idx, to_store[i], i);
+    for(ssize_t i = 0; i < std::ssize(shape); i++)
+        f.EndLoop();
+}
+
 void CodegenNode(Program &prog, GraphNodeHandle node, std::optional<size_t> output_buffer)
 {
     // ReduceOp generates its own loops
@@ -229,21 +1078,7 @@ void CodegenNode(Program &prog, GraphNodeHandle node, std::optional<size_t> outp
     else
     {
         FunctionBuilder f(node);
-        const Shape &shape = node.shape();
-        const Shape &strides = node.strides();
-        auto load_idx = f.IntImmediate(0);
-        for(ssize_t i = 0; i < std::ssize(shape); i++)
-        {
-            auto loop = f.Loop(shape[i], strides[i]);
-            auto stride = f.IntImmediate(strides[i]);
-            auto mul = f.Arithmetic(loop, IntArithmeticInsn::Op::MUL, stride);
-            load_idx = f.Arithmetic(load_idx, IntArithmeticInsn::Op::ADD, mul);
-        }
-        auto to_store = CodegenNode(prog, f, node, load_idx, 0);
-        f.Store(load_idx, to_store);
-        for(ssize_t i = 0; i < std::ssize(shape); i++)
-            f.EndLoop();
-
+        EmitElementwiseNest(prog, f, { node });
         prog.PushFunction(std::move(f));
     }
     if(output_buffer)
@@ -256,13 +1091,222 @@ void CodegenNode(Program &prog, GraphNodeHandle node, std::optional<size_t> outp
     }
 }
 
+void CodegenNodes(Program &prog, const std::vector<GraphNodeHandle> &nodes, const std::vector<size_t> &output_buffers)
+{
+    if(nodes.empty() || nodes.size() != output_buffers.size())
+        throw std::domain_error("CodegenNodes needs one output buffer per node");
+    for(GraphNodeHandle node : nodes)
+    {
+        if(node->Kind() == GraphNode::Kind::ReduceOp)
+            throw std::domain_error("CodegenNodes only computes elementwise nodes");
+        if(node.shape() != nodes[0].shape())
+            throw std::domain_error("CodegenNodes needs nodes of the same shape");
+    }
+    for(size_t buffer : output_buffers)
+        if(buffer >= prog.buffers.size())
+            throw std::domain_error("Invalid output buffer");
+
+    FunctionBuilder f(nodes[0]);
+    EmitElementwiseNest(prog, f, nodes);
+    f.extra_outputs.assign(output_buffers.begin() + 1, output_buffers.end());
+    prog.PushFunction(std::move(f));
+    prog.buffers.pop_back();
+    prog.ChangeOutputBuffer(prog.functions.size() - 1, output_buffers[0]);
+}
+
 codegen::Program CodegenNode(GraphNodeHandle node)
 {
     codegen::Program result;
+    node = SimplifyGraph({ node })[0];
+    PlanMaterialization(result, { node });
     codegen::CodegenNode(result, node);
     return result;
 }
 
+ArenaPlan PlanArena(const Program &prog, size_t alignment)
+{
+    struct Lifetime
+    {
+        size_t ibuff;
+        size_t size_bytes;
+        size_t first; // Function that writes the buffer
+        size_t last; // Last function that reads it
+        bool is_read;
+    };
+
+    const size_t num_functions = prog.functions.size();
+    std::vector<std::optional<Lifetime>> lifetimes(prog.buffers.size());
+    for(size_t ifn = 0; ifn < num_functions; ifn++)
+    {
+        const FunctionBuilder &fn = prog.functions[ifn];
+        for(size_t ioutput = 0; ioutput < fn.NumOutputs(); ioutput++)
+        {
+            size_t buffer = fn.OutputBuffer(ioutput);
+            auto &output = lifetimes[buffer];
+            if(!output)
+                output = Lifetime{ buffer, 0, ifn, ifn, false };
+        }
+        for(size_t input : fn.inputs)
+        {
+            if(auto &lifetime = lifetimes[input])
+            {
+                lifetime->last = ifn;
+                lifetime->is_read = true;
+            }
+        }
+    }
+
+    std::vector<Lifetime> to_place;
+    for(size_t ibuff = 0; ibuff < prog.buffers.size(); ibuff++)
+    {
+        const BufferDescriptor &desc = prog.buffers[ibuff];
+        if(std::holds_alternative<GraphNodeHandle>(desc.id) || !lifetimes[ibuff])
+            continue;
+        Lifetime lifetime = *lifetimes[ibuff];
+        if(!lifetime.is_read)
+            lifetime.last = num_functions;
+        size_t size_bytes = desc.size_elts * sizeof(float);
+        lifetime.size_bytes = (size_bytes + alignment - 1) / alignment * alignment;
+        to_place.push_back(lifetime);
+    }
+
+    // Greedy by size: place the largest buffers first, each at the lowest offset that
+    // doesn't collide with an already placed buffer whose lifetime overlaps.
+    std::stable_sort(to_place.begin(), to_place.end(), [](const Lifetime &x, const Lifetime &y)
+    {
+        return x.size_bytes > y.size_bytes;
+    });
+
+    ArenaPlan result = { 0, std::vector<size_t>(prog.buffers.size(), 0) };
+    std::vector<Lifetime> placed;
+    for(const Lifetime &buffer : to_place)
+    {
+        std::vector<std::pair<size_t, size_t>> taken; // [begin, end) byte ranges
+        for(const Lifetime &other : placed)
+        {
+            if(other.first <= buffer.last && buffer.first <= other.last)
+                taken.push_back({ result.offsets[other.ibuff], result.offsets[other.ibuff] + other.size_bytes });
+        }
+        std::sort(taken.begin(), taken.end());
+
+        size_t offset = 0;
+        for(auto [begin, end] : taken)
+        {
+            if(offset + buffer.size_bytes <= begin)
+                break;
+            offset = std::max(offset, end);
+        }
+        result.offsets[buffer.ibuff] = offset;
+        result.size_bytes = std::max(result.size_bytes, offset + buffer.size_bytes);
+        placed.push_back(buffer);
+    }
+    return result;
+}
+
+ExecutionContext::ExecutionContext(const Program &program, size_t alignment, RunFn run)
+    : program(program), run(std::move(run)), alignment(alignment)
+{
+    ArenaPlan plan = PlanArena(program, alignment);
+    this->arena = new (std::align_val_t{alignment}) std::byte[plan.size_bytes];
+    this->buffers.reserve(program.buffers.size());
+    for(size_t ibuff = 0; ibuff < program.buffers.size(); ibuff++)
+    {
+        const BufferDescriptor &desc = program.buffers[ibuff];
+        if(std::holds_alternative<GraphNodeHandle>(desc.id))
+        {
+            GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+            this->buffers.push_back(tensor.data());
+        }
+        else
+            this->buffers.push_back(this->arena + plan.offsets[ibuff]);
+    }
+}
+
+ExecutionContext::~ExecutionContext()
+{
+    ::operator delete[](this->arena, std::align_val_t{this->alignment});
+}
+
+void ExecutionContext::Bind(GraphNodeHandle tensor, void *data)
+{
+    for(size_t ibuff = 0; ibuff < this->program.buffers.size(); ibuff++)
+    {
+        const auto &id = this->program.buffers[ibuff].id;
+        if(std::holds_alternative<GraphNodeHandle>(id) && std::get<GraphNodeHandle>(id).node_idx == tensor.node_idx)
+        {
+            this->buffers[ibuff] = data;
+            return;
+        }
+    }
+    throw std::domain_error("Program doesn't read the tensor being bound");
+}
+
+void *ExecutionContext::Output() const
+{
+    return this->buffers[this->program.functions.back().output_buffer];
+}
+
+void ExecutionContext::Execute(size_t batch_size)
+{
+    this->run(this->buffers.data(), RunBatchSize(this->program, batch_size));
+}
+
+TaskGraph BuildTaskGraph(const Program &prog, const ArenaPlan &plan)
+{
+    auto overlaps = [&](size_t x, size_t y)
+    {
+        if(x == y)
+            return true;
+        const BufferDescriptor &xdesc = prog.buffers[x];
+        const BufferDescriptor &ydesc = prog.buffers[y];
+        if(std::holds_alternative<GraphNodeHandle>(xdesc.id) || std::holds_alternative<GraphNodeHandle>(ydesc.id))
+            return false;
+        size_t xbegin = plan.offsets[x];
+        size_t ybegin = plan.offsets[y];
+        return xbegin < ybegin + ydesc.size_elts * sizeof(float) && ybegin < xbegin + xdesc.size_elts * sizeof(float);
+    };
+
+    const size_t num_functions = prog.functions.size();
+    TaskGraph graph = { std::vector<std::vector<size_t>>(num_functions), std::vector<size_t>(num_functions, 0) };
+    for(size_t j = 0; j < num_functions; j++)
+    {
+        const FunctionBuilder &later = prog.functions[j];
+        for(size_t i = 0; i < j; i++)
+        {
+            const FunctionBuilder &earlier = prog.functions[i];
+            bool depends = false;
+            for(size_t iearlier = 0; iearlier < earlier.NumOutputs(); iearlier++)
+            {
+                size_t written = earlier.OutputBuffer(iearlier);
+                for(size_t ilater = 0; ilater < later.NumOutputs(); ilater++)
+                    depends = depends || overlaps(written, later.OutputBuffer(ilater));
+                for(size_t input : later.inputs)
+                    depends = depends || overlaps(written, input);
+            }
+            for(size_t ilater = 0; ilater < later.NumOutputs(); ilater++)
+                for(size_t input : earlier.inputs)
+                    depends = depends || overlaps(input, later.OutputBuffer(ilater));
+            if(depends)
+                graph.AddEdge(i, j);
+        }
+    }
+    return graph;
+}
+
+std::vector<FunctionProfile> BuildProfile(const Program &prog, const uint64_t *counters)
+{
+    std::vector<FunctionProfile> result;
+    for(size_t ifn = 0; ifn < prog.functions.size(); ifn++)
+    {
+        const FunctionBuilder &f = prog.functions[ifn];
+        GraphNodeHandle node = f.node;
+        uint64_t calls = counters[2 * ifn];
+        uint64_t bytes_per_call = static_cast<uint64_t>(EstimateCost(prog, f).bytes);
+        result.push_back({ calls, counters[2 * ifn + 1], calls * bytes_per_call, KindName(node->Kind()) });
+    }
+    return result;
+}
+
 }
 
 CompiledTensor GraphNodeHandle::Compile(std::unique_ptr<codegen::Backend> backend) const
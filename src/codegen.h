@@ -4,8 +4,10 @@
 #include <cstdio>
 #include <numeric>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "graph.h"
+#include "executor.h"
 
 namespace gigagrad
 {
@@ -46,11 +48,12 @@ struct IntArithmeticInsn
 struct BeginLoopInsn
 {
     dim_t range;
-    dim_t stride;
+    dim_t stride; // Elements per iteration in the node the loop computes or reduces
+    bool is_batch = false; // Runs for the batch size given at run time, at most `range`
 
     void Print(size_t iinsn)
     {
-        std::printf("v%zu = LOOP [0..%zd, %zd]\n", iinsn, range, stride);
+        std::printf("v%zu = LOOP [0..%s%zd, %zd]\n", iinsn, is_batch ? "batch <= " : "", range, stride);
     }
 };
 
@@ -77,10 +80,14 @@ struct StoreInsn
 {
     size_t offset;
     size_t value;
+    size_t output = 0; // See FunctionBuilder::OutputBuffer
 
     void Print(size_t iinsn)
     {
-        std::printf("Output[v%zu] = v%zu\n", offset, value);
+        if(output == 0)
+            std::printf("Output[v%zu] = v%zu\n", offset, value);
+        else
+            std::printf("Output%zu[v%zu] = v%zu\n", output, offset, value);
     }
 };
 
@@ -146,6 +153,29 @@ struct AccumulateInsn
     }
 };
 
+// Computes output[b, m, n] = sum_k x[b, m, k] * y[b, k, n] for contiguous inputs x of shape
+// (batch..., M, K) and y of shape (batch..., K, N). Backends lower it to a tiled kernel.
+struct MatmulInsn
+{
+    size_t x;
+    size_t y;
+    dim_t M;
+    dim_t K;
+    dim_t N;
+    Shape batch_shape;
+    Shape x_batch_strides; // Zero along dims that x is broadcasted in
+    Shape y_batch_strides;
+    // The output's leading dimension, i.e. the first batch dim or M if there are none,
+    // runs for the batch size given at run time
+    bool is_batched = false;
+
+    void Print(size_t iinsn)
+    {
+        std::printf("Output = MATMUL(I%zu[%zd x %zd], I%zu[%zd x %zd]) x %zu batch dims%s\n",
+                    x, M, K, y, K, N, batch_shape.size(), is_batched ? " (batched)" : "");
+    }
+};
+
 using Instruction = std::variant<
     LoadIntImmediateInsn,
     IntArithmeticInsn,
@@ -156,7 +186,8 @@ using Instruction = std::variant<
     LoadImmediateInsn,
     UnaryInsn,
     BinaryInsn,
-    AccumulateInsn>;
+    AccumulateInsn,
+    MatmulInsn>;
 
 struct FunctionBuilder
 {
@@ -175,9 +206,9 @@ struct FunctionBuilder
             output_size);
     }
 
-    size_t Loop(dim_t range, dim_t stride)
+    size_t Loop(dim_t range, dim_t stride, bool is_batch = false)
     {
-        insns.emplace_back(BeginLoopInsn{range, stride});
+        insns.emplace_back(BeginLoopInsn{range, stride, is_batch});
         return insns.size() - 1;
     }
 
@@ -206,9 +237,9 @@ struct FunctionBuilder
         return insns.size() - 1;
     }
 
-    size_t Store(size_t offset, size_t value)
+    size_t Store(size_t offset, size_t value, size_t output = 0)
     {
-        insns.emplace_back(StoreInsn{offset, value});
+        insns.emplace_back(StoreInsn{offset, value, output});
         return insns.size() - 1;
     }
 
@@ -248,6 +279,12 @@ struct FunctionBuilder
         return insns.size() - 1;
     }
 
+    size_t Matmul(MatmulInsn matmul)
+    {
+        insns.emplace_back(std::move(matmul));
+        return insns.size() - 1;
+    }
+
     void Print()
     {
         for(ssize_t i = 0; i < std::ssize(insns); i++)
@@ -262,18 +299,38 @@ struct FunctionBuilder
     std::vector<Instruction> insns;
     std::vector<size_t> inputs; // Indices into the program inputs
     size_t output_buffer;
+    std::vector<size_t> extra_outputs; // Further buffers stored to, see CodegenNodes
+
+    // Output 0 is output_buffer, the others are the extra outputs
+    size_t OutputBuffer(size_t output) const
+    {
+        return output == 0 ? output_buffer : extra_outputs[output - 1];
+    }
+
+    size_t NumOutputs() const { return 1 + extra_outputs.size(); }
+
+    // Node index -> accumulator of the reductions computed inline by this function
+    std::unordered_map<size_t, size_t> fused_reductions;
 };
 
+// Passes over FunctionBuilder::insns, implemented in passes.cpp
+void SimplifyIndexArithmetic(FunctionBuilder &f);
+void EliminateCommonSubexpressions(FunctionBuilder &f);
+
 struct BufferDescriptor
 {
     std::variant<GraphNodeHandle, size_t> id; // Either a tensor or a function index
     size_t size_elts;
+    DType dtype = DType::F32; // Function outputs are always F32
+    float scale = 1.0f; // See Tensor::scale
 };
 
 struct Program
 {
     void PushFunction(FunctionBuilder function)
     {
+        SimplifyIndexArithmetic(function);
+        EliminateCommonSubexpressions(function);
         functions.emplace_back(std::move(function));
         functions.back().output_buffer = AddBuffer(functions.size() - 1);
         node_function_cache[functions.back().node.node_idx] = functions.size() - 1;
@@ -296,7 +353,8 @@ struct Program
                 if(std::get<GraphNodeHandle>(buff_id).node_idx == t.node_idx)
                     return iinput;
         }
-        buffers.push_back({ t, size_elts });
+        const Tensor &tensor = t->u.t.tensor;
+        buffers.push_back({ t, size_elts, tensor.dtype, tensor.scale });
         return buffers.size() - 1;
     }
 
@@ -339,10 +397,100 @@ struct Program
     std::unordered_map<size_t, size_t> node_function_cache;
     std::vector<FunctionBuilder> functions;
     std::vector<BufferDescriptor> buffers;
+
+    dim_t max_batch = 0; // Leading dimension of the batched inputs, 0 if there are none
+    std::unordered_map<size_t, bool> batched_nodes; // Whether a node's leading dim is the batch
+    std::unordered_set<size_t> materialized_nodes; // See PlanMaterialization
+};
+
+// Number of rows that a backend asked to run `batch_size` rows (see Backend::batch_size)
+// runs. Throws if that's more than the program has.
+size_t RunBatchSize(const Program &prog, size_t batch_size);
+
+// Placement of the intermediate (non-tensor) buffers of a Program in one arena. A buffer
+// is live from the function that writes it until the last function that reads it, and
+// buffers with disjoint lifetimes share memory. Buffers that no function reads, such as
+// the program's output or the loss of a training graph, stay live until the end.
+struct ArenaPlan
+{
+    size_t size_bytes;
+    std::vector<size_t> offsets; // Byte offset of every buffer, unused for tensors
+};
+
+ArenaPlan PlanArena(const Program &prog, size_t alignment);
+
+// One task per function. A function depends on an earlier one if it reads memory the
+// earlier one writes, writes memory it reads, or if both write the same memory, where
+// buffers that share memory in `plan` count as the same memory.
+TaskGraph BuildTaskGraph(const Program &prog, const ArenaPlan &plan);
+
+// Floating point operations a function performs, and the bytes of its inputs and output,
+// i.e. the memory traffic it needs at the least. Implemented in passes.cpp.
+struct FunctionCost
+{
+    double flops;
+    double bytes;
 };
 
+FunctionCost EstimateCost(const Program &prog, const FunctionBuilder &f);
+
+// How the GPU backends map a function onto a grid of thread groups. If the function's only
+// top-level loop has no reductions and nothing follows it, the grid iterates that loop:
+// one group per iteration if a loop inside of it runs for at least MinGroupWork iterations
+// (Group), one thread per iteration otherwise (Flat). Other functions run as a single group
+// (Single). In a group, the loops directly inside the grid loop (or at the top level, for
+// Single) are distributed across the group's threads, which combine their partial
+// reductions after the loop ends. Functions with a matmul get a kernel of their own
+// (Matmul). Implemented in passes.cpp.
+struct GridPlan
+{
+    enum class Mode
+    {
+        Flat,
+        Group,
+        Single,
+        Matmul,
+    };
+    static constexpr dim_t MinGroupWork = 32;
+
+    Mode mode;
+    size_t grid_loop; // BeginLoopInsn iterated by the grid, insns.size() if there is none
+    dim_t grid; // Iterations of the grid loop, 1 if there is none
+    std::vector<bool> is_distributed; // Indexed by insn, set on distributed loops' begin and end
+    // Indexed by insn: at every distributed EndLoopInsn, the accumulators to combine
+    std::vector<std::vector<std::pair<size_t, ReduceOpType>>> reductions;
+};
+
+GridPlan PlanGrid(const FunctionBuilder &f);
+
+// Backends that profile keep two counters per function: the number of calls and the
+// nanoseconds spent in them. This fills in the rest of the profile from the program.
+std::vector<FunctionProfile> BuildProfile(const Program &prog, const uint64_t *counters);
+
+// Elementwise nodes are normally recomputed inline by every function that reads them. This
+// picks the ones among those reachable from `roots` that are expensive enough, and read by
+// enough different functions, that computing them once into a buffer of their own and
+// loading that is cheaper. CodegenNode then gives those a function of their own.
+void PlanMaterialization(Program &prog, const std::vector<GraphNodeHandle> &roots);
+
+// Rewrites the graphs below `roots` into equivalent ones, in the same Graph, that are cheaper
+// to generate code for: ops on immediates are folded, views of views are composed into one
+// where the result is still a strided view, views and ops that change nothing are dropped
+// (x + 0, x - 0, x * 1, x / 1, x ^ 1, max(x, x), 0 - (0 - x)), and exp(log(x)) and
+// log(exp(x)) become x, assuming x is in the domain of log. Returns the rewritten roots,
+// which have the same shapes. Implemented in passes.cpp.
+std::vector<GraphNodeHandle> SimplifyGraph(const std::vector<GraphNodeHandle> &roots);
+
 void CodegenNode(codegen::Program &prog, GraphNodeHandle node, std::optional<size_t> output_buffer = std::nullopt);
-codegen::Program CodegenNode(GraphNodeHandle node);
+codegen::Program CodegenNode(GraphNodeHandle node); // Also runs SimplifyGraph and PlanMaterialization
+
+// Generates a single function that computes every one of `nodes` in one loop nest, and
+// stores each to the matching buffer of `output_buffers`. Subexpressions the nodes share
+// are computed once, and every node is computed before any is stored, so a node may be
+// stored in place of a tensor that the nodes read elementwise. The nodes must be
+// elementwise (not reductions) and have the same shape. The function is cached as the
+// one computing nodes[0].
+void CodegenNodes(codegen::Program &prog, const std::vector<GraphNodeHandle> &nodes, const std::vector<size_t> &output_buffers);
 
 }
 }
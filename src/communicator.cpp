@@ -0,0 +1,172 @@
+#include "communicator.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+
+using namespace gigagrad;
+
+namespace
+{
+
+// What the ranks of MakeLocalCommunicators share. The last rank to arrive at an all-reduce
+// sums everyone's data and writes it back while the others wait for the next generation.
+struct LocalGroup
+{
+    explicit LocalGroup(size_t num_ranks) : contributions(num_ranks) {}
+
+    void AllReduceSum(size_t rank, float *data, size_t size_elts)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->contributions[rank] = { data, size_elts };
+        size_t generation = this->generation;
+        if(++this->arrived < this->contributions.size())
+        {
+            this->done.wait(lock, [&]() { return this->generation != generation; });
+            if(this->error)
+                throw std::domain_error("Ranks all-reduced buffers of different sizes");
+            return;
+        }
+
+        this->error = std::any_of(
+            this->contributions.begin(),
+            this->contributions.end(),
+            [&](const Contribution &c) { return c.size_elts != size_elts; });
+        if(!this->error)
+        {
+            this->sum.assign(size_elts, 0.0f);
+            for(const Contribution &c : this->contributions)
+                for(size_t i = 0; i < size_elts; i++)
+                    this->sum[i] += c.data[i];
+            for(const Contribution &c : this->contributions)
+                std::memcpy(c.data, this->sum.data(), size_elts * sizeof(float));
+        }
+        this->arrived = 0;
+        this->generation++;
+        this->done.notify_all();
+        if(this->error)
+            throw std::domain_error("Ranks all-reduced buffers of different sizes");
+    }
+
+    struct Contribution
+    {
+        float *data;
+        size_t size_elts;
+    };
+
+    std::mutex mutex;
+    std::condition_variable done;
+    std::vector<Contribution> contributions;
+    std::vector<float> sum;
+    size_t arrived = 0;
+    size_t generation = 0;
+    bool error = false;
+};
+
+struct LocalCommunicator : Communicator
+{
+    LocalCommunicator(std::shared_ptr<LocalGroup> group, size_t rank) : group(std::move(group)), rank(rank) {}
+
+    size_t Rank() const override { return this->rank; }
+    size_t NumRanks() const override { return this->group->contributions.size(); }
+
+    void AllReduceSum(float *data, size_t size_elts) override
+    {
+        this->group->AllReduceSum(this->rank, data, size_elts);
+    }
+
+    std::shared_ptr<LocalGroup> group;
+    size_t rank;
+};
+
+}
+
+namespace gigagrad
+{
+
+std::vector<std::shared_ptr<Communicator>> MakeLocalCommunicators(size_t num_ranks)
+{
+    if(num_ranks == 0)
+        throw std::domain_error("A group needs at least one rank");
+    auto group = std::make_shared<LocalGroup>(num_ranks);
+    std::vector<std::shared_ptr<Communicator>> result;
+    for(size_t rank = 0; rank < num_ranks; rank++)
+        result.push_back(std::make_shared<LocalCommunicator>(group, rank));
+    return result;
+}
+
+}
+
+AllReduceQueue::AllReduceQueue(std::shared_ptr<Communicator> communicator)
+    : communicator(std::move(communicator))
+{
+    this->worker = std::thread([this]() { this->WorkerLoop(); });
+}
+
+AllReduceQueue::~AllReduceQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->started.notify_all();
+    this->worker.join();
+}
+
+std::future<void> AllReduceQueue::Start(std::vector<Buffer> buffers)
+{
+    Request request = { std::move(buffers), {} };
+    auto result = request.done.get_future();
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->requests.push_back(std::move(request));
+    }
+    this->started.notify_one();
+    return result;
+}
+
+void AllReduceQueue::WorkerLoop()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for(;;)
+    {
+        this->started.wait(lock, [this]() { return this->stopping || !this->requests.empty(); });
+        if(this->requests.empty())
+            return;
+        Request request = std::move(this->requests.front());
+        this->requests.pop_front();
+
+        lock.unlock();
+        try
+        {
+            this->Reduce(request.buffers);
+            request.done.set_value();
+        }
+        catch(...)
+        {
+            request.done.set_exception(std::current_exception());
+        }
+        lock.lock();
+    }
+}
+
+void AllReduceQueue::Reduce(std::vector<Buffer> &buffers)
+{
+    if(buffers.size() == 1)
+    {
+        this->communicator->AllReduceSum(buffers[0].data, buffers[0].size_elts);
+        return;
+    }
+
+    this->staging.clear();
+    for(const Buffer &buffer : buffers)
+        this->staging.insert(this->staging.end(), buffer.data, buffer.data + buffer.size_elts);
+    this->communicator->AllReduceSum(this->staging.data(), this->staging.size());
+    const float *sum = this->staging.data();
+    for(const Buffer &buffer : buffers)
+    {
+        std::memcpy(buffer.data, sum, buffer.size_elts * sizeof(float));
+        sum += buffer.size_elts;
+    }
+}
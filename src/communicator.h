@@ -0,0 +1,70 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gigagrad
+{
+
+// The transport of data-parallel training. Every rank of a group makes the same calls in
+// the same order, which is how the ranks match up their messages.
+struct Communicator
+{
+    virtual ~Communicator() = default;
+    virtual size_t Rank() const = 0;
+    virtual size_t NumRanks() const = 0;
+
+    // Replaces `data` on every rank with its sum over all of the ranks. Blocks until done.
+    virtual void AllReduceSum(float *data, size_t size_elts) = 0;
+};
+
+// Communicators for `num_ranks` ranks that are threads of this process, e.g. one per
+// device in a single box, or for testing
+std::vector<std::shared_ptr<Communicator>> MakeLocalCommunicators(size_t num_ranks);
+
+// Runs all-reduces on a background thread, in the order they were started, so that they
+// overlap with whatever the calling thread does next
+struct AllReduceQueue
+{
+    struct Buffer
+    {
+        float *data;
+        size_t size_elts;
+    };
+
+    explicit AllReduceQueue(std::shared_ptr<Communicator> communicator);
+    ~AllReduceQueue(); // Finishes the all-reduces that were already started
+
+    // Sums `buffers` across ranks as a single message. The future is ready once they hold
+    // the sums, and rethrows what the communicator threw.
+    std::future<void> Start(std::vector<Buffer> buffers);
+
+    Communicator &GetCommunicator() const { return *communicator; }
+
+private:
+    struct Request
+    {
+        std::vector<Buffer> buffers;
+        std::promise<void> done;
+    };
+
+    void WorkerLoop();
+    void Reduce(std::vector<Buffer> &buffers);
+
+    std::shared_ptr<Communicator> communicator;
+    std::vector<float> staging; // Packs buffers that are reduced together
+
+    std::mutex mutex;
+    std::condition_variable started;
+    std::deque<Request> requests;
+    bool stopping = false;
+
+    std::thread worker;
+};
+
+}
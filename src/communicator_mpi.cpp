@@ -0,0 +1,46 @@
+#include "communicator_mpi.h"
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <string>
+
+using namespace gigagrad;
+
+static void Check(int error)
+{
+    if(error == MPI_SUCCESS)
+        return;
+    char message[MPI_MAX_ERROR_STRING];
+    int length = 0;
+    MPI_Error_string(error, message, &length);
+    throw std::runtime_error("MPI error: " + std::string(message, length));
+}
+
+MpiCommunicator::MpiCommunicator(MPI_Comm comm)
+    : comm(comm)
+{
+    int thread_level;
+    Check(MPI_Query_thread(&thread_level));
+    if(thread_level < MPI_THREAD_SERIALIZED)
+        throw std::runtime_error("MpiCommunicator needs MPI initialized with at least MPI_THREAD_SERIALIZED");
+
+    int rank;
+    int num_ranks;
+    Check(MPI_Comm_rank(comm, &rank));
+    Check(MPI_Comm_size(comm, &num_ranks));
+    this->rank = static_cast<size_t>(rank);
+    this->num_ranks = static_cast<size_t>(num_ranks);
+}
+
+void MpiCommunicator::AllReduceSum(float *data, size_t size_elts)
+{
+    // MPI counts are ints
+    while(size_elts > 0)
+    {
+        int count = static_cast<int>(std::min<size_t>(size_elts, INT_MAX));
+        Check(MPI_Allreduce(MPI_IN_PLACE, data, count, MPI_FLOAT, MPI_SUM, this->comm));
+        data += count;
+        size_elts -= count;
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "communicator.h"
+
+#include <mpi.h>
+
+namespace gigagrad
+{
+
+// Communicates over MPI (only built if meson finds it). The caller initializes and
+// finalizes MPI, and the ranks are those of `comm`. All-reduces run on the AllReduceQueue's
+// worker thread, so MPI must be initialized with MPI_Init_thread and at least
+// MPI_THREAD_SERIALIZED; the constructor throws otherwise.
+struct MpiCommunicator : Communicator
+{
+    explicit MpiCommunicator(MPI_Comm comm = MPI_COMM_WORLD);
+
+    size_t Rank() const override { return rank; }
+    size_t NumRanks() const override { return num_ranks; }
+    void AllReduceSum(float *data, size_t size_elts) override;
+
+private:
+    MPI_Comm comm;
+    size_t rank;
+    size_t num_ranks;
+};
+
+}
@@ -0,0 +1,132 @@
+#include "dataloader.h"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <sys/mman.h>
+
+using namespace gigagrad;
+
+DataLoader::DataLoader(std::unique_ptr<Dataset> dataset, Options options)
+    : dataset(std::move(dataset)), options(options)
+{
+    if(this->options.batch_size == 0 || this->options.num_buffers == 0)
+        throw std::domain_error("Batch size and number of buffers must be positive");
+    if(this->options.rank >= this->options.num_ranks)
+        throw std::domain_error("Rank must be less than the number of ranks");
+    this->num_batches = this->dataset->NumExamples() / (this->options.batch_size * this->options.num_ranks);
+    if(this->num_batches == 0)
+        throw std::domain_error("Dataset doesn't have enough examples for a single batch");
+
+    size_t input_elts = this->options.batch_size * this->dataset->InputSize();
+    size_t label_elts = this->options.batch_size * this->dataset->LabelSize();
+    this->staging.resize((input_elts + label_elts) * this->options.num_buffers);
+    // Best effort: keep the staging buffers resident so that neither side of the
+    // pipeline ever waits on them getting paged back in
+    mlock(this->staging.data(), this->staging.size() * sizeof(float));
+    for(size_t ibatch = 0; ibatch < this->options.num_buffers; ibatch++)
+    {
+        float *inputs = this->staging.data() + ibatch * (input_elts + label_elts);
+        this->batches.push_back({ inputs, inputs + input_elts });
+        this->free_batches.push_back(ibatch);
+    }
+    this->producer = std::thread([this]() { this->ProducerLoop(); });
+}
+
+DataLoader::~DataLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->consumed.notify_all();
+    this->producer.join();
+    munlock(this->staging.data(), this->staging.size() * sizeof(float));
+}
+
+bool DataLoader::Next(GraphNodeHandle input, TrainingContext &ctx)
+{
+    float *inputs;
+    float *labels;
+    if(!this->Next(inputs, labels))
+        return false;
+    input.data() = inputs;
+    ctx.training_example = labels;
+    return true;
+}
+
+bool DataLoader::Next(float *&input, float *&label)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if(this->in_use >= 0)
+    {
+        this->free_batches.push_back(this->in_use);
+        this->in_use = -1;
+        this->consumed.notify_one();
+    }
+    if(this->batches_returned_this_epoch == this->num_batches)
+    {
+        this->batches_returned_this_epoch = 0;
+        return false;
+    }
+
+    this->produced.wait(lock, [this]() { return !this->ready_batches.empty() || this->error; });
+    if(this->ready_batches.empty())
+        std::rethrow_exception(this->error);
+    this->in_use = this->ready_batches.front();
+    this->ready_batches.pop_front();
+    this->batches_returned_this_epoch++;
+    input = this->batches[this->in_use].inputs;
+    label = this->batches[this->in_use].labels;
+    return true;
+}
+
+void DataLoader::ProducerLoop()
+{
+    const size_t batch_size = this->options.batch_size;
+    const size_t input_size = this->dataset->InputSize();
+    const size_t label_size = this->dataset->LabelSize();
+    std::vector<size_t> order(this->dataset->NumExamples());
+    std::iota(order.begin(), order.end(), 0);
+    std::mt19937_64 gen(this->options.seed);
+    for(;;)
+    {
+        if(this->options.shuffle)
+            std::shuffle(order.begin(), order.end(), gen);
+
+        for(size_t ibatch = 0; ibatch < this->num_batches; ibatch++)
+        {
+            size_t to_fill;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->consumed.wait(lock, [this]() { return this->stopping || !this->free_batches.empty(); });
+                if(this->stopping)
+                    return;
+                to_fill = this->free_batches.front();
+                this->free_batches.pop_front();
+            }
+
+            try
+            {
+                const Batch &batch = this->batches[to_fill];
+                for(size_t i = 0; i < batch_size; i++)
+                {
+                    size_t iexample = order[(ibatch * this->options.num_ranks + this->options.rank) * batch_size + i];
+                    this->dataset->Read(iexample, batch.inputs + i * input_size, batch.labels + i * label_size);
+                }
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->error = std::current_exception();
+                this->produced.notify_one();
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->ready_batches.push_back(to_fill);
+            this->produced.notify_one();
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "graph.h"
+#include "training.h"
+
+namespace gigagrad
+{
+
+// A source of training examples. Read is called from the loader's background thread, so
+// decoding, normalization, one-hot encoding and so on overlap with the training step.
+struct Dataset
+{
+    virtual ~Dataset() = default;
+    virtual size_t NumExamples() const = 0;
+    virtual size_t InputSize() const = 0; // In elements, per example
+    virtual size_t LabelSize() const = 0; // In elements, per example
+
+    // Writes example `iexample` as fp32 to `input` and `label`
+    virtual void Read(size_t iexample, float *input, float *label) = 0;
+};
+
+// Assembles batches of a Dataset on a background thread, into a ring of staging buffers
+// (two by default: one being trained on, one being filled). Batches are laid out as
+// [batch_size, InputSize] and [batch_size, LabelSize], and examples that don't fill up a
+// whole batch at the end of an epoch are dropped.
+struct DataLoader
+{
+    struct Options
+    {
+        size_t batch_size = 1;
+        bool shuffle = true; // Reshuffled every epoch
+        uint64_t seed = 0;
+        size_t num_buffers = 2;
+
+        // For data-parallel training: every rank reads `batch_size` examples of each global
+        // batch of `batch_size * num_ranks`. Ranks must use the same seed to agree on the shuffle.
+        size_t rank = 0;
+        size_t num_ranks = 1;
+    };
+
+    DataLoader(std::unique_ptr<Dataset> dataset, Options options);
+    ~DataLoader();
+
+    size_t NumBatches() const { return num_batches; }
+
+    // Points `input` and the training example of `ctx` at the next batch, waiting for it if
+    // it isn't ready yet. The previous batch is handed back to be refilled, so it must no
+    // longer be in use. Returns false (without binding anything) once all of the batches of
+    // an epoch were returned, after which the next call starts the following epoch.
+    // Exceptions thrown by the dataset are rethrown here.
+    bool Next(GraphNodeHandle input, TrainingContext &ctx);
+
+    // Same, for callers that don't train through a TrainingContext
+    bool Next(float *&input, float *&label);
+
+private:
+    struct Batch
+    {
+        float *inputs;
+        float *labels;
+    };
+
+    void ProducerLoop();
+
+    std::unique_ptr<Dataset> dataset;
+    Options options;
+    size_t num_batches;
+
+    std::vector<float> staging; // Backing memory of all of the batches
+    std::vector<Batch> batches;
+
+    std::mutex mutex;
+    std::condition_variable produced;
+    std::condition_variable consumed;
+    std::deque<size_t> free_batches;
+    std::deque<size_t> ready_batches;
+    std::ptrdiff_t in_use = -1;
+    size_t batches_returned_this_epoch = 0;
+    std::exception_ptr error;
+    bool stopping = false;
+
+    std::thread producer;
+};
+
+}
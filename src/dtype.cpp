@@ -0,0 +1,161 @@
+#include "dtype.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace gigagrad
+{
+
+size_t SizeOf(DType dtype)
+{
+    switch(dtype)
+    {
+    case DType::F32:
+        return 4;
+    case DType::F16:
+    case DType::BF16:
+        return 2;
+    case DType::I8:
+    case DType::U8:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+const char *DTypeName(DType dtype)
+{
+    switch(dtype)
+    {
+    case DType::F32:
+        return "f32";
+    case DType::F16:
+        return "f16";
+    case DType::BF16:
+        return "bf16";
+    case DType::I8:
+        return "i8";
+    case DType::U8:
+        return "u8";
+    default:
+        return "invalid";
+    }
+}
+
+bool IsQuantized(DType dtype)
+{
+    return dtype == DType::I8 || dtype == DType::U8;
+}
+
+// Keep these in sync with DTypeConversions in backend_scalar_c.cpp
+uint16_t ToF16(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, 4);
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7FFFFFFF;
+    if(abs >= 0x7F800000) // Inf or NaN
+        return static_cast<uint16_t>(sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0));
+    if(abs >= 0x477FF000) // Rounds to more than the largest half
+        return static_cast<uint16_t>(sign | 0x7C00);
+    if(abs < 0x33000000) // Rounds to zero
+        return static_cast<uint16_t>(sign);
+
+    uint32_t result, remainder, halfway;
+    if(abs < 0x38800000)
+    {
+        // Subnormal half, whose unit is 2^-24
+        uint32_t shift = 126 - (abs >> 23);
+        uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+        result = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        // Rebias the exponent, a carry out of the mantissa correctly bumps it
+        uint32_t rebiased = abs - (112u << 23);
+        result = rebiased >> 13;
+        remainder = rebiased & 0x1FFF;
+        halfway = 0x1000;
+    }
+    if(remainder > halfway || (remainder == halfway && (result & 1)))
+        result++;
+    return static_cast<uint16_t>(sign | result);
+}
+
+float FromF16(uint16_t x)
+{
+    uint32_t sign = static_cast<uint32_t>(x & 0x8000) << 16;
+    uint32_t exponent = (x >> 10) & 0x1F;
+    uint32_t mantissa = x & 0x3FF;
+    uint32_t bits;
+    if(exponent == 0x1F)
+    {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else if(exponent != 0)
+    {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    else if(mantissa == 0)
+    {
+        bits = sign;
+    }
+    else
+    {
+        exponent = 113;
+        while(!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float result;
+    std::memcpy(&result, &bits, 4);
+    return result;
+}
+
+uint16_t ToBF16(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, 4);
+    if((bits & 0x7FFFFFFF) > 0x7F800000)
+        return static_cast<uint16_t>((bits >> 16) | 0x40); // Keep NaNs NaN
+    return static_cast<uint16_t>((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+float FromBF16(uint16_t x)
+{
+    uint32_t bits = static_cast<uint32_t>(x) << 16;
+    float result;
+    std::memcpy(&result, &bits, 4);
+    return result;
+}
+
+int8_t ToI8(float x, float scale)
+{
+    float q = std::nearbyint(x / scale);
+    q = q > 127.0f ? 127.0f : q < -127.0f ? -127.0f : q;
+    return static_cast<int8_t>(q);
+}
+
+float FromI8(int8_t x, float scale)
+{
+    return static_cast<float>(x) * scale;
+}
+
+uint8_t ToU8(float x, float scale)
+{
+    float q = std::nearbyint(x / scale);
+    q = q > 255.0f ? 255.0f : q < 0.0f ? 0.0f : q;
+    return static_cast<uint8_t>(q);
+}
+
+float FromU8(uint8_t x, float scale)
+{
+    return static_cast<float>(x) * scale;
+}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace gigagrad
+{
+
+// Storage type of a tensor. All arithmetic happens in fp32: loads convert to it and stores
+// convert back, so the narrower types only save memory and bandwidth.
+enum class DType : uint8_t
+{
+    F32,
+    F16,
+    BF16,
+    I8, // Symmetric quantization, the value of x is x * scale
+    U8, // Unsigned, the value of x is x * scale (e.g. 1/255 for 8-bit pixels)
+};
+
+size_t SizeOf(DType dtype);
+const char *DTypeName(DType dtype);
+bool IsQuantized(DType dtype); // Stored as integers that are multiplied by the tensor's scale
+
+// Conversions round to nearest even, and overflow to infinity (or saturate for I8 and U8)
+uint16_t ToF16(float x);
+float FromF16(uint16_t x);
+uint16_t ToBF16(float x);
+float FromBF16(uint16_t x);
+int8_t ToI8(float x, float scale);
+float FromI8(int8_t x, float scale);
+uint8_t ToU8(float x, float scale);
+float FromU8(uint8_t x, float scale);
+
+}
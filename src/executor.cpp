@@ -0,0 +1,152 @@
+#include "executor.h"
+
+#include <algorithm>
+
+using namespace gigagrad;
+
+Executor::Executor(size_t num_threads)
+{
+    num_threads = std::max<size_t>(num_threads, 1);
+    for(size_t i = 0; i < num_threads; i++)
+        this->queues.emplace_back(std::make_unique<Queue>());
+    for(size_t i = 1; i < num_threads; i++)
+        this->threads.emplace_back([this, i]() { this->WorkerLoop(i); });
+}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->wake.notify_all();
+    for(std::thread &thread : this->threads)
+        thread.join();
+}
+
+void Executor::Run(const TaskGraph &graph, const std::function<void(size_t)> &fn)
+{
+    size_t num_tasks = graph.NumTasks();
+    if(num_tasks == 0)
+        return;
+
+    this->graph = &graph;
+    this->fn = &fn;
+    this->pending_predecessors = std::make_unique<std::atomic<size_t>[]>(num_tasks);
+    this->remaining = num_tasks;
+    size_t iqueue = 0;
+    for(size_t task = 0; task < num_tasks; task++)
+    {
+        this->pending_predecessors[task] = graph.num_predecessors[task];
+        if(graph.num_predecessors[task] == 0)
+            this->Push(iqueue++ % this->queues.size(), task);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->generation++;
+        this->busy_workers = this->threads.size();
+    }
+    this->wake.notify_all();
+
+    this->Work(0);
+
+    // Workers may still be inspecting the run state, wait for them to let go of it
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->done.wait(lock, [this]() { return this->busy_workers == 0; });
+    this->graph = nullptr;
+    this->fn = nullptr;
+}
+
+void Executor::WorkerLoop(size_t iworker)
+{
+    size_t seen_generation = 0;
+    for(;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->wake.wait(lock, [&]() { return this->stopping || this->generation != seen_generation; });
+            if(this->stopping)
+                return;
+            seen_generation = this->generation;
+        }
+
+        this->Work(iworker);
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if(--this->busy_workers == 0)
+            this->done.notify_all();
+    }
+}
+
+void Executor::Work(size_t iworker)
+{
+    while(this->remaining.load(std::memory_order_acquire) > 0)
+    {
+        size_t task;
+        if(!this->Pop(iworker, task))
+        {
+            // Sleep until a completion makes a task ready or the run finishes
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->ready.wait(lock, [this]()
+            {
+                return this->num_queued.load(std::memory_order_acquire) > 0
+                    || this->remaining.load(std::memory_order_acquire) == 0;
+            });
+            continue;
+        }
+
+        (*this->fn)(task);
+        for(size_t successor : this->graph->successors[task])
+        {
+            if(this->pending_predecessors[successor].fetch_sub(1, std::memory_order_acq_rel) == 1)
+                this->Push(iworker, successor);
+        }
+        if(this->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->ready.notify_all();
+        }
+    }
+}
+
+bool Executor::Pop(size_t iworker, size_t &task)
+{
+    {
+        Queue &own = *this->queues[iworker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(!own.tasks.empty())
+        {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            this->num_queued.fetch_sub(1, std::memory_order_acq_rel);
+            return true;
+        }
+    }
+    for(size_t i = 1; i < this->queues.size(); i++)
+    {
+        Queue &victim = *this->queues[(iworker + i) % this->queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(!victim.tasks.empty())
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            this->num_queued.fetch_sub(1, std::memory_order_acq_rel);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::Push(size_t iworker, size_t task)
+{
+    {
+        Queue &queue = *this->queues[iworker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+        this->num_queued.fetch_add(1, std::memory_order_acq_rel);
+    }
+    // Taking the lock orders this with the check of a worker about to sleep
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->ready.notify_one();
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gigagrad
+{
+
+// A DAG of tasks, identified by index
+struct TaskGraph
+{
+    std::vector<std::vector<size_t>> successors;
+    std::vector<size_t> num_predecessors;
+
+    size_t NumTasks() const { return successors.size(); }
+
+    void AddEdge(size_t from, size_t to)
+    {
+        successors[from].push_back(to);
+        num_predecessors[to]++;
+    }
+};
+
+// Work-stealing thread pool. Every thread (including the one calling Run) owns a queue of
+// ready tasks: it pushes the tasks its completions make ready to the back and pops from the
+// back, and when it runs dry it steals from the front of the others, or sleeps until a task
+// becomes ready.
+struct Executor
+{
+    explicit Executor(size_t num_threads);
+    ~Executor();
+
+    // Calls fn(task) for every task of the graph, each one only after all of its
+    // predecessors have returned. Blocks until all tasks are done.
+    void Run(const TaskGraph &graph, const std::function<void(size_t)> &fn);
+
+    size_t NumThreads() const { return queues.size(); }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    void WorkerLoop(size_t iworker);
+    void Work(size_t iworker);
+    bool Pop(size_t iworker, size_t &task);
+    void Push(size_t iworker, size_t task);
+
+    std::vector<std::unique_ptr<Queue>> queues; // Queue 0 belongs to the caller of Run
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::condition_variable ready; // A task was queued or the run finished
+    size_t generation = 0;
+    size_t busy_workers = 0;
+    bool stopping = false;
+
+    // State of the current Run
+    const TaskGraph *graph = nullptr;
+    const std::function<void(size_t)> *fn = nullptr;
+    std::unique_ptr<std::atomic<size_t>[]> pending_predecessors;
+    std::atomic<size_t> remaining = 0;
+    std::atomic<size_t> num_queued = 0; // Across all queues
+};
+
+}
@@ -0,0 +1,202 @@
+#include "export.h"
+#include "backend_scalar_c.h"
+#include "training.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <system_error>
+
+namespace gigagrad
+{
+
+using namespace codegen;
+
+static size_t NumElements(const Shape &shape)
+{
+    return std::accumulate(shape.begin(), shape.end(), size_t{1}, std::multiplies{});
+}
+
+static bool IsIdentifier(const std::string &name)
+{
+    return !name.empty()
+        && !std::isdigit(static_cast<unsigned char>(name[0]))
+        && std::all_of(name.begin(), name.end(), [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; });
+}
+
+static std::string ShapeString(const Shape &shape)
+{
+    std::string result = "[";
+    for(size_t i = 0; i < shape.size(); i++)
+        result += (i == 0 ? "" : ", ") + std::to_string(shape[i]);
+    return result + "]";
+}
+
+static void WriteFile(const std::filesystem::path &path, const std::string &contents)
+{
+    FILE *file = std::fopen(path.c_str(), "w");
+    if(!file)
+        throw std::system_error(errno, std::generic_category(), path.string());
+    size_t written = std::fwrite(contents.data(), 1, contents.size(), file);
+    if(std::fclose(file) != 0 || written != contents.size())
+        throw std::runtime_error("Failed to write " + path.string());
+}
+
+// Baked tensors are emitted as words of their bytes, which is much less source to parse
+// than float literals, and works the same for every dtype. That makes the library match
+// the byte order of the machine that exported it.
+static void AppendBakedTensor(std::string &source, const std::string &symbol, const BufferDescriptor &desc, GraphNodeHandle tensor)
+{
+    if(!tensor.data())
+        throw std::domain_error("Tensors need data to be baked into a library");
+    size_t data_bytes = SizeOf(desc.dtype) * NumElements(tensor.shape());
+    size_t buffer_bytes = std::max(data_bytes, SizeOf(desc.dtype) * desc.size_elts);
+    std::vector<uint32_t> words((buffer_bytes + 3) / 4, 0);
+    std::memcpy(words.data(), tensor.data(), data_bytes);
+
+    char line[32];
+    source += "static uint32_t " + symbol + "[" + std::to_string(words.size()) + "] __attribute__((aligned(64))) =\n{";
+    for(size_t i = 0; i < words.size(); i++)
+    {
+        std::snprintf(line, sizeof(line), "%s0x%08" PRIx32 "u,", i % 8 == 0 ? "\n    " : " ", words[i]);
+        source += line;
+    }
+    source += "\n};\n\n";
+}
+
+std::vector<GraphNodeHandle> ExportProgram(
+    const Program &program,
+    size_t output_buffer,
+    const std::filesystem::path &directory,
+    const ExportOptions &options)
+{
+    if(!IsIdentifier(options.name))
+        throw std::domain_error("Export name must be a valid C identifier");
+    if(program.buffers.at(output_buffer).dtype != DType::F32)
+        throw std::domain_error("Exported programs must output F32");
+
+    const std::string &name = options.name;
+    std::string upper_name = name;
+    std::transform(name.begin(), name.end(), upper_name.begin(), [](char c) { return std::toupper(static_cast<unsigned char>(c)); });
+
+    SourceOptions source_options = { name.c_str(), options.openmp, false, true };
+    std::string source = GenerateSource(program, source_options);
+    ArenaPlan plan = PlanArena(program, BufferAlignment);
+
+    std::vector<GraphNodeHandle> passed;
+    std::string header =
+        "// Generated by gigagrad. Link with lib" + name + ".a and -lm" + (options.openmp ? " -fopenmp" : "") + ".\n"
+        "#pragma once\n#include <stddef.h>\n#include <stdint.h>\n\n#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+    std::string tensor_docs;
+    std::string tensor_sizes;
+    // Batched programs get a second entry point that runs fewer rows than the maximum
+    bool is_batched = program.max_batch != 0;
+    std::string run_signature = is_batched
+        ? "float *" + name + "_run_batch(void *const *tensors, void *arena, int64_t batch_size)"
+        : "float *" + name + "_run(void *const *tensors, void *arena)";
+    std::string run = run_signature + "\n{\n";
+    run += "    void *buffers[" + std::to_string(program.buffers.size()) + "];\n";
+    for(size_t ibuff = 0; ibuff < program.buffers.size(); ibuff++)
+    {
+        const BufferDescriptor &desc = program.buffers[ibuff];
+        std::string target = "    buffers[" + std::to_string(ibuff) + "] = ";
+        if(!std::holds_alternative<GraphNodeHandle>(desc.id))
+        {
+            run += target + "(char *)arena + " + std::to_string(plan.offsets[ibuff]) + ";\n";
+            continue;
+        }
+
+        GraphNodeHandle tensor = std::get<GraphNodeHandle>(desc.id);
+        bool baked = std::any_of(
+            options.baked_tensors.begin(),
+            options.baked_tensors.end(),
+            [&](GraphNodeHandle t) { return t.node_idx == tensor.node_idx; });
+        if(baked)
+        {
+            std::string symbol = name + "_tensor_" + std::to_string(ibuff);
+            AppendBakedTensor(source, symbol, desc, tensor);
+            run += target + symbol + ";\n";
+            continue;
+        }
+
+        std::string itensor = std::to_string(passed.size());
+        tensor_docs += "//   " + itensor + ": " + DTypeName(desc.dtype) + " " + ShapeString(tensor.shape()) + "\n";
+        tensor_sizes += "#define " + upper_name + "_TENSOR_" + itensor + "_BYTES "
+            + std::to_string(SizeOf(desc.dtype) * desc.size_elts) + "\n";
+        run += target + "tensors[" + itensor + "];\n";
+        passed.push_back(tensor);
+    }
+    run += std::string("    gigagrad_main(buffers, ") + (is_batched ? "batch_size" : "0") + ");\n";
+    run += "    return (float *)buffers[" + std::to_string(output_buffer) + "];\n}\n";
+    if(is_batched)
+    {
+        run += "\nfloat *" + name + "_run(void *const *tensors, void *arena)\n{\n";
+        run += "    return " + name + "_run_batch(tensors, arena, " + std::to_string(program.max_batch) + ");\n}\n";
+    }
+    source += run;
+
+    header += "// Scratch memory for " + name + "_run, aligned to " + upper_name + "_ARENA_ALIGNMENT bytes\n";
+    header += "#define " + upper_name + "_ARENA_BYTES " + std::to_string(plan.size_bytes) + "\n";
+    header += "#define " + upper_name + "_ARENA_ALIGNMENT " + std::to_string(BufferAlignment) + "\n\n";
+    header += "// Tensors to pass to " + name + "_run, in order:\n" + (tensor_docs.empty() ? "//   (none)\n" : tensor_docs);
+    header += "#define " + upper_name + "_NUM_TENSORS " + std::to_string(passed.size()) + "\n" + tensor_sizes + "\n";
+    header += "// Elements of the float array " + name + "_run returns\n";
+    header += "#define " + upper_name + "_OUTPUT_ELEMENTS " + std::to_string(program.buffers[output_buffer].size_elts) + "\n\n";
+    header += "// Runs the program, and returns its output. It lives in the arena (or in one of the\n";
+    header += "// tensors), so it stays valid until the next run.\n";
+    header += "float *" + name + "_run(void *const *tensors, void *arena);\n\n";
+    if(is_batched)
+    {
+        header += "// Leading dimension of the batched tensors\n";
+        header += "#define " + upper_name + "_MAX_BATCH " + std::to_string(program.max_batch) + "\n\n";
+        header += "// Like " + name + "_run, but only runs and writes the first batch_size rows, at\n";
+        header += "// most " + upper_name + "_MAX_BATCH, of the batched tensors and the output\n";
+        header += run_signature + ";\n\n";
+    }
+    header += "#ifdef __cplusplus\n}\n#endif\n";
+
+    std::filesystem::create_directories(directory);
+    std::filesystem::path source_path = directory / (name + ".c");
+    std::filesystem::path object_path = directory / (name + ".o");
+    std::filesystem::path library_path = directory / ("lib" + name + ".a");
+    WriteFile(source_path, source);
+    WriteFile(directory / (name + ".h"), header);
+    std::vector<std::string> compile;
+    AppendWords(compile, options.compiler);
+    compile.insert(compile.end(), { "-c", source_path.string(), "-o", object_path.string() });
+    AppendWords(compile, options.flags);
+    if(options.openmp)
+        compile.push_back("-fopenmp");
+    RunCommand(compile);
+    std::filesystem::remove(library_path);
+    RunCommand({ "ar", "rcs", library_path.string(), object_path.string() });
+    std::filesystem::remove(object_path);
+    return passed;
+}
+
+static const Program &ExportableProgram(const codegen::Backend &backend)
+{
+    const Program *program = backend.GetProgram();
+    if(!program)
+        throw std::domain_error("Backend doesn't keep its program, so it can't be exported");
+    return *program;
+}
+
+}
+
+using namespace gigagrad;
+
+std::vector<GraphNodeHandle> CompiledTensor::Export(const std::filesystem::path &directory, const ExportOptions &options) const
+{
+    const codegen::Program &program = ExportableProgram(*this->backend);
+    return ExportProgram(program, program.functions.back().output_buffer, directory, options);
+}
+
+std::vector<GraphNodeHandle> TrainingContext::Export(const std::filesystem::path &directory, const ExportOptions &options) const
+{
+    return ExportProgram(ExportableProgram(*this->backend), this->loss_buffer_id, directory, options);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "graph.h"
+#include "codegen.h"
+
+namespace gigagrad
+{
+
+struct ExportOptions
+{
+    std::string name = "gigagrad_model"; // Prefix of the library's symbols and of its files
+    std::vector<GraphNodeHandle> baked_tensors; // Compiled in with their current data, e.g. trained weights
+    bool openmp = false; // Programs linking the library then need -fopenmp too
+    // Both are split on whitespace and run without a shell, so they can't quote anything
+    std::string compiler = "cc";
+    std::string flags = "-O3"; // -march=native is faster, but only runs on machines like this one
+};
+
+// Compiles `program` into a static library <name>.a and a header <name>.h in `directory`
+// (next to <name>.c, the source they're built from), so that it can run in programs that
+// don't use gigagrad and never invoke a compiler. The header documents the entry point,
+//     float *<name>_run(void *const *tensors, void *arena),
+// which runs the program on the caller's tensors and scratch memory and returns
+// `output_buffer`. Alongside it are the sizes of everything the caller needs to allocate.
+// Returns the tensors that `tensors` has to point at, in order, which are all of those
+// read or written by the program that aren't baked in.
+std::vector<GraphNodeHandle> ExportProgram(
+    const codegen::Program &program,
+    size_t output_buffer,
+    const std::filesystem::path &directory,
+    const ExportOptions &options = {});
+
+}
@@ -1,7 +1,9 @@
 #include "graph.h"
 
 #include <algorithm>
+#include <cstring>
 #include <functional>
+#include <new>
 #include <numeric>
 #include <stdexcept>
 
@@ -242,7 +244,8 @@ GraphNodeHandle GraphNodeHandle::batchnorm() const
 // If we have matrices X, Y of shape AxB and BxC, then we reshape X into a
 // AxBx1 tensor, and reshape Y into a 1xBxC tensor. Broadcasting then turns this
 // into a cube of multiplications, and then we reduce along the middle axis
-// and cut out the middle axis (since it has dim 1 anyway)
+// and cut out the middle axis (since it has dim 1 anyway). Codegen recognizes
+// this pattern and lowers it to a tiled matmul kernel instead.
 GraphNodeHandle GraphNodeHandle::matmul(GraphNodeHandle y) const
 {
     Shape x_shape = this->shape();
@@ -268,6 +271,27 @@ GraphNodeHandle GraphNodeHandle::matmul(GraphNodeHandle y) const
     return elementwise_mul.sum(-2, false /* keepdim */); // Sum along the middle axis
 }
 
+const char *KindName(enum GraphNode::Kind kind)
+{
+    switch(kind)
+    {
+    case GraphNode::Kind::Tensor:
+        return "Tensor";
+    case GraphNode::Kind::Immediate:
+        return "Immediate";
+    case GraphNode::Kind::UnaryOp:
+        return "UnaryOp";
+    case GraphNode::Kind::BinaryOp:
+        return "BinaryOp";
+    case GraphNode::Kind::ReduceOp:
+        return "ReduceOp";
+    case GraphNode::Kind::ViewOp:
+        return "ViewOp";
+    default:
+        return "Invalid";
+    }
+}
+
 GraphNodeHandle sqrt(GraphNodeHandle x)
 {
     return WrapInUnary(x, UnaryOpType::SQRT);
@@ -640,16 +664,27 @@ GraphNodeHandle Graph::Immediate(float imm)
     return this->AddNode(gigagrad::Immediate{imm});
 }
 
-GraphNodeHandle Graph::AddInput(Shape shape)
+GraphNodeHandle Graph::AddInput(Shape shape, DType dtype)
 {
-    this->inputs.push_back(this->nodes.size());
-    GraphNodeHandle result = this->AddNode(Tensor{}, std::move(shape));
+    GraphNodeHandle result = this->AddNode(Tensor{ .dtype = dtype }, std::move(shape));
+    std::lock_guard<std::mutex> lock(this->inputs_mutex);
+    this->inputs.push_back(result.node_idx);
     return result;
 }
 
-GraphNodeHandle Graph::AddInput(dim_t dim)
+GraphNodeHandle Graph::AddInput(dim_t dim, DType dtype)
+{
+    return this->AddInput(Shape{dim}, dtype);
+}
+
+GraphNodeHandle Graph::AddBatchedInput(Shape shape, DType dtype)
 {
-    return this->AddInput(Shape{dim});
+    if(shape.empty())
+        throw std::domain_error("Batched inputs need a batch dimension");
+    GraphNodeHandle result = this->AddNode(Tensor{ .dtype = dtype, .is_batched = true }, std::move(shape));
+    std::lock_guard<std::mutex> lock(this->inputs_mutex);
+    this->inputs.push_back(result.node_idx);
+    return result;
 }
 
 GraphNodeHandle Graph::AddNode(Tensor tensor, Shape shape)
@@ -728,13 +763,153 @@ GraphNodeHandle Graph::AddNode(ViewOp op)
         });
 }
 
+static size_t HashCombine(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9E3779B97F4A7C15ull + (seed << 6) + (seed >> 2));
+}
+
+static size_t HashShape(size_t seed, const Shape &shape)
+{
+    seed = HashCombine(seed, shape.size());
+    for(dim_t d : shape)
+        seed = HashCombine(seed, static_cast<size_t>(d));
+    return seed;
+}
+
+// Hashes everything that SameNode compares
+static size_t HashNode(const GraphNode &node)
+{
+    const GraphNode::U &u = node.u;
+    size_t hash = HashCombine(static_cast<size_t>(u.k.kind), 0);
+    switch(u.k.kind)
+    {
+    case GraphNode::Kind::Tensor:
+        break;
+    case GraphNode::Kind::Immediate:
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &u.i.immediate.value, sizeof(bits));
+        hash = HashCombine(hash, bits);
+        break;
+    }
+    case GraphNode::Kind::UnaryOp:
+        hash = HashCombine(hash, static_cast<size_t>(u.u.unary_op.type));
+        hash = HashCombine(hash, u.u.unary_op.x.node_idx);
+        break;
+    case GraphNode::Kind::BinaryOp:
+        hash = HashCombine(hash, static_cast<size_t>(u.b.binary_op.type));
+        hash = HashCombine(hash, u.b.binary_op.x.node_idx);
+        hash = HashCombine(hash, u.b.binary_op.y.node_idx);
+        break;
+    case GraphNode::Kind::ReduceOp:
+        hash = HashCombine(hash, static_cast<size_t>(u.r.reduce_op.type));
+        hash = HashCombine(hash, u.r.reduce_op.x.node_idx);
+        hash = HashShape(hash, u.r.reduce_op.dims);
+        hash = HashCombine(hash, u.r.reduce_op.keepdim);
+        break;
+    case GraphNode::Kind::ViewOp:
+        hash = HashCombine(hash, u.v.view_op.x.node_idx);
+        hash = HashShape(hash, u.v.view_op.shape);
+        hash = HashShape(hash, u.v.view_op.strides);
+        hash = HashCombine(hash, static_cast<size_t>(u.v.view_op.offset));
+        break;
+    }
+    hash = HashShape(hash, node.shape);
+    return HashShape(hash, node.strides);
+}
+
+static bool SameNode(const GraphNode &x, const GraphNode &y)
+{
+    const GraphNode::U &a = x.u;
+    const GraphNode::U &b = y.u;
+    if(a.k.kind != b.k.kind || x.shape != y.shape || x.strides != y.strides)
+        return false;
+
+    switch(a.k.kind)
+    {
+    case GraphNode::Kind::Tensor:
+        return false;
+    case GraphNode::Kind::Immediate:
+        return std::memcmp(&a.i.immediate.value, &b.i.immediate.value, sizeof(float)) == 0;
+    case GraphNode::Kind::UnaryOp:
+        return a.u.unary_op.type == b.u.unary_op.type
+            && a.u.unary_op.x.node_idx == b.u.unary_op.x.node_idx;
+    case GraphNode::Kind::BinaryOp:
+        return a.b.binary_op.type == b.b.binary_op.type
+            && a.b.binary_op.x.node_idx == b.b.binary_op.x.node_idx
+            && a.b.binary_op.y.node_idx == b.b.binary_op.y.node_idx;
+    case GraphNode::Kind::ReduceOp:
+        return a.r.reduce_op.type == b.r.reduce_op.type
+            && a.r.reduce_op.x.node_idx == b.r.reduce_op.x.node_idx
+            && a.r.reduce_op.dims == b.r.reduce_op.dims
+            && a.r.reduce_op.keepdim == b.r.reduce_op.keepdim;
+    case GraphNode::Kind::ViewOp:
+        return a.v.view_op.x.node_idx == b.v.view_op.x.node_idx
+            && a.v.view_op.shape == b.v.view_op.shape
+            && a.v.view_op.strides == b.v.view_op.strides
+            && a.v.view_op.offset == b.v.view_op.offset;
+    default:
+        return false;
+    }
+}
+
 GraphNodeHandle Graph::AddNode(GraphNode node)
 {
-    GraphNodeHandle result = { this, this->nodes.size() };
-    this->nodes.emplace_back(std::move(node));
+    if(node.u.k.kind == GraphNode::Kind::Tensor)
+        return { this, this->nodes.push_back(std::move(node)) };
+
+    // The shard stays locked until the node is added, so that two threads adding the same
+    // node get the same one
+    size_t hash = HashNode(node);
+    HashShard &shard = this->node_hashes[hash % NumHashShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto [begin, end] = shard.nodes.equal_range(hash);
+    for(auto it = begin; it != end; ++it)
+        if(SameNode(this->nodes[it->second], node))
+            return { this, it->second };
+
+    GraphNodeHandle result = { this, this->nodes.push_back(std::move(node)) };
+    shard.nodes.emplace(hash, result.node_idx);
     return result;
 }
 
+NodeArena::~NodeArena()
+{
+    size_t num_nodes = this->size();
+    for(size_t i = 0; i < num_nodes; i++)
+        (*this)[i].~GraphNode();
+    for(std::atomic<GraphNode *> &chunk : this->chunks)
+        ::operator delete(chunk.load());
+}
+
+// Everything that can throw happens before the index is claimed, so every index below
+// size() is in an allocated chunk and gets a node: moving a valid node only moves its
+// members
+size_t NodeArena::push_back(GraphNode node)
+{
+    size_t idx = this->num_nodes.load(std::memory_order_relaxed);
+    GraphNode *storage;
+    do
+    {
+        auto [chunk, offset] = Locate(idx);
+        if(chunk >= MaxChunks)
+            throw std::length_error("Too many nodes in graph");
+        storage = this->chunks[chunk].load(std::memory_order_acquire);
+        if(!storage)
+        {
+            std::lock_guard<std::mutex> lock(this->grow_mutex);
+            storage = this->chunks[chunk].load(std::memory_order_acquire);
+            if(!storage)
+            {
+                storage = static_cast<GraphNode *>(::operator new((FirstChunkSize << chunk) * sizeof(GraphNode)));
+                this->chunks[chunk].store(storage, std::memory_order_release);
+            }
+        }
+    } while(!this->num_nodes.compare_exchange_weak(idx, idx + 1, std::memory_order_acq_rel));
+    new (&storage[Locate(idx).second]) GraphNode(std::move(node));
+    return idx;
+}
+
 const Shape &GraphNodeHandle::shape() const
 {
     const GraphNode &node = this->GetNode();
@@ -757,7 +932,7 @@ const GraphNode &GraphNodeHandle::GetNode() const
     return graph->nodes[node_idx];
 }
 
-float *&GraphNodeHandle::data()
+void *&GraphNodeHandle::data()
 {
     GraphNode &node = this->GetNode();
     if(node.u.k.kind != GraphNode::Kind::Tensor)
@@ -765,31 +940,39 @@ float *&GraphNodeHandle::data()
     return GetNode().u.t.tensor.data;
 }
 
+float &GraphNodeHandle::scale()
+{
+    GraphNode &node = this->GetNode();
+    if(node.u.k.kind != GraphNode::Kind::Tensor)
+        throw std::logic_error("Cannot call scale() on non-Tensor node");
+    return GetNode().u.t.tensor.scale;
+}
+
 GraphNodeHandle nn::Module::Immediate(float imm)
 {
     return this->graph.Immediate(imm);
 }
 
-GraphNodeHandle nn::Module::AddInput(Shape shape)
+GraphNodeHandle nn::Module::AddInput(Shape shape, DType dtype)
 {
-    return this->graph.AddInput(std::move(shape));
+    return this->graph.AddInput(std::move(shape), dtype);
 }
 
-GraphNodeHandle nn::Module::AddInput(dim_t dim)
+GraphNodeHandle nn::Module::AddInput(dim_t dim, DType dtype)
 {
-    return this->graph.AddInput(dim);
+    return this->graph.AddInput(dim, dtype);
 }
 
-GraphNodeHandle nn::Module::AddWeight(Shape shape)
+GraphNodeHandle nn::Module::AddWeight(Shape shape, DType dtype)
 {
     this->weights.push_back(this->graph.inputs.size());
-    return this->graph.AddInput(std::move(shape));
+    return this->graph.AddInput(std::move(shape), dtype);
 }
 
-GraphNodeHandle nn::Module::AddWeight(dim_t dim)
+GraphNodeHandle nn::Module::AddWeight(dim_t dim, DType dtype)
 {
     this->weights.push_back(this->graph.inputs.size());
-    return this->graph.AddInput(dim);
+    return this->graph.AddInput(dim, dtype);
 }
 
 GraphNode::U::U(const U &that) : k({ that.k.kind })
@@ -860,6 +1043,14 @@ GraphNode::U &GraphNode::U::operator=(U &&that)
     return *this;
 }
 
+std::unique_ptr<codegen::ExecutionContext> CompiledTensor::CreateContext() const
+{
+    auto context = this->backend->CreateContext();
+    if(!context)
+        throw std::runtime_error("Backend doesn't support execution contexts");
+    return context;
+}
+
 GraphNode::U::~U()
 {
     switch(this->k.kind)
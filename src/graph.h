@@ -1,14 +1,21 @@
 #pragma once
 
-#include <deque>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <filesystem>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <sstream>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
 #include "backend.h"
+#include "dtype.h"
+#include "small_vector.h"
 
 namespace gigagrad
 {
@@ -21,9 +28,11 @@ struct ReduceOp;
 
 struct Graph;
 struct GraphNode;
+struct GraphNodeHandle;
+struct ExportOptions;
 using dim_t = ssize_t;
-using Shape = std::vector<dim_t>;
-using Dims = std::vector<dim_t>;
+using Shape = SmallVector<dim_t, 6>;
+using Dims = SmallVector<dim_t, 6>;
 
 struct CompiledTensor
 {
@@ -32,6 +41,20 @@ struct CompiledTensor
     std::unique_ptr<codegen::Backend> backend;
 
     void Execute() { backend->Execute(); }
+    // Runs the first `batch_size` rows of a program with batched inputs. Later calls of
+    // Execute() keep running that many.
+    void Execute(size_t batch_size)
+    {
+        backend->batch_size = batch_size;
+        backend->Execute();
+    }
+
+    // A context that runs the program independently of Execute() and of other contexts,
+    // see codegen::ExecutionContext. Throws if the backend can't make one.
+    std::unique_ptr<codegen::ExecutionContext> CreateContext() const;
+
+    // Writes the program as a static library, see ExportProgram in export.h
+    std::vector<GraphNodeHandle> Export(const std::filesystem::path &directory, const ExportOptions &options) const;
 };
 
 struct GraphNodeHandle
@@ -70,7 +93,8 @@ struct GraphNodeHandle
     const GraphNode &operator*() const { return this->GetNode(); }
     GraphNode *operator->() { return &this->GetNode(); }
     const GraphNode *operator->() const { return &this->GetNode(); }
-    float *&data();
+    void *&data(); // Points to elements of the tensor's dtype
+    float &scale(); // Of an I8 or U8 tensor, read at compile time
 
     CompiledTensor Compile(std::unique_ptr<codegen::Backend> backend) const;
     template <typename TBackend>
@@ -106,7 +130,10 @@ enum class ReduceOpType
 
 struct Tensor
 {
-    float *data = nullptr;
+    void *data = nullptr;
+    DType dtype = DType::F32;
+    float scale = 1.0f;
+    bool is_batched = false; // See Graph::AddBatchedInput
 };
 
 struct Immediate
@@ -209,6 +236,52 @@ struct GraphNode
     bool needs_gradient = true;
 };
 
+const char *KindName(enum GraphNode::Kind kind);
+
+// Holds the nodes of a graph. Nodes live in chunks that never move, so references to them
+// stay valid while nodes are appended, and looking one up takes no lock. Chunk k holds
+// FirstChunkSize << k nodes, so a few dozen chunks cover any graph.
+struct NodeArena
+{
+    NodeArena() = default;
+    NodeArena(const NodeArena &) = delete;
+    NodeArena &operator=(const NodeArena &) = delete;
+    ~NodeArena();
+
+    // Returns the index of the new node. Several threads may append at once.
+    size_t push_back(GraphNode node);
+
+    GraphNode &operator[](size_t idx)
+    {
+        auto [chunk, offset] = Locate(idx);
+        return this->chunks[chunk].load(std::memory_order_acquire)[offset];
+    }
+
+    const GraphNode &operator[](size_t idx) const
+    {
+        auto [chunk, offset] = Locate(idx);
+        return this->chunks[chunk].load(std::memory_order_acquire)[offset];
+    }
+
+    // Includes nodes that other threads are still appending
+    size_t size() const { return this->num_nodes.load(std::memory_order_acquire); }
+
+private:
+    static constexpr size_t FirstChunkSize = 256;
+    static constexpr size_t MaxChunks = 48;
+
+    static std::pair<size_t, size_t> Locate(size_t idx)
+    {
+        size_t chunk = std::bit_width(idx / FirstChunkSize + 1) - 1;
+        size_t offset = idx - FirstChunkSize * ((size_t{1} << chunk) - 1);
+        return { chunk, offset };
+    }
+
+    std::array<std::atomic<GraphNode *>, MaxChunks> chunks = {};
+    std::atomic<size_t> num_nodes = 0;
+    std::mutex grow_mutex; // Held while allocating a chunk
+};
+
 GraphNodeHandle sqrt(GraphNodeHandle x);
 GraphNodeHandle exp(GraphNodeHandle x);
 GraphNodeHandle log(GraphNodeHandle x);
@@ -282,8 +355,14 @@ GraphNodeHandle matmul(GraphNodeHandle x, GraphNodeHandle y);
 struct Graph
 {
     GraphNodeHandle Immediate(float imm);
-    GraphNodeHandle AddInput(Shape shape);
-    GraphNodeHandle AddInput(dim_t dim);
+    GraphNodeHandle AddInput(Shape shape, DType dtype = DType::F32);
+    GraphNodeHandle AddInput(dim_t dim, DType dtype = DType::F32);
+
+    // An input whose leading dimension is the batch: shape[0] is the maximum batch size,
+    // and the compiled program runs on any number of rows up to it (see
+    // Backend::batch_size). Rows must not depend on each other, so nothing may reduce
+    // along the batch dimension or move it away from the front.
+    GraphNodeHandle AddBatchedInput(Shape shape, DType dtype = DType::F32);
 
     GraphNodeHandle AddNode(struct Tensor, Shape shape);
     GraphNodeHandle AddNode(struct Immediate);
@@ -292,10 +371,25 @@ struct Graph
     GraphNodeHandle AddNode(struct ReduceOp);
     GraphNodeHandle AddNode(struct ViewOp);
 
+    // Returns the existing node if an identical one was already added, so that equal
+    // subexpressions are shared. Tensors are always distinct.
     GraphNodeHandle AddNode(GraphNode node);
 
+    // Graphs may be built from several threads at once, e.g. one sub-graph per thread.
+    // Each thread's inputs keep their order in `inputs`, but the threads' inputs are
+    // interleaved in whatever order they were added. Compile once building is done.
     std::vector<size_t> inputs;
-    std::deque<GraphNode> nodes;
+    NodeArena nodes;
+
+    // Structural hash -> node index, split by hash so that threads rarely contend
+    struct HashShard
+    {
+        std::mutex mutex;
+        std::unordered_multimap<size_t, size_t> nodes;
+    };
+    static constexpr size_t NumHashShards = 16;
+    std::array<HashShard, NumHashShards> node_hashes;
+    std::mutex inputs_mutex;
 };
 
 namespace nn
@@ -305,11 +399,11 @@ struct Module
 {
     GraphNodeHandle Immediate(float imm);
 
-    GraphNodeHandle AddInput(Shape shape);
-    GraphNodeHandle AddInput(dim_t dim);
+    GraphNodeHandle AddInput(Shape shape, DType dtype = DType::F32);
+    GraphNodeHandle AddInput(dim_t dim, DType dtype = DType::F32);
 
-    GraphNodeHandle AddWeight(Shape shape);
-    GraphNodeHandle AddWeight(dim_t dim);
+    GraphNodeHandle AddWeight(Shape shape, DType dtype = DType::F32);
+    GraphNodeHandle AddWeight(dim_t dim, DType dtype = DType::F32);
     
     Graph graph;
     // TODO: Think about if this is a good idea..
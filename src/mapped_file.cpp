@@ -0,0 +1,135 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace gigagrad;
+
+static size_t NumElements(const Shape &shape)
+{
+    return std::accumulate(shape.begin(), shape.end(), size_t{1}, std::multiplies{});
+}
+
+MappedFile::MappedFile(const std::filesystem::path &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::system_error(errno, std::generic_category(), path.string());
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), path.string());
+    }
+    this->size_bytes = static_cast<size_t>(st.st_size);
+    if(this->size_bytes != 0)
+    {
+        void *mapping = mmap(nullptr, this->size_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapping == MAP_FAILED)
+        {
+            int error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), path.string());
+        }
+        this->contents = static_cast<std::byte *>(mapping);
+    }
+    // The mapping keeps the file alive
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if(this->contents)
+        munmap(this->contents, this->size_bytes);
+}
+
+MappedFile::MappedFile(MappedFile &&that)
+    : contents(std::exchange(that.contents, nullptr)), size_bytes(std::exchange(that.size_bytes, 0))
+{
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&that)
+{
+    std::swap(this->contents, that.contents);
+    std::swap(this->size_bytes, that.size_bytes);
+    return *this;
+}
+
+void MappedFile::Bind(GraphNodeHandle tensor, size_t offset) const
+{
+    if(tensor->Kind() != GraphNode::Kind::Tensor)
+        throw std::domain_error("Only tensors can be bound to a file");
+    size_t tensor_bytes = NumElements(tensor.shape()) * SizeOf(tensor->u.t.tensor.dtype);
+    if(offset > this->size_bytes || tensor_bytes > this->size_bytes - offset)
+        throw std::out_of_range("Tensor extends past the end of the file");
+    tensor.data() = this->contents + offset;
+}
+
+void MappedFile::Release(size_t offset, size_t size) const
+{
+    // Only whole pages can be released
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t end = std::min(offset + size, this->size_bytes);
+    size_t first = (offset + page_size - 1) / page_size * page_size;
+    size_t last = end == this->size_bytes ? end : end / page_size * page_size;
+    if(first < last)
+        madvise(this->contents + first, last - first, MADV_DONTNEED);
+}
+
+IdxFile::IdxFile(const std::filesystem::path &path) : file(path)
+{
+    const uint8_t *header = reinterpret_cast<const uint8_t *>(this->file.data());
+    if(this->file.size() < 4 || header[0] != 0 || header[1] != 0)
+        throw std::runtime_error("Invalid magic bytes at beginning of " + path.string());
+
+    switch(header[2])
+    {
+    case 0x08:
+        this->dtype = DType::U8;
+        break;
+    case 0x09:
+        this->dtype = DType::I8;
+        break;
+    default:
+        throw std::runtime_error("Unsupported IDX element type in " + path.string());
+    }
+
+    size_t ndim = header[3];
+    this->header_size = 4 + 4 * ndim;
+    if(this->file.size() < this->header_size)
+        throw std::runtime_error("Truncated IDX header in " + path.string());
+    for(size_t i = 0; i < ndim; i++)
+    {
+        uint32_t dim;
+        std::memcpy(&dim, header + 4 + 4 * i, sizeof(dim));
+        this->shape.push_back(static_cast<dim_t>(__builtin_bswap32(dim)));
+    }
+    if(this->file.size() - this->header_size < this->NumElements() * SizeOf(this->dtype))
+        throw std::runtime_error("Truncated IDX file " + path.string());
+}
+
+size_t IdxFile::NumElements() const
+{
+    return ::NumElements(this->shape);
+}
+
+void IdxFile::Bind(GraphNodeHandle tensor, size_t first_element) const
+{
+    if(tensor->Kind() != GraphNode::Kind::Tensor || tensor->u.t.tensor.dtype != this->dtype)
+        throw std::domain_error("Tensor's dtype doesn't match the IDX file's");
+    if(first_element > this->NumElements() || ::NumElements(tensor.shape()) > this->NumElements() - first_element)
+        throw std::out_of_range("Tensor extends past the end of the IDX file");
+    this->file.Bind(tensor, this->header_size + first_element * SizeOf(this->dtype));
+}
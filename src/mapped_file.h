@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+
+#include "dtype.h"
+#include "graph.h"
+
+namespace gigagrad
+{
+
+// A read-only memory mapping of a whole file. Tensors bound to it read straight from the
+// page cache, so only the pages that are actually touched get loaded, and nothing is
+// copied. Writing to the mapping crashes, so only bind tensors that are read, such as
+// inputs, and not weights that are being trained.
+struct MappedFile
+{
+    explicit MappedFile(const std::filesystem::path &path);
+    ~MappedFile();
+    MappedFile(MappedFile &&that);
+    MappedFile &operator=(MappedFile &&that);
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const std::byte *data() const { return contents; }
+    size_t size() const { return size_bytes; }
+
+    // Points `tensor` at the raw contents of the file starting at `offset` bytes, which
+    // is expected to already be in the tensor's dtype. Throws if the file is too small.
+    void Bind(GraphNodeHandle tensor, size_t offset = 0) const;
+
+    // Tells the kernel that the pages covering [offset, offset + size) won't be read again
+    // soon, so that they stop counting towards this process's memory. They're read from
+    // the file again if they are touched after all.
+    void Release(size_t offset, size_t size) const;
+
+private:
+    std::byte *contents = nullptr;
+    size_t size_bytes = 0;
+};
+
+// An IDX file (the format of MNIST and EMNIST): a big-endian header with the element type
+// and dimensions, followed by the elements. Only the single-byte element types can be
+// used in place, since the multi-byte ones are stored big-endian.
+struct IdxFile
+{
+    explicit IdxFile(const std::filesystem::path &path);
+
+    size_t NumElements() const;
+    const void *elements() const { return file.data() + header_size; }
+
+    // Points `tensor`, which must have the file's dtype, at the elements starting at
+    // `first_element`. `shape[0]` usually counts the examples of a dataset, so binding
+    // at example `i` of a batch is `Bind(x, i * NumElements() / shape[0])`. Throws if
+    // the tensor runs past the end of the file.
+    void Bind(GraphNodeHandle tensor, size_t first_element = 0) const;
+
+    MappedFile file;
+    size_t header_size;
+    DType dtype;
+    Shape shape;
+};
+
+}
@@ -0,0 +1,788 @@
+#include "codegen.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace gigagrad
+{
+namespace codegen
+{
+
+template <typename TFn>
+static void ForEachIntOperand(Instruction &insn, TFn fn)
+{
+    if(auto *i = std::get_if<IntArithmeticInsn>(&insn))
+    {
+        fn(i->x);
+        fn(i->y);
+    }
+    else if(auto *i = std::get_if<LoadInsn>(&insn))
+    {
+        fn(i->idx);
+    }
+    else if(auto *i = std::get_if<StoreInsn>(&insn))
+    {
+        fn(i->offset);
+    }
+}
+
+template <typename TFn>
+static void ForEachFloatOperand(Instruction &insn, TFn fn)
+{
+    if(auto *i = std::get_if<StoreInsn>(&insn))
+    {
+        fn(i->value);
+    }
+    else if(auto *i = std::get_if<UnaryInsn>(&insn))
+    {
+        fn(i->x);
+    }
+    else if(auto *i = std::get_if<BinaryInsn>(&insn))
+    {
+        fn(i->x);
+        fn(i->y);
+    }
+    else if(auto *i = std::get_if<AccumulateInsn>(&insn))
+    {
+        fn(i->accumulator);
+        fn(i->x);
+    }
+}
+
+namespace
+{
+
+// constant + sum(coefficient * atom), where an atom is either a loop variable or an
+// integer value we couldn't simplify. Terms are sorted by atom, so by definition order.
+struct Affine
+{
+    int64_t constant = 0;
+    std::vector<std::pair<size_t, int64_t>> terms;
+
+    static Affine Atom(size_t atom) { return { 0, { { atom, 1 } } }; }
+
+    bool IsConstant() const { return terms.empty(); }
+
+    // Flattened as { constant, atom0, coef0, atom1, coef1, ... } so it can key a map
+    std::vector<int64_t> Key() const
+    {
+        std::vector<int64_t> key = { constant };
+        for(auto [atom, coef] : terms)
+        {
+            key.push_back(static_cast<int64_t>(atom));
+            key.push_back(coef);
+        }
+        return key;
+    }
+};
+
+Affine Combine(const Affine &x, const Affine &y, int64_t y_scale)
+{
+    Affine result = { x.constant + y_scale * y.constant, {} };
+    auto ix = x.terms.begin();
+    auto iy = y.terms.begin();
+    while(ix != x.terms.end() || iy != y.terms.end())
+    {
+        if(iy == y.terms.end() || (ix != x.terms.end() && ix->first < iy->first))
+        {
+            result.terms.push_back(*ix++);
+        }
+        else if(ix == x.terms.end() || iy->first < ix->first)
+        {
+            result.terms.push_back({ iy->first, y_scale * iy->second });
+            iy++;
+        }
+        else
+        {
+            int64_t coef = ix->second + y_scale * iy->second;
+            if(coef != 0)
+                result.terms.push_back({ ix->first, coef });
+            ix++;
+            iy++;
+        }
+    }
+    return result;
+}
+
+Affine Scale(const Affine &x, int64_t scale)
+{
+    if(scale == 0)
+        return {};
+    Affine result = { x.constant * scale, x.terms };
+    for(auto &term : result.terms)
+        term.second *= scale;
+    return result;
+}
+
+struct Range
+{
+    int64_t lo;
+    int64_t hi;
+};
+
+struct Analysis
+{
+    std::vector<std::optional<Affine>> affine; // Set for integer-valued instructions
+    std::vector<std::optional<Range>> atom_ranges;
+    std::vector<bool> is_atom;
+    std::map<size_t, Affine> uses; // Keyed by iinsn * 2 + operand slot
+
+    std::optional<Range> GetRange(const Affine &x) const
+    {
+        Range result = { x.constant, x.constant };
+        for(auto [atom, coef] : x.terms)
+        {
+            if(!atom_ranges[atom])
+                return std::nullopt;
+            int64_t lo = coef * atom_ranges[atom]->lo;
+            int64_t hi = coef * atom_ranges[atom]->hi;
+            result.lo += std::min(lo, hi);
+            result.hi += std::max(lo, hi);
+        }
+        return result;
+    }
+
+    // x = divisor * quotient + remainder, with all terms whose coefficient is divisible
+    // by divisor going to the quotient. If 0 <= remainder < divisor and x >= 0, the
+    // quotient and remainder are exactly x / divisor and x % divisor.
+    std::optional<std::pair<Affine, Affine>> Divide(const Affine &x, int64_t divisor) const
+    {
+        if(divisor <= 0)
+            return std::nullopt;
+        auto x_range = GetRange(x);
+        if(!x_range || x_range->lo < 0)
+            return std::nullopt;
+
+        int64_t constant_quotient = x.constant / divisor;
+        int64_t constant_remainder = x.constant % divisor;
+        if(constant_remainder < 0)
+        {
+            constant_quotient -= 1;
+            constant_remainder += divisor;
+        }
+        Affine quotient = { constant_quotient, {} };
+        Affine remainder = { constant_remainder, {} };
+        for(auto [atom, coef] : x.terms)
+        {
+            if(coef % divisor == 0)
+                quotient.terms.push_back({ atom, coef / divisor });
+            else
+                remainder.terms.push_back({ atom, coef });
+        }
+        auto remainder_range = GetRange(remainder);
+        if(!remainder_range || remainder_range->lo < 0 || remainder_range->hi >= divisor)
+            return std::nullopt;
+        return std::pair{ std::move(quotient), std::move(remainder) };
+    }
+
+    std::optional<Affine> Simplify(const IntArithmeticInsn &i) const
+    {
+        const Affine &x = *affine[i.x];
+        const Affine &y = *affine[i.y];
+        switch(i.op)
+        {
+        case IntArithmeticInsn::Op::ADD:
+            return Combine(x, y, 1);
+        case IntArithmeticInsn::Op::SUB:
+            return Combine(x, y, -1);
+        case IntArithmeticInsn::Op::MUL:
+            if(y.IsConstant())
+                return Scale(x, y.constant);
+            if(x.IsConstant())
+                return Scale(y, x.constant);
+            return std::nullopt;
+        case IntArithmeticInsn::Op::DIV:
+        case IntArithmeticInsn::Op::MOD:
+        {
+            if(!y.IsConstant() || y.constant == 0)
+                return std::nullopt;
+            if(x.IsConstant())
+            {
+                return Affine
+                {
+                    i.op == IntArithmeticInsn::Op::DIV ? x.constant / y.constant : x.constant % y.constant,
+                    {}
+                };
+            }
+            auto divided = Divide(x, y.constant);
+            if(!divided)
+                return std::nullopt;
+            return i.op == IntArithmeticInsn::Op::DIV ? divided->first : divided->second;
+        }
+        default:
+            return std::nullopt;
+        }
+    }
+
+    std::optional<Range> OpaqueRange(const IntArithmeticInsn &i) const
+    {
+        auto x = GetRange(*affine[i.x]);
+        auto y = GetRange(*affine[i.y]);
+        if(!x || !y || x->lo < 0 || y->lo <= 0)
+            return std::nullopt;
+        switch(i.op)
+        {
+        case IntArithmeticInsn::Op::MUL:
+            return Range{ x->lo * y->lo, x->hi * y->hi };
+        case IntArithmeticInsn::Op::DIV:
+            return Range{ x->lo / y->hi, x->hi / y->lo };
+        case IntArithmeticInsn::Op::MOD:
+            return Range{ 0, std::min(x->hi, y->hi - 1) };
+        default:
+            return std::nullopt;
+        }
+    }
+};
+
+Analysis Analyze(const FunctionBuilder &f)
+{
+    size_t num_insns = f.insns.size();
+    Analysis result =
+    {
+        .affine = std::vector<std::optional<Affine>>(num_insns),
+        .atom_ranges = std::vector<std::optional<Range>>(num_insns),
+        .is_atom = std::vector<bool>(num_insns, false),
+        .uses = {},
+    };
+    for(size_t iinsn = 0; iinsn < num_insns; iinsn++)
+    {
+        const Instruction &insn = f.insns[iinsn];
+        if(auto *i = std::get_if<LoadIntImmediateInsn>(&insn))
+        {
+            result.affine[iinsn] = Affine{ i->value, {} };
+        }
+        else if(auto *i = std::get_if<BeginLoopInsn>(&insn))
+        {
+            result.affine[iinsn] = Affine::Atom(iinsn);
+            result.atom_ranges[iinsn] = Range{ 0, i->range - 1 };
+            result.is_atom[iinsn] = true;
+        }
+        else if(auto *i = std::get_if<IntArithmeticInsn>(&insn))
+        {
+            if(auto simplified = result.Simplify(*i))
+            {
+                result.affine[iinsn] = std::move(simplified);
+                continue;
+            }
+            result.affine[iinsn] = Affine::Atom(iinsn);
+            result.atom_ranges[iinsn] = result.OpaqueRange(*i);
+            result.is_atom[iinsn] = true;
+        }
+
+        size_t slot = 0;
+        ForEachIntOperand(const_cast<Instruction &>(insn), [&](size_t operand)
+        {
+            result.uses[iinsn * 2 + slot++] = *result.affine[operand];
+        });
+    }
+    return result;
+}
+
+}
+
+// Rebuilds the integer arithmetic of a function from its affine form. Every use of an
+// index becomes a chain of partial sums c + a0*atom0 + a1*atom1 + ..., where each partial
+// sum is emitted right after the atom it adds (i.e. at the top of that atom's loop), and
+// shared between all uses with the same prefix. This constant folds, turns div/mod of
+// the loop variables into plain multiply-adds, and hoists loop invariant terms.
+void SimplifyIndexArithmetic(FunctionBuilder &f)
+{
+    Analysis analysis = Analyze(f);
+
+    // Determine which partial sums we need and after which atom to emit them
+    std::map<std::vector<int64_t>, size_t> prefix_values; // Partial sum -> new insn index
+    std::map<size_t, std::vector<Affine>> prefixes_after_atom;
+    std::vector<int64_t> constants;
+    for(const auto &[_, use] : analysis.uses)
+    {
+        Affine prefix = { use.constant, {} };
+        if(use.constant != 0 || use.IsConstant())
+            constants.push_back(use.constant);
+        for(auto [atom, coef] : use.terms)
+        {
+            prefix.terms.push_back({ atom, coef });
+            if(prefix_values.emplace(prefix.Key(), -1).second)
+            {
+                prefixes_after_atom[atom].push_back(prefix);
+                constants.push_back(coef);
+            }
+        }
+    }
+    std::sort(constants.begin(), constants.end());
+    constants.erase(std::unique(constants.begin(), constants.end()), constants.end());
+
+    std::vector<Instruction> insns;
+    auto emit = [&](Instruction insn)
+    {
+        insns.emplace_back(std::move(insn));
+        return insns.size() - 1;
+    };
+
+    std::map<int64_t, size_t> constant_values;
+    for(int64_t c : constants)
+    {
+        constant_values[c] = emit(LoadIntImmediateInsn{ c });
+        prefix_values[Affine{ c, {} }.Key()] = constant_values[c];
+    }
+
+    std::vector<size_t> remap(f.insns.size(), -1);
+    auto emit_prefixes = [&](size_t atom)
+    {
+        for(const Affine &prefix : prefixes_after_atom[atom])
+        {
+            auto [_, coef] = prefix.terms.back();
+            size_t term = coef == 1
+                ? remap[atom]
+                : emit(IntArithmeticInsn{ IntArithmeticInsn::Op::MUL, remap[atom], constant_values[coef] });
+
+            Affine parent = prefix;
+            parent.terms.pop_back();
+            size_t value = parent.IsConstant() && parent.constant == 0
+                ? term
+                : emit(IntArithmeticInsn{ IntArithmeticInsn::Op::ADD, prefix_values[parent.Key()], term });
+            prefix_values[prefix.Key()] = value;
+        }
+    };
+
+    for(size_t iinsn = 0; iinsn < f.insns.size(); iinsn++)
+    {
+        Instruction insn = f.insns[iinsn];
+        if(analysis.affine[iinsn] && !analysis.is_atom[iinsn])
+            continue; // Folded into the affine expressions of its users
+
+        size_t slot = 0;
+        ForEachIntOperand(insn, [&](size_t &operand)
+        {
+            operand = prefix_values[analysis.uses[iinsn * 2 + slot++].Key()];
+        });
+        ForEachFloatOperand(insn, [&](size_t &operand) { operand = remap[operand]; });
+        remap[iinsn] = emit(std::move(insn));
+        if(analysis.is_atom[iinsn])
+            emit_prefixes(iinsn);
+    }
+    f.insns = std::move(insns);
+}
+
+// Key of the value computed by a side-effect free instruction
+static std::optional<std::vector<int64_t>> ValueKey(const Instruction &insn)
+{
+    auto index = static_cast<int64_t>(insn.index());
+    if(auto *i = std::get_if<LoadIntImmediateInsn>(&insn))
+        return std::vector<int64_t>{ index, i->value };
+    if(auto *i = std::get_if<IntArithmeticInsn>(&insn))
+        return std::vector<int64_t>{ index, static_cast<int64_t>(i->op), static_cast<int64_t>(i->x), static_cast<int64_t>(i->y) };
+    if(auto *i = std::get_if<LoadInsn>(&insn))
+        return std::vector<int64_t>{ index, static_cast<int64_t>(i->input), static_cast<int64_t>(i->idx) };
+    if(auto *i = std::get_if<LoadImmediateInsn>(&insn))
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &i->value, sizeof(bits));
+        return std::vector<int64_t>{ index, bits };
+    }
+    if(auto *i = std::get_if<UnaryInsn>(&insn))
+        return std::vector<int64_t>{ index, static_cast<int64_t>(i->type), static_cast<int64_t>(i->x) };
+    if(auto *i = std::get_if<BinaryInsn>(&insn))
+        return std::vector<int64_t>{ index, static_cast<int64_t>(i->type), static_cast<int64_t>(i->x), static_cast<int64_t>(i->y) };
+    return std::nullopt;
+}
+
+// Replaces instructions that recompute a value that's still available with that value.
+// A value is available until the end of the loop it was computed in, and loads only until
+// the next store, since the output may alias an input. Accumulators change as the loop
+// runs, so neither they nor anything computed from them are ever shared.
+void EliminateCommonSubexpressions(FunctionBuilder &f)
+{
+    std::unordered_set<size_t> accumulators;
+    for(const Instruction &insn : f.insns)
+        if(auto *accumulate = std::get_if<AccumulateInsn>(&insn))
+            accumulators.insert(accumulate->accumulator);
+
+    std::vector<Instruction> insns;
+    std::vector<size_t> remap(f.insns.size(), -1);
+    std::unordered_set<size_t> mutable_values; // New indices of the accumulators
+    std::map<std::vector<int64_t>, size_t> available;
+    std::vector<std::vector<std::vector<int64_t>>> scopes(1);
+    std::vector<std::vector<int64_t>> loads;
+    for(size_t iinsn = 0; iinsn < f.insns.size(); iinsn++)
+    {
+        Instruction insn = f.insns[iinsn];
+        bool reads_mutable = false;
+        ForEachIntOperand(insn, [&](size_t &operand) { operand = remap[operand]; });
+        ForEachFloatOperand(insn, [&](size_t &operand)
+        {
+            operand = remap[operand];
+            reads_mutable = reads_mutable || mutable_values.contains(operand);
+        });
+
+        std::optional<std::vector<int64_t>> key;
+        if(!accumulators.contains(iinsn) && !reads_mutable)
+            key = ValueKey(insn);
+        if(key)
+        {
+            if(auto existing = available.find(*key); existing != available.end())
+            {
+                remap[iinsn] = existing->second;
+                continue;
+            }
+        }
+
+        insns.emplace_back(std::move(insn));
+        remap[iinsn] = insns.size() - 1;
+        if(accumulators.contains(iinsn))
+            mutable_values.insert(remap[iinsn]);
+
+        const Instruction &emitted = insns.back();
+        if(key)
+        {
+            available[*key] = remap[iinsn];
+            scopes.back().push_back(*key);
+            if(std::holds_alternative<LoadInsn>(emitted))
+                loads.push_back(*key);
+        }
+        else if(std::holds_alternative<BeginLoopInsn>(emitted))
+        {
+            scopes.emplace_back();
+        }
+        else if(std::holds_alternative<EndLoopInsn>(emitted))
+        {
+            for(const auto &scoped : scopes.back())
+                available.erase(scoped);
+            scopes.pop_back();
+        }
+        else if(std::holds_alternative<StoreInsn>(emitted))
+        {
+            for(const auto &load : loads)
+                available.erase(load);
+            loads.clear();
+        }
+    }
+    f.insns = std::move(insns);
+}
+
+FunctionCost EstimateCost(const Program &prog, const FunctionBuilder &f)
+{
+    FunctionCost cost = { 0.0, 0.0 };
+    std::vector<double> trip_counts = { 1.0 };
+    for(const Instruction &insn : f.insns)
+    {
+        if(auto *loop = std::get_if<BeginLoopInsn>(&insn))
+        {
+            trip_counts.push_back(trip_counts.back() * loop->range);
+        }
+        else if(std::holds_alternative<EndLoopInsn>(insn))
+        {
+            trip_counts.pop_back();
+        }
+        else if(std::holds_alternative<UnaryInsn>(insn)
+                || std::holds_alternative<BinaryInsn>(insn)
+                || std::holds_alternative<AccumulateInsn>(insn))
+        {
+            cost.flops += trip_counts.back();
+        }
+        else if(auto *matmul = std::get_if<MatmulInsn>(&insn))
+        {
+            double batch = std::accumulate(
+                matmul->batch_shape.begin(),
+                matmul->batch_shape.end(),
+                1.0,
+                std::multiplies{});
+            cost.flops += 2.0 * batch * matmul->M * matmul->K * matmul->N;
+        }
+    }
+
+    for(size_t input : f.inputs)
+        cost.bytes += prog.buffers[input].size_elts * SizeOf(prog.buffers[input].dtype);
+    for(size_t ioutput = 0; ioutput < f.NumOutputs(); ioutput++)
+    {
+        const BufferDescriptor &output = prog.buffers[f.OutputBuffer(ioutput)];
+        cost.bytes += output.size_elts * SizeOf(output.dtype);
+    }
+    return cost;
+}
+
+GridPlan PlanGrid(const FunctionBuilder &f)
+{
+    GridPlan plan;
+    plan.grid_loop = f.insns.size();
+    plan.grid = 1;
+    plan.is_distributed.assign(f.insns.size(), false);
+    plan.reductions.resize(f.insns.size());
+    bool has_matmul = std::any_of(
+        f.insns.begin(),
+        f.insns.end(),
+        [](const Instruction &insn) { return std::holds_alternative<MatmulInsn>(insn); });
+    if(has_matmul)
+    {
+        plan.mode = GridPlan::Mode::Matmul;
+        return plan;
+    }
+
+    struct OpenLoop
+    {
+        size_t begin;
+        dim_t max_inner_range; // Of the loops directly inside of it
+        std::vector<std::pair<size_t, ReduceOpType>> reductions;
+    };
+    std::vector<OpenLoop> open_loops;
+    std::vector<OpenLoop> top_level_loops;
+    std::vector<size_t> loop_ends(f.insns.size(), 0);
+    std::vector<size_t> depths(f.insns.size(), 0);
+    bool has_insns_after_loops = false;
+    for(size_t iinsn = 0; iinsn < f.insns.size(); iinsn++)
+    {
+        const Instruction &insn = f.insns[iinsn];
+        if(std::holds_alternative<BeginLoopInsn>(insn))
+        {
+            dim_t range = std::get<BeginLoopInsn>(insn).range;
+            if(!open_loops.empty())
+                open_loops.back().max_inner_range = std::max(open_loops.back().max_inner_range, range);
+            depths[iinsn] = open_loops.size();
+            open_loops.push_back({ iinsn, 0, {} });
+        }
+        else if(auto *accum = std::get_if<AccumulateInsn>(&insn))
+        {
+            // Accumulators are declared before the loops they reduce over
+            for(OpenLoop &loop : open_loops)
+                if(accum->accumulator < loop.begin)
+                    loop.reductions.push_back({ accum->accumulator, accum->type });
+        }
+        else if(std::holds_alternative<EndLoopInsn>(insn))
+        {
+            OpenLoop loop = std::move(open_loops.back());
+            open_loops.pop_back();
+            loop_ends[loop.begin] = iinsn;
+            std::sort(loop.reductions.begin(), loop.reductions.end());
+            loop.reductions.erase(std::unique(loop.reductions.begin(), loop.reductions.end()), loop.reductions.end());
+            plan.reductions[iinsn] = loop.reductions;
+            if(open_loops.empty())
+                top_level_loops.push_back(std::move(loop));
+        }
+        else if(open_loops.empty() && !top_level_loops.empty())
+        {
+            has_insns_after_loops = true;
+        }
+    }
+
+    size_t distributed_depth = 0;
+    plan.mode = GridPlan::Mode::Single;
+    if(top_level_loops.size() == 1 && top_level_loops[0].reductions.empty() && !has_insns_after_loops)
+    {
+        plan.grid_loop = top_level_loops[0].begin;
+        plan.grid = std::get<BeginLoopInsn>(f.insns[plan.grid_loop]).range;
+        // Splitting the inner loops only pays off if there's at least a warp's worth of work
+        bool has_wide_inner_loop = top_level_loops[0].max_inner_range >= GridPlan::MinGroupWork;
+        plan.mode = has_wide_inner_loop ? GridPlan::Mode::Group : GridPlan::Mode::Flat;
+        distributed_depth = 1;
+    }
+    if(plan.mode == GridPlan::Mode::Flat)
+        return plan;
+
+    for(size_t iinsn = 0; iinsn < f.insns.size(); iinsn++)
+    {
+        if(std::holds_alternative<BeginLoopInsn>(f.insns[iinsn]) && depths[iinsn] == distributed_depth)
+        {
+            plan.is_distributed[iinsn] = true;
+            plan.is_distributed[loop_ends[iinsn]] = true;
+        }
+    }
+    return plan;
+}
+
+// Same as the generated code computes it
+static float FoldUnary(UnaryOpType type, float x)
+{
+    switch(type)
+    {
+    case UnaryOpType::EXP:
+        return static_cast<float>(std::exp(static_cast<double>(x)));
+    case UnaryOpType::LOG:
+        return static_cast<float>(std::log(static_cast<double>(x)));
+    case UnaryOpType::SIN:
+        return static_cast<float>(std::sin(static_cast<double>(x)));
+    case UnaryOpType::SQRT:
+        return std::sqrt(x);
+    default:
+        return x;
+    }
+}
+
+static float FoldBinary(BinaryOpType type, float x, float y)
+{
+    switch(type)
+    {
+    case BinaryOpType::ADD:
+        return x + y;
+    case BinaryOpType::SUB:
+        return x - y;
+    case BinaryOpType::MUL:
+        return x * y;
+    case BinaryOpType::DIV:
+        return x / y;
+    case BinaryOpType::POW:
+        return static_cast<float>(std::pow(static_cast<double>(x), static_cast<double>(y)));
+    case BinaryOpType::CMP:
+        return static_cast<float>(x == y);
+    case BinaryOpType::MAX:
+        return x > y ? x : y;
+    default:
+        return x;
+    }
+}
+
+static bool IsImmediate(GraphNodeHandle node, float value)
+{
+    return node->Kind() == GraphNode::Kind::Immediate && node->u.i.immediate.value == value;
+}
+
+// A view of `inner` (a view itself) as a single view of inner's input. The outer view
+// indexes the contiguous layout of the inner one, which is the same as indexing its
+// input if no dimension of the outer view carries across a dimension of the inner one.
+static std::optional<GraphNodeHandle> ComposeViews(GraphNodeHandle inner, const ViewOp &outer)
+{
+    const ViewOp &v = inner->u.v.view_op;
+    const Shape &contiguous = inner.strides();
+    dim_t size = std::accumulate(v.shape.begin(), v.shape.end(), dim_t{1}, std::multiplies{});
+    if(outer.offset < 0 || (outer.offset >= size && size != 0))
+        return std::nullopt;
+
+    // The coordinates of the outer view's first element, and the largest it reaches
+    Shape reach(v.shape.size());
+    for(size_t d = 0; d < v.shape.size(); d++)
+        reach[d] = (outer.offset / contiguous[d]) % v.shape[d];
+    dim_t offset = v.offset;
+    for(size_t d = 0; d < v.shape.size(); d++)
+        offset += reach[d] * v.strides[d];
+
+    Shape strides(outer.shape.size(), 0);
+    for(size_t e = 0; e < outer.shape.size(); e++)
+    {
+        dim_t stride = outer.strides[e];
+        if(outer.shape[e] == 1 || stride == 0)
+            continue;
+        // The inner dimension that the stride steps along
+        size_t d = 0;
+        while(d < v.shape.size() && !(contiguous[d] <= stride && stride < contiguous[d] * v.shape[d]))
+            d++;
+        if(stride < 0 || d == v.shape.size() || stride % contiguous[d] != 0)
+            return std::nullopt;
+        dim_t step = stride / contiguous[d];
+        reach[d] += step * (outer.shape[e] - 1);
+        strides[e] = step * v.strides[d];
+    }
+    for(size_t d = 0; d < v.shape.size(); d++)
+        if(reach[d] >= v.shape[d])
+            return std::nullopt;
+    return inner.graph->AddNode(ViewOp{ v.x, outer.shape, std::move(strides), offset });
+}
+
+static GraphNodeHandle Simplify(GraphNodeHandle node, std::unordered_map<size_t, GraphNodeHandle> &simplified)
+{
+    if(auto it = simplified.find(node.node_idx); it != simplified.end())
+        return it->second;
+
+    Graph &graph = *node.graph;
+    const Shape &shape = node.shape();
+    // Replacements have to keep the shape, and can't be broadcast up to it
+    auto same_shape = [&](GraphNodeHandle x) { return x.shape() == shape; };
+    GraphNodeHandle result = node;
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::UnaryOp:
+    {
+        const UnaryOp &u = node->u.u.unary_op;
+        GraphNodeHandle x = Simplify(u.x, simplified);
+        bool is_inverse = x->Kind() == GraphNode::Kind::UnaryOp
+            && ((u.type == UnaryOpType::EXP && x->u.u.unary_op.type == UnaryOpType::LOG)
+                || (u.type == UnaryOpType::LOG && x->u.u.unary_op.type == UnaryOpType::EXP));
+        if(x->Kind() == GraphNode::Kind::Immediate)
+            result = graph.Immediate(FoldUnary(u.type, x->u.i.immediate.value));
+        else if(u.type == UnaryOpType::NOP)
+            result = x;
+        else if(is_inverse)
+            result = x->u.u.unary_op.x;
+        else if(x.node_idx != u.x.node_idx)
+            result = graph.AddNode(UnaryOp{ u.type, x });
+        break;
+    }
+    case GraphNode::Kind::BinaryOp:
+    {
+        const BinaryOp &b = node->u.b.binary_op;
+        GraphNodeHandle x = Simplify(b.x, simplified);
+        GraphNodeHandle y = Simplify(b.y, simplified);
+        bool is_negation = b.type == BinaryOpType::SUB && IsImmediate(x, 0.0f);
+        bool is_double_negation = is_negation
+            && y->Kind() == GraphNode::Kind::BinaryOp
+            && y->u.b.binary_op.type == BinaryOpType::SUB
+            && IsImmediate(y->u.b.binary_op.x, 0.0f)
+            && same_shape(y->u.b.binary_op.y);
+        bool is_identity = x.node_idx == y.node_idx && b.type == BinaryOpType::MAX;
+        if(x->Kind() == GraphNode::Kind::Immediate && y->Kind() == GraphNode::Kind::Immediate)
+            result = graph.Immediate(FoldBinary(b.type, x->u.i.immediate.value, y->u.i.immediate.value));
+        else if(is_double_negation)
+            result = y->u.b.binary_op.y;
+        else if(b.type == BinaryOpType::ADD && IsImmediate(y, 0.0f) && same_shape(x))
+            result = x;
+        else if(b.type == BinaryOpType::ADD && IsImmediate(x, 0.0f) && same_shape(y))
+            result = y;
+        else if(b.type == BinaryOpType::SUB && IsImmediate(y, 0.0f) && same_shape(x))
+            result = x;
+        else if(b.type == BinaryOpType::MUL && IsImmediate(y, 1.0f) && same_shape(x))
+            result = x;
+        else if(b.type == BinaryOpType::MUL && IsImmediate(x, 1.0f) && same_shape(y))
+            result = y;
+        else if((b.type == BinaryOpType::DIV || b.type == BinaryOpType::POW) && IsImmediate(y, 1.0f) && same_shape(x))
+            result = x;
+        else if(is_identity)
+            result = x;
+        else if(x.node_idx != b.x.node_idx || y.node_idx != b.y.node_idx)
+            result = graph.AddNode(BinaryOp{ b.type, x, y });
+        break;
+    }
+    case GraphNode::Kind::ReduceOp:
+    {
+        const ReduceOp &r = node->u.r.reduce_op;
+        GraphNodeHandle x = Simplify(r.x, simplified);
+        if(x.node_idx != r.x.node_idx)
+            result = graph.AddNode(ReduceOp{ r.type, x, r.dims, r.keepdim });
+        break;
+    }
+    case GraphNode::Kind::ViewOp:
+    {
+        const ViewOp &v = node->u.v.view_op;
+        GraphNodeHandle x = Simplify(v.x, simplified);
+        bool is_identity = v.offset == 0 && v.shape == x.shape() && v.strides == x.strides();
+        std::optional<GraphNodeHandle> composed;
+        if(x->Kind() == GraphNode::Kind::ViewOp)
+            composed = ComposeViews(x, v);
+        if(is_identity)
+            result = x;
+        else if(composed)
+            result = Simplify(*composed, simplified);
+        else if(x.node_idx != v.x.node_idx)
+            result = graph.AddNode(ViewOp{ x, v.shape, v.strides, v.offset });
+        break;
+    }
+    default:
+        break;
+    }
+    simplified[node.node_idx] = result;
+    return result;
+}
+
+std::vector<GraphNodeHandle> SimplifyGraph(const std::vector<GraphNodeHandle> &roots)
+{
+    std::unordered_map<size_t, GraphNodeHandle> simplified;
+    std::vector<GraphNodeHandle> result;
+    for(GraphNodeHandle root : roots)
+        result.push_back(Simplify(root, simplified));
+    return result;
+}
+
+}
+}
@@ -1,9 +1,10 @@
 #pragma once
 #include "backend.h"
+#include "codegen.h"
 
 namespace gigagrad
 {
 
-void Eval(codegen::GraphEvalFn fn, std::vector<codegen::BufferDescriptor> buffer_descs);
+void Eval(codegen::GraphEvalFn fn, const codegen::Program &program);
 
 }
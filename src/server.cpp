@@ -0,0 +1,143 @@
+#include "server.h"
+#include "codegen.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <numeric>
+#include <stdexcept>
+
+using namespace gigagrad;
+
+static size_t RowElements(const Shape &shape)
+{
+    return std::accumulate(shape.begin() + 1, shape.end(), size_t{1}, std::multiplies{});
+}
+
+BatchingServer::BatchingServer(CompiledTensor &compiled, std::vector<GraphNodeHandle> inputs, Options options)
+    : compiled(compiled), inputs(std::move(inputs)), options(options)
+{
+    if(this->inputs.empty())
+        throw std::domain_error("BatchingServer needs at least one batched input");
+    this->max_batch = this->inputs[0].shape()[0];
+    for(GraphNodeHandle input : this->inputs)
+    {
+        bool is_batched = input->Kind() == GraphNode::Kind::Tensor && input->u.t.tensor.is_batched;
+        if(!is_batched || input->u.t.tensor.dtype != DType::F32)
+            throw std::domain_error("BatchingServer inputs must be batched F32 inputs");
+        if(static_cast<size_t>(input.shape()[0]) != this->max_batch)
+            throw std::domain_error("BatchingServer inputs have different batch dimensions");
+        this->input_row_elts.push_back(RowElements(input.shape()));
+        this->staging.emplace_back(this->max_batch * this->input_row_elts.back());
+    }
+    const codegen::Program *program = this->compiled.backend->GetProgram();
+    if(program && static_cast<size_t>(program->max_batch) != this->max_batch)
+        throw std::domain_error("BatchingServer inputs aren't the batched inputs of the program");
+    if(this->compiled.shape.empty() || static_cast<size_t>(this->compiled.shape[0]) != this->max_batch)
+        throw std::domain_error("BatchingServer needs a program whose output is batched");
+    this->output_row_elts = RowElements(this->compiled.shape);
+
+    this->server = std::thread([this]() { this->ServeLoop(); });
+}
+
+BatchingServer::~BatchingServer()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->submitted.notify_all();
+    this->server.join();
+}
+
+std::future<std::vector<float>> BatchingServer::Submit(std::vector<std::vector<float>> example)
+{
+    if(example.size() != this->inputs.size())
+        throw std::domain_error("Example needs one row per batched input");
+    for(size_t i = 0; i < example.size(); i++)
+        if(example[i].size() != this->input_row_elts[i])
+            throw std::domain_error("Example row doesn't match the shape of its input");
+
+    Request request = { std::move(example), {}, std::chrono::steady_clock::now() };
+    auto result = request.result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->requests.push_back(std::move(request));
+    }
+    this->submitted.notify_one();
+    return result;
+}
+
+size_t BatchingServer::NumBatchesRun() const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->batches_run;
+}
+
+void BatchingServer::CountBatch()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->batches_run++;
+}
+
+void BatchingServer::ServeLoop()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for(;;)
+    {
+        this->submitted.wait(lock, [this]() { return this->stopping || !this->requests.empty(); });
+        if(this->requests.empty())
+            return;
+
+        // Wait for the batch to fill up, unless we're draining the queue
+        auto deadline = this->requests.front().arrival + this->options.max_delay;
+        this->submitted.wait_until(lock, deadline, [this]()
+        {
+            return this->stopping || this->requests.size() >= this->max_batch;
+        });
+
+        size_t batch_size = std::min(this->requests.size(), this->max_batch);
+        std::vector<Request> batch;
+        batch.reserve(batch_size);
+        for(size_t i = 0; i < batch_size; i++)
+        {
+            batch.push_back(std::move(this->requests.front()));
+            this->requests.pop_front();
+        }
+
+        lock.unlock();
+        this->RunBatch(batch);
+        lock.lock();
+    }
+}
+
+void BatchingServer::RunBatch(std::vector<Request> &batch)
+{
+    try
+    {
+        for(size_t iinput = 0; iinput < this->inputs.size(); iinput++)
+        {
+            size_t row_elts = this->input_row_elts[iinput];
+            float *staged = this->staging[iinput].data();
+            for(size_t irow = 0; irow < batch.size(); irow++)
+                std::memcpy(staged + irow * row_elts, batch[irow].example[iinput].data(), row_elts * sizeof(float));
+            this->inputs[iinput].data() = staged;
+        }
+        this->compiled.Execute(batch.size());
+    }
+    catch(...)
+    {
+        this->CountBatch();
+        for(Request &request : batch)
+            request.result.set_exception(std::current_exception());
+        return;
+    }
+
+    // Counted before any future is ready, so that a client sees its own batch
+    this->CountBatch();
+    for(size_t irow = 0; irow < batch.size(); irow++)
+    {
+        const float *row = this->compiled.data + irow * this->output_row_elts;
+        batch[irow].result.set_value(std::vector<float>(row, row + this->output_row_elts));
+    }
+}
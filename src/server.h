@@ -0,0 +1,72 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "graph.h"
+
+namespace gigagrad
+{
+
+// Serves single examples through a program compiled with batched inputs (see
+// Graph::AddBatchedInput). Concurrent requests are coalesced on a background thread into
+// batches of up to the inputs' batch dimension, and a batch is run at the latest
+// `max_delay` after its oldest request arrived, or as soon as it's full. The program runs
+// only as many rows as there are requests, without being recompiled. The server owns the
+// compiled program's batched inputs while it's alive, so nothing else may run it.
+struct BatchingServer
+{
+    struct Options
+    {
+        std::chrono::microseconds max_delay{ 1000 };
+    };
+
+    // `inputs` are the batched inputs of `compiled`, whose output must be batched too
+    BatchingServer(CompiledTensor &compiled, std::vector<GraphNodeHandle> inputs, Options options);
+    ~BatchingServer(); // Finishes the requests that were already submitted
+
+    // Queues an example, given as one row (the shape of an input without its batch
+    // dimension) per input, in the order the inputs were given. The future gets the
+    // example's row of the output. Exceptions thrown by the program are set on the futures
+    // of every request in the batch.
+    std::future<std::vector<float>> Submit(std::vector<std::vector<float>> example);
+
+    size_t MaxBatch() const { return max_batch; }
+    size_t NumBatchesRun() const;
+
+private:
+    struct Request
+    {
+        std::vector<std::vector<float>> example;
+        std::promise<std::vector<float>> result;
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+    void ServeLoop();
+    void RunBatch(std::vector<Request> &batch);
+    void CountBatch();
+
+    CompiledTensor &compiled;
+    std::vector<GraphNodeHandle> inputs;
+    Options options;
+    size_t max_batch;
+    std::vector<size_t> input_row_elts;
+    size_t output_row_elts;
+
+    std::vector<std::vector<float>> staging; // One full batch per input
+
+    mutable std::mutex mutex;
+    std::condition_variable submitted;
+    std::deque<Request> requests;
+    size_t batches_run = 0;
+    bool stopping = false;
+
+    std::thread server;
+};
+
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <compare>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+namespace gigagrad
+{
+
+// A vector that keeps up to N elements inline and only allocates beyond that. Shapes,
+// strides and reduction dims almost never have more than a handful of elements, so this
+// saves a heap allocation for each of them in every graph node. Only for trivially
+// copyable elements, which lets it move them around with memcpy.
+template <typename T, size_t N>
+class SmallVector
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    using value_type = T;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = T &;
+    using const_reference = const T &;
+    using pointer = T *;
+    using const_pointer = const T *;
+    using iterator = T *;
+    using const_iterator = const T *;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    SmallVector() = default;
+    explicit SmallVector(size_t count) { resize(count); }
+    SmallVector(size_t count, const T &value) { resize(count, value); }
+    SmallVector(std::initializer_list<T> values) { assign(values.begin(), values.end()); }
+
+    template <typename It, typename = std::enable_if_t<!std::is_integral_v<It>>>
+    SmallVector(It first, It last) { assign(first, last); }
+
+    SmallVector(const SmallVector &that) { assign(that.begin(), that.end()); }
+
+    SmallVector(SmallVector &&that) noexcept { steal(that); }
+
+    SmallVector &operator=(const SmallVector &that)
+    {
+        if(this != &that)
+            assign(that.begin(), that.end());
+        return *this;
+    }
+
+    SmallVector &operator=(SmallVector &&that) noexcept
+    {
+        if(this != &that)
+        {
+            release();
+            steal(that);
+        }
+        return *this;
+    }
+
+    SmallVector &operator=(std::initializer_list<T> values)
+    {
+        assign(values.begin(), values.end());
+        return *this;
+    }
+
+    ~SmallVector() { release(); }
+
+    template <typename It>
+    void assign(It first, It last)
+    {
+        size_t count = static_cast<size_t>(std::distance(first, last));
+        clear();
+        reserve(count);
+        std::copy(first, last, elements);
+        length = count;
+    }
+
+    iterator begin() { return elements; }
+    iterator end() { return elements + length; }
+    const_iterator begin() const { return elements; }
+    const_iterator end() const { return elements + length; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    size_t size() const { return length; }
+    size_t capacity() const { return allocated; }
+    bool empty() const { return length == 0; }
+
+    T *data() { return elements; }
+    const T *data() const { return elements; }
+    T &operator[](size_t idx) { return elements[idx]; }
+    const T &operator[](size_t idx) const { return elements[idx]; }
+    T &front() { return elements[0]; }
+    const T &front() const { return elements[0]; }
+    T &back() { return elements[length - 1]; }
+    const T &back() const { return elements[length - 1]; }
+
+    T &at(size_t idx)
+    {
+        if(idx >= length)
+            throw std::out_of_range("SmallVector index out of range");
+        return elements[idx];
+    }
+
+    const T &at(size_t idx) const
+    {
+        if(idx >= length)
+            throw std::out_of_range("SmallVector index out of range");
+        return elements[idx];
+    }
+
+    void reserve(size_t count)
+    {
+        if(count <= allocated)
+            return;
+        size_t new_allocated = std::max(count, 2 * allocated);
+        T *new_elements = static_cast<T *>(::operator new(new_allocated * sizeof(T)));
+        std::memcpy(new_elements, elements, length * sizeof(T));
+        if(elements != inline_elements())
+            ::operator delete(elements);
+        elements = new_elements;
+        allocated = new_allocated;
+    }
+
+    void resize(size_t count, const T &value = T())
+    {
+        reserve(count);
+        if(count > length)
+            std::fill(elements + length, elements + count, value);
+        length = count;
+    }
+
+    void clear() { length = 0; }
+
+    void push_back(const T &value)
+    {
+        T copy = value; // `value` may live in this vector
+        reserve(length + 1);
+        elements[length++] = copy;
+    }
+
+    template <typename... Args>
+    T &emplace_back(Args &&...args)
+    {
+        push_back(T(std::forward<Args>(args)...));
+        return back();
+    }
+
+    void pop_back() { length--; }
+
+    iterator insert(const_iterator pos, const T &value) { return insert(pos, size_t{1}, value); }
+
+    iterator insert(const_iterator pos, size_t count, const T &value)
+    {
+        T copy = value;
+        size_t idx = open_gap(pos, count);
+        std::fill(elements + idx, elements + idx + count, copy);
+        return elements + idx;
+    }
+
+    template <typename It, typename = std::enable_if_t<!std::is_integral_v<It>>>
+    iterator insert(const_iterator pos, It first, It last)
+    {
+        // Copy first in case the range is part of this vector
+        SmallVector values(first, last);
+        size_t idx = open_gap(pos, values.size());
+        std::copy(values.begin(), values.end(), elements + idx);
+        return elements + idx;
+    }
+
+    iterator insert(const_iterator pos, std::initializer_list<T> values) { return insert(pos, values.begin(), values.end()); }
+
+    iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        size_t idx = static_cast<size_t>(first - elements);
+        size_t count = static_cast<size_t>(last - first);
+        std::memmove(elements + idx, elements + idx + count, (length - idx - count) * sizeof(T));
+        length -= count;
+        return elements + idx;
+    }
+
+    friend bool operator==(const SmallVector &x, const SmallVector &y)
+    {
+        return std::equal(x.begin(), x.end(), y.begin(), y.end());
+    }
+
+    friend auto operator<=>(const SmallVector &x, const SmallVector &y)
+    {
+        return std::lexicographical_compare_three_way(x.begin(), x.end(), y.begin(), y.end());
+    }
+
+private:
+    T *inline_elements() { return reinterpret_cast<T *>(storage); }
+
+    // Makes room for `count` elements at `pos`, and returns its index
+    size_t open_gap(const_iterator pos, size_t count)
+    {
+        size_t idx = static_cast<size_t>(pos - elements);
+        reserve(length + count);
+        std::memmove(elements + idx + count, elements + idx, (length - idx) * sizeof(T));
+        length += count;
+        return idx;
+    }
+
+    void steal(SmallVector &that)
+    {
+        if(that.elements == that.inline_elements())
+        {
+            elements = inline_elements();
+            allocated = N;
+            std::memcpy(elements, that.elements, that.length * sizeof(T));
+        }
+        else
+        {
+            elements = that.elements;
+            allocated = that.allocated;
+            that.elements = that.inline_elements();
+            that.allocated = N;
+        }
+        length = that.length;
+        that.length = 0;
+    }
+
+    void release()
+    {
+        if(elements != inline_elements())
+            ::operator delete(elements);
+        elements = inline_elements();
+        allocated = N;
+        length = 0;
+    }
+
+    T *elements = inline_elements();
+    size_t length = 0;
+    size_t allocated = N;
+    alignas(T) std::byte storage[N * sizeof(T)];
+};
+
+}
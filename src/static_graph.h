@@ -0,0 +1,599 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+#include "graph.h"
+
+// Graphs whose shapes are known at compile time, evaluated through expression templates
+// instead of generated code. An expression is a tree of node types that carry their shape
+// in the type, so every loop bound and stride is a compile-time constant and the compiler
+// inlines (and for small graphs, unrolls) the whole evaluation. Nothing is allocated:
+// inputs point at the caller's data, and the only memory an expression owns is a
+// std::array inside of each reduction, which holds its results.
+//
+// The ops, their broadcasting and their shapes are those of graph.h, and ToGraph turns an
+// expression into the equivalent runtime graph, so that a model can be checked against (or
+// trained with) any of the backends and then evaluated statically. Shape errors that the
+// runtime graph throws for are compile errors here.
+//
+//     gg::static_graph::Input<16, 4> w;
+//     gg::static_graph::Input<4> x;
+//     auto y = gg::static_graph::softmax<0>(gg::static_graph::relu(w % x));
+//     w.data = w_data;
+//     x.data = x_data;
+//     std::array<float, 16> out = gg::static_graph::Evaluate(y);
+namespace gigagrad
+{
+namespace static_graph
+{
+
+constexpr size_t MaxRank = 8;
+
+struct StaticShape
+{
+    size_t rank = 0;
+    std::array<dim_t, MaxRank> dims = {};
+
+    constexpr dim_t operator[](size_t i) const { return dims[i]; }
+    constexpr size_t size() const
+    {
+        size_t result = 1;
+        for(size_t i = 0; i < rank; i++)
+            result *= dims[i];
+        return result;
+    }
+    constexpr bool operator==(const StaticShape &) const = default;
+
+    Shape ToShape() const { return Shape(dims.begin(), dims.begin() + rank); }
+};
+
+using StaticStrides = std::array<dim_t, MaxRank>;
+
+template <dim_t... Dims>
+constexpr StaticShape MakeShape()
+{
+    static_assert(sizeof...(Dims) <= MaxRank, "Too many dimensions");
+    return { sizeof...(Dims), { Dims... } };
+}
+
+constexpr StaticStrides ContiguousStrides(StaticShape shape)
+{
+    StaticStrides result = {};
+    dim_t stride = 1;
+    for(size_t i = shape.rank; i-- > 0;)
+    {
+        result[i] = stride;
+        stride *= shape[i];
+    }
+    return result;
+}
+
+constexpr dim_t FixDim(dim_t dim, size_t rank)
+{
+    dim_t mod = static_cast<dim_t>(rank);
+    return ((dim % mod) + mod) % mod;
+}
+
+constexpr StaticShape BroadcastShapes(StaticShape x, StaticShape y)
+{
+    StaticShape larger = x.rank > y.rank ? x : y;
+    StaticShape smaller = x.rank > y.rank ? y : x;
+    for(size_t i = 0; i < smaller.rank; i++)
+    {
+        dim_t &dim_x = larger.dims[larger.rank - i - 1];
+        dim_t dim_y = smaller[smaller.rank - i - 1];
+        if(dim_x == 1 && dim_y != 1)
+            dim_x = dim_y;
+        else if(dim_x != dim_y && dim_y != 1)
+            throw std::domain_error("Cannot broadcast incompatible shapes");
+    }
+    return larger;
+}
+
+// Reductions take a bit mask of the dimensions they reduce
+constexpr StaticShape ReducedShape(StaticShape x, unsigned mask, bool keepdim)
+{
+    StaticShape result;
+    for(size_t i = 0; i < x.rank; i++)
+    {
+        if(!(mask & (1u << i)))
+            result.dims[result.rank++] = x[i];
+        else if(keepdim)
+            result.dims[result.rank++] = 1;
+    }
+    return result;
+}
+
+// Resolves a dimension of -1, like GraphNodeHandle::reshape
+constexpr StaticShape ReshapedShape(StaticShape x, StaticShape shape)
+{
+    size_t known = 1;
+    size_t num_implicit_dims = 0;
+    for(size_t i = 0; i < shape.rank; i++)
+    {
+        if(shape[i] == -1)
+            num_implicit_dims++;
+        else
+            known *= shape[i];
+    }
+    if(num_implicit_dims > 1)
+        throw std::domain_error("Reshape can have at most one implicit dimension");
+    for(size_t i = 0; i < shape.rank; i++)
+        if(shape[i] == -1)
+            shape.dims[i] = static_cast<dim_t>(x.size() / known);
+    if(shape.size() != x.size())
+        throw std::domain_error("Reshape number of elements doesn't match that of input tensor");
+    return shape;
+}
+
+inline float ApplyUnary(UnaryOpType type, float x)
+{
+    switch(type)
+    {
+    case UnaryOpType::EXP:
+        return std::exp(x);
+    case UnaryOpType::LOG:
+        return std::log(x);
+    case UnaryOpType::SIN:
+        return std::sin(x);
+    case UnaryOpType::SQRT:
+        return std::sqrt(x);
+    default:
+        return x;
+    }
+}
+
+inline float ApplyBinary(BinaryOpType type, float x, float y)
+{
+    switch(type)
+    {
+    case BinaryOpType::ADD:
+        return x + y;
+    case BinaryOpType::SUB:
+        return x - y;
+    case BinaryOpType::MUL:
+        return x * y;
+    case BinaryOpType::DIV:
+        return x / y;
+    case BinaryOpType::POW:
+        return std::pow(x, y);
+    case BinaryOpType::CMP:
+        return static_cast<float>(x == y);
+    case BinaryOpType::MAX:
+        return x > y ? x : y;
+    default:
+        return x;
+    }
+}
+
+// Every node derives from Expr, and has a static `shape`, a Prepare() that computes its
+// reductions, an Eval(i) that returns element i (in contiguous layout) once prepared, and a
+// Build() that adds it to a runtime graph
+struct Expr
+{
+};
+
+template <typename E>
+concept Expression = std::derived_from<E, Expr>;
+
+// Runtime inputs that ToGraph made so far, by the Input they stand for
+using GraphInputs = std::unordered_map<const void *, GraphNodeHandle>;
+
+template <StaticShape S>
+struct InputNode : Expr
+{
+    static constexpr StaticShape shape = S;
+    const float *data = nullptr;
+};
+
+template <dim_t... Dims>
+using Input = InputNode<MakeShape<Dims...>()>;
+
+// How expressions refer to an Input: by address, so that its data can be set later
+template <StaticShape S>
+struct InputRef : Expr
+{
+    static constexpr StaticShape shape = S;
+    const InputNode<S> *input;
+
+    void Prepare() {}
+    float Eval(size_t i) const { return input->data[i]; }
+
+    GraphNodeHandle Build(Graph &graph, GraphInputs &inputs) const
+    {
+        auto [existing, is_new] = inputs.try_emplace(input);
+        if(is_new)
+        {
+            existing->second = graph.AddInput(S.ToShape());
+            existing->second.data() = const_cast<float *>(input->data);
+        }
+        return existing->second;
+    }
+};
+
+template <typename X>
+struct StoredAs
+{
+    using type = X;
+    static X Store(const X &x) { return x; }
+};
+
+template <StaticShape S>
+struct StoredAs<InputNode<S>>
+{
+    using type = InputRef<S>;
+    static InputRef<S> Store(const InputNode<S> &x) { return { {}, &x }; }
+};
+
+template <typename X>
+using Stored = typename StoredAs<X>::type;
+
+template <Expression X>
+Stored<X> Store(const X &x)
+{
+    return StoredAs<X>::Store(x);
+}
+
+struct Constant : Expr
+{
+    static constexpr StaticShape shape = {};
+    float value;
+
+    void Prepare() {}
+    float Eval(size_t) const { return value; }
+    GraphNodeHandle Build(Graph &graph, GraphInputs &) const { return graph.Immediate(value); }
+};
+
+template <UnaryOpType Type, Expression X>
+struct UnaryNode : Expr
+{
+    static constexpr StaticShape shape = X::shape;
+    X x;
+
+    void Prepare() { x.Prepare(); }
+    float Eval(size_t i) const { return ApplyUnary(Type, x.Eval(i)); }
+    GraphNodeHandle Build(Graph &graph, GraphInputs &inputs) const
+    {
+        return graph.AddNode(UnaryOp{ Type, x.Build(graph, inputs) });
+    }
+};
+
+template <BinaryOpType Type, Expression X, Expression Y>
+struct BinaryNode : Expr
+{
+    static constexpr StaticShape shape = BroadcastShapes(X::shape, Y::shape);
+    X x;
+    Y y;
+
+    // Index into the contiguous operand `operand` of element `i`, where shapes are aligned on
+    // the right and the dimensions an operand is broadcast along don't move it
+    template <StaticShape Operand>
+    static size_t OperandIndex(size_t i)
+    {
+        if constexpr(Operand == shape)
+        {
+            return i;
+        }
+        else
+        {
+            constexpr StaticStrides strides = ContiguousStrides(shape);
+            constexpr StaticStrides operand_strides = ContiguousStrides(Operand);
+            constexpr size_t rank_difference = shape.rank - Operand.rank;
+            size_t result = 0;
+            for(size_t d = 0; d < Operand.rank; d++)
+                if(Operand[d] == shape[d + rank_difference])
+                    result += (i / strides[d + rank_difference]) % shape[d + rank_difference] * operand_strides[d];
+            return result;
+        }
+    }
+
+    void Prepare()
+    {
+        x.Prepare();
+        y.Prepare();
+    }
+    float Eval(size_t i) const
+    {
+        return ApplyBinary(Type, x.Eval(OperandIndex<X::shape>(i)), y.Eval(OperandIndex<Y::shape>(i)));
+    }
+    GraphNodeHandle Build(Graph &graph, GraphInputs &inputs) const
+    {
+        return graph.AddNode(BinaryOp{ Type, x.Build(graph, inputs), y.Build(graph, inputs) });
+    }
+};
+
+// Computes all of its results in Prepare, since every element of its consumers reads them
+template <ReduceOpType Type, unsigned Mask, bool KeepDim, Expression X>
+struct ReduceNode : Expr
+{
+    static constexpr StaticShape shape = ReducedShape(X::shape, Mask, KeepDim);
+    X x;
+    std::array<float, shape.size()> values;
+
+    void Prepare()
+    {
+        // Strides of the output along each dimension of the input, 0 for reduced ones
+        constexpr StaticStrides output_strides = []()
+        {
+            StaticStrides contiguous = ContiguousStrides(shape);
+            StaticStrides result = {};
+            for(size_t i = 0, ioutput = 0; i < X::shape.rank; i++)
+            {
+                bool is_reduced = Mask & (1u << i);
+                if(!is_reduced)
+                    result[i] = contiguous[ioutput];
+                if(!is_reduced || KeepDim)
+                    ioutput++;
+            }
+            return result;
+        }();
+        constexpr StaticStrides input_strides = ContiguousStrides(X::shape);
+
+        x.Prepare();
+        // Like the generated kernels, max starts from 0 as well
+        values.fill(0.0f);
+        for(size_t i = 0; i < X::shape.size(); i++)
+        {
+            size_t output = 0;
+            for(size_t d = 0; d < X::shape.rank; d++)
+                output += (i / input_strides[d]) % X::shape[d] * output_strides[d];
+            float value = x.Eval(i);
+            if constexpr(Type == ReduceOpType::SUM)
+                values[output] += value;
+            else
+                values[output] = values[output] > value ? values[output] : value;
+        }
+    }
+    float Eval(size_t i) const { return values[i]; }
+    GraphNodeHandle Build(Graph &graph, GraphInputs &inputs) const
+    {
+        Dims dims;
+        for(size_t i = 0; i < X::shape.rank; i++)
+            if(Mask & (1u << i))
+                dims.push_back(static_cast<dim_t>(i));
+        GraphNodeHandle input = x.Build(graph, inputs);
+        return Type == ReduceOpType::SUM ? input.sum(std::move(dims), KeepDim) : input.max(std::move(dims), KeepDim);
+    }
+};
+
+template <StaticShape S, StaticStrides Strides, dim_t Offset, Expression X>
+struct ViewNode : Expr
+{
+    static constexpr StaticShape shape = S;
+    X x;
+
+    void Prepare() { x.Prepare(); }
+    float Eval(size_t i) const
+    {
+        if constexpr(Offset == 0 && Strides == ContiguousStrides(S))
+        {
+            return x.Eval(i);
+        }
+        else
+        {
+            constexpr StaticStrides contiguous = ContiguousStrides(S);
+            dim_t index = Offset;
+            for(size_t d = 0; d < S.rank; d++)
+                index += static_cast<dim_t>(i / contiguous[d]) % S[d] * Strides[d];
+            return x.Eval(static_cast<size_t>(index));
+        }
+    }
+    GraphNodeHandle Build(Graph &graph, GraphInputs &inputs) const
+    {
+        Shape strides(Strides.begin(), Strides.begin() + S.rank);
+        return x.Build(graph, inputs).as_strided(S.ToShape(), std::move(strides), Offset);
+    }
+};
+
+template <Expression X>
+Stored<X> AsOperand(const X &x)
+{
+    return Store(x);
+}
+
+inline Constant AsOperand(float x)
+{
+    return { {}, x };
+}
+
+template <typename X>
+using Operand = decltype(AsOperand(std::declval<const X &>()));
+
+// At least one side of a binary op is an expression, the other may be a float
+template <typename X, typename Y>
+concept Operands = (Expression<X> && (Expression<Y> || std::convertible_to<Y, float>))
+    || (Expression<Y> && std::convertible_to<X, float>);
+
+template <BinaryOpType Type, typename X, typename Y>
+BinaryNode<Type, Operand<X>, Operand<Y>> MakeBinary(const X &x, const Y &y)
+{
+    return { {}, AsOperand(x), AsOperand(y) };
+}
+
+template <UnaryOpType Type, Expression X>
+UnaryNode<Type, Stored<X>> MakeUnary(const X &x)
+{
+    return { {}, Store(x) };
+}
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator+(const X &x, const Y &y) { return MakeBinary<BinaryOpType::ADD>(x, y); }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator-(const X &x, const Y &y) { return MakeBinary<BinaryOpType::SUB>(x, y); }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator*(const X &x, const Y &y) { return MakeBinary<BinaryOpType::MUL>(x, y); }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator/(const X &x, const Y &y) { return MakeBinary<BinaryOpType::DIV>(x, y); }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator==(const X &x, const Y &y) { return MakeBinary<BinaryOpType::CMP>(x, y); }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto max(const X &x, const Y &y) { return MakeBinary<BinaryOpType::MAX>(x, y); }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto pow(const X &x, const Y &y) { return MakeBinary<BinaryOpType::POW>(x, y); }
+
+template <Expression X>
+auto operator^(const X &x, float y) { return pow(x, y); }
+
+template <Expression X>
+auto operator-(const X &x) { return 0.0f - x; }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto min(const X &x, const Y &y) { return -max(-x, -y); }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator>(const X &x, const Y &y) { return max(x, y) == x; }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator<(const X &x, const Y &y) { return y > x; }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator<=(const X &x, const Y &y) { return max(x - y, 0.0f) == 0.0f; }
+
+template <typename X, typename Y> requires Operands<X, Y>
+auto operator>=(const X &x, const Y &y) { return min(x - y, 0.0f) == 0.0f; }
+
+template <Expression X>
+auto exp(const X &x) { return MakeUnary<UnaryOpType::EXP>(x); }
+
+template <Expression X>
+auto log(const X &x) { return MakeUnary<UnaryOpType::LOG>(x); }
+
+template <Expression X>
+auto sin(const X &x) { return MakeUnary<UnaryOpType::SIN>(x); }
+
+template <Expression X>
+auto cos(const X &x) { return sin(x + 3.14159265f / 2.0f); }
+
+template <Expression X>
+auto sqrt(const X &x) { return MakeUnary<UnaryOpType::SQRT>(x); }
+
+template <Expression X>
+auto sigmoid(const X &x)
+{
+    auto expx = exp(x);
+    return expx / (1 + expx);
+}
+
+template <Expression X>
+auto relu(const X &x) { return max(x, 0.0f); }
+
+template <unsigned Mask, bool KeepDim, ReduceOpType Type, Expression X>
+ReduceNode<Type, Mask, KeepDim, Stored<X>> MakeReduce(const X &x)
+{
+    return { {}, Store(x), {} };
+}
+
+constexpr unsigned AllDims(size_t rank)
+{
+    return rank == 0 ? 0u : ~0u >> (32 - rank);
+}
+
+template <Expression X>
+auto sum(const X &x) { return MakeReduce<AllDims(X::shape.rank), false, ReduceOpType::SUM>(x); }
+
+template <dim_t Axis, bool KeepDim = false, Expression X>
+auto sum(const X &x) { return MakeReduce<1u << FixDim(Axis, X::shape.rank), KeepDim, ReduceOpType::SUM>(x); }
+
+template <Expression X>
+auto max(const X &x) { return MakeReduce<AllDims(X::shape.rank), false, ReduceOpType::MAX>(x); }
+
+template <dim_t Axis, bool KeepDim = false, Expression X>
+auto max(const X &x) { return MakeReduce<1u << FixDim(Axis, X::shape.rank), KeepDim, ReduceOpType::MAX>(x); }
+
+template <dim_t Axis = -1, Expression X>
+auto softmax(const X &x)
+{
+    auto m = max<Axis, true>(x);
+    auto exp_shifted = exp(x - m);
+    auto sum_exp_shifted = sum<Axis, true>(exp_shifted);
+    return exp_shifted / sum_exp_shifted;
+}
+
+template <StaticShape S, StaticStrides Strides, dim_t Offset, Expression X>
+ViewNode<S, Strides, Offset, Stored<X>> as_strided(const X &x)
+{
+    return { {}, Store(x) };
+}
+
+template <StaticShape S, Expression X>
+auto ReshapeTo(const X &x)
+{
+    constexpr StaticShape shape = ReshapedShape(X::shape, S);
+    return as_strided<shape, ContiguousStrides(shape), 0>(x);
+}
+
+template <dim_t... Dims, Expression X>
+auto reshape(const X &x) { return ReshapeTo<MakeShape<Dims...>()>(x); }
+
+// Reshapes of the operands of matmul, see GraphNodeHandle::matmul
+constexpr std::array<StaticShape, 2> MatmulShapes(StaticShape x, StaticShape y)
+{
+    if(x.rank == 1)
+        x = { 2, { 1, x[0] } };
+    if(y.rank == 1)
+        y = { 2, { y[0], 1 } };
+    if(x.rank < 2 || y.rank < 2 || x.rank == MaxRank || y.rank == MaxRank)
+        throw std::domain_error("Shapes must be at least of size 2 for matmul");
+
+    x.dims[x.rank++] = 1;
+    y.dims[y.rank] = y[y.rank - 1];
+    y.dims[y.rank - 1] = y[y.rank - 2];
+    y.dims[y.rank - 2] = 1;
+    y.rank++;
+    if(x[x.rank - 2] != y[y.rank - 2])
+        throw std::domain_error("Incompatible shapes in matmul");
+    return { x, y };
+}
+
+template <Expression X, Expression Y>
+auto matmul(const X &x, const Y &y)
+{
+    constexpr std::array<StaticShape, 2> shapes = MatmulShapes(X::shape, Y::shape);
+    return sum<-2>(ReshapeTo<shapes[0]>(x) * ReshapeTo<shapes[1]>(y));
+}
+
+template <Expression X, Expression Y>
+auto operator%(const X &x, const Y &y) { return matmul(x, y); }
+
+// Computes every element of `expr` into `output`. Evaluating an expression updates the
+// results of its reductions, so an expression can't be evaluated by two threads at once.
+template <Expression E>
+void Evaluate(E &expr, float *output)
+{
+    expr.Prepare();
+    for(size_t i = 0; i < E::shape.size(); i++)
+        output[i] = expr.Eval(i);
+}
+
+template <Expression E>
+std::array<float, E::shape.size()> Evaluate(E &expr)
+{
+    std::array<float, E::shape.size()> result;
+    Evaluate(expr, result.data());
+    return result;
+}
+
+// Adds the computation of `expr` to `graph`. Each Input becomes an input of the graph that
+// points at the Input's data, and Inputs that `expr` reads more than once become the same
+// input.
+template <Expression E>
+GraphNodeHandle ToGraph(Graph &graph, const E &expr)
+{
+    GraphInputs inputs;
+    return Store(expr).Build(graph, inputs);
+}
+
+}
+}
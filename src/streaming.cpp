@@ -0,0 +1,165 @@
+#include "streaming.h"
+#include "codegen.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <numeric>
+#include <stdexcept>
+
+using namespace gigagrad;
+
+static size_t RowElements(const Shape &shape)
+{
+    return std::accumulate(shape.begin() + 1, shape.end(), size_t{1}, std::multiplies{});
+}
+
+StreamingEvaluator::StreamingEvaluator(CompiledTensor &compiled, std::vector<Source> sources)
+    : compiled(compiled), sources(std::move(sources))
+{
+    if(this->sources.empty())
+        throw std::domain_error("StreamingEvaluator needs at least one batched input");
+    this->chunk_rows = this->sources[0].input.shape()[0];
+    size_t staging_elts = 0;
+    for(const Source &source : this->sources)
+    {
+        GraphNodeHandle input = source.input;
+        bool is_batched = input->Kind() == GraphNode::Kind::Tensor && input->u.t.tensor.is_batched;
+        if(!is_batched)
+            throw std::domain_error("StreamingEvaluator inputs must be batched inputs");
+        if(static_cast<size_t>(input.shape()[0]) != this->chunk_rows)
+            throw std::domain_error("StreamingEvaluator inputs have different batch dimensions");
+        if(static_cast<bool>(source.read) == (source.file != nullptr))
+            throw std::domain_error("Every source needs either a callback or a file");
+        if(source.read && input->u.t.tensor.dtype != DType::F32)
+            throw std::domain_error("Callbacks can only fill F32 inputs");
+
+        size_t row_elts = RowElements(input.shape());
+        this->row_bytes.push_back(row_elts * SizeOf(input->u.t.tensor.dtype));
+        this->staging_offsets.push_back(staging_elts);
+        if(source.read)
+            staging_elts += this->chunk_rows * row_elts;
+        this->last_chunks.emplace_back(source.file ? this->chunk_rows * this->row_bytes.back() : 0);
+    }
+    this->staging[0].resize(staging_elts);
+    this->staging[1].resize(staging_elts);
+
+    if(const codegen::Program *program = this->compiled.backend->GetProgram())
+    {
+        if(static_cast<size_t>(program->max_batch) != this->chunk_rows)
+            throw std::domain_error("StreamingEvaluator inputs aren't the batched inputs of the program");
+        for(const codegen::BufferDescriptor &buffer : program->buffers)
+        {
+            const GraphNodeHandle *tensor = std::get_if<GraphNodeHandle>(&buffer.id);
+            if(!tensor || !(*tensor)->u.t.tensor.is_batched)
+                continue;
+            bool has_source = std::any_of(
+                this->sources.begin(),
+                this->sources.end(),
+                [&](const Source &source) { return source.input.node_idx == tensor->node_idx; });
+            if(!has_source)
+                throw std::domain_error("Every batched input of the program needs a source");
+        }
+    }
+    if(this->compiled.shape.empty() || static_cast<size_t>(this->compiled.shape[0]) != this->chunk_rows)
+        throw std::domain_error("StreamingEvaluator needs a program whose output is batched");
+    this->output_row_elts = RowElements(this->compiled.shape);
+}
+
+size_t StreamingEvaluator::ChunkSize(size_t ichunk, size_t num_rows) const
+{
+    return std::min(this->chunk_rows, num_rows - ichunk * this->chunk_rows);
+}
+
+void StreamingEvaluator::ReadChunk(size_t ichunk, size_t num_rows, size_t istaging)
+{
+    size_t first_row = ichunk * this->chunk_rows;
+    size_t chunk_size = this->ChunkSize(ichunk, num_rows);
+    for(size_t isource = 0; isource < this->sources.size(); isource++)
+    {
+        const Source &source = this->sources[isource];
+        if(source.read)
+            source.read(first_row, chunk_size, this->staging[istaging].data() + this->staging_offsets[isource]);
+    }
+}
+
+void StreamingEvaluator::BindChunk(size_t ichunk, size_t num_rows, size_t istaging)
+{
+    size_t first_row = ichunk * this->chunk_rows;
+    size_t chunk_size = this->ChunkSize(ichunk, num_rows);
+    for(size_t isource = 0; isource < this->sources.size(); isource++)
+    {
+        const Source &source = this->sources[isource];
+        GraphNodeHandle input = source.input;
+        if(source.read)
+        {
+            input.data() = this->staging[istaging].data() + this->staging_offsets[isource];
+            continue;
+        }
+
+        // The Metal and CUDA backends read every row of the batch whatever the chunk size,
+        // so a chunk whose rows would extend past the end of the file is copied out instead
+        size_t offset = source.offset + first_row * this->row_bytes[isource];
+        size_t chunk_bytes = chunk_size * this->row_bytes[isource];
+        size_t size = source.file->size();
+        if(offset > size || chunk_bytes > size - offset)
+            throw std::out_of_range("Rows extend past the end of the file");
+        std::vector<std::byte> &last_chunk = this->last_chunks[isource];
+        if(last_chunk.size() > size - offset)
+        {
+            std::memcpy(last_chunk.data(), source.file->data() + offset, chunk_bytes);
+            input.data() = last_chunk.data();
+        }
+        else
+        {
+            input.data() = const_cast<std::byte *>(source.file->data() + offset);
+        }
+    }
+}
+
+void StreamingEvaluator::Run(size_t num_rows, const WriteFn &write)
+{
+    size_t num_chunks = (num_rows + this->chunk_rows - 1) / this->chunk_rows;
+    if(num_chunks == 0)
+        return;
+
+    this->ReadChunk(0, num_rows, 0);
+    for(size_t ichunk = 0; ichunk < num_chunks; ichunk++)
+    {
+        std::future<void> next;
+        if(ichunk + 1 < num_chunks)
+        {
+            next = std::async(std::launch::async, [this, ichunk, num_rows]()
+            {
+                this->ReadChunk(ichunk + 1, num_rows, (ichunk + 1) % 2);
+            });
+        }
+
+        try
+        {
+            size_t first_row = ichunk * this->chunk_rows;
+            size_t chunk_size = this->ChunkSize(ichunk, num_rows);
+            this->BindChunk(ichunk, num_rows, ichunk % 2);
+            this->compiled.Execute(chunk_size);
+            write(first_row, chunk_size, this->compiled.data);
+            for(size_t isource = 0; isource < this->sources.size(); isource++)
+            {
+                const Source &source = this->sources[isource];
+                if(source.file)
+                {
+                    size_t offset = source.offset + first_row * this->row_bytes[isource];
+                    source.file->Release(offset, chunk_size * this->row_bytes[isource]);
+                }
+            }
+        }
+        catch(...)
+        {
+            if(next.valid())
+                next.wait();
+            throw;
+        }
+        if(next.valid())
+            next.get();
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "graph.h"
+#include "mapped_file.h"
+
+namespace gigagrad
+{
+
+// Evaluates a program compiled with batched inputs (see Graph::AddBatchedInput) over any
+// number of rows, such as a dataset that doesn't fit in memory, one chunk of up to the
+// batch dimension at a time. Every chunk runs only its rows of the program, whose buffers
+// are sized for a single chunk, so memory stays bounded by the batch dimension rather than
+// the size of the data. Inputs stream in from mapped files, in place, or through a callback
+// that fills a staging buffer; the next chunk is read on a background thread while the
+// current one runs. Outputs stream out through a callback, chunk by chunk.
+struct StreamingEvaluator
+{
+    // Writes rows [first_row, first_row + num_rows) of an input to `rows`, as fp32
+    using ReadFn = std::function<void(size_t first_row, size_t num_rows, float *rows)>;
+    // Receives rows [first_row, first_row + num_rows) of the output
+    using WriteFn = std::function<void(size_t first_row, size_t num_rows, const float *rows)>;
+
+    // Where the rows of one of the batched inputs come from: either `read`, for F32 inputs,
+    // or `file`, which holds the rows in the input's dtype from `offset` bytes on. Pages of
+    // the file are released once their chunk is done. Chunks are bound in place, except for
+    // one whose whole batch would extend past the end of the file, which is copied out.
+    struct Source
+    {
+        GraphNodeHandle input;
+        ReadFn read;
+        const MappedFile *file = nullptr;
+        size_t offset = 0;
+    };
+
+    // The sources must cover the batched inputs of `compiled`, whose output must be batched
+    // too. The evaluator rebinds the inputs, so nothing else may run `compiled` meanwhile.
+    StreamingEvaluator(CompiledTensor &compiled, std::vector<Source> sources);
+
+    size_t ChunkRows() const { return chunk_rows; }
+
+    // Runs rows [0, num_rows) in order. Throws what the callbacks throw, after the chunk
+    // that is being read in the background is done.
+    void Run(size_t num_rows, const WriteFn &write);
+
+private:
+    // Points the inputs at chunk `ichunk`, reading the callback sources into staging set
+    // `istaging`
+    void ReadChunk(size_t ichunk, size_t num_rows, size_t istaging);
+    void BindChunk(size_t ichunk, size_t num_rows, size_t istaging);
+    size_t ChunkSize(size_t ichunk, size_t num_rows) const;
+
+    CompiledTensor &compiled;
+    std::vector<Source> sources;
+    size_t chunk_rows;
+    std::vector<size_t> row_bytes; // Per source, in the input's dtype
+    size_t output_row_elts;
+
+    // Two chunks of every callback source: one being run, one being read
+    std::vector<float> staging[2];
+    std::vector<size_t> staging_offsets; // Per source, in elements
+    // Per file source, a whole chunk to copy rows into where the file ends first
+    std::vector<std::vector<std::byte>> last_chunks;
+};
+
+}
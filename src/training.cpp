@@ -1,6 +1,11 @@
 #include "training.h"
 #include "codegen.h"
 
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <unordered_set>
+
 using namespace gigagrad;
 
 struct Gradient
@@ -155,23 +160,325 @@ void Differentiate(BackpropContext &ctx, GraphNodeHandle node, GraphNodeHandle s
     node->Visit([&](auto &&x) { Differentiate(ctx, node, x, seed); });
 }
 
+// Collects the tensors `node` reads that aren't already behind a generated function
+static void CollectTensorReads(
+    const codegen::Program &prog,
+    GraphNodeHandle node,
+    std::unordered_set<size_t> &visited,
+    std::unordered_set<size_t> &tensors)
+{
+    if(prog.node_function_cache.contains(node.node_idx) || !visited.insert(node.node_idx).second)
+        return;
+
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::Tensor:
+        tensors.insert(node.node_idx);
+        break;
+    case GraphNode::Kind::UnaryOp:
+        CollectTensorReads(prog, node->u.u.unary_op.x, visited, tensors);
+        break;
+    case GraphNode::Kind::BinaryOp:
+        CollectTensorReads(prog, node->u.b.binary_op.x, visited, tensors);
+        CollectTensorReads(prog, node->u.b.binary_op.y, visited, tensors);
+        break;
+    case GraphNode::Kind::ReduceOp:
+        CollectTensorReads(prog, node->u.r.reduce_op.x, visited, tensors);
+        break;
+    case GraphNode::Kind::ViewOp:
+        CollectTensorReads(prog, node->u.v.view_op.x, visited, tensors);
+        break;
+    default:
+        break;
+    }
+}
+
+// Returns whether the function generated for `node` (of shape `shape`) may store to `weight`
+// in place, i.e. whether it only reads `weight` at the index it stores to. Reductions that
+// don't fuse into the function's loop nest get functions of their own that run before it,
+// so only views and fusable reductions can read other elements.
+static bool ReadsElementwise(
+    const codegen::Program &prog,
+    GraphNodeHandle node,
+    const Shape &shape,
+    size_t weight,
+    bool elementwise,
+    std::unordered_set<size_t> (&visited)[2])
+{
+    // Materialized nodes get functions of their own too
+    bool is_materialized = prog.materialized_nodes.contains(node.node_idx);
+    if(prog.node_function_cache.contains(node.node_idx) || is_materialized || !visited[elementwise].insert(node.node_idx).second)
+        return true;
+
+    switch(node->Kind())
+    {
+    case GraphNode::Kind::Tensor:
+        return elementwise || node.node_idx != weight;
+    case GraphNode::Kind::UnaryOp:
+        return ReadsElementwise(prog, node->u.u.unary_op.x, shape, weight, elementwise, visited);
+    case GraphNode::Kind::BinaryOp:
+    {
+        const BinaryOp &b = node->u.b.binary_op;
+        return ReadsElementwise(prog, b.x, shape, weight, elementwise && b.x.shape() == node.shape(), visited)
+            && ReadsElementwise(prog, b.y, shape, weight, elementwise && b.y.shape() == node.shape(), visited);
+    }
+    case GraphNode::Kind::ReduceOp:
+    {
+        const ReduceOp &r = node->u.r.reduce_op;
+        if(!r.keepdim || r.x.shape() != shape)
+            return true;
+        return ReadsElementwise(prog, r.x, shape, weight, false, visited);
+    }
+    case GraphNode::Kind::ViewOp:
+        return ReadsElementwise(prog, node->u.v.view_op.x, shape, weight, false, visited);
+    default:
+        return true;
+    }
+}
+
+static size_t NumElements(const Shape &shape)
+{
+    return std::accumulate(shape.begin(), shape.end(), size_t{1}, std::multiplies{});
+}
+
+// Indices into OptimizerState::scalars
+enum OptimizerScalar
+{
+    LearningRate,
+    AdamStepSize,
+    AdamSecondMomentScale,
+    WeightDecayFactor,
+};
+
+// The new values of a weight and its moments, which one function computes and stores in
+// place of the weight and the moments
+struct WeightUpdate
+{
+    std::vector<GraphNodeHandle> values; // The new weight comes first
+    std::vector<GraphNodeHandle> moments; // The tensor each of the other values replaces
+};
+
+static WeightUpdate BuildWeightUpdate(
+    nn::Module &network,
+    const Optimizer &optimizer,
+    OptimizerState &state,
+    GraphNodeHandle weight,
+    GraphNodeHandle gradient)
+{
+    WeightUpdate update;
+    auto scalar = [&](size_t i) { return state.scalars_tensor.as_strided({ 1 }, { 1 }, static_cast<dim_t>(i)); };
+    auto add_moment = [&]()
+    {
+        state.moments.emplace_back(NumElements(weight.shape()), 0.0f);
+        GraphNodeHandle moment = network.AddInput(weight.shape());
+        moment.data() = state.moments.back().data();
+        update.moments.push_back(moment);
+        return moment;
+    };
+
+    if(optimizer.weight_decay != 0.0f && optimizer.type != Optimizer::Type::AdamW)
+        gradient = gradient + optimizer.weight_decay * weight;
+
+    switch(optimizer.type)
+    {
+    case Optimizer::Type::SGD:
+    {
+        if(optimizer.momentum == 0.0f)
+        {
+            update.values = { weight - scalar(LearningRate) * gradient };
+            break;
+        }
+        GraphNodeHandle velocity = optimizer.momentum * add_moment() + gradient;
+        update.values = { weight - scalar(LearningRate) * velocity, velocity };
+        break;
+    }
+    case Optimizer::Type::Adam:
+    case Optimizer::Type::AdamW:
+    {
+        GraphNodeHandle m = optimizer.beta1 * add_moment() + (1.0f - optimizer.beta1) * gradient;
+        GraphNodeHandle v = optimizer.beta2 * add_moment() + (1.0f - optimizer.beta2) * (gradient * gradient);
+        GraphNodeHandle decayed = optimizer.type == Optimizer::Type::AdamW ? weight * scalar(WeightDecayFactor) : weight;
+        GraphNodeHandle step = scalar(AdamStepSize) * m / (sqrt(v * scalar(AdamSecondMomentScale)) + optimizer.epsilon);
+        update.values = { decayed - step, m, v };
+        break;
+    }
+    default:
+        throw std::domain_error("Unknown optimizer");
+    }
+    return update;
+}
+
+// Forgets the functions of the forward pass that compute activations which aren't kept, so
+// that the backward pass generates functions of its own to recompute them. The forward
+// pass's buffers then die with its last reader.
+static void DropActivations(codegen::Program &prog, GraphNodeHandle loss, const CheckpointOptions &options)
+{
+    if(options.keep.empty() && !options.budget_bytes)
+        return;
+
+    std::vector<std::pair<size_t, size_t>> activations; // Function and node, in execution order
+    for(const auto &[node_idx, function] : prog.node_function_cache)
+        if(node_idx != loss.node_idx)
+            activations.push_back({ function, node_idx });
+    std::sort(activations.begin(), activations.end());
+    auto activation_bytes = [&](size_t iactivation)
+    {
+        size_t buffer = prog.functions[activations[iactivation].first].output_buffer;
+        return prog.buffers[buffer].size_elts * sizeof(float);
+    };
+
+    std::vector<bool> is_kept(activations.size(), false);
+    if(!options.keep.empty())
+    {
+        for(size_t i = 0; i < activations.size(); i++)
+            is_kept[i] = std::any_of(
+                options.keep.begin(),
+                options.keep.end(),
+                [&](GraphNodeHandle node) { return node.node_idx == activations[i].second; });
+    }
+    else
+    {
+        // Keeps every stride-th activation, for the smallest stride that fits
+        for(size_t stride = 1; stride <= activations.size(); stride++)
+        {
+            size_t bytes = 0;
+            for(size_t i = stride - 1; i < activations.size(); i += stride)
+                bytes += activation_bytes(i);
+            if(bytes > *options.budget_bytes)
+                continue;
+            for(size_t i = stride - 1; i < activations.size(); i += stride)
+                is_kept[i] = true;
+            break;
+        }
+    }
+
+    for(size_t i = 0; i < activations.size(); i++)
+        if(!is_kept[i])
+            prog.node_function_cache.erase(activations[i].second);
+}
+
+// Gives every gradient a function of its own, and groups the gradients into buckets in the
+// order their functions run
+static std::unique_ptr<DataParallelState> PlanDataParallel(
+    codegen::Program &prog,
+    const std::vector<Gradient> &weight_gradients,
+    const DataParallelOptions &options)
+{
+    struct Computed
+    {
+        size_t function;
+        size_t buffer;
+        size_t size_elts;
+    };
+    std::vector<Computed> computed;
+    for(const Gradient &g : weight_gradients)
+    {
+        // Equal gradients are the same node, and must only be summed once
+        if(!prog.node_function_cache.contains(g.gradient.node_idx))
+            CodegenNode(prog, g.gradient);
+        size_t function = prog.node_function_cache[g.gradient.node_idx];
+        size_t buffer = prog.functions[function].output_buffer;
+        bool is_new = std::none_of(computed.begin(), computed.end(), [&](const Computed &c) { return c.buffer == buffer; });
+        if(is_new)
+            computed.push_back({ function, buffer, NumElements(g.gradient.shape()) });
+    }
+    std::sort(computed.begin(), computed.end(), [](const Computed &x, const Computed &y) { return x.function < y.function; });
+
+    auto result = std::make_unique<DataParallelState>(options.communicator);
+    size_t bucket_bytes = 0;
+    for(const Computed &c : computed)
+    {
+        if(result->buckets.empty() || bucket_bytes >= options.bucket_bytes)
+        {
+            result->buckets.emplace_back();
+            bucket_bytes = 0;
+        }
+        DataParallelState::Bucket &bucket = result->buckets.back();
+        bucket.buffers.push_back(c.buffer);
+        bucket.sizes_elts.push_back(c.size_elts);
+        bucket.last_function = c.function;
+        bucket_bytes += c.size_elts * sizeof(float);
+    }
+    return result;
+}
+
+// Runs the functions one at a time, sending each bucket as soon as its last gradient is
+// computed. Once every bucket has been sent, it waits for all of their sums before running
+// the rest of the functions, which are the updates that read them.
+static void ExecuteDataParallel(codegen::Backend &backend, DataParallelState &state)
+{
+    std::vector<std::future<void>> sent;
+    size_t arrived = 0;
+    for(size_t ifn = 0; ifn < state.num_functions; ifn++)
+    {
+        if(sent.size() == state.buckets.size())
+        {
+            for(; arrived < sent.size(); arrived++)
+                sent[arrived].get();
+        }
+        if(!backend.ExecuteFunction(ifn))
+            throw std::runtime_error("Data-parallel training needs a backend that can run functions one at a time");
+
+        while(sent.size() < state.buckets.size() && state.buckets[sent.size()].last_function == ifn)
+        {
+            const DataParallelState::Bucket &bucket = state.buckets[sent.size()];
+            std::vector<AllReduceQueue::Buffer> buffers;
+            for(size_t i = 0; i < bucket.buffers.size(); i++)
+                buffers.push_back({ static_cast<float *>(backend.GetBuffer(bucket.buffers[i])), bucket.sizes_elts[i] });
+            sent.push_back(state.queue.Start(std::move(buffers)));
+        }
+    }
+    for(; arrived < sent.size(); arrived++)
+        sent[arrived].get();
+}
+
 namespace gigagrad
 {
 
+void TrainingContext::Execute()
+{
+    // Adam's bias corrections are folded into its step size and the scale of its second moment
+    OptimizerState &state = *this->optimizer_state;
+    const Optimizer &optimizer = this->optimizer;
+    state.step++;
+    float step = static_cast<float>(state.step);
+    state.scalars[LearningRate] = optimizer.learning_rate;
+    state.scalars[AdamStepSize] = optimizer.learning_rate / (1.0f - std::pow(optimizer.beta1, step));
+    state.scalars[AdamSecondMomentScale] = 1.0f / (1.0f - std::pow(optimizer.beta2, step));
+    state.scalars[WeightDecayFactor] = 1.0f - optimizer.learning_rate * optimizer.weight_decay;
+    if(this->data_parallel)
+        ExecuteDataParallel(*this->backend, *this->data_parallel);
+    else
+        this->backend->Execute();
+}
+
 TrainingContext CompileTrainingGraph(
     nn::Module &network,
     GraphNodeHandle model_output,
     std::unique_ptr<codegen::Backend> backend,
     float learning_rate)
+{
+    return CompileTrainingGraph(network, model_output, std::move(backend), Optimizer{ .learning_rate = learning_rate }, {});
+}
+
+TrainingContext CompileTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    Optimizer optimizer,
+    DataParallelOptions data_parallel,
+    CheckpointOptions checkpointing)
 {
     GraphNodeHandle training_example = network.AddInput(model_output.shape()); 
     GraphNodeHandle error = model_output - training_example;
     GraphNodeHandle loss = sum(error * error);
-    GraphNodeHandle seed = network.Immediate(learning_rate);
+    GraphNodeHandle seed = network.Immediate(1.0f);
     BackpropContext ctx;
     Differentiate(ctx, loss, seed);
-    CodegenNode(ctx.program, loss);
-    size_t loss_buffer_id = ctx.program.buffers.size() - 1;
+
+    auto state = std::make_unique<OptimizerState>();
+    state->scalars_tensor = network.AddInput(static_cast<dim_t>(OptimizerState::NumScalars));
+    state->scalars_tensor.data() = state->scalars.data();
 
     std::unordered_map<size_t, size_t> weights_to_buffers;
     for(size_t weight : network.weights)
@@ -179,6 +486,61 @@ TrainingContext CompileTrainingGraph(
         size_t node_idx = network.graph.inputs[weight];
         weights_to_buffers[node_idx] = -1;
     }
+
+    // Sum up the contributions to each weight's gradient. Equal contributions are the same
+    // node, so they can't be applied one at a time.
+    std::vector<Gradient> weight_gradients;
+    for(const Gradient &contribution : ctx.gradients)
+    {
+        if(!weights_to_buffers.contains(contribution.input.node_idx))
+            continue;
+        auto existing = std::find_if(
+            weight_gradients.begin(),
+            weight_gradients.end(),
+            [&](const Gradient &g) { return g.input.node_idx == contribution.input.node_idx; });
+        if(existing == weight_gradients.end())
+            weight_gradients.push_back(contribution);
+        else
+            existing->gradient = existing->gradient + contribution.gradient;
+    }
+
+    // Backpropagation leaves a lot to simplify, such as the products with the seed and the
+    // views that undo the views of the forward pass. Kept activations are rewritten along
+    // with the rest, so that they still match their nodes in the simplified graph.
+    std::vector<GraphNodeHandle> to_simplify = { loss };
+    for(const Gradient &g : weight_gradients)
+        to_simplify.push_back(g.gradient);
+    to_simplify.insert(to_simplify.end(), checkpointing.keep.begin(), checkpointing.keep.end());
+    std::vector<GraphNodeHandle> simplified = codegen::SimplifyGraph(to_simplify);
+    loss = simplified[0];
+    for(size_t igrad = 0; igrad < weight_gradients.size(); igrad++)
+        weight_gradients[igrad].gradient = simplified[igrad + 1];
+    std::copy(simplified.begin() + 1 + weight_gradients.size(), simplified.end(), checkpointing.keep.begin());
+
+    // Every gradient has to see the weights from before the step. Where possible the update
+    // is fused into the last kernel of the gradient, which then writes the weight in place:
+    // that is the case once no gradient left to compute reads the weight, and the kernel
+    // itself only reads it elementwise. Whenever no weight qualifies, we materialize a
+    // gradient into its own buffer, which both releases its reads and lets its update
+    // be a plain elementwise one.
+    std::vector<WeightUpdate> updates;
+    std::vector<GraphNodeHandle> roots;
+    for(const auto &[weight, gradient] : weight_gradients)
+    {
+        updates.push_back(BuildWeightUpdate(network, optimizer, *state, weight, gradient));
+        roots.push_back(updates.back().values[0]);
+    }
+
+    // The forward pass is shared by the loss and the gradients, so plan for all of them.
+    // Data-parallel gradients get functions of their own, to be sent from their buffers.
+    roots.push_back(loss);
+    if(data_parallel.communicator)
+        for(const Gradient &g : weight_gradients)
+            roots.push_back(g.gradient);
+    codegen::PlanMaterialization(ctx.program, roots);
+    CodegenNode(ctx.program, loss);
+    size_t loss_buffer_id = ctx.program.buffers.size() - 1;
+    DropActivations(ctx.program, loss, checkpointing);
     for(size_t ibuffer = 0; ibuffer < ctx.program.buffers.size(); ibuffer++)
     {
         const codegen::BufferDescriptor &id = ctx.program.buffers[ibuffer];
@@ -189,27 +551,75 @@ TrainingContext CompileTrainingGraph(
                 weights_to_buffers[tensor.node_idx] = ibuffer;
         }
     }
+    // The new weight and moments are stored in place, in one function
+    auto codegen_update = [&](size_t igrad)
+    {
+        const WeightUpdate &update = updates[igrad];
+        size_t weight_idx = weight_gradients[igrad].input.node_idx;
+        std::vector<size_t> output_buffers = { weights_to_buffers[weight_idx] };
+        for(size_t imoment = 0; imoment < update.moments.size(); imoment++)
+            output_buffers.push_back(ctx.program.AddBuffer(update.moments[imoment], NumElements(update.moments[imoment].shape())));
+        codegen::CodegenNodes(ctx.program, update.values, output_buffers);
+    };
 
-    for(size_t i = 0; i < ctx.gradients.size(); i++)
+    std::unique_ptr<DataParallelState> data_parallel_state;
+    if(data_parallel.communicator)
     {
-        size_t weight_idx = ctx.gradients[i].input.node_idx;
-        if(weights_to_buffers.contains(weight_idx))
-            CodegenNode(ctx.program, ctx.gradients[i].gradient);
+        data_parallel_state = PlanDataParallel(ctx.program, weight_gradients, data_parallel);
+        for(size_t igrad = 0; igrad < weight_gradients.size(); igrad++)
+            codegen_update(igrad);
+        data_parallel_state->num_functions = ctx.program.functions.size();
     }
-    for(size_t i = 0; i < ctx.gradients.size(); i++)
+
+    std::vector<bool> materialized(weight_gradients.size(), false);
+    std::vector<size_t> pending(data_parallel.communicator ? 0 : weight_gradients.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    while(!pending.empty())
     {
-        size_t weight_idx = ctx.gradients[i].input.node_idx;
-        if(weights_to_buffers.contains(weight_idx))
+        auto ready = std::find_if(pending.begin(), pending.end(), [&](size_t igrad)
         {
-            size_t gradient_buffer_idx = weights_to_buffers[weight_idx];
-            auto [weight, gradient] = ctx.gradients[i];
-            CodegenNode(ctx.program, (weight - gradient), gradient_buffer_idx);
+            std::unordered_set<size_t> visited;
+            std::unordered_set<size_t> read_by_others;
+            for(size_t iother : pending)
+            {
+                if(iother != igrad && !materialized[iother])
+                    CollectTensorReads(ctx.program, weight_gradients[iother].gradient, visited, read_by_others);
+            }
+            size_t weight_idx = weight_gradients[igrad].input.node_idx;
+            if(read_by_others.contains(weight_idx))
+                return false;
+            std::unordered_set<size_t> update_visited[2];
+            GraphNodeHandle new_weight = updates[igrad].values[0];
+            return materialized[igrad]
+                || ReadsElementwise(ctx.program, new_weight, new_weight.shape(), weight_idx, true, update_visited);
+        });
+
+        if(ready == pending.end())
+        {
+            auto to_materialize = std::find_if(
+                pending.begin(),
+                pending.end(),
+                [&](size_t igrad) { return !materialized[igrad]; });
+            CodegenNode(ctx.program, weight_gradients[*to_materialize].gradient);
+            materialized[*to_materialize] = true;
+            continue;
         }
+
+        codegen_update(*ready);
+        pending.erase(ready);
     }
     backend->LowerProgram(std::move(ctx.program));
     backend->InitBuffers();
 
     float *loss_buffer = static_cast<float *>(backend->GetBuffer(loss_buffer_id));
-    return { loss_buffer, training_example.data(), std::move(backend) };
+    return {
+        loss_buffer,
+        training_example.data(),
+        std::move(backend),
+        loss_buffer_id,
+        optimizer,
+        std::move(state),
+        std::move(data_parallel_state),
+    };
 }
 }
@@ -1,27 +1,150 @@
 #pragma once
 
+#include <array>
+#include <optional>
+
 #include "graph.h"
 #include "codegen.h"
+#include "communicator.h"
 
 namespace gigagrad
 {
 
+// How a training step turns the gradients into new weights. Each weight gets a single kernel
+// that reads its gradient, optimizer state and weight once, and writes the new state and
+// weight in place. The learning rate is read at every step, so it can follow a schedule
+// without recompiling; the other parameters are compiled in.
+struct Optimizer
+{
+    enum class Type
+    {
+        SGD, // v = momentum * v + g, w -= learning_rate * v
+        Adam,
+        AdamW, // Adam with the weight decay applied to the weight rather than the gradient
+    };
+
+    Type type = Type::SGD;
+    float learning_rate = 0.1f;
+    float momentum = 0.0f; // SGD only. Without momentum, SGD keeps no state.
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+    float epsilon = 1e-8f;
+    float weight_decay = 0.0f; // Added to the gradient as weight_decay * w, except for AdamW
+};
+
+// The state an optimizer keeps across steps
+struct OptimizerState
+{
+    // Recomputed from the Optimizer before every step: the learning rate, Adam's step size
+    // and scale of the second moment (which include the bias corrections), and the factor
+    // AdamW decays weights by
+    static constexpr size_t NumScalars = 4;
+
+    std::array<float, NumScalars> scalars = {};
+    GraphNodeHandle scalars_tensor; // An input of the network, bound to `scalars`
+    std::vector<std::vector<float>> moments; // Bound to inputs of the network, zeroed
+    size_t step = 0;
+};
+
+// Trains one replica of the network per rank of `communicator`. Every rank compiles the same
+// network, starts from the same weights and feeds its own shard of each batch (see
+// DataLoader::Options::rank). Each step sums the gradients over the ranks before updating, so
+// the ranks stay in sync, and the loss is that of the local shard. The gradients are sent in
+// buckets of about `bucket_bytes` as soon as the backward pass has computed them, overlapping
+// communication with the rest of the backward pass. This needs a backend that runs functions
+// one at a time out of host memory, i.e. anything but CUDA.
+struct DataParallelOptions
+{
+    std::shared_ptr<Communicator> communicator; // None trains on a single rank
+    size_t bucket_bytes = size_t{1} << 20;
+};
+
+struct DataParallelState
+{
+    // Gradients that are all-reduced as one message, once function `last_function` is done
+    struct Bucket
+    {
+        std::vector<size_t> buffers;
+        std::vector<size_t> sizes_elts;
+        size_t last_function;
+    };
+
+    explicit DataParallelState(std::shared_ptr<Communicator> communicator) : queue(std::move(communicator)) {}
+
+    std::vector<Bucket> buckets; // In the order the functions run
+    size_t num_functions = 0;
+    AllReduceQueue queue;
+};
+
+// Activation checkpointing, to bound the memory of a training step. Every activation that
+// the forward pass stores and a gradient reads normally stays in memory until the last such
+// gradient is computed. Activations that aren't kept are freed once the forward pass is done
+// with them instead, and the backward pass recomputes them from the nearest kept activations
+// (or the inputs) when it first needs them, at the cost of running that part of the forward
+// pass twice. Only activations that get functions of their own, such as the results of
+// matmuls and reductions, take memory: elementwise ones are recomputed inline regardless.
+struct CheckpointOptions
+{
+    // Activations to keep. If empty, keeps evenly spaced activations, at the largest density
+    // whose activations fit in `budget_bytes`. The backward pass also holds the activations
+    // it recomputes between two kept ones, so memory is smallest with about the square root
+    // of the number of activations kept, rather than none.
+    std::vector<GraphNodeHandle> keep;
+    std::optional<size_t> budget_bytes; // None keeps every activation
+};
+
 struct TrainingContext
 {
     float *loss;
-    float *&training_example;
+    void *&training_example;
     std::unique_ptr<codegen::Backend> backend;
+    size_t loss_buffer_id; // In the backend's program
+
+    Optimizer optimizer; // Changes to the learning rate apply from the next step on
+    std::unique_ptr<OptimizerState> optimizer_state;
+    std::unique_ptr<DataParallelState> data_parallel; // Unless compiled for a single rank
+
+    void Execute();
 
-    void Execute() { backend->Execute(); }
+    // Writes one training step as a static library that returns the loss, see ExportProgram
+    // in export.h. Baked weights live in the library and are updated in place. The
+    // scalars and moments of the optimizer are tensors of the step too, and callers that
+    // pass the scalars in keep them up to date themselves.
+    std::vector<GraphNodeHandle> Export(const std::filesystem::path &directory, const ExportOptions &options) const;
 };
 
-// TODO: Allow dynamic learning rate
+TrainingContext CompileTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    std::unique_ptr<codegen::Backend> backend,
+    Optimizer optimizer,
+    DataParallelOptions data_parallel = {},
+    CheckpointOptions checkpointing = {});
+
+// Plain SGD
 TrainingContext CompileTrainingGraph(
     nn::Module &network,
     GraphNodeHandle model_output,
     std::unique_ptr<codegen::Backend> backend,
     float learning_rate = 0.1f);
 
+template <typename TBackend>
+TrainingContext CompileTrainingGraph(
+    nn::Module &network,
+    GraphNodeHandle model_output,
+    Optimizer optimizer,
+    DataParallelOptions data_parallel = {},
+    CheckpointOptions checkpointing = {})
+{
+    return CompileTrainingGraph(
+        network,
+        model_output,
+        std::make_unique<TBackend>(),
+        optimizer,
+        std::move(data_parallel),
+        std::move(checkpointing));
+}
+
 template <typename TBackend>
 TrainingContext CompileTrainingGraph(nn::Module &network, GraphNodeHandle model_output, float learning_rate = 0.1f)
 {
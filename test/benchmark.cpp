@@ -0,0 +1,392 @@
+#include "src/graph.h"
+#include "src/codegen.h"
+#include "src/backend_scalar_c.h"
+#include "src/backend_openmp.h"
+#include "src/backend_jit.h"
+#include "src/training.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace gg = gigagrad;
+
+// Runs a set of graphs on every backend and reports the time of the whole program and of
+// each of its functions, along with the FLOP/s and memory bandwidth that amounts to.
+//
+// Usage: gigagrad-benchmark [--json] [--backend scalar_c|openmp|jit] [--filter substring]
+//                           [--warmup N] [--repetitions N]
+
+struct Options
+{
+    bool json = false;
+    std::vector<std::string> backends = { "scalar_c", "openmp", "jit" };
+    std::string filter;
+    size_t warmup = 5;
+    size_t repetitions = 50;
+};
+
+struct Stats
+{
+    double median_ms;
+    double p99_ms;
+};
+
+struct FunctionResult
+{
+    const char *kind;
+    gg::codegen::FunctionCost cost;
+    Stats stats;
+};
+
+struct CaseResult
+{
+    std::string name;
+    std::string backend;
+    gg::codegen::FunctionCost cost;
+    Stats stats;
+    std::vector<FunctionResult> functions; // Empty if the backend can't run functions one at a time
+};
+
+// A benchmark builds its graph and compiles it on the given backend. The returned function
+// runs the program once, and `backend` is set to the backend that runs it.
+using ExecuteFn = std::function<void()>;
+using SetupFn = std::function<ExecuteFn(std::unique_ptr<gg::codegen::Backend>, gg::codegen::Backend *&backend)>;
+
+struct Benchmark
+{
+    std::string name;
+    SetupFn setup;
+};
+
+static std::unique_ptr<gg::codegen::Backend> MakeBackend(const std::string &name)
+{
+    if(name == "scalar_c")
+        return std::make_unique<gg::codegen::BackendScalarC>();
+    if(name == "openmp")
+        return std::make_unique<gg::codegen::BackendOpenMP>();
+    if(name == "jit")
+        return std::make_unique<gg::codegen::BackendJit>();
+    std::fprintf(stderr, "Unknown backend %s\n", name.c_str());
+    std::exit(1);
+}
+
+static void FillRandom(float *x, size_t size_elts)
+{
+    static std::default_random_engine e(0);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for(size_t i = 0; i < size_elts; i++)
+        x[i] = dist(e);
+}
+
+static size_t NumElements(const gg::Shape &shape)
+{
+    size_t result = 1;
+    for(gg::dim_t d : shape)
+        result *= d;
+    return result;
+}
+
+// Keeps the inputs of the benchmarks alive
+static std::vector<std::unique_ptr<float[]>> input_data;
+
+static void SetRandomData(gg::GraphNodeHandle tensor)
+{
+    size_t size_elts = NumElements(tensor.shape());
+    input_data.emplace_back(std::make_unique<float[]>(size_elts));
+    FillRandom(input_data.back().get(), size_elts);
+    tensor.data() = input_data.back().get();
+}
+
+// Compiles the graph built by `build`, which gets the graph and returns the node to compute
+static Benchmark GraphBenchmark(std::string name, std::function<gg::GraphNodeHandle(gg::Graph &)> build)
+{
+    auto setup = [build](std::unique_ptr<gg::codegen::Backend> backend, gg::codegen::Backend *&out) -> ExecuteFn
+    {
+        auto graph = std::make_shared<gg::Graph>();
+        gg::GraphNodeHandle node = build(*graph);
+        auto result = std::make_shared<gg::CompiledTensor>(node.Compile(std::move(backend)));
+        out = result->backend.get();
+        return [graph, result]() { result->Execute(); };
+    };
+    return { std::move(name), std::move(setup) };
+}
+
+static Benchmark MatmulBenchmark(gg::dim_t size)
+{
+    return GraphBenchmark("matmul_" + std::to_string(size), [size](gg::Graph &graph)
+    {
+        auto a = graph.AddInput({ size, size });
+        auto b = graph.AddInput({ size, size });
+        SetRandomData(a);
+        SetRandomData(b);
+        return a % b;
+    });
+}
+
+// Same network as gigagrad-emnist, on random data
+static Benchmark TrainingBenchmark(std::string name, gg::Optimizer optimizer)
+{
+    auto setup = [optimizer](std::unique_ptr<gg::codegen::Backend> backend, gg::codegen::Backend *&out) -> ExecuteFn
+    {
+        constexpr gg::dim_t BatchSize = 32;
+        constexpr gg::dim_t HiddenLayerSize = 40;
+        auto network = std::make_shared<gg::nn::Module>();
+        auto x = network->AddInput({ BatchSize, 28 * 28, 1 });
+        auto w1 = network->AddWeight({ HiddenLayerSize, 28 * 28 });
+        auto b1 = network->AddWeight({ HiddenLayerSize, 1 });
+        auto z1 = (w1 % x.batchnorm()) + b1;
+        auto w2 = network->AddWeight({ 10, HiddenLayerSize });
+        auto b2 = network->AddWeight({ 10, 1 });
+        auto z2 = (w2 % z1.relu()) + b2;
+        for(gg::GraphNodeHandle tensor : { x, w1, b1, w2, b2 })
+            SetRandomData(tensor);
+
+        auto ctx = std::make_shared<gg::TrainingContext>(
+            gg::CompileTrainingGraph(*network, z2.softmax(-2), std::move(backend), optimizer));
+        input_data.emplace_back(std::make_unique<float[]>(BatchSize * 10));
+        std::fill_n(input_data.back().get(), BatchSize * 10, 0.1f);
+        ctx->training_example = input_data.back().get();
+        out = ctx->backend.get();
+        return [network, ctx]() { ctx->Execute(); };
+    };
+    return { std::move(name), setup };
+}
+
+static std::vector<Benchmark> AllBenchmarks()
+{
+    std::vector<Benchmark> result;
+    for(gg::dim_t size : { 64, 128, 256, 512 })
+        result.push_back(MatmulBenchmark(size));
+
+    result.push_back(GraphBenchmark("softmax_1024x1024", [](gg::Graph &graph)
+    {
+        auto x = graph.AddInput({ 1024, 1024 });
+        SetRandomData(x);
+        return x.softmax(1);
+    }));
+    result.push_back(GraphBenchmark("batchnorm_1024x256", [](gg::Graph &graph)
+    {
+        auto x = graph.AddInput({ 1024, 256 });
+        SetRandomData(x);
+        return x.batchnorm();
+    }));
+    for(gg::dim_t axis = 0; axis < 3; axis++)
+    {
+        result.push_back(GraphBenchmark("sum_128x128x128_axis" + std::to_string(axis), [axis](gg::Graph &graph)
+        {
+            auto x = graph.AddInput({ 128, 128, 128 });
+            SetRandomData(x);
+            return x.sum(axis);
+        }));
+        result.push_back(GraphBenchmark("max_128x128x128_axis" + std::to_string(axis), [axis](gg::Graph &graph)
+        {
+            auto x = graph.AddInput({ 128, 128, 128 });
+            SetRandomData(x);
+            return x.max(axis);
+        }));
+    }
+    result.push_back(GraphBenchmark("sum_1048576", [](gg::Graph &graph)
+    {
+        auto x = graph.AddInput({ 1 << 20 });
+        SetRandomData(x);
+        return x.sum();
+    }));
+    result.push_back(GraphBenchmark("squared_error_1024x1024", [](gg::Graph &graph)
+    {
+        auto x = graph.AddInput({ 1024, 1024 });
+        auto y = graph.AddInput({ 1024, 1024 });
+        SetRandomData(x);
+        SetRandomData(y);
+        auto error = x - y;
+        return (error * error).sum();
+    }));
+    result.push_back(GraphBenchmark("shared_exp_1024x1024", [](gg::Graph &graph)
+    {
+        auto x = graph.AddInput({ 1024, 1024 });
+        SetRandomData(x);
+        auto e = gg::exp(x);
+        return e * e.sum(gg::dim_t{1}).reshape({ 1024, 1 });
+    }));
+    result.push_back(TrainingBenchmark("training_step", { .learning_rate = 0.005f }));
+    result.push_back(TrainingBenchmark("training_step_adam", { .type = gg::Optimizer::Type::Adam, .learning_rate = 0.001f }));
+    return result;
+}
+
+static Stats ComputeStats(std::vector<double> samples_ms)
+{
+    std::sort(samples_ms.begin(), samples_ms.end());
+    size_t p99 = std::min(samples_ms.size() - 1, (samples_ms.size() * 99) / 100);
+    return { samples_ms[samples_ms.size() / 2], samples_ms[p99] };
+}
+
+template <typename TFn>
+static double TimeMs(TFn fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static CaseResult RunBenchmark(const Benchmark &benchmark, const std::string &backend_name, const Options &options)
+{
+    gg::codegen::Backend *backend = nullptr;
+    ExecuteFn execute = benchmark.setup(MakeBackend(backend_name), backend);
+
+    CaseResult result = { benchmark.name, backend_name, { 0.0, 0.0 }, {}, {} };
+    const gg::codegen::Program *program = backend->GetProgram();
+    if(program)
+    {
+        for(const gg::codegen::FunctionBuilder &f : program->functions)
+        {
+            gg::codegen::FunctionCost cost = gg::codegen::EstimateCost(*program, f);
+            result.cost.flops += cost.flops;
+            result.cost.bytes += cost.bytes;
+            gg::GraphNodeHandle node = f.node;
+            result.functions.push_back({ gg::KindName(node->Kind()), cost, {} });
+        }
+    }
+
+    for(size_t i = 0; i < options.warmup; i++)
+        execute();
+
+    std::vector<double> samples(options.repetitions);
+    for(double &sample : samples)
+        sample = TimeMs(execute);
+    result.stats = ComputeStats(samples);
+
+    // Per-function timings. The functions run in program order, so their inputs are valid
+    // even where the arena reuses memory.
+    if(!program || !backend->ExecuteFunction(0))
+    {
+        result.functions.clear();
+        return result;
+    }
+    std::vector<std::vector<double>> function_samples(result.functions.size());
+    for(size_t irep = 0; irep < options.repetitions; irep++)
+        for(size_t ifn = 0; ifn < result.functions.size(); ifn++)
+            function_samples[ifn].push_back(TimeMs([&]() { backend->ExecuteFunction(ifn); }));
+    for(size_t ifn = 0; ifn < result.functions.size(); ifn++)
+        result.functions[ifn].stats = ComputeStats(function_samples[ifn]);
+    return result;
+}
+
+static double GigaPerSecond(double amount, double ms)
+{
+    return ms > 0.0 ? amount / (ms * 1e6) : 0.0;
+}
+
+static void PrintText(const CaseResult &r)
+{
+    std::printf("%-28s %-9s median %9.4fms  p99 %9.4fms  %8.2f GFLOP/s  %8.2f GB/s\n",
+                r.name.c_str(),
+                r.backend.c_str(),
+                r.stats.median_ms,
+                r.stats.p99_ms,
+                GigaPerSecond(r.cost.flops, r.stats.median_ms),
+                GigaPerSecond(r.cost.bytes, r.stats.median_ms));
+    for(size_t ifn = 0; ifn < r.functions.size(); ifn++)
+    {
+        const FunctionResult &f = r.functions[ifn];
+        std::printf("    fn %-3zu %-10s        median %9.4fms  p99 %9.4fms  %8.2f GFLOP/s  %8.2f GB/s\n",
+                    ifn,
+                    f.kind,
+                    f.stats.median_ms,
+                    f.stats.p99_ms,
+                    GigaPerSecond(f.cost.flops, f.stats.median_ms),
+                    GigaPerSecond(f.cost.bytes, f.stats.median_ms));
+    }
+}
+
+static void PrintJsonMeasurement(const gg::codegen::FunctionCost &cost, const Stats &stats)
+{
+    std::printf("\"median_ms\": %.6f, \"p99_ms\": %.6f, \"flops\": %.0f, \"bytes\": %.0f, \"gflops\": %.4f, \"gbps\": %.4f",
+                stats.median_ms,
+                stats.p99_ms,
+                cost.flops,
+                cost.bytes,
+                GigaPerSecond(cost.flops, stats.median_ms),
+                GigaPerSecond(cost.bytes, stats.median_ms));
+}
+
+static void PrintJson(const std::vector<CaseResult> &results)
+{
+    std::printf("[\n");
+    for(size_t ir = 0; ir < results.size(); ir++)
+    {
+        const CaseResult &r = results[ir];
+        std::printf("  { \"name\": \"%s\", \"backend\": \"%s\", ", r.name.c_str(), r.backend.c_str());
+        PrintJsonMeasurement(r.cost, r.stats);
+        std::printf(", \"functions\": [");
+        for(size_t ifn = 0; ifn < r.functions.size(); ifn++)
+        {
+            std::printf("%s\n    { \"index\": %zu, \"kind\": \"%s\", ", ifn == 0 ? "" : ",", ifn, r.functions[ifn].kind);
+            PrintJsonMeasurement(r.functions[ifn].cost, r.functions[ifn].stats);
+            std::printf(" }");
+        }
+        std::printf("] }%s\n", ir + 1 == results.size() ? "" : ",");
+    }
+    std::printf("]\n");
+}
+
+static Options ParseOptions(int argc, const char **argv)
+{
+    Options options;
+    for(int i = 1; i < argc; i++)
+    {
+        auto value = [&]()
+        {
+            if(i + 1 >= argc)
+            {
+                std::fprintf(stderr, "Missing value for %s\n", argv[i]);
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+
+        if(std::strcmp(argv[i], "--json") == 0)
+            options.json = true;
+        else if(std::strcmp(argv[i], "--backend") == 0)
+            options.backends = { value() };
+        else if(std::strcmp(argv[i], "--filter") == 0)
+            options.filter = value();
+        else if(std::strcmp(argv[i], "--warmup") == 0)
+            options.warmup = std::strtoull(value(), nullptr, 10);
+        else if(std::strcmp(argv[i], "--repetitions") == 0)
+            options.repetitions = std::max<size_t>(std::strtoull(value(), nullptr, 10), 1);
+        else
+        {
+            std::fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            std::exit(1);
+        }
+    }
+    return options;
+}
+
+int main(int argc, const char **argv)
+{
+    Options options = ParseOptions(argc, argv);
+    std::vector<CaseResult> results;
+    for(const Benchmark &benchmark : AllBenchmarks())
+    {
+        if(benchmark.name.find(options.filter) == std::string::npos)
+            continue;
+        for(const std::string &backend : options.backends)
+        {
+            results.push_back(RunBenchmark(benchmark, backend, options));
+            if(!options.json)
+                PrintText(results.back());
+        }
+    }
+    if(options.json)
+        PrintJson(results);
+    return 0;
+}
@@ -1,7 +1,11 @@
 #include "src/training.h"
-#include "src/backend_scalar_c.h"
+#include "src/dataloader.h"
+#include "src/mapped_file.h"
+#include "src/backend_openmp.h"
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
+#include <string>
 #include <vector>
 #include <random>
 
@@ -12,228 +16,47 @@ constexpr gg::dim_t BatchSize = 128;
 // Download dataset from
 // https://www.nist.gov/itl/products-and-services/emnist-dataset
 
-enum class DataType : uint8_t
+// Images are normalized to [0, 1] and labels one-hot encoded as the DataLoader asks
+// for them, on its background thread. Both read straight from the mapped files.
+struct EmnistDataset : gg::Dataset
 {
-    U8 = 0x08,
-    I8 = 0x09,
-    I16 = 0x0B,
-    I32 = 0x0C,
-    F32 = 0x0D,
-    F64 = 0x0E,
-};
-
-size_t SizeOf(DataType dtype)
-{
-    switch(dtype)
-    {
-    case DataType::U8:
-        return sizeof(uint8_t);
-    case DataType::I8:
-        return sizeof(int8_t);
-    case DataType::I16:
-        return sizeof(int16_t);
-    case DataType::I32:
-        return sizeof(int32_t);
-    case DataType::F32:
-        return sizeof(float);
-    case DataType::F64:
-        return sizeof(double);
-    default:
-        exit(1);
-    }
-}
-
-struct ParsedDataFile
-{
-    DataType dtype;
-    std::vector<size_t> shape;
-    std::vector<uint8_t> data;
-};
+    gg::IdxFile images;
+    gg::IdxFile labels;
+    size_t image_size;
+    size_t num_classes;
 
-ParsedDataFile LoadDataFile(const char *filename)
-{
-    FILE *file = fopen(filename, "rb");
-    if(!file)
-    {
-        fprintf(stderr, "File %s not found\n", filename);
-        exit(1);
-    }
-    uint32_t magic = 0;
-    if(fseek(file, 0, SEEK_SET))
+    EmnistDataset(const std::string &images_path, const std::string &labels_path)
+        : images(images_path), labels(labels_path)
     {
-        fprintf(stderr, "Failed to seek: %d\n", ferror(file));
-        exit(1);
-    }
-    if(fread(&magic, sizeof(uint32_t), 1, file) < 1)
-    {
-        fprintf(stderr, "Failed to read from file: %d\n", ferror(file));
-        exit(1);
-    }
-    if(static_cast<uint16_t>(magic & 0xFFFF) != 0)
-    {
-        fprintf(stderr, "Invalid magic bytes at beginning of file %s (0x%x), exiting\n", filename, magic);
-        exit(1);
-    }
-
-    uint8_t raw_dtype = (magic >> 16) & 0xFF;
-    DataType dtype;
-    switch(raw_dtype)
-    {
-    case (uint8_t)DataType::U8:
-        dtype = DataType::U8;
-        break;
-    case (uint8_t)DataType::I8:
-        dtype = DataType::I8;
-        break;
-    case (uint8_t)DataType::I16:
-        dtype = DataType::I16;
-        break;
-    case (uint8_t)DataType::I32:
-        dtype = DataType::I32;
-        break;
-    case (uint8_t)DataType::F32:
-        dtype = DataType::F32;
-        break;
-    case (uint8_t)DataType::F64:
-        dtype = DataType::F64;
-        break;
-    default:
-        fprintf(stderr, "Invalid datatype 0x%x, exiting\n", raw_dtype);
-        exit(1);
-        __builtin_unreachable();
-    }
-
-
-    uint8_t ndim = (magic >> 24) & 0xFF;
-
-    std::vector<size_t> shape(ndim);
-    size_t offset = 4;
-    size_t total_dataset_size = 1;
-    for(size_t i = 0; i < ndim; i++)
-    {
-        uint32_t dim = 0;
-        if(fseek(file, offset, SEEK_SET))
-        {
-            fprintf(stderr, "Failed to seek to offset %zu\n", offset);
-            exit(1);
-        }
-        if(fread(&dim, sizeof(dim), 1, file) < 1)
+        if(images.dtype != gg::DType::U8 || labels.dtype != gg::DType::U8)
         {
-            fprintf(stderr, "Failed to read\n");
+            fprintf(stderr, "Expected unsigned byte images and labels\n");
             exit(1);
         }
-        shape[i] = static_cast<size_t>(__builtin_bswap32(dim));
-        total_dataset_size *= shape[i];
-        offset += sizeof(dim);
+        const uint8_t *label_data = static_cast<const uint8_t *>(labels.elements());
+        image_size = images.NumElements() / images.shape[0];
+        num_classes = *std::max_element(label_data, label_data + labels.NumElements()) + 1;
     }
 
-    std::vector<uint8_t> data(total_dataset_size * SizeOf(dtype), 0);
-    if(fseek(file, offset, SEEK_SET))
-    {
-        fprintf(stderr, "Failed to seek to offset %zu\n", offset);
-        exit(1);
-    }
-    if(fread(data.data(), SizeOf(dtype), total_dataset_size, file) < total_dataset_size)
-    {
-        fprintf(stderr, "Failed to read dataset\n");
-        exit(1);
-    }
-
-    return { dtype, std::move(shape), std::move(data) };
-}
-
-template <typename T>
-std::vector<float> CastToFloatAndNormalize(const std::vector<uint8_t> &input)
-{
-    size_t num_elements = input.size() / sizeof(T);
-    std::vector<float> result(num_elements);
-    const T *input_data = reinterpret_cast<const T *>(input.data());
-    for(size_t i = 0; i < num_elements; i++)
-    {
-        result[i] = static_cast<float>(input_data[i]) / 255.0;
-    }
-    return result;
-}
-
-std::vector<float> CastToFloatAndNormalize(DataType dtype, const std::vector<uint8_t> &input)
-{
-    switch(dtype)
-    {
-    case DataType::U8:
-        return CastToFloatAndNormalize<uint8_t>(input);
-    case DataType::I8:
-        return CastToFloatAndNormalize<int8_t>(input);
-    case DataType::I16:
-        return CastToFloatAndNormalize<int16_t>(input);
-    case DataType::I32:
-        return CastToFloatAndNormalize<int32_t>(input);
-    case DataType::F32:
-        return CastToFloatAndNormalize<float>(input);
-    case DataType::F64:
-        return CastToFloatAndNormalize<double>(input);
-    default:
-        exit(1);
-    }
-}
+    size_t NumExamples() const override { return images.shape[0]; }
+    size_t InputSize() const override { return image_size; }
+    size_t LabelSize() const override { return num_classes; }
 
-template <typename T>
-std::vector<float> ToOneHot(const std::vector<uint8_t> &input)
-{
-    size_t num_elements = input.size() / sizeof(T);
-    const T *input_data = reinterpret_cast<const T *>(input.data());
-    T max_val = 0;
-    for(size_t i = 0; i < num_elements; i++)
+    void Read(size_t iexample, float *input, float *label) override
     {
-        if(input_data[i] < 0)
-        {
-            fprintf(stderr, "Tried to one-hot encode invalid value: %d\n", (int)input_data[i]);
-            exit(1);
-        }
-        max_val = std::max(max_val, input_data[i]);
+        const uint8_t *image = static_cast<const uint8_t *>(images.elements()) + iexample * image_size;
+        for(size_t i = 0; i < image_size; i++)
+            input[i] = image[i] / 255.0f;
+        std::fill(label, label + num_classes, 0.0f);
+        label[static_cast<const uint8_t *>(labels.elements())[iexample]] = 1.0f;
     }
-    std::vector<float> result(max_val * num_elements, 0.0f);
-    for(size_t i = 0; i < num_elements; i++)
-    {
-        T cur_val = input_data[i];
-        result[i * max_val + cur_val] = 1.0f;
-    }
-    return result;
-}
-
-std::vector<float> ToOneHot(DataType dtype, const std::vector<uint8_t> &input)
-{
-    switch(dtype)
-    {
-    case DataType::U8:
-        return ToOneHot<uint8_t>(input);
-    case DataType::I8:
-        return ToOneHot<int8_t>(input);
-    case DataType::I16:
-        return ToOneHot<int16_t>(input);
-    case DataType::I32:
-        return ToOneHot<int32_t>(input);
-    default:
-        fprintf(stderr, "Can't cast non-integer to one-hot\n");
-        exit(1);
-    }
-}
-
-struct Dataset
-{
-    std::vector<size_t> shape;
-    std::vector<float> inputs;
-    std::vector<float> labels;
 };
 
-Dataset LoadDataset(const char *directory, const char *dataset)
+std::unique_ptr<EmnistDataset> LoadDataset(const char *directory, const char *dataset)
 {
     std::string image_name = std::string(directory) + "/emnist-mnist-" + dataset + "-images-idx3-ubyte";
     std::string label_name = std::string(directory) + "/emnist-mnist-" + dataset + "-labels-idx1-ubyte";
-    ParsedDataFile images = LoadDataFile(image_name.c_str());
-    ParsedDataFile labels = LoadDataFile(label_name.c_str());
-    std::vector<float> images_float = CastToFloatAndNormalize(images.dtype, images.data);
-    std::vector<float> labels_onehot = ToOneHot(labels.dtype, labels.data);
-    return { std::move(images.shape), std::move(images_float), std::move(labels_onehot) };
+    return std::make_unique<EmnistDataset>(image_name, label_name);
 }
 
 void InitializeWeights(float *weight, size_t size_elts)
@@ -252,7 +75,7 @@ int main(int argc, const char **argv)
         exit(1);
     }
 
-    Dataset train = LoadDataset(argv[1], "train");
+    gg::DataLoader train(LoadDataset(argv[1], "train"), { .batch_size = BatchSize });
 
     constexpr size_t HiddenLayerSize = 40;
 
@@ -268,24 +91,27 @@ int main(int argc, const char **argv)
     auto b2 = network.AddWeight({ 10, 1 });
     auto z2 = (w2 % a2) + b2;
     auto result = z2.softmax(-2);
-    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, result, 0.005f);
-
-    w1.data() = new float[HiddenLayerSize * 28 * 28];
-    b1.data() = new float[HiddenLayerSize * 1];
-    w2.data() = new float[10 * HiddenLayerSize];
-    b2.data() = new float[10 * 1];
-    InitializeWeights(w1.data(), HiddenLayerSize * 28 * 28);
-    InitializeWeights(b1.data(), HiddenLayerSize * 1);
-    InitializeWeights(w2.data(), 10 * HiddenLayerSize);
-    InitializeWeights(b2.data(), 10 * 1);
-
-    size_t num_batches = train.shape[0] / BatchSize;
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendOpenMP>(network, result, 0.005f);
+
+    auto w1_data = new float[HiddenLayerSize * 28 * 28];
+    auto b1_data = new float[HiddenLayerSize * 1];
+    auto w2_data = new float[10 * HiddenLayerSize];
+    auto b2_data = new float[10 * 1];
+    InitializeWeights(w1_data, HiddenLayerSize * 28 * 28);
+    InitializeWeights(b1_data, HiddenLayerSize * 1);
+    InitializeWeights(w2_data, 10 * HiddenLayerSize);
+    InitializeWeights(b2_data, 10 * 1);
+    w1.data() = w1_data;
+    b1.data() = b1_data;
+    w2.data() = w2_data;
+    b2.data() = b2_data;
+
+    size_t num_batches = train.NumBatches();
     for(size_t iepoch = 0; iepoch < 100; iepoch++)
     {
-        for(size_t ibatch = 0; ibatch < num_batches; ibatch++)
+        // The loader prepares the next batch while we train on this one
+        for(size_t ibatch = 0; train.Next(x, ctx); ibatch++)
         {
-            x.data() = &train.inputs[BatchSize * 28 * 28 * ibatch];
-            ctx.training_example = &train.labels[BatchSize * 10 * ibatch];
             ctx.Execute();
             printf("Epoch %zu Batch (%zu / %zu) loss: %.6f\n", iepoch, ibatch, num_batches, *ctx.loss);
         }
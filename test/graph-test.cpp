@@ -3,10 +3,36 @@
 #include "src/graph.h"
 #include "src/codegen.h"
 #include "src/backend_scalar_c.h"
+#include "src/backend_openmp.h"
+#include "src/backend_jit.h"
 #include "src/training.h"
+#include "src/executor.h"
+#include "src/dataloader.h"
+#include "src/mapped_file.h"
+#include "src/export.h"
+#include "src/server.h"
+#include "src/static_graph.h"
+#include "src/streaming.h"
+#ifdef __APPLE__
+#include "src/backend_metal.h"
+#endif
+#ifdef GIGAGRAD_CUDA
+#include "src/backend_cuda.h"
+#endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <numeric>
+#include <string>
 #include <random>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
 
 namespace gg = gigagrad;
 
@@ -20,7 +46,7 @@ void TestGradient(
     float example = 0.0f;
     ctx.training_example = &example;
     ctx.Execute();
-    REQUIRE_THAT(*w.data(),
+    REQUIRE_THAT(*static_cast<float *>(w.data()),
                  Catch::Matchers::WithinRel(expected, 0.001f)
                  || Catch::Matchers::WithinAbs(0, 0.000001f));
 }
@@ -200,7 +226,8 @@ void NaiveMatmul(float *x, float *y, size_t A, size_t B, size_t C, float *result
     }
 }
 
-TEST_CASE("TestMatmul", "[Codegen]")
+template <typename TBackend>
+void TestMatmul()
 {
     constexpr size_t NumTrials = 10;
     for(size_t itrial = 0; itrial < NumTrials; itrial++)
@@ -214,28 +241,2020 @@ TEST_CASE("TestMatmul", "[Codegen]")
         gg::Graph graph;
         auto x = graph.AddInput({ A, B });
         auto y = graph.AddInput({ B, C });
-        auto result = (x % y).Compile<gg::codegen::BackendScalarC>();
+        auto result = (x % y).Compile<TBackend>();
     
-        x.data() = new float[A * B];
-        y.data() = new float[B * C];
-        RandomMatrix(x.data(), A * B);
-        RandomMatrix(y.data(), B * C);
+        auto x_data = new float[A * B];
+        auto y_data = new float[B * C];
+        x.data() = x_data;
+        y.data() = y_data;
+        RandomMatrix(x_data, A * B);
+        RandomMatrix(y_data, B * C);
 
         result.Execute();
         auto actual = result.data;
         auto expected = new float[A * C];
-        NaiveMatmul(x.data(), y.data(), A, B, C, expected);
+        NaiveMatmul(x_data, y_data, A, B, C, expected);
         for(gg::dim_t i = 0; i < A * C; i++)
         {
             REQUIRE(std::abs(actual[i] - expected[i]) / actual[i] <= 0.02f);
         }
         // Make LeakSanitizer happy
-        delete [] x.data();
-        delete [] y.data();
+        delete [] x_data;
+        delete [] y_data;
         delete [] expected;
     }
 }
 
+TEST_CASE("TestMatmul", "[Codegen]")
+{
+    TestMatmul<gg::codegen::BackendScalarC>();
+}
+
+TEST_CASE("TestMatmulOpenMP", "[Codegen]")
+{
+    TestMatmul<gg::codegen::BackendOpenMP>();
+}
+
+TEST_CASE("TestMatmulJit", "[Codegen]")
+{
+    TestMatmul<gg::codegen::BackendJit>();
+}
+
+TEST_CASE("TestBatchedMatmul", "[Codegen]")
+{
+    constexpr gg::dim_t Batch = 3, A = 17, B = 33, C = 9;
+    gg::Graph graph;
+    auto w = graph.AddInput({ A, B });
+    auto x = graph.AddInput({ Batch, B, C });
+    auto result = (w % x).Compile<gg::codegen::BackendScalarC>();
+    REQUIRE(result.shape == gg::Shape{ Batch, A, C });
+
+    std::vector<float> w_data(A * B);
+    std::vector<float> x_data(Batch * B * C);
+    RandomMatrix(w_data.data(), w_data.size());
+    RandomMatrix(x_data.data(), x_data.size());
+    w.data() = w_data.data();
+    x.data() = x_data.data();
+    result.Execute();
+
+    std::vector<float> expected(A * C);
+    for(gg::dim_t ibatch = 0; ibatch < Batch; ibatch++)
+    {
+        NaiveMatmul(w_data.data(), &x_data[ibatch * B * C], A, B, C, expected.data());
+        for(gg::dim_t i = 0; i < A * C; i++)
+            REQUIRE_THAT(result.data[ibatch * A * C + i], Catch::Matchers::WithinAbs(expected[i], 0.001f));
+    }
+}
+
+TEST_CASE("TestBroadcast", "[Codegen]")
+{
+    {
+        gg::Graph graph;
+        auto x = graph.AddInput({ 2, 1, 3 });
+        auto y = graph.AddInput({ 2, 4, 3 });
+        float x_data[] = { 0, 1, 2, 3, 4, 5 };
+        float y_data[24] = {};
+        x.data() = x_data;
+        y.data() = y_data;
+        auto result = (x + y).Compile<gg::codegen::BackendScalarC>();
+        result.Execute();
+        for(int i = 0; i < 24; i++)
+            REQUIRE(result.data[i] == x_data[(i / 12) * 3 + i % 3]);
+    }
+    {
+        gg::Graph graph;
+        auto x = graph.AddInput({ 2, 3 });
+        auto y = graph.AddInput({ 3 });
+        float x_data[] = { 0, 10, 20, 30, 40, 50 };
+        float y_data[] = { 1, 2, 3 };
+        x.data() = x_data;
+        y.data() = y_data;
+        auto result = (x + y).Compile<gg::codegen::BackendScalarC>();
+        result.Execute();
+        for(int i = 0; i < 6; i++)
+            REQUIRE(result.data[i] == x_data[i] + y_data[i % 3]);
+    }
+}
+
+TEST_CASE("TestSimplifyIndexArithmetic", "[Codegen]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput({ 4, 1, 8 });
+    auto y = graph.AddInput({ 4, 5, 8 });
+    auto z = gg::exp(x * y).sum(gg::dim_t{1}) + x.reshape({ 4, 8 });
+    gg::codegen::Program prog = gg::codegen::CodegenNode(z);
+    for(const auto &fn : prog.functions)
+    {
+        for(const auto &insn : fn.insns)
+        {
+            if(auto *arith = std::get_if<gg::codegen::IntArithmeticInsn>(&insn))
+            {
+                REQUIRE(arith->op != gg::codegen::IntArithmeticInsn::Op::DIV);
+                REQUIRE(arith->op != gg::codegen::IntArithmeticInsn::Op::MOD);
+            }
+        }
+    }
+}
+
+TEST_CASE("TestFuseSoftmax", "[Codegen]")
+{
+    constexpr gg::dim_t Rows = 7, Cols = 19;
+    gg::Graph graph;
+    auto x = graph.AddInput({ Rows, Cols });
+    auto softmax = x.softmax(1);
+    REQUIRE(gg::codegen::CodegenNode(softmax).functions.size() == 1);
+
+    float x_data[Rows * Cols];
+    RandomMatrix(x_data, Rows * Cols);
+    x.data() = x_data;
+    auto result = softmax.Compile<gg::codegen::BackendScalarC>();
+    result.Execute();
+    for(gg::dim_t i = 0; i < Rows; i++)
+    {
+        float max = x_data[i * Cols];
+        for(gg::dim_t j = 0; j < Cols; j++)
+            max = std::max(max, x_data[i * Cols + j]);
+        float sum = 0.0f;
+        for(gg::dim_t j = 0; j < Cols; j++)
+            sum += std::exp(x_data[i * Cols + j] - max);
+        for(gg::dim_t j = 0; j < Cols; j++)
+        {
+            float expected = std::exp(x_data[i * Cols + j] - max) / sum;
+            REQUIRE_THAT(result.data[i * Cols + j], Catch::Matchers::WithinAbs(expected, 0.0001f));
+        }
+    }
+}
+
+TEST_CASE("TestFuseBatchnorm", "[Codegen]")
+{
+    constexpr gg::dim_t Batch = 9, Features = 5;
+    gg::Graph graph;
+    auto x = graph.AddInput({ Batch, Features });
+    auto batchnorm = x.batchnorm();
+    REQUIRE(gg::codegen::CodegenNode(batchnorm).functions.size() == 1);
+
+    float x_data[Batch * Features];
+    RandomMatrix(x_data, Batch * Features);
+    x.data() = x_data;
+    auto result = batchnorm.Compile<gg::codegen::BackendScalarC>();
+    result.Execute();
+    for(gg::dim_t j = 0; j < Features; j++)
+    {
+        float mean = 0.0f;
+        for(gg::dim_t i = 0; i < Batch; i++)
+            mean += x_data[i * Features + j] / Batch;
+        float sum_square_errors = 0.0f;
+        for(gg::dim_t i = 0; i < Batch; i++)
+            sum_square_errors += (x_data[i * Features + j] - mean) * (x_data[i * Features + j] - mean);
+        for(gg::dim_t i = 0; i < Batch; i++)
+        {
+            float expected = (x_data[i * Features + j] - mean) / std::sqrt(sum_square_errors + 0.001f);
+            REQUIRE_THAT(result.data[i * Features + j], Catch::Matchers::WithinAbs(expected, 0.0001f));
+        }
+    }
+}
+
+TEST_CASE("TestArenaReuse", "[Codegen]")
+{
+    constexpr gg::dim_t N = 16;
+    gg::Graph graph;
+    auto x = graph.AddInput({ N, N });
+    auto w = graph.AddInput({ N, N });
+    auto y = ((x % w) % w) % w;
+
+    // The first and third matmul have disjoint lifetimes, so only two of the three
+    // buffers need to exist at once.
+    gg::codegen::Program prog = gg::codegen::CodegenNode(y);
+    REQUIRE(prog.functions.size() == 3);
+    gg::codegen::ArenaPlan plan = gg::codegen::PlanArena(prog, gg::codegen::BufferAlignment);
+    REQUIRE(plan.size_bytes == 2 * N * N * sizeof(float));
+
+    float x_data[N * N];
+    float w_data[N * N];
+    RandomMatrix(x_data, N * N);
+    RandomMatrix(w_data, N * N);
+    x.data() = x_data;
+    w.data() = w_data;
+    auto result = y.Compile<gg::codegen::BackendScalarC>();
+    result.Execute();
+
+    float tmp1[N * N];
+    float tmp2[N * N];
+    NaiveMatmul(x_data, w_data, N, N, N, tmp1);
+    NaiveMatmul(tmp1, w_data, N, N, N, tmp2);
+    NaiveMatmul(tmp2, w_data, N, N, N, tmp1);
+    for(gg::dim_t i = 0; i < N * N; i++)
+        REQUIRE_THAT(result.data[i], Catch::Matchers::WithinRel(tmp1[i], 0.001f) || Catch::Matchers::WithinAbs(tmp1[i], 0.01f));
+}
+
+TEST_CASE("TestKernelCache", "[Codegen]")
+{
+    // Paths reach the compiler as they are, without going through the shell
+    auto cache_dir = std::filesystem::temp_directory_path() / "gigagrad test-kernel-cache; $HOME";
+    std::filesystem::remove_all(cache_dir);
+
+    auto count_kernels = [&]()
+    {
+        auto entries = std::filesystem::directory_iterator(cache_dir);
+        return std::count_if(
+            std::filesystem::begin(entries),
+            std::filesystem::end(entries),
+            [](const auto &entry) { return entry.path().extension() == ".so"; });
+    };
+
+    gg::Graph graph;
+    auto x = graph.AddInput({ 4 });
+    float x_data[] = { 1.0f, 2.0f, 3.0f, 4.0f };
+    x.data() = x_data;
+    for(int i = 0; i < 2; i++)
+    {
+        auto backend = std::make_unique<gg::codegen::BackendScalarC>();
+        backend->cache_directory = cache_dir;
+        auto result = (x * 2.0f).Compile(std::move(backend));
+        result.Execute();
+        REQUIRE(result.data[3] == 8.0f);
+        REQUIRE(count_kernels() == 1);
+    }
+    auto backend = std::make_unique<gg::codegen::BackendScalarC>();
+    backend->cache_directory = cache_dir;
+    auto result = (x * 3.0f).Compile(std::move(backend));
+    result.Execute();
+    REQUIRE(result.data[3] == 12.0f);
+    REQUIRE(count_kernels() == 2);
+
+    // Threads compiling the same program into an empty cache end up sharing one kernel
+    std::filesystem::remove_all(cache_dir);
+    std::vector<std::thread> threads;
+    std::vector<float> outputs(4);
+    for(size_t ithread = 0; ithread < outputs.size(); ithread++)
+    {
+        threads.emplace_back([&, ithread]()
+        {
+            gg::Graph graph;
+            auto x = graph.AddInput({ 4 });
+            x.data() = x_data;
+            auto backend = std::make_unique<gg::codegen::BackendScalarC>();
+            backend->cache_directory = cache_dir;
+            auto result = (x * 5.0f).Compile(std::move(backend));
+            result.Execute();
+            outputs[ithread] = result.data[3];
+        });
+    }
+    for(std::thread &thread : threads)
+        thread.join();
+    REQUIRE(outputs == std::vector<float>(4, 20.0f));
+    REQUIRE(count_kernels() == 1);
+    REQUIRE(std::none_of(
+        std::filesystem::directory_iterator(cache_dir),
+        std::filesystem::directory_iterator(),
+        [](const auto &entry) { return entry.path().string().find(".tmp") != std::string::npos; }));
+    std::filesystem::remove_all(cache_dir);
+}
+
+TEST_CASE("TestTrainOpenMP", "[Train]")
+{
+    gg::nn::Module network;
+    auto x = network.AddInput(4);
+    auto w = network.AddWeight(4);
+    auto L1 = w - x;
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendOpenMP>(network, L1);
+    float x_data[] = { 1.0, 2.0, 3.0, 4.0 };
+    float w_data[] = { -0.1, 0.1, -0.001, 0.0001 };
+    float training_example_data[] = { 0.0, 0.0, 0.0, 0.0 };
+    x.data() = x_data;
+    w.data() = w_data;
+    ctx.training_example = training_example_data;
+    float prev_loss = 1000;
+    for(int i = 0; i < 50; i++)
+    {
+        ctx.Execute();
+        REQUIRE(*ctx.loss < prev_loss);
+    }
+    for(int i = 0; i < 4; i++)
+    {
+        float pct_diff = (std::abs(w_data[i] - x_data[i]) / x_data[i]) * 100.0f;
+        REQUIRE(pct_diff < 1);
+    }
+}
+
+TEST_CASE("TestJitMatchesScalarC", "[Codegen]")
+{
+    constexpr gg::dim_t Rows = 6, Cols = 10;
+    gg::Graph graph;
+    auto x = graph.AddInput({ Rows, Cols });
+    auto y = graph.AddInput({ Cols });
+    auto a = x.softmax(1) + gg::sin(x) * gg::log(x * x + 1.0f) - gg::sqrt(gg::pow(x * x, 0.5f) + 1.0f);
+    auto b = gg::max(a, y) + (x == x) + a.swapaxes(0, 1).reshape({ Rows, Cols }) / 3.0f;
+    auto result = b.sum(gg::dim_t{0});
+
+    float x_data[Rows * Cols];
+    float y_data[Cols];
+    RandomMatrix(x_data, Rows * Cols);
+    RandomMatrix(y_data, Cols);
+    x.data() = x_data;
+    y.data() = y_data;
+    auto expected = result.Compile<gg::codegen::BackendScalarC>();
+    auto actual = result.Compile<gg::codegen::BackendJit>();
+    expected.Execute();
+    actual.Execute();
+    for(gg::dim_t i = 0; i < Cols; i++)
+        REQUIRE_THAT(actual.data[i], Catch::Matchers::WithinAbs(expected.data[i], 0.001f));
+}
+
+TEST_CASE("TestTrainJit", "[Train]")
+{
+    gg::nn::Module network;
+    auto x = network.AddInput(4);
+    auto w = network.AddWeight(4);
+    auto L1 = w - x;
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendJit>(network, L1);
+    float x_data[] = { 1.0, 2.0, 3.0, 4.0 };
+    float w_data[] = { -0.1, 0.1, -0.001, 0.0001 };
+    float training_example_data[] = { 0.0, 0.0, 0.0, 0.0 };
+    x.data() = x_data;
+    w.data() = w_data;
+    ctx.training_example = training_example_data;
+    float prev_loss = 1000;
+    for(int i = 0; i < 50; i++)
+    {
+        ctx.Execute();
+        REQUIRE(*ctx.loss < prev_loss);
+    }
+    for(int i = 0; i < 4; i++)
+    {
+        float pct_diff = (std::abs(w_data[i] - x_data[i]) / x_data[i]) * 100.0f;
+        REQUIRE(pct_diff < 1);
+    }
+}
+
+TEST_CASE("TestExecutor", "[Executor]")
+{
+    constexpr size_t NumTasks = 200;
+    std::default_random_engine rng(0);
+    std::uniform_int_distribution<size_t> num_edges(0, 3);
+    gg::TaskGraph graph;
+    graph.successors.resize(NumTasks);
+    graph.num_predecessors.resize(NumTasks);
+    std::vector<std::vector<size_t>> predecessors(NumTasks);
+    for(size_t to = 1; to < NumTasks; to++)
+    {
+        std::uniform_int_distribution<size_t> from(0, to - 1);
+        for(size_t i = num_edges(rng); i > 0; i--)
+        {
+            size_t f = from(rng);
+            graph.AddEdge(f, to);
+            predecessors[to].push_back(f);
+        }
+    }
+
+    gg::Executor executor(4);
+    for(int run = 0; run < 10; run++)
+    {
+        std::vector<std::atomic<size_t>> finished(NumTasks);
+        std::atomic<size_t> clock = 0;
+        std::atomic<bool> ordered = true;
+        executor.Run(graph, [&](size_t task)
+        {
+            for(size_t p : predecessors[task])
+                if(finished[p] == 0)
+                    ordered = false;
+            finished[task] = ++clock;
+        });
+        REQUIRE(ordered);
+        REQUIRE(clock == NumTasks);
+    }
+
+    // Workers with nothing to do sleep rather than spin while a chain of tasks runs
+    gg::TaskGraph chain;
+    chain.successors.resize(5);
+    chain.num_predecessors.resize(5);
+    for(size_t task = 0; task + 1 < 5; task++)
+        chain.AddEdge(task, task + 1);
+    std::clock_t cpu_start = std::clock();
+    executor.Run(chain, [](size_t) { std::this_thread::sleep_for(std::chrono::milliseconds(20)); });
+    double cpu_seconds = static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    REQUIRE(cpu_seconds < 0.05);
+}
+
+TEST_CASE("TestTrainMultithreaded", "[Train]")
+{
+    auto train = [](size_t num_threads, float *w1_data, float *w2_data)
+    {
+        gg::nn::Module network;
+        auto x = network.AddInput(4);
+        auto w1 = network.AddWeight(4);
+        auto w2 = network.AddWeight(4);
+        auto L1 = (w1 - x) + (w2 * x);
+        auto backend = std::make_unique<gg::codegen::BackendScalarC>();
+        backend->num_threads = num_threads;
+        gg::TrainingContext ctx = gg::CompileTrainingGraph(network, L1, std::move(backend));
+        float x_data[] = { 1.0, 2.0, 3.0, 4.0 };
+        float training_example_data[] = { 0.0, 0.0, 0.0, 0.0 };
+        x.data() = x_data;
+        w1.data() = w1_data;
+        w2.data() = w2_data;
+        ctx.training_example = training_example_data;
+        for(int i = 0; i < 20; i++)
+            ctx.Execute();
+    };
+
+    float expected_w1[] = { -0.1, 0.1, -0.001, 0.0001 };
+    float expected_w2[] = { 0.2, -0.3, 0.05, 0.01 };
+    float actual_w1[] = { -0.1, 0.1, -0.001, 0.0001 };
+    float actual_w2[] = { 0.2, -0.3, 0.05, 0.01 };
+    train(1, expected_w1, expected_w2);
+    train(4, actual_w1, actual_w2);
+    for(int i = 0; i < 4; i++)
+    {
+        REQUIRE(actual_w1[i] == expected_w1[i]);
+        REQUIRE(actual_w2[i] == expected_w2[i]);
+    }
+}
+
+TEST_CASE("TestEstimateCost", "[Codegen]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput({ 4, 8 });
+    auto y = graph.AddInput({ 8, 3 });
+    gg::codegen::Program matmul = gg::codegen::CodegenNode(x % y);
+    gg::codegen::FunctionCost cost = gg::codegen::EstimateCost(matmul, matmul.functions[0]);
+    REQUIRE(cost.flops == 2 * 4 * 8 * 3);
+    REQUIRE(cost.bytes == (4 * 8 + 8 * 3 + 4 * 3) * sizeof(float));
+
+    // Max, then subtract + exp + sum, then subtract + exp + divide for each element
+    gg::codegen::Program softmax = gg::codegen::CodegenNode(x.softmax(1));
+    REQUIRE(softmax.functions.size() == 1);
+    REQUIRE(gg::codegen::EstimateCost(softmax, softmax.functions[0]).flops == 4 * 8 * 7);
+}
+
+TEST_CASE("TestProfile", "[Codegen]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput({ 4, 8 });
+    auto y = graph.AddInput({ 8, 3 });
+    float x_data[4 * 8];
+    float y_data[8 * 3];
+    RandomMatrix(x_data, 4 * 8);
+    RandomMatrix(y_data, 8 * 3);
+    x.data() = x_data;
+    y.data() = y_data;
+    auto z = (x % y).relu();
+
+    std::vector<std::unique_ptr<gg::codegen::Backend>> backends;
+    backends.emplace_back(std::make_unique<gg::codegen::BackendScalarC>());
+    backends.emplace_back(std::make_unique<gg::codegen::BackendJit>());
+    for(auto &backend : backends)
+    {
+        backend->profile = true;
+        auto result = z.Compile(std::move(backend));
+        for(int i = 0; i < 3; i++)
+            result.Execute();
+
+        const gg::codegen::Program &program = *result.backend->GetProgram();
+        std::vector<gg::codegen::FunctionProfile> profile = result.backend->GetProfile();
+        REQUIRE(profile.size() == program.functions.size());
+        REQUIRE(std::string(profile.front().node_kind) == "ReduceOp"); // The matmul
+        REQUIRE(std::string(profile.back().node_kind) == "BinaryOp"); // The relu
+        for(size_t ifn = 0; ifn < profile.size(); ifn++)
+        {
+            REQUIRE(profile[ifn].calls == 3);
+            REQUIRE(profile[ifn].bytes == 3 * gg::codegen::EstimateCost(program, program.functions[ifn]).bytes);
+        }
+        result.backend->ResetProfile();
+        REQUIRE(result.backend->GetProfile().front().calls == 0);
+    }
+
+    // Backends that compile the same program load the same object but count on their own
+    std::vector<gg::CompiledTensor> results;
+    for(int i = 0; i < 2; i++)
+    {
+        auto backend = std::make_unique<gg::codegen::BackendScalarC>();
+        backend->profile = true;
+        results.push_back(z.Compile(std::move(backend)));
+    }
+    results[0].Execute();
+    results[0].Execute();
+    results[1].Execute();
+    REQUIRE(results[0].backend->GetProfile().front().calls == 2);
+    REQUIRE(results[1].backend->GetProfile().front().calls == 1);
+    results[0].backend->ResetProfile();
+    REQUIRE(results[0].backend->GetProfile().front().calls == 0);
+    REQUIRE(results[1].backend->GetProfile().front().calls == 1);
+    auto context = results[1].backend->CreateContext();
+    context->Execute();
+    REQUIRE(results[1].backend->GetProfile().front().calls == 2);
+
+    auto unprofiled = z.Compile<gg::codegen::BackendScalarC>();
+    unprofiled.Execute();
+    REQUIRE(unprofiled.backend->GetProfile().empty());
+}
+
+TEST_CASE("TestDTypeConversions", "[DType]")
+{
+    for(float x : { 0.0f, 1.0f, -2.5f, 0.1f, 65504.0f, 6.1e-5f, 3.0e-7f, -1.0e-3f })
+    {
+        REQUIRE_THAT(gg::FromF16(gg::ToF16(x)), Catch::Matchers::WithinRel(x, 0.001f) || Catch::Matchers::WithinAbs(x, 3.0e-8f));
+        REQUIRE_THAT(gg::FromBF16(gg::ToBF16(x)), Catch::Matchers::WithinRel(x, 0.004f));
+    }
+    REQUIRE(gg::ToF16(1.0f) == 0x3C00);
+    REQUIRE(gg::ToF16(65520.0f) == 0x7C00); // Rounds to infinity
+    REQUIRE(gg::ToF16(5.9604645e-8f) == 0x0001); // Smallest subnormal
+    REQUIRE(gg::FromF16(0x0001) == 5.9604645e-8f);
+    REQUIRE(gg::ToBF16(1.0f) == 0x3F80);
+    REQUIRE(gg::ToBF16(1.00390625f) == 0x3F80); // Ties to even
+    REQUIRE(gg::ToBF16(1.01171875f) == 0x3F82);
+    REQUIRE(gg::ToI8(0.26f, 0.1f) == 3);
+    REQUIRE(gg::ToI8(-100.0f, 0.1f) == -127);
+    REQUIRE(gg::FromI8(-3, 0.5f) == -1.5f);
+    REQUIRE(gg::ToU8(-1.0f, 0.1f) == 0);
+    REQUIRE(gg::ToU8(300.0f, 1.0f) == 255);
+    REQUIRE(gg::FromU8(255, 1.0f / 255.0f) == 1.0f);
+}
+
+template <typename TBackend>
+void TestMixedPrecision()
+{
+    constexpr gg::dim_t Rows = 5, Cols = 6;
+    float x_f32[Rows * Cols];
+    float y_f32[Cols * Rows];
+    RandomMatrix(x_f32, Rows * Cols);
+    RandomMatrix(y_f32, Cols * Rows);
+    uint16_t x_f16[Rows * Cols];
+    uint16_t y_bf16[Cols * Rows];
+    int8_t bias_i8[Rows];
+    float x_expected[Rows * Cols];
+    float y_expected[Cols * Rows];
+    float bias_expected[Rows];
+    for(gg::dim_t i = 0; i < Rows * Cols; i++)
+    {
+        x_f16[i] = gg::ToF16(x_f32[i]);
+        y_bf16[i] = gg::ToBF16(y_f32[i]);
+        x_expected[i] = gg::FromF16(x_f16[i]);
+        y_expected[i] = gg::FromBF16(y_bf16[i]);
+    }
+    for(gg::dim_t i = 0; i < Rows; i++)
+    {
+        bias_i8[i] = static_cast<int8_t>(i * 10 - 20);
+        bias_expected[i] = gg::FromI8(bias_i8[i], 0.05f);
+    }
+
+    gg::Graph graph;
+    auto x = graph.AddInput({ Rows, Cols }, gg::DType::F16);
+    auto y = graph.AddInput({ Cols, Rows }, gg::DType::BF16);
+    auto bias = graph.AddInput({ Rows, 1 }, gg::DType::I8);
+    x.data() = x_f16;
+    y.data() = y_bf16;
+    bias.data() = bias_i8;
+    bias.scale() = 0.05f;
+    auto result = ((x % y) + bias).Compile<TBackend>();
+    result.Execute();
+
+    float expected[Rows * Rows];
+    NaiveMatmul(x_expected, y_expected, Rows, Cols, Rows, expected);
+    for(gg::dim_t i = 0; i < Rows; i++)
+        for(gg::dim_t j = 0; j < Rows; j++)
+            REQUIRE_THAT(result.data[i * Rows + j], Catch::Matchers::WithinAbs(expected[i * Rows + j] + bias_expected[i], 0.001f));
+}
+
+TEST_CASE("TestMixedPrecision", "[DType]")
+{
+    TestMixedPrecision<gg::codegen::BackendScalarC>();
+    TestMixedPrecision<gg::codegen::BackendJit>();
+}
+
+TEST_CASE("TestTrainBF16", "[Train]")
+{
+    gg::nn::Module network;
+    auto x = network.AddInput(4);
+    auto w = network.AddWeight(4, gg::DType::BF16);
+    auto L1 = w - x;
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, L1);
+    float x_data[] = { 1.0, 2.0, 3.0, 4.0 };
+    uint16_t w_data[4];
+    for(int i = 0; i < 4; i++)
+        w_data[i] = gg::ToBF16(0.0f);
+    float training_example_data[] = { 0.0, 0.0, 0.0, 0.0 };
+    x.data() = x_data;
+    w.data() = w_data;
+    ctx.training_example = training_example_data;
+    for(int i = 0; i < 50; i++)
+        ctx.Execute();
+    // Training stalls once an update rounds away in bf16, i.e. once the learning rate
+    // times the error drops below half of an ulp of w, which is up to 4% of w here
+    for(int i = 0; i < 4; i++)
+        REQUIRE_THAT(gg::FromBF16(w_data[i]), Catch::Matchers::WithinRel(x_data[i], 0.05f));
+}
+
+TEST_CASE("TestHashConsing", "[Graph]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput({ 4, 8 });
+    auto y = graph.AddInput({ 4, 8 });
+    REQUIRE(x.node_idx != y.node_idx);
+
+    auto a = gg::exp(x * y).sum(gg::dim_t{1});
+    size_t num_nodes = graph.nodes.size();
+    auto b = gg::exp(x * y).sum(gg::dim_t{1});
+    REQUIRE(a.node_idx == b.node_idx);
+    REQUIRE(graph.nodes.size() == num_nodes);
+
+    REQUIRE((x * y).node_idx != (y * x).node_idx);
+    REQUIRE((x + 1.0f).node_idx != (x + 2.0f).node_idx);
+    REQUIRE(x.sum(gg::dim_t{1}).node_idx != x.sum(gg::dim_t{1}, true).node_idx);
+    REQUIRE(x.reshape({ 8, 4 }).node_idx != x.reshape({ 2, 16 }).node_idx);
+}
+
+TEST_CASE("TestConcurrentGraphBuild", "[Graph]")
+{
+    constexpr int NumThreads = 4;
+    constexpr int NumLayers = 500;
+    gg::Graph graph;
+    auto x = graph.AddInput({ 2, 3 });
+
+    // Each thread builds a deep chain of its own that also shares the same head, and the
+    // chains add enough nodes that the arena grows while the others append
+    std::vector<gg::GraphNodeHandle> heads(NumThreads);
+    std::vector<gg::GraphNodeHandle> chains(NumThreads);
+    std::vector<gg::GraphNodeHandle> starts;
+    for(int i = 0; i < NumThreads; i++)
+        starts.push_back(graph.AddInput({ 2, 3 }));
+    std::vector<std::thread> threads;
+    for(int i = 0; i < NumThreads; i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            heads[i] = gg::exp(x * 2.0f).sum(gg::dim_t{1}, true);
+            auto chain = starts[i];
+            for(int layer = 0; layer < NumLayers; layer++)
+                chain = 0.5f * chain + heads[i];
+            chains[i] = chain;
+        });
+    }
+    for(std::thread &thread : threads)
+        thread.join();
+
+    for(int i = 1; i < NumThreads; i++)
+        REQUIRE(heads[i].node_idx == heads[0].node_idx);
+    REQUIRE(graph.inputs.size() == NumThreads + 1);
+
+    float x_data[] = { 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
+    float chain_data[] = { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f };
+    x.data() = x_data;
+    for(int i = 0; i < NumThreads; i++)
+        starts[i].data() = chain_data;
+    auto result = chains[0] + chains[NumThreads - 1];
+    auto compiled = result.Compile<gg::codegen::BackendScalarC>();
+    compiled.Execute();
+
+    // The chain converges to twice the head: 2 * 3 * exp(0) and 2 * 3 * exp(2)
+    float expected[] = { 6.0f, 6.0f, 6.0f, 6.0f * std::exp(2.0f), 6.0f * std::exp(2.0f), 6.0f * std::exp(2.0f) };
+    for(int i = 0; i < 6; i++)
+        REQUIRE_THAT(compiled.data[i], Catch::Matchers::WithinRel(2.0f * expected[i], 0.001f));
+}
+
+TEST_CASE("TestEliminateCommonSubexpressions", "[Codegen]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput({ 4, 8 });
+    auto errors = x - x.mean(1, true);
+    auto result = (errors * errors) + gg::exp(errors);
+    gg::codegen::Program program = gg::codegen::CodegenNode(result);
+
+    // The mean gets computed once and each of x - mean, times, exp and plus once per element
+    const gg::codegen::FunctionBuilder &f = program.functions.back();
+    auto count = [&](auto type)
+    {
+        return std::count_if(f.insns.begin(), f.insns.end(), [](const gg::codegen::Instruction &insn)
+        {
+            return std::holds_alternative<decltype(type)>(insn);
+        });
+    };
+    REQUIRE(count(gg::codegen::StoreInsn{}) == 1);
+    REQUIRE(count(gg::codegen::UnaryInsn{}) == 1);
+
+    float x_data[4 * 8];
+    RandomMatrix(x_data, 4 * 8);
+    x.data() = x_data;
+    auto compiled = result.Compile<gg::codegen::BackendScalarC>();
+    compiled.Execute();
+    for(int i = 0; i < 4; i++)
+    {
+        float mean = 0.0f;
+        for(int j = 0; j < 8; j++)
+            mean += x_data[i * 8 + j] / 8;
+        for(int j = 0; j < 8; j++)
+        {
+            float e = x_data[i * 8 + j] - mean;
+            REQUIRE_THAT(compiled.data[i * 8 + j], Catch::Matchers::WithinAbs(e * e + std::exp(e), 0.0001f));
+        }
+    }
+}
+
+TEST_CASE("TestSimplifyGraph", "[Codegen]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput({ 4, 6 });
+    auto simplify = [](gg::GraphNodeHandle node) { return gg::codegen::SimplifyGraph({ node })[0]; };
+
+    REQUIRE(simplify((x * 1.0f + 0.0f) / 1.0f).node_idx == x.node_idx);
+    REQUIRE(simplify(-(-x)).node_idx == x.node_idx);
+    REQUIRE(simplify(gg::exp(gg::log(x))).node_idx == x.node_idx);
+    REQUIRE(simplify(x.reshape({ 4, 6 })).node_idx == x.node_idx);
+    REQUIRE(simplify(x + (graph.Immediate(2.0f) * 3.0f - 6.0f)).node_idx == x.node_idx);
+    auto folded = simplify(gg::sqrt(graph.Immediate(2.0f) * 8.0f));
+    REQUIRE(folded->Kind() == gg::GraphNode::Kind::Immediate);
+    REQUIRE(folded->u.i.immediate.value == 4.0f);
+
+    // Adding 0 to a smaller operand broadcasts it, so that has to stay
+    auto row = graph.AddInput(6);
+    auto broadcast = simplify(row + x * 0.0f);
+    REQUIRE(broadcast.shape() == gg::Shape{ 4, 6 });
+
+    // Reshapes of a view compose into one view, but flattening a transposed view can't
+    auto transposed = x.as_strided({ 6, 4 }, { 1, 6 }, 0);
+    auto composed = simplify(transposed.reshape({ 3, 2, 4 }).as_strided({ 3, 4 }, { 8, 1 }, 4));
+    REQUIRE(composed->Kind() == gg::GraphNode::Kind::ViewOp);
+    REQUIRE(composed->u.v.view_op.x.node_idx == x.node_idx);
+    auto flattened = simplify(transposed.reshape(24));
+    REQUIRE(flattened->u.v.view_op.x.node_idx == transposed.node_idx);
+
+    float x_data[4 * 6];
+    float row_data[6];
+    RandomMatrix(x_data, 4 * 6);
+    RandomMatrix(row_data, 6);
+    x.data() = x_data;
+    row.data() = row_data;
+    auto result = (transposed.reshape({ 3, 2, 4 }).as_strided({ 3, 4 }, { 8, 1 }, 4) * 1.0f).Compile<gg::codegen::BackendScalarC>();
+    result.Execute();
+    for(int i = 0; i < 3; i++)
+    {
+        for(int j = 0; j < 4; j++)
+        {
+            // Element (i, 1, j) of the reshape is element (2 * i + 1, j) of the transpose
+            REQUIRE(result.data[i * 4 + j] == x_data[j * 6 + 2 * i + 1]);
+        }
+    }
+    auto flattened_result = (-(-transposed.reshape(24))).Compile<gg::codegen::BackendScalarC>();
+    flattened_result.Execute();
+    for(int i = 0; i < 24; i++)
+        REQUIRE(flattened_result.data[i] == x_data[(i % 4) * 6 + i / 4]);
+}
+
+TEST_CASE("TestFusedWeightUpdate", "[Train]")
+{
+    {
+        // The update fuses into the gradient's kernel: one function for the loss, one
+        // that writes the new weight in place
+        gg::nn::Module network;
+        auto x = network.AddInput(4);
+        auto w = network.AddWeight(4);
+        gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, w - x);
+        const gg::codegen::Program &prog = *ctx.backend->GetProgram();
+        REQUIRE(prog.functions.size() == 2);
+        const gg::codegen::BufferDescriptor &output = prog.buffers[prog.functions.back().output_buffer];
+        REQUIRE(std::holds_alternative<gg::GraphNodeHandle>(output.id));
+        REQUIRE(std::get<gg::GraphNodeHandle>(output.id).node_idx == w.node_idx);
+    }
+
+    // Each layer's gradient reads the other layer's weight, so the updates must not
+    // overwrite it before both gradients are computed
+    gg::nn::Module network;
+    auto x = network.AddInput(3);
+    auto w1 = network.AddWeight({ 2, 3 });
+    auto w2 = network.AddWeight({ 1, 2 });
+    auto y = w2 % (w1 % x);
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, y, 0.1f);
+    float x_data[] = { 1.0f, -2.0f, 0.5f };
+    float w1_data[] = { 0.1f, 0.2f, -0.3f, 0.4f, -0.5f, 0.6f };
+    float w2_data[] = { 0.7f, -0.8f };
+    float training_example_data[] = { 0.25f };
+    x.data() = x_data;
+    w1.data() = w1_data;
+    w2.data() = w2_data;
+    ctx.training_example = training_example_data;
+
+    float h[2];
+    for(int j = 0; j < 2; j++)
+        h[j] = w1_data[3 * j] * x_data[0] + w1_data[3 * j + 1] * x_data[1] + w1_data[3 * j + 2] * x_data[2];
+    float error = w2_data[0] * h[0] + w2_data[1] * h[1] - training_example_data[0];
+    float expected_w1[6];
+    float expected_w2[2];
+    for(int j = 0; j < 2; j++)
+    {
+        expected_w2[j] = w2_data[j] - 0.1f * 2.0f * error * h[j];
+        for(int k = 0; k < 3; k++)
+            expected_w1[3 * j + k] = w1_data[3 * j + k] - 0.1f * 2.0f * error * w2_data[j] * x_data[k];
+    }
+
+    ctx.Execute();
+    REQUIRE_THAT(*ctx.loss, Catch::Matchers::WithinRel(error * error, 0.0001f));
+    for(int i = 0; i < 6; i++)
+        REQUIRE_THAT(w1_data[i], Catch::Matchers::WithinRel(expected_w1[i], 0.0001f));
+    for(int i = 0; i < 2; i++)
+        REQUIRE_THAT(w2_data[i], Catch::Matchers::WithinRel(expected_w2[i], 0.0001f));
+}
+
+template <typename TBackend>
+void TestOptimizer(gg::Optimizer optimizer, size_t num_moments)
+{
+    gg::nn::Module network;
+    auto x = network.AddInput({ 2, 3 });
+    auto w = network.AddWeight({ 2, 3 });
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<TBackend>(network, w - x, optimizer);
+
+    // The loss, and one function that updates the weight and its moments in place
+    const gg::codegen::Program &prog = *ctx.backend->GetProgram();
+    REQUIRE(prog.functions.size() == 2);
+    const gg::codegen::FunctionBuilder &update = prog.functions.back();
+    REQUIRE(update.extra_outputs.size() == num_moments);
+    REQUIRE(std::get<gg::GraphNodeHandle>(prog.buffers[update.output_buffer].id).node_idx == w.node_idx);
+
+    float x_data[] = { 1.0f, -2.0f, 0.5f, 3.0f, 0.0f, -1.0f };
+    float w_data[] = { 0.5f, 0.5f, -0.5f, 1.0f, 2.0f, 0.0f };
+    float training_example_data[6] = {};
+    x.data() = x_data;
+    w.data() = w_data;
+    ctx.training_example = training_example_data;
+
+    float expected[6];
+    float m[6] = {};
+    float v[6] = {};
+    std::copy(std::begin(w_data), std::end(w_data), expected);
+    for(int step = 1; step <= 5; step++)
+    {
+        // The learning rate changes without recompiling
+        ctx.optimizer.learning_rate = optimizer.learning_rate / step;
+        float lr = ctx.optimizer.learning_rate;
+        for(int i = 0; i < 6; i++)
+        {
+            float g = 2.0f * (expected[i] - x_data[i]);
+            if(optimizer.type != gg::Optimizer::Type::AdamW)
+                g += optimizer.weight_decay * expected[i];
+            if(optimizer.type == gg::Optimizer::Type::SGD)
+            {
+                m[i] = optimizer.momentum * m[i] + g;
+                expected[i] -= lr * m[i];
+                continue;
+            }
+            m[i] = optimizer.beta1 * m[i] + (1.0f - optimizer.beta1) * g;
+            v[i] = optimizer.beta2 * v[i] + (1.0f - optimizer.beta2) * g * g;
+            float m_hat = m[i] / (1.0f - std::pow(optimizer.beta1, step));
+            float v_hat = v[i] / (1.0f - std::pow(optimizer.beta2, step));
+            if(optimizer.type == gg::Optimizer::Type::AdamW)
+                expected[i] -= lr * optimizer.weight_decay * expected[i];
+            expected[i] -= lr * m_hat / (std::sqrt(v_hat) + optimizer.epsilon);
+        }
+        ctx.Execute();
+        for(int i = 0; i < 6; i++)
+            REQUIRE_THAT(w_data[i], Catch::Matchers::WithinAbs(expected[i], 0.0001f));
+    }
+}
+
+TEST_CASE("TestOptimizers", "[Train]")
+{
+    using Type = gg::Optimizer::Type;
+    gg::Optimizer momentum = { .type = Type::SGD, .learning_rate = 0.1f, .momentum = 0.9f, .weight_decay = 0.01f };
+    gg::Optimizer adam = { .type = Type::Adam, .learning_rate = 0.05f, .weight_decay = 0.01f };
+    gg::Optimizer adamw = { .type = Type::AdamW, .learning_rate = 0.05f, .weight_decay = 0.1f };
+    TestOptimizer<gg::codegen::BackendScalarC>({ .type = Type::SGD, .learning_rate = 0.1f }, 0);
+    TestOptimizer<gg::codegen::BackendScalarC>(momentum, 1);
+    TestOptimizer<gg::codegen::BackendScalarC>(adam, 2);
+    TestOptimizer<gg::codegen::BackendScalarC>(adamw, 2);
+    TestOptimizer<gg::codegen::BackendOpenMP>(adamw, 2);
+    TestOptimizer<gg::codegen::BackendJit>(momentum, 1);
+    TestOptimizer<gg::codegen::BackendJit>(adamw, 2);
+}
+
+template <typename TBackend>
+void TestDataParallel(size_t bucket_bytes)
+{
+    // Two ranks, each with one example of the batch. Both gradients read both weights,
+    // so the updates must wait for the sums of both.
+    constexpr size_t NumRanks = 2;
+    float x_data[NumRanks][3] = { { 1.0f, -2.0f, 0.5f }, { -1.0f, 0.5f, 2.0f } };
+    float training_example_data[NumRanks][1] = { { 0.25f }, { -1.0f } };
+    float w1_data[NumRanks][6];
+    float w2_data[NumRanks][2];
+    const float w1_init[] = { 0.1f, 0.2f, -0.3f, 0.4f, -0.5f, 0.6f };
+    const float w2_init[] = { 0.7f, -0.8f };
+
+    auto communicators = gg::MakeLocalCommunicators(NumRanks);
+    std::vector<gg::nn::Module> networks(NumRanks);
+    std::vector<gg::TrainingContext> contexts;
+    for(size_t rank = 0; rank < NumRanks; rank++)
+    {
+        auto x = networks[rank].AddInput(3);
+        auto w1 = networks[rank].AddWeight({ 2, 3 });
+        auto w2 = networks[rank].AddWeight({ 1, 2 });
+        contexts.push_back(gg::CompileTrainingGraph<TBackend>(
+            networks[rank],
+            w2 % (w1 % x),
+            { .learning_rate = 0.1f },
+            { .communicator = communicators[rank], .bucket_bytes = bucket_bytes }));
+        REQUIRE(contexts.back().data_parallel->buckets.size() == (bucket_bytes == 1 ? 2 : 1));
+        std::copy(std::begin(w1_init), std::end(w1_init), w1_data[rank]);
+        std::copy(std::begin(w2_init), std::end(w2_init), w2_data[rank]);
+        x.data() = x_data[rank];
+        w1.data() = w1_data[rank];
+        w2.data() = w2_data[rank];
+        contexts.back().training_example = training_example_data[rank];
+    }
+
+    float expected_w1[6];
+    float expected_w2[2];
+    std::copy(std::begin(w1_init), std::end(w1_init), expected_w1);
+    std::copy(std::begin(w2_init), std::end(w2_init), expected_w2);
+    for(int step = 0; step < 3; step++)
+    {
+        float g1[6] = {};
+        float g2[2] = {};
+        float expected_loss[NumRanks];
+        for(size_t rank = 0; rank < NumRanks; rank++)
+        {
+            const float *xr = x_data[rank];
+            float h[2];
+            for(int j = 0; j < 2; j++)
+                h[j] = expected_w1[3 * j] * xr[0] + expected_w1[3 * j + 1] * xr[1] + expected_w1[3 * j + 2] * xr[2];
+            float error = expected_w2[0] * h[0] + expected_w2[1] * h[1] - training_example_data[rank][0];
+            expected_loss[rank] = error * error;
+            for(int j = 0; j < 2; j++)
+            {
+                g2[j] += 2.0f * error * h[j];
+                for(int k = 0; k < 3; k++)
+                    g1[3 * j + k] += 2.0f * error * expected_w2[j] * xr[k];
+            }
+        }
+        for(int i = 0; i < 6; i++)
+            expected_w1[i] -= 0.1f * g1[i];
+        for(int i = 0; i < 2; i++)
+            expected_w2[i] -= 0.1f * g2[i];
+
+        std::vector<std::thread> ranks;
+        for(size_t rank = 0; rank < NumRanks; rank++)
+            ranks.emplace_back([&, rank]() { contexts[rank].Execute(); });
+        for(std::thread &t : ranks)
+            t.join();
+
+        for(size_t rank = 0; rank < NumRanks; rank++)
+        {
+            REQUIRE_THAT(*contexts[rank].loss, Catch::Matchers::WithinRel(expected_loss[rank], 0.0001f));
+            for(int i = 0; i < 6; i++)
+                REQUIRE_THAT(w1_data[rank][i], Catch::Matchers::WithinAbs(expected_w1[i], 0.0001f));
+            for(int i = 0; i < 2; i++)
+                REQUIRE_THAT(w2_data[rank][i], Catch::Matchers::WithinAbs(expected_w2[i], 0.0001f));
+        }
+    }
+}
+
+TEST_CASE("TestDataParallel", "[Train]")
+{
+    TestDataParallel<gg::codegen::BackendScalarC>(1);
+    TestDataParallel<gg::codegen::BackendScalarC>(size_t{1} << 20);
+    TestDataParallel<gg::codegen::BackendJit>(1);
+
+    // The local group checks that the ranks agree on the sizes
+    auto communicators = gg::MakeLocalCommunicators(2);
+    gg::AllReduceQueue queues[] = { gg::AllReduceQueue(communicators[0]), gg::AllReduceQueue(communicators[1]) };
+    float a[2] = { 1.0f, 2.0f };
+    float b[3] = { 3.0f, 4.0f, 5.0f };
+    auto done_a = queues[0].Start({ { a, 2 } });
+    auto done_b = queues[1].Start({ { b, 3 } });
+    REQUIRE_THROWS_AS(done_a.get(), std::domain_error);
+    REQUIRE_THROWS_AS(done_b.get(), std::domain_error);
+}
+
+// Trains a deep MLP for a few steps, returning its weights and the size of its arena
+static std::pair<std::vector<float>, size_t> TrainCheckpointed(const gg::CheckpointOptions &checkpointing, size_t keep_layer = -1)
+{
+    constexpr gg::dim_t Layers = 8, Batch = 32, Hidden = 64;
+    gg::nn::Module network;
+    auto x = network.AddInput({ Batch, Hidden, 1 });
+    std::vector<float> weights(Layers * Hidden * Hidden);
+    std::default_random_engine gen(0);
+    std::uniform_real_distribution<float> dist(-0.2f, 0.2f);
+    std::generate(weights.begin(), weights.end(), [&]() { return dist(gen); });
+
+    gg::CheckpointOptions options = checkpointing;
+    auto activation = x;
+    for(gg::dim_t layer = 0; layer < Layers; layer++)
+    {
+        auto w = network.AddWeight({ Hidden, Hidden });
+        w.data() = &weights[layer * Hidden * Hidden];
+        auto z = w % activation;
+        if(static_cast<size_t>(layer) == keep_layer)
+            options.keep.push_back(z);
+        activation = gg::max(z, 0.0f);
+    }
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(
+        network,
+        activation,
+        { .learning_rate = 0.001f },
+        {},
+        options);
+
+    std::vector<float> x_data(Batch * Hidden);
+    std::vector<float> training_example_data(Batch * Hidden, 0.1f);
+    std::generate(x_data.begin(), x_data.end(), [&]() { return dist(gen); });
+    x.data() = x_data.data();
+    ctx.training_example = training_example_data.data();
+    for(int step = 0; step < 3; step++)
+        ctx.Execute();
+    return { weights, gg::codegen::PlanArena(*ctx.backend->GetProgram(), gg::codegen::BufferAlignment).size_bytes };
+}
+
+TEST_CASE("TestCheckpointing", "[Train]")
+{
+    // The recomputed activations are the same, and only part of them is in memory at once
+    auto [expected, full_arena] = TrainCheckpointed({});
+    for(auto checkpointing : { gg::CheckpointOptions{ .budget_bytes = 16384 }, gg::CheckpointOptions{ .budget_bytes = 0 } })
+    {
+        auto [weights, arena] = TrainCheckpointed(checkpointing);
+        if(checkpointing.budget_bytes == 16384)
+            REQUIRE(arena < full_arena * 3 / 4);
+        for(size_t i = 0; i < weights.size(); i++)
+            REQUIRE_THAT(weights[i], Catch::Matchers::WithinAbs(expected[i], 0.00001f));
+    }
+
+    auto [weights, arena] = TrainCheckpointed({}, 4);
+    REQUIRE(arena < full_arena);
+    for(size_t i = 0; i < weights.size(); i++)
+        REQUIRE_THAT(weights[i], Catch::Matchers::WithinAbs(expected[i], 0.00001f));
+}
+
+TEST_CASE("TestCheckpointingSimplified", "[Train]")
+{
+    // The views on x and the * 1 are simplified away, which rewrites the kept activations too
+    auto train = [](bool keep, std::vector<float> &weights)
+    {
+        gg::nn::Module network;
+        auto x = network.AddInput({ 4, 8 });
+        auto w1 = network.AddWeight({ 4, 8 });
+        auto w2 = network.AddWeight({ 2, 4 });
+        w1.data() = weights.data();
+        w2.data() = weights.data() + 4 * 8;
+        auto h = w1 % x.reshape({ 32 }).reshape({ 8, 4 });
+        auto a = gg::max(h * 1.0f, 0.0f);
+        auto out = w2 % a;
+        gg::CheckpointOptions checkpointing;
+        if(keep)
+            checkpointing.keep = { h, a, out };
+        gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(
+            network,
+            out,
+            { .learning_rate = 0.01f },
+            {},
+            checkpointing);
+
+        std::vector<float> x_data(4 * 8);
+        std::iota(x_data.begin(), x_data.end(), -16.0f);
+        std::vector<float> training_example_data(2 * 4, 0.5f);
+        x.data() = x_data.data();
+        ctx.training_example = training_example_data.data();
+        for(int step = 0; step < 3; step++)
+            ctx.Execute();
+        return ctx.backend->GetProgram()->functions.size();
+    };
+
+    std::vector<float> expected(4 * 8 + 2 * 4);
+    for(size_t i = 0; i < expected.size(); i++)
+        expected[i] = 0.01f * static_cast<float>(static_cast<int>(i % 7) - 3);
+    std::vector<float> weights = expected;
+    size_t unchecked_functions = train(false, expected);
+    REQUIRE(train(true, weights) == unchecked_functions);
+    for(size_t i = 0; i < weights.size(); i++)
+        REQUIRE_THAT(weights[i], Catch::Matchers::WithinAbs(expected[i], 0.00001f));
+}
+
+struct CountingDataset : gg::Dataset
+{
+    size_t NumExamples() const override { return 10; }
+    size_t InputSize() const override { return 2; }
+    size_t LabelSize() const override { return 1; }
+
+    void Read(size_t iexample, float *input, float *label) override
+    {
+        if(iexample == throw_on)
+            throw std::runtime_error("Unreadable example");
+        input[0] = static_cast<float>(iexample);
+        input[1] = static_cast<float>(iexample) + 0.5f;
+        label[0] = -static_cast<float>(iexample);
+    }
+
+    size_t throw_on = -1;
+};
+
+TEST_CASE("TestDataLoader", "[DataLoader]")
+{
+    gg::DataLoader in_order(std::make_unique<CountingDataset>(), { .batch_size = 3, .shuffle = false });
+    REQUIRE(in_order.NumBatches() == 3);
+    float *input;
+    float *label;
+    for(int iepoch = 0; iepoch < 2; iepoch++)
+    {
+        for(size_t ibatch = 0; ibatch < 3; ibatch++)
+        {
+            REQUIRE(in_order.Next(input, label));
+            for(size_t i = 0; i < 3; i++)
+            {
+                float iexample = static_cast<float>(3 * ibatch + i);
+                REQUIRE(input[2 * i] == iexample);
+                REQUIRE(input[2 * i + 1] == iexample + 0.5f);
+                REQUIRE(label[i] == -iexample);
+            }
+        }
+        REQUIRE(!in_order.Next(input, label));
+    }
+
+    // Every epoch sees a different permutation, without repeating examples within it
+    gg::DataLoader shuffled(std::make_unique<CountingDataset>(), { .batch_size = 3, .seed = 1 });
+    std::vector<std::vector<float>> epochs;
+    for(int iepoch = 0; iepoch < 2; iepoch++)
+    {
+        std::vector<float> seen;
+        while(shuffled.Next(input, label))
+        {
+            for(size_t i = 0; i < 3; i++)
+            {
+                REQUIRE(input[2 * i + 1] == input[2 * i] + 0.5f);
+                REQUIRE(label[i] == -input[2 * i]);
+                seen.push_back(input[2 * i]);
+            }
+        }
+        REQUIRE(seen.size() == 9);
+        std::vector<float> sorted = seen;
+        std::sort(sorted.begin(), sorted.end());
+        REQUIRE(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+        epochs.push_back(std::move(seen));
+    }
+    REQUIRE(epochs[0] != epochs[1]);
+
+    // Ranks read disjoint shards of the same shuffle
+    gg::DataLoader rank0(std::make_unique<CountingDataset>(), { .batch_size = 2, .seed = 1, .rank = 0, .num_ranks = 2 });
+    gg::DataLoader rank1(std::make_unique<CountingDataset>(), { .batch_size = 2, .seed = 1, .rank = 1, .num_ranks = 2 });
+    REQUIRE(rank0.NumBatches() == 2);
+    std::vector<float> sharded;
+    float *other_input;
+    float *other_label;
+    while(rank0.Next(input, label))
+    {
+        REQUIRE(rank1.Next(other_input, other_label));
+        sharded.insert(sharded.end(), { input[0], input[2], other_input[0], other_input[2] });
+    }
+    std::sort(sharded.begin(), sharded.end());
+    REQUIRE(std::adjacent_find(sharded.begin(), sharded.end()) == sharded.end());
+    REQUIRE_THROWS_AS(
+        gg::DataLoader(std::make_unique<CountingDataset>(), { .rank = 2, .num_ranks = 2 }),
+        std::domain_error);
+
+    auto failing = std::make_unique<CountingDataset>();
+    failing->throw_on = 4;
+    gg::DataLoader failing_loader(std::move(failing), { .batch_size = 3, .shuffle = false });
+    REQUIRE(failing_loader.Next(input, label));
+    REQUIRE_THROWS_AS(failing_loader.Next(input, label), std::runtime_error);
+}
+
+struct ConstantDataset : gg::Dataset
+{
+    size_t NumExamples() const override { return 8; }
+    size_t InputSize() const override { return 4; }
+    size_t LabelSize() const override { return 4; }
+
+    void Read(size_t, float *input, float *label) override
+    {
+        std::iota(input, input + 4, 1.0f);
+        std::fill(label, label + 4, 0.0f);
+    }
+};
+
+TEST_CASE("TestTrainDataLoader", "[Train]")
+{
+    gg::nn::Module network;
+    auto x = network.AddInput({ 2, 4 });
+    auto w = network.AddWeight(4);
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendScalarC>(network, w - x);
+    float w_data[] = { -0.1, 0.1, -0.001, 0.0001 };
+    w.data() = w_data;
+
+    gg::DataLoader loader(std::make_unique<ConstantDataset>(), { .batch_size = 2 });
+    float prev_loss = 1000;
+    for(int iepoch = 0; iepoch < 10; iepoch++)
+    {
+        size_t num_batches = 0;
+        for(; loader.Next(x, ctx); num_batches++)
+        {
+            ctx.Execute();
+            REQUIRE(*ctx.loss <= prev_loss);
+            prev_loss = *ctx.loss;
+        }
+        REQUIRE(num_batches == 4);
+    }
+    for(int i = 0; i < 4; i++)
+        REQUIRE_THAT(w_data[i], Catch::Matchers::WithinRel(i + 1.0f, 0.01f));
+}
+
+template <typename TBackend>
+void TestIdxFile(const std::filesystem::path &path)
+{
+    gg::IdxFile file(path);
+    REQUIRE(file.dtype == gg::DType::U8);
+    REQUIRE(file.shape == gg::Shape{ 2, 2, 3 });
+    REQUIRE(file.NumElements() == 12);
+
+    // The second example, read in place and normalized by the load
+    gg::Graph graph;
+    auto x = graph.AddInput({ 2, 3 }, gg::DType::U8);
+    x.scale() = 1.0f / 255.0f;
+    file.Bind(x, 6);
+    REQUIRE(x.data() == static_cast<const uint8_t *>(file.elements()) + 6);
+    auto result = (x * 2.0f).template Compile<TBackend>();
+    result.Execute();
+    for(int i = 0; i < 6; i++)
+        REQUIRE_THAT(result.data[i], Catch::Matchers::WithinRel(2.0f * (6 + i * 40) / 255.0f, 0.0001f));
+
+    REQUIRE_THROWS_AS(file.Bind(x, 7), std::out_of_range);
+    auto wrong_dtype = graph.AddInput({ 2, 3 });
+    REQUIRE_THROWS_AS(file.Bind(wrong_dtype), std::domain_error);
+}
+
+TEST_CASE("TestIdxFile", "[DataLoader]")
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "gigagrad-test-idx3-ubyte";
+    {
+        uint8_t contents[4 + 3 * 4 + 12] = { 0, 0, 0x08, 3, 0, 0, 0, 2, 0, 0, 0, 2, 0, 0, 0, 3 };
+        for(int i = 0; i < 12; i++)
+            contents[16 + i] = static_cast<uint8_t>(i < 6 ? i : 6 + (i - 6) * 40);
+        FILE *f = std::fopen(path.c_str(), "wb");
+        REQUIRE(f);
+        REQUIRE(std::fwrite(contents, 1, sizeof(contents), f) == sizeof(contents));
+        std::fclose(f);
+    }
+    TestIdxFile<gg::codegen::BackendScalarC>(path);
+    TestIdxFile<gg::codegen::BackendJit>(path);
+    std::filesystem::remove(path);
+    REQUIRE_THROWS_AS(gg::IdxFile(path), std::system_error);
+}
+
+TEST_CASE("TestExport", "[Export]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput(4);
+    auto w = graph.AddInput({ 2, 4 });
+    float x_data[] = { 1.0f, -2.0f, 3.0f, 0.5f };
+    float w_data[] = { 0.1f, 0.2f, 0.3f, 0.4f, -1.0f, 1.0f, -1.0f, 1.0f };
+    x.data() = x_data;
+    w.data() = w_data;
+    auto result = ((w % x) + 1.0f).Compile<gg::codegen::BackendScalarC>();
+    result.Execute();
+
+    // Paths reach the compiler as they are, without going through the shell
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / "gigagrad test-export; $HOME";
+    std::vector<gg::GraphNodeHandle> tensors = result.Export(directory, { .name = "test_model", .baked_tensors = { w } });
+    REQUIRE(tensors.size() == 1);
+    REQUIRE(tensors[0].node_idx == x.node_idx);
+    REQUIRE(std::filesystem::exists(directory / "libtest_model.a"));
+
+    // Link a program against it that knows nothing about gigagrad
+    std::string driver = R"(
+#include <stdio.h>
+#include <stdlib.h>
+#include "test_model.h"
+int main(void)
+{
+    float x[] = { 1.0f, -2.0f, 3.0f, 0.5f };
+    void *tensors[TEST_MODEL_NUM_TENSORS] = { x };
+    void *arena = aligned_alloc(TEST_MODEL_ARENA_ALIGNMENT, TEST_MODEL_ARENA_BYTES);
+    float *output = test_model_run(tensors, arena);
+    for(int i = 0; i < TEST_MODEL_OUTPUT_ELEMENTS; i++)
+        printf("%a\n", output[i]);
+    return 0;
+}
+)";
+    FILE *file = std::fopen((directory / "driver.c").c_str(), "w");
+    REQUIRE(file);
+    std::fputs(driver.c_str(), file);
+    std::fclose(file);
+    auto quote = [](const std::filesystem::path &path) { return "'" + path.string() + "'"; };
+    std::string command = "cc " + quote(directory / "driver.c") + " -I" + quote(directory)
+        + " -L" + quote(directory) + " -ltest_model -lm -o " + quote(directory / "driver");
+    REQUIRE(std::system(command.c_str()) == 0);
+
+    FILE *output = popen(quote(directory / "driver").c_str(), "r");
+    REQUIRE(output);
+    std::vector<float> values;
+    float value;
+    while(std::fscanf(output, "%a", &value) == 1)
+        values.push_back(value);
+    REQUIRE(pclose(output) == 0);
+    REQUIRE(values.size() == 2);
+    for(size_t i = 0; i < values.size(); i++)
+        REQUIRE_THAT(values[i], Catch::Matchers::WithinRel(result.data[i], 0.00001f));
+    REQUIRE_THROWS_AS(result.Export(directory, { .compiler = "gigagrad-no-such-compiler" }), std::system_error);
+    std::filesystem::remove_all(directory);
+}
+
+template <typename TBackend>
+void TestSplitReduction()
+{
+    constexpr gg::dim_t N = 1 << 20;
+    gg::Graph graph;
+    auto x = graph.AddInput({ N });
+    std::vector<float> x_data(N);
+    RandomMatrix(x_data.data(), N);
+    x.data() = x_data.data();
+
+    // Partial sums of chunks, then their sum
+    gg::codegen::Program program = gg::codegen::CodegenNode(x.sum());
+    REQUIRE(program.functions.size() == 2);
+
+    double expected_sum = 0.0;
+    float expected_max = x_data[0];
+    for(float value : x_data)
+    {
+        expected_sum += value;
+        expected_max = std::max(expected_max, value);
+    }
+    auto sum = x.sum().Compile<TBackend>();
+    auto max = x.max().Compile<TBackend>();
+    sum.Execute();
+    max.Execute();
+    REQUIRE_THAT(sum.data[0], Catch::Matchers::WithinAbs(expected_sum, 0.5));
+    REQUIRE(max.data[0] == expected_max);
+
+    // Rows of a transposed matrix, which are reduced along the untransposed layout
+    constexpr gg::dim_t Rows = 3, Cols = 640;
+    auto y = graph.AddInput({ Cols, Rows });
+    std::vector<float> y_data(Rows * Cols);
+    RandomMatrix(y_data.data(), y_data.size());
+    y.data() = y_data.data();
+    auto row_sums = y.as_strided({ Rows, Cols }, { 1, Rows }, 0).sum(gg::dim_t{1}).Compile<TBackend>();
+    row_sums.Execute();
+    for(gg::dim_t irow = 0; irow < Rows; irow++)
+    {
+        float expected = 0.0f;
+        for(gg::dim_t icol = 0; icol < Cols; icol++)
+            expected += y_data[icol * Rows + irow];
+        REQUIRE_THAT(row_sums.data[irow], Catch::Matchers::WithinAbs(expected, 0.001f));
+    }
+}
+
+TEST_CASE("TestSplitReduction", "[Codegen]")
+{
+    TestSplitReduction<gg::codegen::BackendScalarC>();
+    TestSplitReduction<gg::codegen::BackendOpenMP>();
+    TestSplitReduction<gg::codegen::BackendJit>();
+
+    // The innermost reduction loop walks the contiguous axis, in blocks of 8 accumulators
+    gg::Graph graph;
+    auto x = graph.AddInput({ 64, 256 });
+    gg::codegen::Program program = gg::codegen::CodegenNode(x.as_strided({ 256, 64 }, { 1, 256 }, 0).sum());
+    const gg::codegen::FunctionBuilder &fn = program.functions[0];
+    auto innermost = std::find_if(
+        fn.insns.rbegin(),
+        fn.insns.rend(),
+        [](const gg::codegen::Instruction &insn) { return std::holds_alternative<gg::codegen::BeginLoopInsn>(insn); });
+    REQUIRE(std::get<gg::codegen::BeginLoopInsn>(*innermost).range == 256 / 8);
+}
+
+template <typename TBackend>
+void TestLoopOrder()
+{
+    constexpr gg::dim_t A = 40, B = 16, C = 48;
+    gg::Graph graph;
+    auto x = graph.AddInput({ A, B, C });
+    std::vector<float> x_data(A * B * C);
+    RandomMatrix(x_data.data(), x_data.size());
+    x.data() = x_data.data();
+
+    // Reduced along the outermost axis, tiled along the innermost one
+    auto sum = x.sum(gg::dim_t{0}).Compile<TBackend>();
+    auto max = (x + 10.0f).max(gg::dim_t{1}).Compile<TBackend>();
+    sum.Execute();
+    max.Execute();
+    for(gg::dim_t ib = 0; ib < B; ib++)
+    {
+        for(gg::dim_t ic = 0; ic < C; ic++)
+        {
+            float expected = 0.0f;
+            for(gg::dim_t ia = 0; ia < A; ia++)
+                expected += x_data[ia * B * C + ib * C + ic];
+            REQUIRE_THAT(sum.data[ib * C + ic], Catch::Matchers::WithinAbs(expected, 0.0001f));
+        }
+    }
+    for(gg::dim_t ia = 0; ia < A; ia++)
+    {
+        for(gg::dim_t ic = 0; ic < C; ic++)
+        {
+            float expected = 0.0f;
+            for(gg::dim_t ib = 0; ib < B; ib++)
+                expected = std::max(expected, x_data[ia * B * C + ib * C + ic] + 10.0f);
+            REQUIRE(max.data[ia * C + ic] == expected);
+        }
+    }
+
+    // Stored transposed, read contiguously
+    auto transposed = x.as_strided({ C, B, A }, { 1, C, B * C }, 0);
+    auto doubled = (transposed * 2.0f).Compile<TBackend>();
+    doubled.Execute();
+    for(gg::dim_t i = 0; i < A * B * C; i++)
+    {
+        gg::dim_t ic = i / (B * A), ib = (i / A) % B, ia = i % A;
+        REQUIRE(doubled.data[i] == 2.0f * x_data[ia * B * C + ib * C + ic]);
+    }
+}
+
+TEST_CASE("TestLoopOrder", "[Codegen]")
+{
+    TestLoopOrder<gg::codegen::BackendScalarC>();
+    TestLoopOrder<gg::codegen::BackendOpenMP>();
+    TestLoopOrder<gg::codegen::BackendJit>();
+
+    auto innermost_loop = [](const gg::codegen::Program &program)
+    {
+        const std::vector<gg::codegen::Instruction> &insns = program.functions.back().insns;
+        auto innermost = std::find_if(
+            insns.rbegin(),
+            insns.rend(),
+            [](const gg::codegen::Instruction &insn) { return std::holds_alternative<gg::codegen::BeginLoopInsn>(insn); });
+        return std::get<gg::codegen::BeginLoopInsn>(*innermost);
+    };
+
+    gg::Graph graph;
+    auto x = graph.AddInput({ 64, 32 });
+    auto y = graph.AddInput({ 64, 32 });
+    auto elementwise = x.as_strided({ 32, 64 }, { 1, 32 }, 0) + y.as_strided({ 32, 64 }, { 1, 32 }, 0);
+    REQUIRE(innermost_loop(gg::codegen::CodegenNode(elementwise)).range == 32);
+
+    gg::codegen::Program reduction = gg::codegen::CodegenNode(x.sum(gg::dim_t{0}));
+    REQUIRE(innermost_loop(reduction).range == 64);
+    auto stores = std::count_if(
+        reduction.functions.back().insns.begin(),
+        reduction.functions.back().insns.end(),
+        [](const gg::codegen::Instruction &insn) { return std::holds_alternative<gg::codegen::StoreInsn>(insn); });
+    REQUIRE(stores == 16);
+}
+
+template <typename TBackend>
+void TestDynamicBatch()
+{
+    constexpr gg::dim_t MaxBatch = 8, K = 16, N = 4;
+    gg::Graph graph;
+    auto x = graph.AddBatchedInput({ MaxBatch, K });
+    auto w = graph.AddInput({ K, N });
+    auto b = graph.AddInput(N);
+    std::vector<float> x_data(MaxBatch * K), w_data(K * N), b_data(N);
+    RandomMatrix(x_data.data(), x_data.size());
+    RandomMatrix(w_data.data(), w_data.size());
+    RandomMatrix(b_data.data(), b_data.size());
+    x.data() = x_data.data();
+    w.data() = w_data.data();
+    b.data() = b_data.data();
+
+    auto y = x.matmul(w) + b;
+    auto centered = (y - y.sum(gg::dim_t{1}, true) * 0.25f).Compile<TBackend>();
+    for(size_t batch_size : { 3, 8, 1 })
+    {
+        centered.Execute(batch_size);
+        for(size_t i = 0; i < batch_size; i++)
+        {
+            float row[N];
+            float mean = 0.0f;
+            for(gg::dim_t j = 0; j < N; j++)
+            {
+                row[j] = b_data[j];
+                for(gg::dim_t k = 0; k < K; k++)
+                    row[j] += x_data[i * K + k] * w_data[k * N + j];
+                mean += row[j] * 0.25f;
+            }
+            for(gg::dim_t j = 0; j < N; j++)
+                REQUIRE_THAT(centered.data[i * N + j], Catch::Matchers::WithinAbs(row[j] - mean, 0.0001f));
+        }
+    }
+    REQUIRE_THROWS_AS(centered.Execute(MaxBatch + 1), std::domain_error);
+}
+
+TEST_CASE("TestDynamicBatch", "[Codegen]")
+{
+    TestDynamicBatch<gg::codegen::BackendScalarC>();
+    TestDynamicBatch<gg::codegen::BackendOpenMP>();
+    TestDynamicBatch<gg::codegen::BackendJit>();
+
+    gg::Graph graph;
+    auto x = graph.AddBatchedInput({ 8, 16 });
+    auto unbatched = graph.AddInput({ 8, 16 });
+    gg::codegen::Program program = gg::codegen::CodegenNode(x * 2.0f);
+    REQUIRE(program.max_batch == 8);
+    auto batch_loops = std::count_if(
+        program.functions.back().insns.begin(),
+        program.functions.back().insns.end(),
+        [](const gg::codegen::Instruction &insn)
+        {
+            auto *loop = std::get_if<gg::codegen::BeginLoopInsn>(&insn);
+            return loop && loop->is_batch;
+        });
+    REQUIRE(batch_loops == 1);
+
+    // Rows must stay independent
+    REQUIRE_THROWS_AS(gg::codegen::CodegenNode(x.sum(gg::dim_t{0})), std::domain_error);
+    REQUIRE_THROWS_AS(gg::codegen::CodegenNode(x.reshape({ 128 })), std::domain_error);
+    REQUIRE_THROWS_AS(gg::codegen::CodegenNode(x.as_strided({ 8, 16 }, { 1, 8 }, 0)), std::domain_error);
+    auto scaled = (unbatched * 2.0f).Compile<gg::codegen::BackendScalarC>();
+    REQUIRE_THROWS_AS(scaled.Execute(4), std::domain_error);
+}
+
+TEST_CASE("TestBatchingServer", "[Server]")
+{
+    constexpr gg::dim_t MaxBatch = 8, K = 3;
+    gg::Graph graph;
+    auto x = graph.AddBatchedInput({ MaxBatch, K });
+    auto y = graph.AddBatchedInput({ MaxBatch, 1 });
+    auto result = (x * y + 1.0f).Compile<gg::codegen::BackendScalarC>();
+
+    auto expected = [](size_t i, gg::dim_t k) { return static_cast<float>(i) * static_cast<float>(k) * 0.5f + 1.0f; };
+    auto example = [](size_t i) -> std::vector<std::vector<float>>
+    {
+        return { { 0.0f, static_cast<float>(i), static_cast<float>(2 * i) }, { 0.5f } };
+    };
+
+    // A full batch runs right away, however long the deadline is
+    std::vector<std::future<std::vector<float>>> futures(MaxBatch);
+    {
+        gg::BatchingServer server(result, { x, y }, { .max_delay = std::chrono::seconds(60) });
+        std::vector<std::thread> clients;
+        for(size_t i = 0; i < MaxBatch; i++)
+            clients.emplace_back([&, i]() { futures[i] = server.Submit(example(i)); });
+        for(std::thread &client : clients)
+            client.join();
+        for(size_t i = 0; i < MaxBatch; i++)
+        {
+            std::vector<float> row = futures[i].get();
+            REQUIRE(row.size() == K);
+            for(gg::dim_t k = 0; k < K; k++)
+                REQUIRE(row[k] == expected(i, k));
+        }
+        REQUIRE(server.NumBatchesRun() == 1);
+
+        // Partial batches run once the deadline passes, or when the server shuts down
+        futures.resize(3);
+        for(size_t i = 0; i < futures.size(); i++)
+            futures[i] = server.Submit(example(i));
+        REQUIRE_THROWS_AS(server.Submit({ { 1.0f } }), std::domain_error);
+    }
+    for(size_t i = 0; i < futures.size(); i++)
+    {
+        std::vector<float> row = futures[i].get();
+        for(gg::dim_t k = 0; k < K; k++)
+            REQUIRE(row[k] == expected(i, k));
+    }
+
+    gg::BatchingServer server(result, { x, y }, { .max_delay = std::chrono::milliseconds(1) });
+    std::vector<float> row = server.Submit(example(5)).get();
+    for(gg::dim_t k = 0; k < K; k++)
+        REQUIRE(row[k] == expected(5, k));
+}
+
+template <typename TBackend>
+void TestExecutionContext()
+{
+    constexpr size_t NumThreads = 4, M = 32, K = 64;
+    gg::Graph graph;
+    auto x = graph.AddInput(K);
+    auto w = graph.AddInput({ M, K });
+    std::vector<float> w_data(M * K);
+    RandomMatrix(w_data.data(), w_data.size());
+    w.data() = w_data.data();
+    auto result = ((w % x) * 2.0f).Compile<TBackend>();
+
+    // Every thread runs its own input through the same compiled program
+    std::vector<std::vector<float>> x_data(NumThreads, std::vector<float>(K));
+    std::vector<std::vector<float>> outputs(NumThreads);
+    std::vector<std::thread> threads;
+    for(size_t ithread = 0; ithread < NumThreads; ithread++)
+    {
+        RandomMatrix(x_data[ithread].data(), K);
+        threads.emplace_back([&, ithread]()
+        {
+            auto context = result.CreateContext();
+            context->Bind(x, x_data[ithread].data());
+            for(int i = 0; i < 20; i++)
+                context->Execute();
+            const float *output = static_cast<const float *>(context->Output());
+            outputs[ithread].assign(output, output + M);
+        });
+    }
+    for(std::thread &thread : threads)
+        thread.join();
+
+    REQUIRE(x.data() == nullptr);
+    for(size_t ithread = 0; ithread < NumThreads; ithread++)
+    {
+        for(size_t i = 0; i < M; i++)
+        {
+            float expected = 0.0f;
+            for(size_t k = 0; k < K; k++)
+                expected += w_data[i * K + k] * x_data[ithread][k];
+            REQUIRE_THAT(outputs[ithread][i], Catch::Matchers::WithinAbs(2.0f * expected, 0.0001f));
+        }
+    }
+
+    auto context = result.CreateContext();
+    auto unused = graph.AddInput(K);
+    REQUIRE_THROWS_AS(context->Bind(unused, x_data[0].data()), std::domain_error);
+}
+
+template <typename TBackend>
+void TestStreaming(const gg::MappedFile &file)
+{
+    // 10 rows in chunks of 4: the callback input is F32, the file holds U8 rows
+    constexpr size_t NumRows = 10;
+    gg::Graph graph;
+    auto x = graph.AddBatchedInput({ 4, 3 });
+    auto y = graph.AddBatchedInput({ 4, 3 }, gg::DType::U8);
+    auto w = graph.AddInput(3);
+    y.scale() = 0.5f;
+    float w_data[] = { 1.0f, -1.0f, 2.0f };
+    w.data() = w_data;
+    auto compiled = (x * y * w).sum(gg::dim_t{1}).template Compile<TBackend>();
+
+    std::vector<size_t> chunks_read;
+    auto read = [&](size_t first_row, size_t num_rows, float *rows)
+    {
+        chunks_read.push_back(first_row);
+        for(size_t i = 0; i < num_rows * 3; i++)
+            rows[i] = static_cast<float>(first_row * 3 + i);
+    };
+    gg::StreamingEvaluator evaluator(compiled, { { .input = x, .read = read }, { .input = y, .file = &file, .offset = 1 } });
+    REQUIRE(evaluator.ChunkRows() == 4);
+
+    std::vector<float> output;
+    evaluator.Run(NumRows, [&](size_t first_row, size_t num_rows, const float *rows)
+    {
+        REQUIRE(first_row == output.size());
+        REQUIRE(num_rows == (first_row == 8 ? 2 : 4));
+        output.insert(output.end(), rows, rows + num_rows);
+    });
+    REQUIRE(chunks_read == std::vector<size_t>{ 0, 4, 8 });
+    REQUIRE(output.size() == NumRows);
+    const uint8_t *y_data = reinterpret_cast<const uint8_t *>(file.data() + 1);
+    for(size_t row = 0; row < NumRows; row++)
+    {
+        float expected = 0.0f;
+        for(size_t i = 0; i < 3; i++)
+            expected += static_cast<float>(row * 3 + i) * y_data[row * 3 + i] * 0.5f * w_data[i];
+        REQUIRE_THAT(output[row], Catch::Matchers::WithinRel(expected, 0.0001f));
+    }
+
+    // The file only has 10 rows, and callbacks' exceptions come out of Run
+    REQUIRE_THROWS_AS(evaluator.Run(NumRows + 1, [](size_t, size_t, const float *) {}), std::out_of_range);
+    gg::StreamingEvaluator failing(compiled, {
+        { .input = x, .read = [](size_t first_row, size_t, float *) { if(first_row == 4) throw std::runtime_error("Unreadable"); } },
+        { .input = y, .file = &file, .offset = 1 },
+    });
+    REQUIRE_THROWS_AS(failing.Run(NumRows, [](size_t, size_t, const float *) {}), std::runtime_error);
+    REQUIRE_THROWS_AS(gg::StreamingEvaluator(compiled, { { .input = x, .read = read } }), std::domain_error);
+}
+
+// Rows of a file that ends exactly at a page boundary, so reading past it faults
+template <typename TBackend>
+void TestStreamingPageEnd(const gg::MappedFile &file, size_t offset)
+{
+    constexpr size_t NumRows = 10, RowBytes = 256;
+    gg::Graph graph;
+    auto y = graph.AddBatchedInput({ 4, RowBytes }, gg::DType::U8);
+    auto w = graph.AddInput({ RowBytes, 2 });
+    y.scale() = 1.0f / 255;
+    std::vector<float> w_data(RowBytes * 2);
+    for(size_t i = 0; i < w_data.size(); i++)
+        w_data[i] = static_cast<float>(i % 5) * 0.01f - 0.02f;
+    w.data() = w_data.data();
+    auto compiled = (y % w).softmax().template Compile<TBackend>();
+
+    gg::StreamingEvaluator evaluator(compiled, { { .input = y, .file = &file, .offset = offset } });
+    std::vector<float> output;
+    evaluator.Run(NumRows, [&](size_t first_row, size_t num_rows, const float *rows)
+    {
+        // Only the last chunk would extend past the end of the file
+        const std::byte *bound = static_cast<const std::byte *>(y.data());
+        bool in_file = bound >= file.data() && bound < file.data() + file.size();
+        REQUIRE(in_file == (num_rows == 4));
+        output.insert(output.end(), rows, rows + num_rows * 2);
+    });
+
+    const uint8_t *y_data = reinterpret_cast<const uint8_t *>(file.data() + offset);
+    for(size_t row = 0; row < NumRows; row++)
+    {
+        float logits[2] = { 0.0f, 0.0f };
+        for(size_t j = 0; j < 2; j++)
+            for(size_t k = 0; k < RowBytes; k++)
+                logits[j] += y_data[row * RowBytes + k] / 255.0f * w_data[k * 2 + j];
+        float max = std::max(logits[0], logits[1]);
+        float sum = std::exp(logits[0] - max) + std::exp(logits[1] - max);
+        for(size_t j = 0; j < 2; j++)
+            REQUIRE_THAT(output[row * 2 + j], Catch::Matchers::WithinAbs(std::exp(logits[j] - max) / sum, 0.0001f));
+    }
+}
+
+TEST_CASE("TestStreaming", "[Codegen]")
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "gigagrad-test-streaming";
+    {
+        uint8_t contents[1 + 10 * 3];
+        for(int i = 0; i < 1 + 10 * 3; i++)
+            contents[i] = static_cast<uint8_t>(i * 7 % 11);
+        FILE *f = std::fopen(path.c_str(), "wb");
+        REQUIRE(f);
+        REQUIRE(std::fwrite(contents, 1, sizeof(contents), f) == sizeof(contents));
+        std::fclose(f);
+    }
+    {
+        gg::MappedFile file(path);
+        TestStreaming<gg::codegen::BackendScalarC>(file);
+        TestStreaming<gg::codegen::BackendJit>(file);
+    }
+
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t file_size = (10 * 256 + page_size - 1) / page_size * page_size;
+    {
+        std::vector<uint8_t> contents(file_size);
+        for(size_t i = 0; i < file_size; i++)
+            contents[i] = static_cast<uint8_t>(i * 13 % 251);
+        FILE *f = std::fopen(path.c_str(), "wb");
+        REQUIRE(f);
+        REQUIRE(std::fwrite(contents.data(), 1, file_size, f) == file_size);
+        std::fclose(f);
+    }
+    {
+        gg::MappedFile file(path);
+        TestStreamingPageEnd<gg::codegen::BackendScalarC>(file, file_size - 10 * 256);
+        TestStreamingPageEnd<gg::codegen::BackendOpenMP>(file, file_size - 10 * 256);
+        TestStreamingPageEnd<gg::codegen::BackendJit>(file, file_size - 10 * 256);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("TestExecutionContext", "[Codegen]")
+{
+    TestExecutionContext<gg::codegen::BackendScalarC>();
+    TestExecutionContext<gg::codegen::BackendOpenMP>();
+    TestExecutionContext<gg::codegen::BackendJit>();
+}
+
+TEST_CASE("TestMaterialization", "[Codegen]")
+{
+    constexpr gg::dim_t Rows = 16, Cols = 32;
+    gg::Graph graph;
+    auto x = graph.AddInput({ Rows, Cols });
+    std::vector<float> x_data(Rows * Cols);
+    RandomMatrix(x_data.data(), x_data.size());
+    x.data() = x_data.data();
+
+    auto count_exps = [](const gg::codegen::Program &program)
+    {
+        size_t result = 0;
+        for(const gg::codegen::FunctionBuilder &fn : program.functions)
+        {
+            for(const gg::codegen::Instruction &insn : fn.insns)
+            {
+                auto *unary = std::get_if<gg::codegen::UnaryInsn>(&insn);
+                result += unary && unary->type == gg::UnaryOpType::EXP;
+            }
+        }
+        return result;
+    };
+
+    // The row sums get a function of their own, which would recompute exp
+    auto e = gg::exp(x);
+    auto scaled = e * e.sum(gg::dim_t{1}).reshape({ Rows, 1 });
+    gg::codegen::Program program = gg::codegen::CodegenNode(scaled);
+    REQUIRE(program.functions.size() == 3);
+    REQUIRE(count_exps(program) == 1);
+
+    auto result = scaled.Compile<gg::codegen::BackendScalarC>();
+    result.Execute();
+    for(gg::dim_t i = 0; i < Rows; i++)
+    {
+        float sum = 0.0f;
+        for(gg::dim_t j = 0; j < Cols; j++)
+            sum += std::exp(x_data[i * Cols + j]);
+        for(gg::dim_t j = 0; j < Cols; j++)
+            REQUIRE_THAT(result.data[i * Cols + j], Catch::Matchers::WithinRel(std::exp(x_data[i * Cols + j]) * sum, 0.0001f));
+    }
+
+    // Cheap expressions are recomputed, and so is anything that only one function reads
+    auto shifted = x + 1.0f;
+    REQUIRE(gg::codegen::CodegenNode(shifted * shifted.sum(gg::dim_t{1}).reshape({ Rows, 1 })).functions.size() == 2);
+    REQUIRE(gg::codegen::CodegenNode(x.softmax(1)).functions.size() == 1);
+}
+
+TEST_CASE("TestPlanGrid", "[Codegen]")
+{
+    gg::Graph graph;
+    auto x = graph.AddInput({ 4, 8 });
+    auto y = graph.AddInput({ 8 });
+    auto z = graph.AddInput({ 8, 3 });
+
+    auto wide = graph.AddInput({ 4, 48 });
+
+    // Rows of 8 are too narrow to split, a thread per row loops over them
+    gg::codegen::Program elementwise = gg::codegen::CodegenNode(x + y);
+    gg::codegen::GridPlan flat = gg::codegen::PlanGrid(elementwise.functions[0]);
+    REQUIRE(flat.mode == gg::codegen::GridPlan::Mode::Flat);
+    REQUIRE(flat.grid == 4);
+
+    gg::codegen::Program softmax = gg::codegen::CodegenNode(wide.softmax(1));
+    const gg::codegen::FunctionBuilder &fn = softmax.functions[0];
+    gg::codegen::GridPlan group = gg::codegen::PlanGrid(fn);
+    REQUIRE(group.mode == gg::codegen::GridPlan::Mode::Group);
+    REQUIRE(group.grid == 4);
+    // Max, sum and the normalization each get split across the group
+    size_t num_distributed = std::count(group.is_distributed.begin(), group.is_distributed.end(), true);
+    REQUIRE(num_distributed == 6);
+    size_t num_reductions = 0;
+    for(const auto &reductions : group.reductions)
+        num_reductions += reductions.size();
+    REQUIRE(num_reductions == 2);
+
+    gg::codegen::Program full = gg::codegen::CodegenNode(x.sum());
+    REQUIRE(gg::codegen::PlanGrid(full.functions[0]).mode == gg::codegen::GridPlan::Mode::Single);
+
+    gg::codegen::Program matmul = gg::codegen::CodegenNode(x % z);
+    REQUIRE(gg::codegen::PlanGrid(matmul.functions.back()).mode == gg::codegen::GridPlan::Mode::Matmul);
+}
+
+#ifdef GIGAGRAD_CUDA
+TEST_CASE("TestCuda", "[Codegen]")
+{
+    TestMatmul<gg::codegen::BackendCuda>();
+    TestMixedPrecision<gg::codegen::BackendCuda>();
+
+    // A full reduction, a fused one and a strided one, each mapped to the grid differently
+    constexpr gg::dim_t Rows = 37, Cols = 300;
+    gg::Graph graph;
+    auto x = graph.AddInput({ Rows, Cols });
+    auto y = graph.AddInput({ Cols });
+    auto a = x.softmax(1) + gg::sin(x) * gg::log(x * x + 1.0f);
+    auto b = gg::max(a, y) + a.sum(gg::dim_t{0}) / 3.0f + a.max();
+    auto result = b.swapaxes(0, 1).sum(gg::dim_t{1});
+
+    std::vector<float> x_data(Rows * Cols);
+    std::vector<float> y_data(Cols);
+    RandomMatrix(x_data.data(), x_data.size());
+    RandomMatrix(y_data.data(), y_data.size());
+    x.data() = x_data.data();
+    y.data() = y_data.data();
+    auto expected = result.Compile<gg::codegen::BackendScalarC>();
+    auto actual = result.Compile<gg::codegen::BackendCuda>();
+    expected.Execute();
+    actual.Execute();
+    for(gg::dim_t i = 0; i < Cols; i++)
+        REQUIRE_THAT(actual.data[i], Catch::Matchers::WithinAbs(expected.data[i], 0.01f));
+
+    // Weights stay on the device until they're copied back
+    gg::nn::Module network;
+    auto input = network.AddInput(4);
+    auto w = network.AddWeight(4);
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendCuda>(network, w - input);
+    float input_data[] = { 1.0, 2.0, 3.0, 4.0 };
+    float w_data[] = { -0.1, 0.1, -0.001, 0.0001 };
+    float training_example_data[] = { 0.0, 0.0, 0.0, 0.0 };
+    input.data() = input_data;
+    w.data() = w_data;
+    ctx.training_example = training_example_data;
+    float prev_loss = 1000;
+    for(int i = 0; i < 50; i++)
+    {
+        ctx.Execute();
+        REQUIRE(ctx.loss[0] < prev_loss);
+        prev_loss = ctx.loss[0];
+    }
+    REQUIRE(w_data[0] == -0.1f);
+    static_cast<gg::codegen::BackendCuda *>(ctx.backend.get())->CopyTensorsToHost();
+    for(int i = 0; i < 4; i++)
+        REQUIRE_THAT(w_data[i], Catch::Matchers::WithinAbs(input_data[i], 0.01f));
+}
+#endif
+
+#ifdef __APPLE__
+TEST_CASE("TestMetal", "[Codegen]")
+{
+    TestMatmul<gg::codegen::BackendMetal>();
+    TestMixedPrecision<gg::codegen::BackendMetal>();
+
+    // A full reduction, a fused one and a strided one, each mapped to the grid differently
+    constexpr gg::dim_t Rows = 37, Cols = 300;
+    gg::Graph graph;
+    auto x = graph.AddInput({ Rows, Cols });
+    auto y = graph.AddInput({ Cols });
+    auto a = x.softmax(1) + gg::sin(x) * gg::log(x * x + 1.0f);
+    auto b = gg::max(a, y) + a.sum(gg::dim_t{0}) / 3.0f + a.max();
+    auto result = b.swapaxes(0, 1).sum(gg::dim_t{1});
+
+    std::vector<float> x_data(Rows * Cols);
+    std::vector<float> y_data(Cols);
+    RandomMatrix(x_data.data(), x_data.size());
+    RandomMatrix(y_data.data(), y_data.size());
+    x.data() = x_data.data();
+    y.data() = y_data.data();
+    auto expected = result.Compile<gg::codegen::BackendScalarC>();
+    auto actual = result.Compile<gg::codegen::BackendMetal>();
+    expected.Execute();
+    actual.Execute();
+    for(gg::dim_t i = 0; i < Cols; i++)
+        REQUIRE_THAT(actual.data[i], Catch::Matchers::WithinAbs(expected.data[i], 0.01f));
+
+    gg::nn::Module network;
+    auto input = network.AddInput(4);
+    auto w = network.AddWeight(4);
+    gg::TrainingContext ctx = gg::CompileTrainingGraph<gg::codegen::BackendMetal>(network, w - input);
+    float input_data[] = { 1.0, 2.0, 3.0, 4.0 };
+    float w_data[] = { -0.1, 0.1, -0.001, 0.0001 };
+    float training_example_data[] = { 0.0, 0.0, 0.0, 0.0 };
+    input.data() = input_data;
+    w.data() = w_data;
+    ctx.training_example = training_example_data;
+    float prev_loss = 1000;
+    for(int i = 0; i < 20; i++)
+    {
+        ctx.Execute();
+        REQUIRE(ctx.loss[0] < prev_loss);
+        prev_loss = ctx.loss[0];
+    }
+}
+#endif
+
+// Compares a static expression with the runtime graph it converts to
+template <typename E>
+void CheckStaticGraph(E &expr)
+{
+    std::array<float, E::shape.size()> expected = gg::static_graph::Evaluate(expr);
+    gg::Graph graph;
+    gg::GraphNodeHandle node = gg::static_graph::ToGraph(graph, expr);
+    REQUIRE(node.shape() == E::shape.ToShape());
+    auto result = node.Compile<gg::codegen::BackendScalarC>();
+    result.Execute();
+    for(size_t i = 0; i < expected.size(); i++)
+        REQUIRE_THAT(result.data[i], Catch::Matchers::WithinAbs(expected[i], 0.0001f));
+}
+
+TEST_CASE("TestStaticGraph", "[Graph]")
+{
+    namespace sg = gg::static_graph;
+    sg::Input<16, 4> w;
+    sg::Input<16, 1> b;
+    sg::Input<4> x;
+    sg::Input<3, 16> w2;
+    auto hidden = sg::relu(w % x + b);
+    auto y = sg::softmax<0>(w2 % hidden);
+    static_assert(decltype(hidden)::shape == sg::MakeShape<16, 1>());
+    static_assert(decltype(y)::shape == sg::MakeShape<3, 1>());
+
+    std::vector<float> w_data(64);
+    std::vector<float> b_data(16);
+    std::vector<float> w2_data(48);
+    float x_data[] = { 1.0f, -2.0f, 0.5f, 3.0f };
+    std::default_random_engine gen(0);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for(std::vector<float> *data : { &w_data, &b_data, &w2_data })
+        std::generate(data->begin(), data->end(), [&]() { return dist(gen); });
+    // Inputs are set after building the expression, which only refers to them
+    w.data = w_data.data();
+    b.data = b_data.data();
+    x.data = x_data;
+    w2.data = w2_data.data();
+
+    std::array<float, 3> probabilities = sg::Evaluate(y);
+    float h[16];
+    for(int i = 0; i < 16; i++)
+    {
+        h[i] = b_data[i];
+        for(int k = 0; k < 4; k++)
+            h[i] += w_data[4 * i + k] * x_data[k];
+        h[i] = std::max(h[i], 0.0f);
+    }
+    float logits[3];
+    float total = 0.0f;
+    for(int j = 0; j < 3; j++)
+    {
+        logits[j] = 0.0f;
+        for(int i = 0; i < 16; i++)
+            logits[j] += w2_data[16 * j + i] * h[i];
+    }
+    float largest = *std::max_element(logits, logits + 3);
+    for(int j = 0; j < 3; j++)
+        total += std::exp(logits[j] - largest);
+    for(int j = 0; j < 3; j++)
+        REQUIRE_THAT(probabilities[j], Catch::Matchers::WithinRel(std::exp(logits[j] - largest) / total, 0.0001f));
+    CheckStaticGraph(y);
+
+    // Broadcasting, reductions along each axis, views and comparisons
+    auto wide = sg::reshape<4, -1>(w);
+    auto mixed = sg::max(wide * 2.0f, sg::sum<1, true>(wide)) - sg::max<0>(wide) / 3.0f + (wide > 0.25f);
+    static_assert(decltype(mixed)::shape == sg::MakeShape<4, 16>());
+    CheckStaticGraph(mixed);
+    auto strided = sg::as_strided<sg::MakeShape<3, 4>(), sg::StaticStrides{ 1, 8 }, 2>(w2);
+    auto scalar = sg::sum(sg::sigmoid(strided) * sg::cos(strided)) + sg::log(sg::sqrt(sg::pow(strided, 2.0f) + 1.0f));
+    CheckStaticGraph(scalar);
+}
+
 TEST_CASE("TestLogisticRegressionShape", "[Graph]")
 {
     gg::Graph graph;
@@ -1,5 +1,7 @@
 #include "src/graph.h"
 #include "src/backend_scalar_c.h"
+#include "src/backend_openmp.h"
+#include "src/backend_jit.h"
 
 #include <chrono>
 #include <iostream>
@@ -19,22 +21,17 @@ void FillRandom(std::vector<float> &x)
         v = dist(e);
 }
 
-int main()
+template <typename TBackend>
+double BenchmarkMatmul(const std::vector<float> &A, const std::vector<float> &B)
 {
-    std::vector<float> A(MatrixSize * MatrixSize);
-    std::vector<float> B(MatrixSize * MatrixSize);
-
-    FillRandom(A);
-    FillRandom(B);
-
     gg::Graph graph;
     auto a = graph.AddInput({ MatrixSize, MatrixSize });
     auto b = graph.AddInput({ MatrixSize, MatrixSize });
     auto matmul = a % b;
-    auto result = matmul.Compile<gg::codegen::BackendScalarC>();
+    auto result = matmul.Compile<TBackend>();
 
-    a.data() = A.data();
-    b.data() = B.data();
+    a.data() = const_cast<float *>(A.data());
+    b.data() = const_cast<float *>(B.data());
 
     auto start = std::chrono::high_resolution_clock::now();
     for(size_t i = 0; i < NumIterations; i++)
@@ -45,8 +42,20 @@ int main()
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
         / static_cast<double>(NumIterations);
+    return duration.count();
+}
+
+int main()
+{
+    std::vector<float> A(MatrixSize * MatrixSize);
+    std::vector<float> B(MatrixSize * MatrixSize);
+
+    FillRandom(A);
+    FillRandom(B);
 
-    printf("ScalarC: %.4fms\n", duration.count());
+    printf("ScalarC: %.4fms\n", BenchmarkMatmul<gg::codegen::BackendScalarC>(A, B));
+    printf("OpenMP: %.4fms\n", BenchmarkMatmul<gg::codegen::BackendOpenMP>(A, B));
+    printf("Jit: %.4fms\n", BenchmarkMatmul<gg::codegen::BackendJit>(A, B));
 
     return 0;
 }